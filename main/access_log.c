@@ -0,0 +1,272 @@
+#include "access_log.h"
+
+#include <string.h>
+
+#define ACCESS_LOG_MAGIC    0x474F4C41  // "ALOG"
+#define ACCESS_LOG_VERSION  1
+
+// Entries are read in batches of this size, so a query needs little stack.
+#define ACCESS_LOG_READ_BATCH  8
+
+#define ACCESS_LOG_BLOOM_HASHES  3
+
+struct access_log_header {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t entry_size;
+    uint32_t seq;
+    uint32_t reserved;
+};
+
+_Static_assert(sizeof(struct access_log_header) == ACCESS_LOG_HEADER_SIZE, "header size must match ACCESS_LOG_HEADER_SIZE");
+
+#define FNV_OFFSET  2166136261u
+#define FNV_PRIME   16777619u
+
+static uint32_t fnv1a(const void *data, size_t len) {
+    const uint8_t *bytes = data;
+    uint32_t hash = FNV_OFFSET;
+
+    for (size_t i = 0; i < len; i++) {
+        hash = (hash ^ bytes[i]) * FNV_PRIME;
+    }
+
+    return hash;
+}
+
+static size_t uid_len(const char *uid) {
+    return strnlen(uid, ACCESS_LOG_UID_LEN);
+}
+
+// Bit positions are taken from different bits of one hash.
+static void bloom_add(uint8_t *bloom, uint32_t hash) {
+    for (int i = 0; i < ACCESS_LOG_BLOOM_HASHES; i++) {
+        uint32_t bit = (hash >> (i * 10)) % (ACCESS_LOG_BLOOM_BYTES * 8);
+        bloom[bit / 8] |= 1 << (bit % 8);
+    }
+}
+
+static bool bloom_test(const uint8_t *bloom, uint32_t hash) {
+    for (int i = 0; i < ACCESS_LOG_BLOOM_HASHES; i++) {
+        uint32_t bit = (hash >> (i * 10)) % (ACCESS_LOG_BLOOM_BYTES * 8);
+        if (!(bloom[bit / 8] & (1 << (bit % 8)))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static uint32_t entry_checksum(const struct access_log_entry *entry) {
+    return fnv1a(entry, offsetof(struct access_log_entry, checksum));
+}
+
+static bool entry_is_empty(const struct access_log_entry *entry) {
+    return entry->seq == UINT32_MAX;
+}
+
+static bool entry_is_valid(const struct access_log_entry *entry) {
+    return entry->checksum == entry_checksum(entry);
+}
+
+static uint32_t entry_offset(uint32_t sector, uint32_t index) {
+    return sector * ACCESS_LOG_SECTOR_SIZE + sizeof(struct access_log_header) + index * sizeof(struct access_log_entry);
+}
+
+static void sector_reset(struct access_log_sector *sector, uint32_t seq) {
+    memset(sector, 0, sizeof(*sector));
+    sector->seq = seq;
+    sector->min_timestamp = UINT32_MAX;
+}
+
+static void sector_add(struct access_log_sector *sector, const struct access_log_entry *entry) {
+    if (entry->timestamp < sector->min_timestamp) {
+        sector->min_timestamp = entry->timestamp;
+    }
+    if (entry->timestamp > sector->max_timestamp) {
+        sector->max_timestamp = entry->timestamp;
+    }
+    bloom_add(sector->bloom, fnv1a(entry->uid, uid_len(entry->uid)));
+}
+
+static int sector_start(struct access_log *log, uint32_t sector, uint32_t seq) {
+    struct access_log_header header = {
+        .magic = ACCESS_LOG_MAGIC,
+        .version = ACCESS_LOG_VERSION,
+        .entry_size = sizeof(struct access_log_entry),
+        .seq = seq,
+    };
+
+    sector_reset(&log->sectors[sector], 0);
+
+    uint32_t offset = sector * ACCESS_LOG_SECTOR_SIZE;
+    if (log->flash.erase_sector(log->flash.ctx, offset) != 0) return -1;
+    if (log->flash.write(log->flash.ctx, offset, &header, sizeof(header)) != 0) return -1;
+
+    log->sectors[sector].seq = seq;
+    log->head = sector;
+
+    return 0;
+}
+
+static int sector_scan(struct access_log *log, uint32_t sector, uint32_t *max_seq) {
+    struct access_log_header header;
+    struct access_log_entry batch[ACCESS_LOG_READ_BATCH];
+    struct access_log_sector *index = &log->sectors[sector];
+
+    sector_reset(index, 0);
+
+    if (log->flash.read(log->flash.ctx, sector * ACCESS_LOG_SECTOR_SIZE, &header, sizeof(header)) != 0) return -1;
+
+    bool is_valid = header.magic == ACCESS_LOG_MAGIC
+        && header.version == ACCESS_LOG_VERSION
+        && header.entry_size == sizeof(struct access_log_entry)
+        && header.seq != 0 && header.seq != UINT32_MAX;
+    if (!is_valid) return 0;
+
+    index->seq = header.seq;
+
+    for (uint32_t first = 0; first < ACCESS_LOG_ENTRIES_PER_SECTOR; first += ACCESS_LOG_READ_BATCH) {
+        uint32_t count = ACCESS_LOG_ENTRIES_PER_SECTOR - first;
+        if (count > ACCESS_LOG_READ_BATCH) {
+            count = ACCESS_LOG_READ_BATCH;
+        }
+
+        if (log->flash.read(log->flash.ctx, entry_offset(sector, first), batch, count * sizeof(batch[0])) != 0) return -1;
+
+        for (uint32_t i = 0; i < count; i++) {
+            if (entry_is_empty(&batch[i])) return 0;
+
+            index->count++;
+            if (!entry_is_valid(&batch[i])) continue;
+
+            sector_add(index, &batch[i]);
+            if (batch[i].seq > *max_seq) {
+                *max_seq = batch[i].seq;
+            }
+        }
+    }
+
+    return 0;
+}
+
+int access_log_init(
+    struct access_log *log, const struct access_log_flash *flash,
+    struct access_log_sector *sectors, uint32_t sectors_count
+) {
+    log->flash = *flash;
+    log->sectors = sectors;
+    log->sectors_count = sectors_count;
+    log->head = 0;
+
+    uint32_t max_seq = 0;
+    uint32_t head_seq = 0;
+
+    for (uint32_t i = 0; i < sectors_count; i++) {
+        if (sector_scan(log, i, &max_seq) != 0) return -1;
+
+        if (sectors[i].seq > head_seq) {
+            head_seq = sectors[i].seq;
+            log->head = i;
+        }
+    }
+
+    log->next_seq = max_seq + 1;
+
+    if (head_seq == 0) {
+        return sector_start(log, 0, 1);
+    }
+
+    return 0;
+}
+
+int access_log_append(struct access_log *log, uint32_t timestamp, uint8_t door, uint8_t kind, const char *uid) {
+    struct access_log_sector *sector = &log->sectors[log->head];
+
+    if (sector->count == ACCESS_LOG_ENTRIES_PER_SECTOR) {
+        if (sector_start(log, (log->head + 1) % log->sectors_count, sector->seq + 1) != 0) return -1;
+        sector = &log->sectors[log->head];
+    }
+
+    struct access_log_entry entry = {
+        .seq = log->next_seq++,
+        .timestamp = timestamp,
+        .door = door,
+        .kind = kind,
+    };
+    memcpy(entry.uid, uid, uid_len(uid));
+    entry.checksum = entry_checksum(&entry);
+
+    // Slot is used even if write fails, it may be partially written.
+    uint32_t offset = entry_offset(log->head, sector->count);
+    sector->count++;
+
+    if (log->flash.write(log->flash.ctx, offset, &entry, sizeof(entry)) != 0) return -1;
+
+    sector_add(sector, &entry);
+
+    return 0;
+}
+
+static bool entry_matches(
+    const struct access_log_entry *entry, const struct access_log_query *query,
+    size_t query_uid_len, uint32_t end_seq
+) {
+    if (!entry_is_valid(entry)) return false;
+    // Appended by emit callback while the query runs.
+    if (entry->seq >= end_seq) return false;
+    if (entry->timestamp < query->from || entry->timestamp > query->to) return false;
+
+    if (query->uid != NULL) {
+        return uid_len(entry->uid) == query_uid_len && memcmp(entry->uid, query->uid, query_uid_len) == 0;
+    }
+
+    return true;
+}
+
+int access_log_query(const struct access_log *log, struct access_log_query *query, access_log_emit_t emit, void *arg) {
+    struct access_log_entry batch[ACCESS_LOG_READ_BATCH];
+
+    size_t query_uid_len = query->uid != NULL ? uid_len(query->uid) : 0;
+    uint32_t query_uid_hash = query->uid != NULL ? fnv1a(query->uid, query_uid_len) : 0;
+    int emitted = 0;
+
+    // Emit may append, the query sees the log as it was when it started.
+    uint32_t head = log->head;
+    uint32_t end_seq = log->next_seq;
+
+    query->sectors_read = 0;
+
+    // Sectors are appended in ring order, so going back from head is going back in time.
+    for (uint32_t i = 0; i < log->sectors_count; i++) {
+        uint32_t sector = (head + log->sectors_count - i) % log->sectors_count;
+        const struct access_log_sector *index = &log->sectors[sector];
+
+        if (index->seq == 0 || index->count == 0) continue;
+        if (index->max_timestamp < query->from || index->min_timestamp > query->to) continue;
+        if (query->uid != NULL && !bloom_test(index->bloom, query_uid_hash)) continue;
+
+        query->sectors_read++;
+
+        for (uint32_t end = index->count; end > 0;) {
+            uint32_t first = end > ACCESS_LOG_READ_BATCH ? end - ACCESS_LOG_READ_BATCH : 0;
+
+            if (log->flash.read(log->flash.ctx, entry_offset(sector, first), batch, (end - first) * sizeof(batch[0])) != 0) {
+                return -1;
+            }
+
+            for (uint32_t j = end - first; j > 0; j--) {
+                const struct access_log_entry *entry = &batch[j - 1];
+                if (!entry_matches(entry, query, query_uid_len, end_seq)) continue;
+
+                emitted++;
+                if (!emit(entry, arg) || emitted == query->limit) {
+                    return emitted;
+                }
+            }
+
+            end = first;
+        }
+    }
+
+    return emitted;
+}
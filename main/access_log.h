@@ -0,0 +1,101 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Append-only access log in a ring of flash sectors. When the ring is full
+// the oldest sector is erased. Every sector has a small index in RAM: the
+// time range of its entries for time queries, and a bloom filter of UIDs for
+// UID queries. Queries read only sectors the index can not rule out, one
+// small batch of entries at a time, newest first.
+//
+// Has no ESP-IDF dependencies, utils/bench_access_log.c builds it on host
+// with a file instead of flash.
+
+#define ACCESS_LOG_SECTOR_SIZE  4096
+#define ACCESS_LOG_HEADER_SIZE  16
+#define ACCESS_LOG_UID_LEN      32
+#define ACCESS_LOG_BLOOM_BYTES  64
+
+enum access_log_kind {
+    ACCESS_LOG_GRANTED = 1,
+    ACCESS_LOG_DENIED_CODE,
+    ACCESS_LOG_DENIED_SCHEDULE,
+    ACCESS_LOG_REMOTE,
+};
+
+struct access_log_entry {
+    uint32_t seq;
+    uint32_t timestamp;
+    uint8_t  door;
+    uint8_t  kind;
+    uint16_t reserved;
+    // Not null terminated if UID is ACCESS_LOG_UID_LEN chars long.
+    char     uid[ACCESS_LOG_UID_LEN];
+    // Detects entries torn by a power loss.
+    uint32_t checksum;
+};
+
+#define ACCESS_LOG_ENTRIES_PER_SECTOR \
+    ((ACCESS_LOG_SECTOR_SIZE - ACCESS_LOG_HEADER_SIZE) / sizeof(struct access_log_entry))
+
+// Flash access, offsets are relative to the log start. Return 0 on success.
+struct access_log_flash {
+    int (*read)(void *ctx, uint32_t offset, void *buf, size_t len);
+    int (*write)(void *ctx, uint32_t offset, const void *buf, size_t len);
+    int (*erase_sector)(void *ctx, uint32_t offset);
+    void *ctx;
+};
+
+// Index of one sector, rebuilt from flash by access_log_init.
+struct access_log_sector {
+    // 0 if sector has no valid header.
+    uint32_t seq;
+    uint32_t min_timestamp;
+    uint32_t max_timestamp;
+    // Used entry slots, including torn ones.
+    uint16_t count;
+    uint8_t  bloom[ACCESS_LOG_BLOOM_BYTES];
+};
+
+struct access_log {
+    struct access_log_flash flash;
+    struct access_log_sector *sectors;
+    uint32_t sectors_count;
+
+    // Sector appended to.
+    uint32_t head;
+    uint32_t next_seq;
+};
+
+struct access_log_query {
+    // NULL matches any UID.
+    const char *uid;
+    // Inclusive.
+    uint32_t from;
+    uint32_t to;
+    // 0 means no limit.
+    uint32_t limit;
+
+    // Set by access_log_query, shows how well the index narrowed the search.
+    uint32_t sectors_read;
+};
+
+// Returns false to stop the query.
+typedef bool (*access_log_emit_t)(const struct access_log_entry *entry, void *arg);
+
+// Sectors array has an index entry for every flash sector of the log and
+// must stay valid while the log is used. Returns -1 on flash error.
+int access_log_init(
+    struct access_log *log, const struct access_log_flash *flash,
+    struct access_log_sector *sectors, uint32_t sectors_count
+);
+
+// Returns -1 on flash error.
+int access_log_append(struct access_log *log, uint32_t timestamp, uint8_t door, uint8_t kind, const char *uid);
+
+// Emits matching entries newest first. Emit may append to the same log, such
+// entries are not emitted, and entries of a sector erased by an append are
+// lost. Returns number of emitted entries or -1 on flash error.
+int access_log_query(const struct access_log *log, struct access_log_query *query, access_log_emit_t emit, void *arg);
@@ -0,0 +1,163 @@
+#include "batch.h"
+
+#include <esp_log.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <freertos/semphr.h>
+
+#include "config.h"
+#include "hardware.h"
+#include "mqtt.h"
+#include "payload.h"
+#include "tasks.h"
+#include "trace.h"
+#include "heap_guard.h"
+
+#define TAG "batch"
+
+// Checkin and command topics of every door.
+#define BATCH_TOPICS_MAX  (DOORS_COUNT * 2)
+// Batch is flushed early when the next event does not fit.
+#define BATCH_MAX_SIZE    1024
+
+// Array framing, separator and JSON terminator.
+#define BATCH_FRAMING_SIZE  3
+
+struct batch {
+    const char *topic;
+    int count;
+    struct payload writer;
+    uint8_t payload[BATCH_MAX_SIZE];
+};
+
+static struct {
+#ifdef USE_EVENT_BATCHING
+    SemaphoreHandle_t mutex;
+    StaticSemaphore_t mutex_buffer;
+    TaskHandle_t task;
+
+    struct batch batches[BATCH_TOPICS_MAX];
+#endif
+
+    struct batch_stats stats;
+} batch = {0};
+
+#ifdef USE_EVENT_BATCHING
+// Must be called with mutex taken.
+static int batch_flush(struct batch *b) {
+    if (b->count == 0) return 0;
+
+    payload_end(&b->writer);
+    int len = payload_finish(&b->writer);
+
+    TRACE_BEGIN("batch_flush");
+    // Enqueued, so keypad task never waits for the mutex while the network is slow.
+    int ret = mqtt_enqueue_data(b->topic, b->payload, len, /* qos */ 1, /* retain */ false, NULL, NULL);
+    TRACE_END("batch_flush");
+
+    ESP_LOGD(TAG, "Flushed %d events to topic '%s'", b->count, b->topic);
+
+    batch.stats.events += b->count;
+    batch.stats.publishes += 1;
+
+    b->count = 0;
+
+    return ret;
+}
+
+static struct batch *batch_find(const char *topic) {
+    for (int i = 0; i < BATCH_TOPICS_MAX; i++) {
+        struct batch *b = &batch.batches[i];
+        if (b->topic == topic || b->topic == NULL) {
+            b->topic = topic;
+            return b;
+        }
+    }
+
+    return NULL;
+}
+
+static void batch_thread(void *param) {
+    for (;;) {
+        // Woken by the first event of a batch, events which come during the
+        // window are added to the same batch.
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        vTaskDelay(pdMS_TO_TICKS(EVENT_BATCH_WINDOW_MS));
+
+        xSemaphoreTake(batch.mutex, portMAX_DELAY);
+        for (int i = 0; i < BATCH_TOPICS_MAX; i++) {
+            batch_flush(&batch.batches[i]);
+        }
+        xSemaphoreGive(batch.mutex);
+    }
+}
+#endif
+
+void batch_init(void) {
+#ifdef USE_EVENT_BATCHING
+    static StackType_t stack[BATCH_TASK_STACK_SIZE];
+    static StaticTask_t task;
+
+    batch.mutex = xSemaphoreCreateMutexStatic(&batch.mutex_buffer);
+
+    batch.task = xTaskCreateStaticPinnedToCore(
+        batch_thread,
+        "batch",
+        BATCH_TASK_STACK_SIZE,
+        NULL,
+        BATCH_TASK_PRIORITY,
+        stack,
+        &task,
+        BATCH_TASK_CORE
+    );
+    heap_guard_watch_task(batch.task);
+#endif
+}
+
+int batch_publish(const char *topic, const void *data, int data_len) {
+#ifdef USE_EVENT_BATCHING
+    if (data_len + BATCH_FRAMING_SIZE > BATCH_MAX_SIZE) {
+        ESP_LOGE(TAG, "Event of %d bytes does not fit batch, increase BATCH_MAX_SIZE", data_len);
+        return -1;
+    }
+
+    xSemaphoreTake(batch.mutex, portMAX_DELAY);
+
+    struct batch *b = batch_find(topic);
+    if (b == NULL) {
+        xSemaphoreGive(batch.mutex);
+        ESP_LOGE(TAG, "No batch for topic '%s', increase BATCH_TOPICS_MAX", topic);
+        return -1;
+    }
+
+    int ret = 0;
+    if (b->count > 0 && b->writer.len + data_len + BATCH_FRAMING_SIZE > BATCH_MAX_SIZE) {
+        ret = batch_flush(b);
+    }
+
+    bool is_first = b->count == 0;
+    if (is_first) {
+        payload_init(&b->writer, PAYLOAD_FORMAT, b->payload, sizeof(b->payload));
+        payload_array_begin(&b->writer);
+    }
+    payload_raw(&b->writer, data, data_len);
+    b->count += 1;
+
+    xSemaphoreGive(batch.mutex);
+
+    if (is_first) {
+        xTaskNotifyGive(batch.task);
+    }
+
+    return ret;
+#else
+    batch.stats.events += 1;
+    batch.stats.publishes += 1;
+
+    return mqtt_enqueue_data(topic, data, data_len, /* qos */ 1, /* retain */ false, NULL, NULL);
+#endif
+}
+
+void batch_get_stats(struct batch_stats *stats) {
+    *stats = batch.stats;
+}
@@ -0,0 +1,20 @@
+#pragma once
+
+#include <stdint.h>
+
+// Events of the same topic published within EVENT_BATCH_WINDOW_MS are sent
+// as one JSON or CBOR array with qos 1, so a burst of checkins waits for one
+// PUBACK instead of one per checkin. Without USE_EVENT_BATCHING every event is
+// published right away as is.
+
+struct batch_stats {
+    uint32_t events;
+    uint32_t publishes;
+};
+
+void batch_init(void);
+
+// Topic must be a static string, it is used to find the batch.
+int batch_publish(const char *topic, const void *data, int data_len);
+
+void batch_get_stats(struct batch_stats *stats);
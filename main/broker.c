@@ -0,0 +1,415 @@
+#include "broker.h"
+
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <lwip/sockets.h>
+#include <lwip/netdb.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <mdns.h>
+
+#include "config.h"
+#include "mqtt.h"
+#include "tasks.h"
+#include "trace.h"
+#include "heap_guard.h"
+
+#define TAG "broker"
+
+#define BROKER_URI_MAX             128
+#define BROKER_HOST_MAX            64
+
+#define BROKER_PROBE_TIMEOUT_MS    2000
+#define BROKER_CHECK_INTERVAL_SEC  10
+// Client retries the current broker every MQTT_RECONNECT_DELAY_SEC, it is
+// given a few attempts before another broker is probed.
+#define BROKER_FAILOVER_SEC        (3 * MQTT_RECONNECT_DELAY_SEC)
+// Probes run this often while a fallback broker is used, so the lock fails
+// back soon after a better broker recovers.
+#define BROKER_FAILBACK_SEC        60
+// Refreshes RTTs reported in status while the preferred broker is used.
+#define BROKER_REFRESH_SEC         (10 * 60)
+// Among fallback brokers, a later one is selected only if it is this much
+// faster, so RTT jitter does not flip brokers.
+#define BROKER_RTT_MARGIN_MS       20
+
+#ifdef USE_MQTT_MDNS
+#ifndef MQTT_MDNS_HOSTS
+#error "USE_MQTT_MDNS requires MQTT_MDNS_HOSTS, see config.template.h"
+#endif
+#define BROKER_MDNS_MAX            2
+#define BROKER_MDNS_TIMEOUT_MS     1500
+#endif
+
+struct broker_candidate {
+    char uri[BROKER_URI_MAX];
+    char host[BROKER_HOST_MAX];
+    uint16_t port;
+
+    struct broker_candidate_stats stats;
+};
+
+static const char *const configured_uris[] = {
+    MQTT_URI,
+#ifdef MQTT_FALLBACK_URIS
+    MQTT_FALLBACK_URIS,
+#endif
+};
+
+static struct {
+    portMUX_TYPE spinlock;
+
+    // Used only by broker task, after init.
+    struct broker_candidate candidates[BROKER_CANDIDATES_MAX];
+    int count;
+    int active;
+    int64_t down_since;
+    int64_t probed_at;
+    bool is_discovering;
+
+    // Copied out by broker_get_stats, switches are written by broker task only.
+    int stats_active;
+    int stats_count;
+    uint32_t switches;
+    struct broker_candidate_stats stats[BROKER_CANDIDATES_MAX];
+} broker = {
+    .spinlock = portMUX_INITIALIZER_UNLOCKED,
+};
+
+static uint16_t default_port(const char *uri) {
+    if (strncmp(uri, "mqtts://", strlen("mqtts://")) == 0) return 8883;
+    if (strncmp(uri, "wss://", strlen("wss://")) == 0) return 443;
+    if (strncmp(uri, "ws://", strlen("ws://")) == 0) return 80;
+    return 1883;
+}
+
+bool broker_parse_uri(const char *uri, char *host, size_t host_size, uint16_t *port) {
+    const char *start = strstr(uri, "://");
+    if (start == NULL) {
+        return false;
+    }
+    start += strlen("://");
+
+    const char *at = strchr(start, '@');
+    const char *path = strchr(start, '/');
+    if (at != NULL && (path == NULL || at < path)) {
+        start = at + 1;
+    }
+
+    size_t host_len = strcspn(start, ":/");
+    if (host_len == 0 || host_len >= host_size) {
+        return false;
+    }
+
+    memcpy(host, start, host_len);
+    host[host_len] = '\0';
+    *port = start[host_len] == ':' ? atoi(start + host_len + 1) : default_port(uri);
+    return true;
+}
+
+static bool broker_add(const char *uri) {
+    if (broker.count == BROKER_CANDIDATES_MAX) {
+        ESP_LOGW(TAG, "Ignoring broker, increase BROKER_CANDIDATES_MAX");
+        return false;
+    }
+
+    struct broker_candidate *c = &broker.candidates[broker.count];
+    if (strlen(uri) >= BROKER_URI_MAX || !broker_parse_uri(uri, c->host, sizeof(c->host), &c->port)) {
+        ESP_LOGE(TAG, "Invalid broker URI");
+        return false;
+    }
+
+    strlcpy(c->uri, uri, sizeof(c->uri));
+    snprintf(c->stats.name, sizeof(c->stats.name), "%s:%u", c->host, c->port);
+
+    for (int i = 0; i < broker.count; i++) {
+        if (strcmp(broker.candidates[i].stats.name, c->stats.name) == 0) {
+            return false;
+        }
+    }
+
+    broker.count++;
+    return true;
+}
+
+#ifdef USE_MQTT_MDNS
+static const char *const mdns_hosts[] = { MQTT_MDNS_HOSTS };
+
+// Anyone on the LAN can announce a broker, so only listed hosts are used, and
+// only over TLS, where the certificate must match <host>.local.
+static bool broker_mdns_allowed(const char *hostname) {
+    for (int i = 0; i < sizeof(mdns_hosts) / sizeof(mdns_hosts[0]); i++) {
+        if (strcmp(mdns_hosts[i], hostname) == 0) return true;
+    }
+    return false;
+}
+
+// Announced brokers get scheme and credentials of MQTT_URI.
+static void broker_add_discovered(const char *hostname, uint16_t port) {
+    const char *host = strstr(MQTT_URI, "://") + strlen("://");
+    const char *at = strchr(host, '@');
+    int prefix_len = (at != NULL ? at + 1 : host) - MQTT_URI;
+
+    char uri[BROKER_URI_MAX];
+    snprintf(uri, sizeof(uri), "%.*s%s.local:%u", prefix_len, MQTT_URI, hostname, port);
+
+    if (broker_add(uri)) {
+        ESP_LOGI(TAG, "Discovered broker %s", broker.candidates[broker.count - 1].stats.name);
+    }
+}
+
+static void broker_discover(void) {
+    mdns_result_t *results = NULL;
+
+    // Query results are allocated by mDNS component.
+    heap_guard_allow_begin();
+    esp_err_t ret = mdns_query_ptr("_mqtt", "_tcp", BROKER_MDNS_TIMEOUT_MS, BROKER_MDNS_MAX, &results);
+
+    for (mdns_result_t *r = results; ret == ESP_OK && r != NULL; r = r->next) {
+        if (r->hostname == NULL || !broker_mdns_allowed(r->hostname)) continue;
+        broker_add_discovered(r->hostname, r->port);
+    }
+
+    mdns_query_results_free(results);
+    heap_guard_allow_end();
+}
+#endif
+
+static int broker_open_probe(struct broker_candidate *c) {
+    const struct addrinfo hints = {
+        .ai_family = AF_INET,
+        .ai_socktype = SOCK_STREAM,
+    };
+    struct addrinfo *addr = NULL;
+    if (getaddrinfo(c->host, NULL, &hints, &addr) != 0 || addr == NULL) {
+        ESP_LOGW(TAG, "Failed to resolve broker %s", c->stats.name);
+        return -1;
+    }
+
+    struct sockaddr_in sa = *(struct sockaddr_in *)addr->ai_addr;
+    sa.sin_port = htons(c->port);
+    freeaddrinfo(addr);
+
+    int sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (sock < 0) {
+        return -1;
+    }
+
+    fcntl(sock, F_SETFL, fcntl(sock, F_GETFL, 0) | O_NONBLOCK);
+    if (connect(sock, (struct sockaddr *)&sa, sizeof(sa)) != 0 && errno != EINPROGRESS) {
+        close(sock);
+        return -1;
+    }
+
+    return sock;
+}
+
+// Connects to all candidates at once, RTT is the time to TCP handshake.
+// Name resolution is not included.
+static void broker_probe(void) {
+    int socks[BROKER_CANDIDATES_MAX];
+    int64_t started[BROKER_CANDIDATES_MAX];
+
+    // Sockets and resolver allocate from heap.
+    heap_guard_allow_begin();
+    TRACE_BEGIN("broker_probe");
+
+    for (int i = 0; i < broker.count; i++) {
+        broker.candidates[i].stats.is_healthy = false;
+        socks[i] = broker_open_probe(&broker.candidates[i]);
+        started[i] = esp_timer_get_time();
+    }
+
+    int64_t deadline = esp_timer_get_time() + BROKER_PROBE_TIMEOUT_MS * 1000;
+    for (;;) {
+        fd_set writable;
+        FD_ZERO(&writable);
+        int max_sock = -1;
+        for (int i = 0; i < broker.count; i++) {
+            if (socks[i] < 0) continue;
+            FD_SET(socks[i], &writable);
+            if (socks[i] > max_sock) max_sock = socks[i];
+        }
+
+        int64_t remaining_us = deadline - esp_timer_get_time();
+        if (max_sock < 0 || remaining_us <= 0) break;
+
+        struct timeval timeout = {
+            .tv_sec = remaining_us / 1000000,
+            .tv_usec = remaining_us % 1000000,
+        };
+        if (select(max_sock + 1, NULL, &writable, NULL, &timeout) <= 0) break;
+
+        int64_t now = esp_timer_get_time();
+        for (int i = 0; i < broker.count; i++) {
+            if (socks[i] < 0 || !FD_ISSET(socks[i], &writable)) continue;
+
+            int error = 0;
+            socklen_t len = sizeof(error);
+            getsockopt(socks[i], SOL_SOCKET, SO_ERROR, &error, &len);
+
+            struct broker_candidate_stats *stats = &broker.candidates[i].stats;
+            stats->is_healthy = error == 0;
+            stats->rtt_ms = (now - started[i]) / 1000;
+
+            close(socks[i]);
+            socks[i] = -1;
+        }
+    }
+
+    for (int i = 0; i < broker.count; i++) {
+        if (socks[i] >= 0) {
+            close(socks[i]);
+        }
+    }
+
+    TRACE_END("broker_probe");
+    heap_guard_allow_end();
+
+    broker.probed_at = esp_timer_get_time();
+}
+
+static void broker_publish_stats(void) {
+    taskENTER_CRITICAL(&broker.spinlock);
+    for (int i = 0; i < broker.count; i++) {
+        broker.stats[i] = broker.candidates[i].stats;
+    }
+    broker.stats_count = broker.count;
+    broker.stats_active = broker.active;
+    taskEXIT_CRITICAL(&broker.spinlock);
+}
+
+// Returns -1 if no candidate is healthy. MQTT_URI is used whenever it is
+// healthy, so the lock fails back as soon as it recovers. Otherwise the first
+// healthy fallback is preferred.
+static int broker_select(void) {
+    if (broker.candidates[0].stats.is_healthy) {
+        return 0;
+    }
+
+    int preferred = -1;
+    int fastest = -1;
+
+    for (int i = 1; i < broker.count; i++) {
+        const struct broker_candidate_stats *stats = &broker.candidates[i].stats;
+        if (!stats->is_healthy) continue;
+
+        if (preferred < 0) {
+            preferred = i;
+        }
+        if (fastest < 0 || stats->rtt_ms < broker.candidates[fastest].stats.rtt_ms) {
+            fastest = i;
+        }
+    }
+
+    if (preferred < 0) {
+        return -1;
+    }
+
+    if (broker.candidates[fastest].stats.rtt_ms + BROKER_RTT_MARGIN_MS < broker.candidates[preferred].stats.rtt_ms) {
+        return fastest;
+    }
+
+    return preferred;
+}
+
+static void broker_thread(void *param) {
+    for (;;) {
+        vTaskDelay(pdMS_TO_TICKS(BROKER_CHECK_INTERVAL_SEC * 1000));
+
+        int64_t now = esp_timer_get_time();
+        if (mqtt_is_connected()) {
+            broker.down_since = 0;
+        } else if (broker.down_since == 0) {
+            broker.down_since = now;
+        }
+
+        bool is_down = broker.down_since != 0 && now - broker.down_since >= BROKER_FAILOVER_SEC * 1000000ll;
+        int64_t probe_interval_sec = broker.active != 0 ? BROKER_FAILBACK_SEC : BROKER_REFRESH_SEC;
+        bool is_due = broker.probed_at == 0 || now - broker.probed_at >= probe_interval_sec * 1000000ll;
+
+        if (!is_down && !is_due) continue;
+
+#ifdef USE_MQTT_MDNS
+        if (broker.is_discovering) {
+            broker_discover();
+        }
+#endif
+        broker_probe();
+
+        // Connected broker is kept until it is down, even if a probe of it
+        // failed, so the lock never leaves MQTT_URI while it works.
+        int selected = broker_select();
+        if (selected < 0 || selected == broker.active || (broker.active == 0 && !is_down)) {
+            broker_publish_stats();
+            continue;
+        }
+
+        const struct broker_candidate *from = &broker.candidates[broker.active];
+        const struct broker_candidate *to = &broker.candidates[selected];
+        ESP_LOGW(
+            TAG, "Switching broker from %s to %s, RTT %lu ms",
+            from->stats.name, to->stats.name, to->stats.rtt_ms
+        );
+
+        mqtt_set_broker(to->uri);
+        broker.active = selected;
+        broker.down_since = 0;
+        broker.switches++;
+        broker_publish_stats();
+    }
+}
+
+void broker_init(void) {
+    static StackType_t stack[BROKER_TASK_STACK_SIZE];
+    static StaticTask_t task;
+
+    for (int i = 0; i < sizeof(configured_uris) / sizeof(configured_uris[0]); i++) {
+        broker_add(configured_uris[i]);
+    }
+    // MQTT client starts with MQTT_URI.
+    broker.active = 0;
+    broker_publish_stats();
+
+#ifdef USE_MQTT_MDNS
+    // Credentials of MQTT_URI are sent to announced brokers, so their
+    // certificates must be verified.
+    broker.is_discovering = strncmp(MQTT_URI, "mqtts://", strlen("mqtts://")) == 0;
+    if (broker.is_discovering) {
+        ESP_ERROR_CHECK(mdns_init());
+        ESP_ERROR_CHECK(mdns_hostname_set("xecut-lock-" MQTT_DEVICE_ID));
+    } else {
+        ESP_LOGE(TAG, "Broker discovery is disabled, it requires mqtts:// in MQTT_URI");
+    }
+#endif
+
+    if (broker.count == 1 && !broker.is_discovering) {
+        return;
+    }
+
+    TaskHandle_t handle = xTaskCreateStaticPinnedToCore(
+        broker_thread,
+        "broker",
+        BROKER_TASK_STACK_SIZE,
+        NULL,
+        BROKER_TASK_PRIORITY,
+        stack,
+        &task,
+        BROKER_TASK_CORE
+    );
+    heap_guard_watch_task(handle);
+}
+
+void broker_get_stats(struct broker_stats *stats) {
+    taskENTER_CRITICAL(&broker.spinlock);
+    stats->active = broker.stats_active;
+    stats->count = broker.stats_count;
+    stats->switches = broker.switches;
+    memcpy(stats->candidates, broker.stats, sizeof(stats->candidates));
+    taskEXIT_CRITICAL(&broker.spinlock);
+}
@@ -0,0 +1,37 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Failover between MQTT brokers. Candidates are MQTT_URI, MQTT_FALLBACK_URIS
+// and, with USE_MQTT_MDNS, listed brokers announced as _mqtt._tcp. All
+// candidates are probed in parallel with a TCP connect, and the broker is
+// switched only when the current one stays down, or when MQTT_URI or a better
+// fallback is healthy again.
+
+#define BROKER_CANDIDATES_MAX  4
+#define BROKER_NAME_MAX        48
+
+struct broker_candidate_stats {
+    // Host and port, credentials are never reported.
+    char name[BROKER_NAME_MAX];
+    bool is_healthy;
+    // Connect time of the last probe, valid if healthy.
+    uint32_t rtt_ms;
+};
+
+struct broker_stats {
+    int active;
+    int count;
+    uint32_t switches;
+    struct broker_candidate_stats candidates[BROKER_CANDIDATES_MAX];
+};
+
+// Called after mqtt_init. Does nothing if MQTT_URI is the only candidate.
+void broker_init(void);
+
+void broker_get_stats(struct broker_stats *stats);
+
+// Takes host and port from scheme://[user:password@]host[:port][/path].
+bool broker_parse_uri(const char *uri, char *host, size_t host_size, uint16_t *port);
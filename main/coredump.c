@@ -0,0 +1,342 @@
+#include "coredump.h"
+
+#include <esp_log.h>
+#include <esp_err.h>
+#include <esp_system.h>
+#include <esp_app_desc.h>
+#include <esp_core_dump.h>
+#include <esp_flash.h>
+#include <mqtt_client.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "config.h"
+#include "mqtt.h"
+#include "payload.h"
+#include "storage.h"
+#include "tasks.h"
+
+#define TAG "coredump"
+
+// Summary is CBOR even without USE_CBOR, so it fits one small message, and
+// its topic has the same suffix as other CBOR topics.
+#define COREDUMP_SUMMARY_TOPIC  MQTT_TOPIC(MQTT_DEVICE_ID, "coredump/summary/cbor")
+#define COREDUMP_ELF_TOPIC      MQTT_TOPIC(MQTT_DEVICE_ID, "coredump/elf")
+#define COREDUMP_DUMP_TOPIC     MQTT_TOPIC(MQTT_DEVICE_ID, "coredump/dump")
+
+#define COREDUMP_SUMMARY_SIZE   1536
+#define COREDUMP_CHUNK_SIZE     2048
+#define COREDUMP_TASKS_MAX      24
+// Chunks are sent with qos 1, outbox is drained before the next one.
+#define COREDUMP_OUTBOX_MAX     (4 * COREDUMP_CHUNK_SIZE)
+
+#define COREDUMP_NOTIFY_SUMMARY  (1 << 0)
+#define COREDUMP_NOTIFY_DUMP     (1 << 1)
+
+// ELF core dump layout, see ELF specification and core_dump_elf.c in ESP-IDF.
+#define ELF_PHDR_TYPE_LOAD   1
+#define ELF_PHDR_TYPE_NOTE   4
+#define ELF_NOTE_PRSTATUS    1
+// Offsets in prstatus note of Xtensa and RISC-V, pr_pid holds TCB address.
+#define PRSTATUS_PID_OFFSET  24
+#define PRSTATUS_PC_OFFSET   72
+#define ELF_HEADER_SEARCH    64
+
+// Chunk of the whole dump, offsets let host detect lost chunks.
+struct coredump_chunk_header {
+    uint32_t offset;
+    uint32_t total;
+} __attribute__((packed));
+
+struct coredump_task {
+    uint32_t tcb;
+    uint32_t pc;
+    char name[configMAX_TASK_NAME_LEN];
+};
+
+static struct {
+    TaskHandle_t task;
+
+    bool has_dump;
+    size_t addr;
+    size_t size;
+    // Checksum at the end of dump, identifies it in NVS once summary is delivered.
+    uint32_t checksum;
+
+    uint8_t summary[COREDUMP_SUMMARY_SIZE];
+    int summary_len;
+    int summary_msg_id;
+
+    struct coredump_task tasks[COREDUMP_TASKS_MAX];
+    int tasks_count;
+
+    uint8_t chunk[sizeof(struct coredump_chunk_header) + COREDUMP_CHUNK_SIZE];
+} coredump = {
+    .summary_msg_id = -1,
+};
+
+static esp_err_t read_dump(size_t offset, void *buf, size_t len) {
+    if (offset + len > coredump.size) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    return esp_flash_read(NULL, buf, coredump.addr + offset, len);
+}
+
+static uint32_t read_u32(size_t offset) {
+    uint32_t value = 0;
+    read_dump(offset, &value, sizeof(value));
+    return value;
+}
+
+static struct coredump_task *find_task(uint32_t tcb) {
+    for (int i = 0; i < coredump.tasks_count; i++) {
+        if (coredump.tasks[i].tcb == tcb) {
+            return &coredump.tasks[i];
+        }
+    }
+    return NULL;
+}
+
+// Task list is taken from prstatus notes, one per task. Task names are read
+// from TCBs, which are dumped as separate load segments.
+static void parse_tasks(void) {
+    uint8_t magic[4];
+    size_t elf = 0;
+    for (; elf < ELF_HEADER_SEARCH; elf += 4) {
+        if (read_dump(elf, magic, sizeof(magic)) != ESP_OK) return;
+        if (memcmp(magic, "\x7f" "ELF", 4) == 0) break;
+    }
+    if (elf == ELF_HEADER_SEARCH) {
+        ESP_LOGW(TAG, "No ELF header in core dump");
+        return;
+    }
+
+    uint32_t phoff = read_u32(elf + 28);
+    uint16_t phsize = read_u32(elf + 42) & 0xFFFF;
+    uint16_t phnum = read_u32(elf + 44) & 0xFFFF;
+
+    for (int i = 0; i < phnum; i++) {
+        size_t phdr = elf + phoff + i * phsize;
+        if (read_u32(phdr) != ELF_PHDR_TYPE_NOTE) continue;
+
+        size_t note = elf + read_u32(phdr + 4);
+        size_t end = note + read_u32(phdr + 16);
+
+        while (note + 12 <= end && coredump.tasks_count < COREDUMP_TASKS_MAX) {
+            uint32_t namesz = read_u32(note);
+            uint32_t descsz = read_u32(note + 4);
+            uint32_t type = read_u32(note + 8);
+            size_t desc = note + 12 + ((namesz + 3) & ~3);
+
+            if (type == ELF_NOTE_PRSTATUS) {
+                struct coredump_task *task = &coredump.tasks[coredump.tasks_count++];
+                task->tcb = read_u32(desc + PRSTATUS_PID_OFFSET);
+                task->pc = read_u32(desc + PRSTATUS_PC_OFFSET);
+            }
+
+            note = desc + ((descsz + 3) & ~3);
+        }
+    }
+
+    for (int i = 0; i < phnum; i++) {
+        size_t phdr = elf + phoff + i * phsize;
+        if (read_u32(phdr) != ELF_PHDR_TYPE_LOAD) continue;
+
+        struct coredump_task *task = find_task(read_u32(phdr + 8));
+        if (task == NULL) continue;
+
+        // StaticTask_t mirrors TCB layout, ucDummy7 is the task name.
+        size_t name = elf + read_u32(phdr + 4) + offsetof(StaticTask_t, ucDummy7);
+        read_dump(name, task->name, sizeof(task->name));
+        task->name[sizeof(task->name) - 1] = '\0';
+    }
+}
+
+static void format_summary(void) {
+    esp_core_dump_summary_t summary;
+    bool has_summary = esp_core_dump_get_summary(&summary) == ESP_OK;
+
+    struct payload p;
+    payload_init(&p, PAYLOAD_CBOR, coredump.summary, sizeof(coredump.summary));
+    payload_map_begin(&p);
+
+    payload_key_uint(&p, PAYLOAD_RESET_REASON, esp_reset_reason());
+    payload_key_text(&p, PAYLOAD_VERSION, esp_app_get_description()->version);
+    payload_key_uint(&p, PAYLOAD_SIZE, coredump.size);
+
+    if (has_summary) {
+        payload_key_text(&p, PAYLOAD_ELF_SHA256, (const char *)summary.app_elf_sha256);
+        payload_key_text(&p, PAYLOAD_TASK, summary.exc_task);
+        payload_key_uint(&p, PAYLOAD_TCB, summary.exc_tcb);
+        payload_key_uint(&p, PAYLOAD_PC, summary.exc_pc);
+#ifdef __XTENSA__
+        payload_key_uint(&p, PAYLOAD_EXC_CAUSE, summary.ex_info.exc_cause);
+        payload_key_uint(&p, PAYLOAD_EXC_VADDR, summary.ex_info.exc_vaddr);
+
+        payload_key(&p, PAYLOAD_REGISTERS);
+        payload_array_begin(&p);
+        for (int i = 0; i < sizeof(summary.ex_info.exc_a) / sizeof(summary.ex_info.exc_a[0]); i++) {
+            payload_uint(&p, summary.ex_info.exc_a[i]);
+        }
+        payload_end(&p);
+#endif
+
+        payload_key(&p, PAYLOAD_BACKTRACE);
+        payload_array_begin(&p);
+        for (int i = 0; i < summary.exc_bt_info.depth; i++) {
+            payload_uint(&p, summary.exc_bt_info.bt[i]);
+        }
+        payload_end(&p);
+        payload_key(&p, PAYLOAD_BACKTRACE_CORRUPTED);
+        payload_bool(&p, summary.exc_bt_info.corrupted);
+    }
+
+    payload_key(&p, PAYLOAD_TASKS);
+    payload_array_begin(&p);
+    for (int i = 0; i < coredump.tasks_count; i++) {
+        const struct coredump_task *task = &coredump.tasks[i];
+
+        payload_map_begin(&p);
+        payload_key_text(&p, PAYLOAD_NAME, task->name);
+        payload_key_uint(&p, PAYLOAD_TCB, task->tcb);
+        payload_key_uint(&p, PAYLOAD_PC, task->pc);
+        payload_end(&p);
+    }
+    payload_end(&p);
+
+    payload_end(&p);
+
+    coredump.summary_len = payload_finish(&p);
+    if (coredump.summary_len < 0) {
+        ESP_LOGE(TAG, "Summary does not fit %d bytes", sizeof(coredump.summary));
+    }
+}
+
+static void publish_summary(void) {
+    if (coredump.summary_len < 0) return;
+
+    // Retained, so backend gets it even if it subscribes after the upload.
+    coredump.summary_msg_id = mqtt_publish_data(
+        COREDUMP_SUMMARY_TOPIC, coredump.summary, coredump.summary_len, /* qos */ 1, /* retain */ true
+    );
+}
+
+static void publish_dump(void) {
+    esp_mqtt_client_handle_t client = mqtt_get_client();
+    struct coredump_chunk_header *header = (struct coredump_chunk_header *)coredump.chunk;
+    uint8_t *data = &coredump.chunk[sizeof(*header)];
+
+    ESP_LOGI(TAG, "Sending core dump of %u bytes", coredump.size);
+
+    for (size_t offset = 0; offset < coredump.size; offset += COREDUMP_CHUNK_SIZE) {
+        size_t len = coredump.size - offset;
+        if (len > COREDUMP_CHUNK_SIZE) {
+            len = COREDUMP_CHUNK_SIZE;
+        }
+
+        while (esp_mqtt_client_get_outbox_size(client) > COREDUMP_OUTBOX_MAX) {
+            vTaskDelay(pdMS_TO_TICKS(50));
+        }
+
+        header->offset = offset;
+        header->total = coredump.size;
+        if (read_dump(offset, data, len) != ESP_OK) {
+            ESP_LOGE(TAG, "Unable to read core dump at offset %u", offset);
+            return;
+        }
+
+        if (mqtt_publish_data(COREDUMP_ELF_TOPIC, coredump.chunk, sizeof(*header) + len, /* qos */ 1, /* retain */ false) < 0) {
+            return;
+        }
+    }
+}
+
+static void coredump_thread(void *param) {
+    for (;;) {
+        uint32_t requests = 0;
+        xTaskNotifyWait(0, UINT32_MAX, &requests, portMAX_DELAY);
+
+        if (requests & COREDUMP_NOTIFY_SUMMARY) {
+            publish_summary();
+        }
+        if (requests & COREDUMP_NOTIFY_DUMP) {
+            publish_dump();
+        }
+    }
+}
+
+static void mqtt_event_handler(
+    void *arg,
+    esp_event_base_t event_base,
+    int32_t event_id,
+    void *event_data
+) {
+    esp_mqtt_event_handle_t event = event_data;
+
+    if (event_id == MQTT_EVENT_CONNECTED) {
+        xTaskNotify(coredump.task, COREDUMP_NOTIFY_SUMMARY, eSetBits);
+    }
+    else if (event_id == MQTT_EVENT_PUBLISHED && event->msg_id == coredump.summary_msg_id) {
+        // Dump is kept for coredump/dump requests until the next crash
+        // overwrites it, only its upload is remembered.
+        ESP_LOGI(TAG, "Summary is delivered");
+        storage_save_blob("coredump", "uploaded", &coredump.checksum, sizeof(coredump.checksum));
+        esp_mqtt_client_unregister_event(mqtt_get_client(), ESP_EVENT_ANY_ID, &mqtt_event_handler);
+    }
+}
+
+static void mqtt_coredump_dump_topic_updated(
+    const char *topic, int topic_len,
+    const char *data,  int data_len
+) {
+    if (!coredump.has_dump) {
+        ESP_LOGW(TAG, "No core dump in flash");
+        return;
+    }
+
+    xTaskNotify(coredump.task, COREDUMP_NOTIFY_DUMP, eSetBits);
+}
+
+static bool is_uploaded(void) {
+    uint32_t uploaded = 0;
+    size_t len = sizeof(uploaded);
+
+    return storage_load_blob("coredump", "uploaded", &uploaded, &len) == ESP_OK
+        && len == sizeof(uploaded)
+        && uploaded == coredump.checksum;
+}
+
+void coredump_init(void) {
+    static StackType_t stack[COREDUMP_TASK_STACK_SIZE];
+    static StaticTask_t task;
+
+    coredump.has_dump = esp_core_dump_image_check() == ESP_OK
+        && esp_core_dump_image_get(&coredump.addr, &coredump.size) == ESP_OK;
+    if (!coredump.has_dump) return;
+
+    coredump.checksum = read_u32(coredump.size - sizeof(uint32_t));
+
+    coredump.task = xTaskCreateStaticPinnedToCore(
+        coredump_thread,
+        "coredump",
+        COREDUMP_TASK_STACK_SIZE,
+        NULL,
+        COREDUMP_TASK_PRIORITY,
+        stack,
+        &task,
+        COREDUMP_TASK_CORE
+    );
+
+    mqtt_subscribe(COREDUMP_DUMP_TOPIC, /* qos */ 1, mqtt_coredump_dump_topic_updated);
+
+    if (is_uploaded()) return;
+
+    ESP_LOGW(TAG, "Found core dump of %u bytes from the last crash", coredump.size);
+
+    parse_tasks();
+    format_summary();
+
+    ESP_ERROR_CHECK(esp_mqtt_client_register_event(mqtt_get_client(), ESP_EVENT_ANY_ID, &mqtt_event_handler, NULL));
+}
@@ -0,0 +1,10 @@
+#pragma once
+
+// Crash telemetry. Core dump saved to flash on a crash is summarized on the
+// next boot to the crashed task, its backtrace and registers and the task
+// list. Summary is published as retained CBOR to
+// xecut-lock/<id>/coredump/summary/cbor, see utils/decode_coredump.py. The whole dump is sent in chunks to
+// xecut-lock/<id>/coredump/elf on request to xecut-lock/<id>/coredump/dump.
+
+// Called after mqtt_init.
+void coredump_init(void);
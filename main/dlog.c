@@ -0,0 +1,188 @@
+#include "dlog.h"
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "tasks.h"
+#include "heap_guard.h"
+
+// These values must be identical to the values from the utils/decode_log.py file.
+#define DLOG_MAGIC    0x474F4C44  // "DLOG"
+#define DLOG_VERSION  1
+
+// Must be power of two.
+#define DLOG_RECORDS        256
+#define DLOG_MESSAGE_SIZE   256
+
+struct dlog_record {
+    uint32_t timestamp_ms;
+    uint32_t format;
+    uint32_t tag;
+    uint8_t  level;
+    uint8_t  nargs;
+    uint16_t reserved;
+    uint32_t args[DLOG_ARGS_MAX];
+};
+
+struct dlog_dump_header {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t record_size;
+    uint32_t count;
+    uint32_t dropped;
+};
+
+static struct {
+    portMUX_TYPE spinlock;
+    TaskHandle_t task;
+
+    // Records between tail and head are not printed yet. Printed records are
+    // kept until overwritten, so a dump contains recent history.
+    struct dlog_record records[DLOG_RECORDS];
+    uint32_t head;
+    uint32_t tail;
+
+    uint32_t dropped;
+    // Reported by drain task, so overload is visible in console as well.
+    uint32_t reported_dropped;
+} dlog = {
+    .spinlock = portMUX_INITIALIZER_UNLOCKED,
+};
+
+static char level_letter(esp_log_level_t level) {
+    switch (level) {
+        case ESP_LOG_ERROR:   return 'E';
+        case ESP_LOG_WARN:    return 'W';
+        case ESP_LOG_INFO:    return 'I';
+        case ESP_LOG_DEBUG:   return 'D';
+        case ESP_LOG_VERBOSE: return 'V';
+        default:              return '?';
+    }
+}
+
+static void dlog_print(const struct dlog_record *record) {
+    char message[DLOG_MESSAGE_SIZE];
+
+    // Unused arguments are ignored by snprintf.
+    snprintf(
+        message, sizeof(message), (const char *)record->format,
+        record->args[0], record->args[1], record->args[2], record->args[3]
+    );
+
+    esp_log_write(
+        record->level, (const char *)record->tag,
+        "%c (%lu) %s: %s\n",
+        level_letter(record->level), record->timestamp_ms, (const char *)record->tag, message
+    );
+}
+
+static void dlog_thread(void *param) {
+    for (;;) {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+
+        for (;;) {
+            struct dlog_record record;
+            uint32_t dropped;
+
+            taskENTER_CRITICAL(&dlog.spinlock);
+            bool has_record = dlog.tail != dlog.head;
+            if (has_record) {
+                record = dlog.records[dlog.tail % DLOG_RECORDS];
+                dlog.tail++;
+            }
+            dropped = dlog.dropped;
+            taskEXIT_CRITICAL(&dlog.spinlock);
+
+            if (dropped != dlog.reported_dropped) {
+                ESP_LOGW("dlog", "%lu log records dropped", dropped - dlog.reported_dropped);
+                dlog.reported_dropped = dropped;
+            }
+
+            if (!has_record) break;
+
+            dlog_print(&record);
+        }
+    }
+}
+
+void dlog_init(void) {
+    static StackType_t stack[DLOG_TASK_STACK_SIZE];
+    static StaticTask_t task;
+
+    dlog.task = xTaskCreateStaticPinnedToCore(
+        dlog_thread,
+        "dlog",
+        DLOG_TASK_STACK_SIZE,
+        NULL,
+        DLOG_TASK_PRIORITY,
+        stack,
+        &task,
+        DLOG_TASK_CORE
+    );
+    heap_guard_watch_task(dlog.task);
+}
+
+void dlog_record(esp_log_level_t level, const char *tag, const char *format, int nargs, ...) {
+    if (level > CONFIG_LOG_DEFAULT_LEVEL) {
+        return;
+    }
+
+    struct dlog_record record = {
+        .timestamp_ms = esp_log_timestamp(),
+        .format = (uint32_t)format,
+        .tag = (uint32_t)tag,
+        .level = level,
+        .nargs = nargs,
+    };
+
+    va_list args;
+    va_start(args, nargs);
+    for (int i = 0; i < nargs && i < DLOG_ARGS_MAX; i++) {
+        record.args[i] = va_arg(args, uint32_t);
+    }
+    va_end(args);
+
+    taskENTER_CRITICAL(&dlog.spinlock);
+    bool is_full = dlog.head - dlog.tail == DLOG_RECORDS;
+    if (is_full) {
+        dlog.dropped++;
+    } else {
+        dlog.records[dlog.head % DLOG_RECORDS] = record;
+        dlog.head++;
+    }
+    taskEXIT_CRITICAL(&dlog.spinlock);
+
+    if (!is_full && dlog.task != NULL) {
+        xTaskNotifyGive(dlog.task);
+    }
+}
+
+void dlog_dump(dlog_emit_t emit, void *arg) {
+    static struct {
+        struct dlog_dump_header header;
+        struct dlog_record records[DLOG_RECORDS];
+    } dump;
+
+    taskENTER_CRITICAL(&dlog.spinlock);
+    uint32_t count = dlog.head < DLOG_RECORDS ? dlog.head : DLOG_RECORDS;
+    for (uint32_t i = 0; i < count; i++) {
+        dump.records[i] = dlog.records[(dlog.head - count + i) % DLOG_RECORDS];
+    }
+    dump.header = (struct dlog_dump_header) {
+        .magic = DLOG_MAGIC,
+        .version = DLOG_VERSION,
+        .record_size = sizeof(struct dlog_record),
+        .count = count,
+        .dropped = dlog.dropped,
+    };
+    taskEXIT_CRITICAL(&dlog.spinlock);
+
+    emit(&dump, sizeof(dump.header) + count * sizeof(struct dlog_record), arg);
+}
+
+uint32_t dlog_dropped(void) {
+    return dlog.dropped;
+}
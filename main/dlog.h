@@ -0,0 +1,40 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <esp_log.h>
+
+// Deferred logging. Only format string pointer and raw arguments are recorded
+// into a ring buffer, formatting and console output happen in a low priority task.
+//
+// Arguments are stored as 32-bit words, so only 32-bit integers, chars and
+// pointers to static strings are allowed, at most DLOG_ARGS_MAX of them.
+// Must not be used from interrupts.
+
+#define DLOG_ARGS_MAX  4
+
+#define DLOG_NARGS(...) DLOG_NARGS_(0, ##__VA_ARGS__, 4, 3, 2, 1, 0)
+#define DLOG_NARGS_(_0, _1, _2, _3, _4, n, ...) n
+
+#define DLOG(level, tag, format, ...) do { \
+        if (LOG_LOCAL_LEVEL >= (level)) { \
+            dlog_record((level), (tag), (format), DLOG_NARGS(__VA_ARGS__), ##__VA_ARGS__); \
+        } \
+    } while (0)
+
+#define DLOGE(tag, format, ...)  DLOG(ESP_LOG_ERROR, tag, format, ##__VA_ARGS__)
+#define DLOGW(tag, format, ...)  DLOG(ESP_LOG_WARN,  tag, format, ##__VA_ARGS__)
+#define DLOGI(tag, format, ...)  DLOG(ESP_LOG_INFO,  tag, format, ##__VA_ARGS__)
+#define DLOGD(tag, format, ...)  DLOG(ESP_LOG_DEBUG, tag, format, ##__VA_ARGS__)
+
+// Receives binary dump of the ring buffer, see utils/decode_log.py for format.
+typedef void (*dlog_emit_t)(const void *data, size_t len, void *arg);
+
+void dlog_init(void);
+
+void dlog_record(esp_log_level_t level, const char *tag, const char *format, int nargs, ...)
+    __attribute__((format(printf, 3, 5)));
+
+void dlog_dump(dlog_emit_t emit, void *arg);
+
+uint32_t dlog_dropped(void);
@@ -0,0 +1,229 @@
+#include "door.h"
+
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "config.h"
+#include "mqtt.h"
+#include "payload.h"
+#include "tasks.h"
+#include "trace.h"
+#include "dlog.h"
+#include "power.h"
+#include "soak.h"
+
+#define TAG "door"
+
+#define DOOR_INACTIVITY_RESET_US  (30 * 1000 * 1000)
+
+// Session started this soon after light sleep wakeup is counted as woken by it.
+#define DOOR_WAKE_WINDOW_US       (1000 * 1000)
+
+static struct door doors[DOORS_COUNT];
+
+// Single task serves inputs of all doors, waking up only on input events.
+// Completed OTP verifications are handled by event loop.
+#define DOORS_QUEUE_SET_SIZE  (DOORS_COUNT * DOOR_INPUT_SLOTS * INPUT_QUEUE_SIZE)
+
+static QueueSetHandle_t doors_queue_set;
+
+// A single door keeps the topics of firmware without door support, so
+// existing backends work after an upgrade.
+static void door_init_topic(struct door *door, char *topic, const char *suffix) {
+#if DOORS_COUNT == 1
+    snprintf(topic, DOOR_TOPIC_MAX_LEN, MQTT_TOPIC(MQTT_DEVICE_ID, "%s"), suffix);
+#else
+    snprintf(topic, DOOR_TOPIC_MAX_LEN, MQTT_TOPIC(MQTT_DEVICE_ID, "%s/%s"), door->hw->name, suffix);
+#endif
+}
+
+static struct input *door_find_input(QueueSetMemberHandle_t queue, struct door **door) {
+    for (int i = 0; i < DOORS_COUNT; i++) {
+        for (int j = 0; j < doors[i].inputs_count; j++) {
+            if (doors[i].inputs[j].queue == queue) {
+                *door = &doors[i];
+                return &doors[i].inputs[j];
+            }
+        }
+    }
+    return NULL;
+}
+
+static TickType_t doors_reset_timeout(void) {
+    int64_t now = esp_timer_get_time();
+    int64_t timeout_us = INT64_MAX;
+
+    for (int i = 0; i < DOORS_COUNT; i++) {
+        if (doors[i].last_input_timestamp == INT64_MAX) continue;
+
+        int64_t left_us = doors[i].last_input_timestamp + DOOR_INACTIVITY_RESET_US - now;
+        if (left_us < timeout_us) {
+            timeout_us = left_us > 0 ? left_us : 0;
+        }
+    }
+
+    if (timeout_us == INT64_MAX) {
+        return portMAX_DELAY;
+    }
+
+    return pdMS_TO_TICKS(timeout_us / 1000) + 1;
+}
+
+static void doors_reset_inactive(void) {
+    int64_t now = esp_timer_get_time();
+
+    for (int i = 0; i < DOORS_COUNT; i++) {
+        struct door *door = &doors[i];
+
+        bool keypad_used = door->last_input_timestamp != INT64_MAX;
+        if (keypad_used && now - door->last_input_timestamp >= DOOR_INACTIVITY_RESET_US) {
+            DLOGD(TAG, "Reset keypad of door '%s' after 30 seconds of inactivity", door->hw->name);
+            keypad_reset(&door->keypad);
+            door->last_input_timestamp = INT64_MAX;
+            power_stay_awake_release();
+
+            for (int j = 0; j < door->inputs_count; j++) {
+                input_arm_wakeup(&door->inputs[j]);
+            }
+        }
+    }
+}
+
+static void door_handle_input_start(struct door *door) {
+    bool is_session_start = door->last_input_timestamp == INT64_MAX;
+    door->last_input_timestamp = esp_timer_get_time();
+
+    if (!is_session_start) {
+        return;
+    }
+
+    // Keep UART running until the keypad is reset after inactivity.
+    power_stay_awake_acquire();
+
+    int64_t since_wakeup_us = power_since_wakeup_us();
+    if (since_wakeup_us < DOOR_WAKE_WINDOW_US && since_wakeup_us > door->stats.wake_max_us) {
+        door->stats.wake_max_us = since_wakeup_us;
+    }
+}
+
+static void door_handle_input(struct door *door, struct input *input) {
+    static char keys[KEYPAD_UART_BUFFER_SIZE];
+
+    int len = input_read(input, keys, sizeof(keys));
+
+    // Session starts on the wakeup edge, before its byte is received, and
+    // keeps the chip awake for the following keys.
+    bool is_woken = input_take_wakeup(input);
+    if (len == 0 && !is_woken) {
+        return;
+    }
+
+    door_handle_input_start(door);
+
+    if (len > 0) {
+        int64_t start = esp_timer_get_time();
+        keypad_process(&door->keypad, keys, len);
+        SOAK_RECORD(SOAK_KEYPAD_PROCESS, start);
+    }
+}
+
+static void door_update_stats(struct door *door, int64_t wakeup_timestamp, UBaseType_t queued) {
+    uint32_t latency_us = esp_timer_get_time() - wakeup_timestamp;
+
+    door->stats.events += 1;
+    door->stats.total_us += latency_us;
+    if (latency_us > door->stats.max_us) {
+        door->stats.max_us = latency_us;
+    }
+    if (queued > door->stats.max_queued) {
+        door->stats.max_queued = queued;
+    }
+}
+
+static void door_add_input(struct door *door, const struct input_hardware *hw) {
+    struct input *input = &door->inputs[door->inputs_count];
+    if (!input_init(input, hw)) return;
+
+    BaseType_t ret = xQueueAddToSet(input->queue, doors_queue_set);
+    assert(ret == pdPASS);
+    door->inputs_count++;
+}
+
+static void doors_init_queue_set(void) {
+    // There is no static variant of xQueueCreateSet in this FreeRTOS version.
+    static uint8_t storage[DOORS_QUEUE_SET_SIZE * sizeof(QueueSetMemberHandle_t)];
+    static StaticQueue_t queue_set;
+
+    doors_queue_set = xQueueGenericCreateStatic(
+        DOORS_QUEUE_SET_SIZE, sizeof(QueueSetMemberHandle_t),
+        storage, &queue_set, queueQUEUE_TYPE_SET
+    );
+}
+
+void doors_init(struct keypad_callbacks cb) {
+    doors_init_queue_set();
+
+    for (int i = 0; i < DOORS_COUNT; i++) {
+        struct door *door = &doors[i];
+
+        door->index = i;
+        door->hw = &doors_hardware[i];
+        door->last_input_timestamp = INT64_MAX;
+
+        keypad_init(&door->keypad, cb, door);
+        for (int j = 0; j < DOOR_INPUTS_MAX; j++) {
+            door_add_input(door, &door->hw->inputs[j]);
+        }
+#ifdef USE_SOAK
+        static const struct input_hardware soak_input = { .type = INPUT_SOAK };
+        door_add_input(door, &soak_input);
+#endif
+        lock_init(&door->lock, door->hw->lock_gpio);
+        door_sensor_init(&door->sensor, door->hw->contact_gpio, door->hw->exit_gpio, &door->lock, door);
+
+        door_init_topic(door, door->topics.checkin, "checkin" PAYLOAD_TOPIC_SUFFIX);
+        door_init_topic(door, door->topics.command, "command" PAYLOAD_TOPIC_SUFFIX);
+        door_init_topic(door, door->topics.alarm,   "alarm" PAYLOAD_TOPIC_SUFFIX);
+        door_init_topic(door, door->topics.lock,    "lock");
+        door_init_topic(door, door->topics.sensor,  "door" PAYLOAD_TOPIC_SUFFIX);
+    }
+}
+
+struct door *door_get(int index) {
+    return &doors[index];
+}
+
+struct door *door_find_by_lock_topic(const char *topic, int topic_len) {
+    for (int i = 0; i < DOORS_COUNT; i++) {
+        const char *lock_topic = doors[i].topics.lock;
+        if (strlen(lock_topic) == topic_len && memcmp(lock_topic, topic, topic_len) == 0) {
+            return &doors[i];
+        }
+    }
+    return NULL;
+}
+
+void doors_loop(void) {
+    for (;;) {
+        QueueSetMemberHandle_t queue = xQueueSelectFromSet(doors_queue_set, doors_reset_timeout());
+        int64_t wakeup_timestamp = esp_timer_get_time();
+
+        if (queue != NULL) {
+            struct door *door = NULL;
+            struct input *input = door_find_input(queue, &door);
+            UBaseType_t queued = uxQueueMessagesWaiting(queue);
+
+            if (input != NULL) {
+                TRACE_BEGIN("keypad_input");
+                door_handle_input(door, input);
+                TRACE_END("keypad_input");
+                door_update_stats(door, wakeup_timestamp, queued);
+            }
+        }
+
+        // Reset keypads after inactivity before receiving new data.
+        doors_reset_inactive();
+    }
+}
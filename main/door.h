@@ -0,0 +1,63 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "config.h"
+#include "door_sensor.h"
+#include "hardware.h"
+#include "input.h"
+#include "keypad.h"
+#include "lock.h"
+
+#define DOOR_TOPIC_MAX_LEN  96
+
+#ifdef USE_SOAK
+// One more input for synthetic keys, see soak.h.
+#define DOOR_INPUT_SLOTS  (DOOR_INPUTS_MAX + 1)
+#else
+#define DOOR_INPUT_SLOTS  DOOR_INPUTS_MAX
+#endif
+
+struct door_topics {
+    char checkin[DOOR_TOPIC_MAX_LEN];
+    char command[DOOR_TOPIC_MAX_LEN];
+    char alarm[DOOR_TOPIC_MAX_LEN];
+    char lock[DOOR_TOPIC_MAX_LEN];
+    char sensor[DOOR_TOPIC_MAX_LEN];
+};
+
+// Keypad input latency, measured from keypad task wakeup to the end of input
+// processing. Decode errors are counted per input, see input.h.
+struct door_stats {
+    uint32_t events;
+    uint64_t total_us;
+    uint32_t max_us;
+    uint32_t max_queued;
+
+    // Time from light sleep wakeup to the start of a session.
+    uint32_t wake_max_us;
+};
+
+struct door {
+    int index;
+    const struct door_hardware *hw;
+
+    struct keypad keypad;
+    struct input inputs[DOOR_INPUT_SLOTS];
+    int inputs_count;
+    struct lock lock;
+    struct door_sensor sensor;
+    struct door_topics topics;
+    struct door_stats stats;
+
+    // INT64_MAX when keypad is idle. Light sleep is forbidden while it is not.
+    int64_t last_input_timestamp;
+};
+
+void doors_init(struct keypad_callbacks cb);
+
+struct door *door_get(int index);
+
+struct door *door_find_by_lock_topic(const char *topic, int topic_len);
+
+void doors_loop(void);
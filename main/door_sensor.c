@@ -0,0 +1,320 @@
+#include "door_sensor.h"
+
+#include <assert.h>
+#include <driver/gptimer.h>
+#include <esp_err.h>
+#include <esp_log.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/queue.h>
+#include <freertos/task.h>
+
+#include "config.h"
+#include "hardware.h"
+#include "lock.h"
+#include "event_loop.h"
+#include "power.h"
+#include "tasks.h"
+#include "heap_guard.h"
+
+#define TAG "door_sensor"
+
+// Opening this soon after unlock or exit request is not forced.
+#define DOOR_SENSOR_ENTRY_GRACE_US  (5 * 1000 * 1000)
+#define DOOR_SENSOR_HELD_OPEN_US    (30 * 1000 * 1000)
+
+// Interrupt of an input stays disabled until its sample is handled, so every
+// input has at most one sample queued, and every door one held open timeout.
+#define DOOR_SENSOR_QUEUE_SIZE      (DOORS_COUNT * 3)
+
+struct door_sensor_sample {
+    struct door_sensor_input *input;
+    int level;
+    // Held open timeout of this door instead of a sample.
+    struct door_sensor *held_open;
+};
+
+static struct {
+    QueueHandle_t queue;
+    TaskHandle_t task;
+
+    // ESP32-S3 has only four GPTimers and every Wiegand reader takes one, so
+    // all inputs share a single debounce timer. It runs while any input is
+    // debouncing, its alarm is set to the earliest sample time.
+    gptimer_handle_t debounce_timer;
+    portMUX_TYPE spinlock;
+    bool is_timer_running;
+    struct door_sensor_input *inputs[DOORS_COUNT * 2];
+    int inputs_count;
+} door_sensors = {
+    .spinlock = portMUX_INITIALIZER_UNLOCKED,
+};
+
+const char *door_sensor_event_name(enum door_sensor_event_kind kind) {
+    switch (kind) {
+    case DOOR_SENSOR_OPENED:       return "door_opened";
+    case DOOR_SENSOR_FORCED_OPEN:  return "door_forced_open";
+    case DOOR_SENSOR_HELD_OPEN:    return "door_held_open";
+    case DOOR_SENSOR_CLOSED:       return "door_closed";
+    case DOOR_SENSOR_EXIT_REQUEST: return "exit_request";
+    }
+    return "unknown";
+}
+
+static void door_sensor_post(struct door_sensor *sensor, enum door_sensor_event_kind kind, int64_t edge_us) {
+    struct event event = {
+        .id = EVENT_DOOR_SENSOR,
+        .door_sensor = {
+            .ctx = sensor->ctx,
+            .kind = kind,
+            .edge_us = edge_us,
+        },
+    };
+    // Door events are never dropped, see event_loop_post.
+    event_loop_post(&event, portMAX_DELAY);
+}
+
+// Runs in GPIO interrupt. Light sleep is forbidden until the sample is
+// handled, otherwise the debounce timer would stop.
+static void door_sensor_isr(void *arg) {
+    struct door_sensor_input *input = arg;
+
+    gpio_intr_disable(input->gpio);
+    input->edge_us = esp_timer_get_time();
+    power_stay_awake_acquire();
+
+    portENTER_CRITICAL_ISR(&door_sensors.spinlock);
+
+    if (door_sensors.is_timer_running) {
+        // Alarm is already set to an earlier sample time.
+        uint64_t now;
+        gptimer_get_raw_count(door_sensors.debounce_timer, &now);
+        input->debounce_until = now + DOOR_SENSOR_DEBOUNCE_US;
+    } else {
+        input->debounce_until = DOOR_SENSOR_DEBOUNCE_US;
+
+        gptimer_alarm_config_t alarm_config = {
+            .alarm_count = input->debounce_until,
+        };
+        gptimer_set_raw_count(door_sensors.debounce_timer, 0);
+        gptimer_set_alarm_action(door_sensors.debounce_timer, &alarm_config);
+        gptimer_start(door_sensors.debounce_timer);
+        door_sensors.is_timer_running = true;
+    }
+    input->is_debouncing = true;
+
+    portEXIT_CRITICAL_ISR(&door_sensors.spinlock);
+}
+
+// Runs in timer interrupt. Samples every input which is due, then moves the
+// alarm to the next one.
+static bool door_sensor_debounced(gptimer_handle_t timer, const gptimer_alarm_event_data_t *edata, void *arg) {
+    BaseType_t task_woken = pdFALSE;
+    uint64_t next = UINT64_MAX;
+
+    portENTER_CRITICAL_ISR(&door_sensors.spinlock);
+
+    for (int i = 0; i < door_sensors.inputs_count; i++) {
+        struct door_sensor_input *input = door_sensors.inputs[i];
+        if (!input->is_debouncing) continue;
+
+        if (input->debounce_until > edata->count_value) {
+            if (input->debounce_until < next) {
+                next = input->debounce_until;
+            }
+            continue;
+        }
+
+        struct door_sensor_sample sample = {
+            .input = input,
+            .level = gpio_get_level(input->gpio),
+        };
+        input->is_debouncing = false;
+        xQueueSendFromISR(door_sensors.queue, &sample, &task_woken);
+    }
+
+    if (next == UINT64_MAX) {
+        gptimer_stop(timer);
+        door_sensors.is_timer_running = false;
+    } else {
+        gptimer_alarm_config_t alarm_config = {
+            .alarm_count = next,
+        };
+        gptimer_set_alarm_action(timer, &alarm_config);
+    }
+
+    portEXIT_CRITICAL_ISR(&door_sensors.spinlock);
+
+    return task_woken == pdTRUE;
+}
+
+// Level interrupt fires right away if the input changed again while its
+// sample was handled, so no change is missed.
+static void door_sensor_arm(struct door_sensor_input *input) {
+    gpio_int_type_t intr_type = input->level ? GPIO_INTR_LOW_LEVEL : GPIO_INTR_HIGH_LEVEL;
+
+#ifdef USE_POWER_SAVE
+    // Also sets interrupt type.
+    ESP_ERROR_CHECK(gpio_wakeup_enable(input->gpio, intr_type));
+#else
+    ESP_ERROR_CHECK(gpio_set_intr_type(input->gpio, intr_type));
+#endif
+    gpio_intr_enable(input->gpio);
+}
+
+static bool is_recent(int64_t timestamp, int64_t now) {
+    return timestamp != 0 && now - timestamp < DOOR_SENSOR_ENTRY_GRACE_US;
+}
+
+static void door_sensor_contact_changed(struct door_sensor *sensor, int64_t edge_us) {
+    sensor->is_open = sensor->contact.level == DOOR_CONTACT_OPEN_LOGIC_LEVEL;
+
+    if (!sensor->is_open) {
+        esp_timer_stop(sensor->held_open_timer);
+        door_sensor_post(sensor, DOOR_SENSOR_CLOSED, edge_us);
+        return;
+    }
+
+    bool is_expected = sensor->lock->is_open
+        || is_recent(sensor->lock->triggered_at, edge_us)
+        || is_recent(sensor->exit_requested_at, edge_us);
+
+    esp_timer_start_once(sensor->held_open_timer, DOOR_SENSOR_HELD_OPEN_US);
+    door_sensor_post(sensor, is_expected ? DOOR_SENSOR_OPENED : DOOR_SENSOR_FORCED_OPEN, edge_us);
+}
+
+static void door_sensor_exit_changed(struct door_sensor *sensor, int64_t edge_us) {
+    if (sensor->exit.level != DOOR_EXIT_PRESSED_LOGIC_LEVEL) return;
+
+    sensor->exit_requested_at = edge_us;
+    door_sensor_post(sensor, DOOR_SENSOR_EXIT_REQUEST, edge_us);
+}
+
+// Runs in esp_timer task, which must not wait for the event loop, so the
+// event is posted by door sensor task.
+static void door_sensor_held_open(void *arg) {
+    struct door_sensor_sample sample = {
+        .held_open = arg,
+    };
+    xQueueSend(door_sensors.queue, &sample, 0);
+}
+
+static void door_sensor_thread(void *arg) {
+    struct door_sensor_sample sample;
+
+    for (;;) {
+        xQueueReceive(door_sensors.queue, &sample, portMAX_DELAY);
+
+        if (sample.held_open != NULL) {
+            door_sensor_post(sample.held_open, DOOR_SENSOR_HELD_OPEN, esp_timer_get_time());
+            continue;
+        }
+
+        struct door_sensor_input *input = sample.input;
+        struct door_sensor *sensor = input->sensor;
+        int64_t edge_us = input->edge_us;
+
+        bool is_changed = sample.level != input->level;
+        input->level = sample.level;
+        door_sensor_arm(input);
+        power_stay_awake_release();
+
+        if (!is_changed) {
+            sensor->stats.bounces++;
+            continue;
+        }
+
+        if (input == &sensor->contact) {
+            door_sensor_contact_changed(sensor, edge_us);
+        } else {
+            door_sensor_exit_changed(sensor, edge_us);
+        }
+    }
+}
+
+static void door_sensor_init_shared(void) {
+    static StackType_t stack[DOOR_SENSOR_TASK_STACK_SIZE];
+    static StaticTask_t task;
+    static uint8_t queue_storage[DOOR_SENSOR_QUEUE_SIZE * sizeof(struct door_sensor_sample)];
+    static StaticQueue_t queue;
+
+    door_sensors.queue = xQueueCreateStatic(
+        DOOR_SENSOR_QUEUE_SIZE, sizeof(struct door_sensor_sample), queue_storage, &queue
+    );
+
+    door_sensors.task = xTaskCreateStaticPinnedToCore(
+        door_sensor_thread,
+        "door_sensor",
+        DOOR_SENSOR_TASK_STACK_SIZE,
+        NULL,
+        DOOR_SENSOR_TASK_PRIORITY,
+        stack,
+        &task,
+        DOOR_SENSOR_TASK_CORE
+    );
+    heap_guard_watch_task(door_sensors.task);
+
+    // Clocked from XTAL, so the timer holds no APB frequency lock, see power.h.
+    gptimer_config_t timer_config = {
+        .clk_src = GPTIMER_CLK_SRC_XTAL,
+        .direction = GPTIMER_COUNT_UP,
+        .resolution_hz = 1000000,
+    };
+    ESP_ERROR_CHECK(gptimer_new_timer(&timer_config, &door_sensors.debounce_timer));
+
+    gptimer_event_callbacks_t callbacks = {
+        .on_alarm = door_sensor_debounced,
+    };
+    ESP_ERROR_CHECK(gptimer_register_event_callbacks(door_sensors.debounce_timer, &callbacks, NULL));
+    ESP_ERROR_CHECK(gptimer_enable(door_sensors.debounce_timer));
+}
+
+static void door_sensor_init_input(struct door_sensor *sensor, struct door_sensor_input *input, gpio_num_t gpio) {
+    input->sensor = sensor;
+    input->gpio = gpio;
+    input->level = gpio_get_level(gpio);
+
+    assert(door_sensors.inputs_count < DOORS_COUNT * 2);
+    door_sensors.inputs[door_sensors.inputs_count++] = input;
+
+    ESP_ERROR_CHECK(gpio_isr_handler_add(gpio, door_sensor_isr, input));
+    door_sensor_arm(input);
+}
+
+void door_sensor_init(struct door_sensor *sensor, gpio_num_t contact_gpio, gpio_num_t exit_gpio, struct lock *lock, void *ctx) {
+    sensor->lock = lock;
+    sensor->ctx = ctx;
+
+    if (contact_gpio == GPIO_NUM_NC && exit_gpio == GPIO_NUM_NC) {
+        return;
+    }
+
+    if (door_sensors.task == NULL) {
+        door_sensor_init_shared();
+    }
+
+    const esp_timer_create_args_t timer_args = {
+        .callback = door_sensor_held_open,
+        .arg = sensor,
+        .name = "door_held_open",
+    };
+    ESP_ERROR_CHECK(esp_timer_create(&timer_args, &sensor->held_open_timer));
+
+    if (contact_gpio != GPIO_NUM_NC) {
+        door_sensor_init_input(sensor, &sensor->contact, contact_gpio);
+        // Door open at boot is reported only when it closes.
+        sensor->is_open = sensor->contact.level == DOOR_CONTACT_OPEN_LOGIC_LEVEL;
+    }
+    if (exit_gpio != GPIO_NUM_NC) {
+        door_sensor_init_input(sensor, &sensor->exit, exit_gpio);
+    }
+}
+
+void door_sensor_record_latency(struct door_sensor *sensor, int64_t edge_us) {
+    uint32_t latency_us = esp_timer_get_time() - edge_us;
+
+    sensor->stats.events += 1;
+    sensor->stats.latency_total_us += latency_us;
+    if (latency_us > sensor->stats.latency_max_us) {
+        sensor->stats.latency_max_us = latency_us;
+    }
+}
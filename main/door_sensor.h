@@ -0,0 +1,71 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <driver/gpio.h>
+#include <esp_timer.h>
+
+// Door contact and request-to-exit button. An input interrupts on the level
+// opposite to its debounced state, then a hardware timer shared by all inputs
+// samples it again after DOOR_SENSOR_DEBOUNCE_US and only a stable change is
+// accepted. Edge
+// time is taken in the interrupt handler and travels with the event, so
+// latency is measured from the physical edge to the MQTT publish.
+
+enum door_sensor_event_kind {
+    // Door opened while unlocked, or soon after unlock or exit request.
+    DOOR_SENSOR_OPENED,
+    DOOR_SENSOR_FORCED_OPEN,
+    // Door is still open DOOR_SENSOR_HELD_OPEN_US after opening.
+    DOOR_SENSOR_HELD_OPEN,
+    DOOR_SENSOR_CLOSED,
+    DOOR_SENSOR_EXIT_REQUEST,
+};
+
+struct door_sensor;
+struct lock;
+
+struct door_sensor_input {
+    struct door_sensor *sensor;
+    gpio_num_t gpio;
+    // Sample time in debounce timer ticks, guarded by the timer spinlock.
+    uint64_t debounce_until;
+    bool is_debouncing;
+
+    // Debounced level, used only by door sensor task.
+    int level;
+    // Set by interrupt handler, read after debounce.
+    volatile int64_t edge_us;
+};
+
+struct door_sensor_stats {
+    uint32_t events;
+    // Edges which did not survive debounce.
+    uint32_t bounces;
+    // From the edge to MQTT publish.
+    uint32_t latency_max_us;
+    uint64_t latency_total_us;
+};
+
+struct door_sensor {
+    struct door_sensor_input contact;
+    struct door_sensor_input exit;
+
+    struct lock *lock;
+    void *ctx;
+
+    volatile bool is_open;
+    int64_t exit_requested_at;
+    esp_timer_handle_t held_open_timer;
+
+    struct door_sensor_stats stats;
+};
+
+// Called after hardware_setup and lock_init. Pass GPIO_NUM_NC for inputs
+// which are not connected. Events are posted to event loop with ctx.
+void door_sensor_init(struct door_sensor *sensor, gpio_num_t contact_gpio, gpio_num_t exit_gpio, struct lock *lock, void *ctx);
+
+const char *door_sensor_event_name(enum door_sensor_event_kind kind);
+
+// Called by event handler once the event is published.
+void door_sensor_record_latency(struct door_sensor *sensor, int64_t edge_us);
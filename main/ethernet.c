@@ -9,8 +9,12 @@
 #include <esp_eth_phy_w5500.h>
 #include <esp_eth_mac_w5500.h>
 #include <lwip/esp_netif_net_stack.h>
+#include <stdio.h>
 
 #include "hardware.h"
+#include "tasks.h"
+#include "trace.h"
+#include "shadow.h"
 
 #define TAG "eth"
 
@@ -31,6 +35,9 @@ static esp_eth_mac_t *eth_w5500_get_mac(void) {
 
     eth_mac_config_t mac_config = ETH_MAC_DEFAULT_CONFIG();
     mac_config.rx_task_stack_size = 4096;
+    mac_config.rx_task_prio = ETH_RX_TASK_PRIORITY;
+    // eth_init is called from app_main, which runs on NETWORK_CORE.
+    mac_config.flags |= ETH_MAC_FLAG_PIN_TO_CORE;
 
     esp_eth_mac_t *mac = esp_eth_mac_new_w5500(&w5500_config, &mac_config);
 
@@ -53,9 +60,12 @@ static void eth_event_handler(
     switch (event_id) {
     case ETHERNET_EVENT_CONNECTED:
         ESP_LOGI(TAG, "Link Up");
+        TRACE_INSTANT("eth_link_up");
         break;
     case ETHERNET_EVENT_DISCONNECTED:
         ESP_LOGW(TAG, "Link Down");
+        TRACE_INSTANT("eth_link_down");
+        shadow_set_network("eth", "");
         break;
     case ETHERNET_EVENT_START:
         ESP_LOGD(TAG, "Ethernet Started");
@@ -78,6 +88,11 @@ static void got_ip_event_handler(
     ip_event_got_ip_t *event = (ip_event_got_ip_t *) event_data;
     const esp_netif_ip_info_t *ip_info = &event->ip_info;
     ESP_LOGI(TAG, "Got IP Address: " IPSTR, IP2STR(&ip_info->ip));
+    TRACE_INSTANT("eth_got_ip");
+
+    char ip[16];
+    snprintf(ip, sizeof(ip), IPSTR, IP2STR(&ip_info->ip));
+    shadow_set_network("eth", ip);
 }
 
 void eth_init(void) {
@@ -0,0 +1,160 @@
+#include "event_loop.h"
+
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <freertos/task.h>
+#include <freertos/queue.h>
+
+#include "tasks.h"
+#include "trace.h"
+#include "dlog.h"
+#include "heap_guard.h"
+
+#define TAG "event_loop"
+
+// Critical post logs and retries this often while its queue is full.
+#define EVENT_LOOP_RETRY_MS  100
+
+struct event_handler {
+    enum event_id id;
+    event_handler_t handler;
+    void *arg;
+    struct event_handler_stats stats;
+};
+
+static struct {
+    QueueHandle_t queue;
+    QueueHandle_t critical_queue;
+    // Notified once per queued event of both queues.
+    TaskHandle_t task;
+
+    struct event_handler handlers[EVENT_HANDLERS_MAX];
+    int handlers_count;
+
+    struct event_loop_stats stats;
+} loop = {0};
+
+static void event_loop_dispatch(const struct event *event) {
+    for (int i = 0; i < loop.handlers_count; i++) {
+        struct event_handler *h = &loop.handlers[i];
+        if (h->id != event->id) continue;
+
+        int64_t start = esp_timer_get_time();
+        TRACE_BEGIN(h->stats.name);
+        h->handler(event, h->arg);
+        TRACE_END(h->stats.name);
+        int64_t end = esp_timer_get_time();
+
+        uint32_t dispatch_us = start - event->posted_at;
+        uint32_t exec_us = end - start;
+
+        h->stats.calls += 1;
+        h->stats.exec_total_us += exec_us;
+        if (dispatch_us > h->stats.dispatch_max_us) {
+            h->stats.dispatch_max_us = dispatch_us;
+        }
+        if (exec_us > h->stats.exec_max_us) {
+            h->stats.exec_max_us = exec_us;
+        }
+    }
+}
+
+static bool event_is_critical(enum event_id id) {
+    return id == EVENT_ALARM || id == EVENT_DOOR_SENSOR;
+}
+
+static void event_loop_thread(void *param) {
+    struct event event;
+
+    for (;;) {
+        ulTaskNotifyTake(pdFALSE, portMAX_DELAY);
+
+        if (xQueueReceive(loop.critical_queue, &event, 0) != pdTRUE &&
+            xQueueReceive(loop.queue, &event, 0) != pdTRUE) {
+            continue;
+        }
+
+        // Counted after receive, so the event being dispatched is included.
+        UBaseType_t queued = uxQueueMessagesWaiting(loop.queue) + uxQueueMessagesWaiting(loop.critical_queue) + 1;
+        if (queued > loop.stats.max_queued) {
+            loop.stats.max_queued = queued;
+        }
+
+        event_loop_dispatch(&event);
+    }
+}
+
+void event_loop_init(void) {
+    static uint8_t queue_storage[EVENT_LOOP_QUEUE_SIZE * sizeof(struct event)];
+    static StaticQueue_t queue;
+    static uint8_t critical_queue_storage[EVENT_LOOP_CRITICAL_QUEUE_SIZE * sizeof(struct event)];
+    static StaticQueue_t critical_queue;
+    static StackType_t stack[EVENT_LOOP_TASK_STACK_SIZE];
+    static StaticTask_t task;
+
+    loop.queue = xQueueCreateStatic(EVENT_LOOP_QUEUE_SIZE, sizeof(struct event), queue_storage, &queue);
+    loop.critical_queue = xQueueCreateStatic(
+        EVENT_LOOP_CRITICAL_QUEUE_SIZE, sizeof(struct event),
+        critical_queue_storage, &critical_queue
+    );
+
+    loop.task = xTaskCreateStaticPinnedToCore(
+        event_loop_thread,
+        "event_loop",
+        EVENT_LOOP_TASK_STACK_SIZE,
+        NULL,
+        EVENT_LOOP_TASK_PRIORITY,
+        stack,
+        &task,
+        EVENT_LOOP_TASK_CORE
+    );
+    heap_guard_watch_task(loop.task);
+}
+
+void event_loop_register(enum event_id id, const char *name, event_handler_t handler, void *arg) {
+    if (loop.handlers_count == EVENT_HANDLERS_MAX) {
+        ESP_LOGE(TAG, "Unable to register handler '%s', increase EVENT_HANDLERS_MAX", name);
+        return;
+    }
+
+    loop.handlers[loop.handlers_count] = (struct event_handler) {
+        .id = id,
+        .handler = handler,
+        .arg = arg,
+        .stats.name = name,
+    };
+    loop.handlers_count += 1;
+}
+
+bool event_loop_post(struct event *event, TickType_t timeout) {
+    event->posted_at = esp_timer_get_time();
+
+    if (event_is_critical(event->id)) {
+        // Alarms must not be lost, a full queue only delays the caller.
+        while (xQueueSend(loop.critical_queue, event, pdMS_TO_TICKS(EVENT_LOOP_RETRY_MS)) != pdTRUE) {
+            DLOGW(TAG, "Critical queue is full, still waiting to post event %d", event->id);
+            loop.stats.delayed += 1;
+        }
+    } else if (xQueueSend(loop.queue, event, timeout) != pdTRUE) {
+        DLOGW(TAG, "Queue is full, dropping event %d", event->id);
+        loop.stats.dropped += 1;
+        return false;
+    }
+
+    xTaskNotifyGive(loop.task);
+    return true;
+}
+
+void event_loop_get_stats(struct event_loop_stats *stats) {
+    *stats = loop.stats;
+}
+
+int event_loop_get_handler_stats(struct event_handler_stats *stats, int max) {
+    int count = loop.handlers_count < max ? loop.handlers_count : max;
+
+    for (int i = 0; i < count; i++) {
+        stats[i] = loop.handlers[i].stats;
+    }
+
+    return count;
+}
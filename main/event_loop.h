@@ -0,0 +1,90 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <freertos/FreeRTOS.h>
+
+#include "door_sensor.h"
+#include "keypad.h"
+#include "otp_worker.h"
+
+// Lock-critical events are dispatched by their own task with its own
+// priority, so slow handlers of the default event loop (Wi-Fi reconnects,
+// indicator refresh, IP events) never delay them. Events are copied into a
+// bounded static queue, posting never allocates. Alarms and door sensor events
+// have their own queue, which is dispatched first and never drops.
+
+enum event_id {
+    // Keypad command entered, see struct keypad_callbacks.
+    EVENT_KEYPAD_COMMAND,
+    // OTP verification of a checkin is complete.
+    EVENT_OTP_RESULT,
+    EVENT_LOCK_OPENED,
+    EVENT_LOCK_CLOSED,
+    EVENT_ALARM,
+    // Debounced door contact or exit button change, see door_sensor.h.
+    EVENT_DOOR_SENSOR,
+};
+
+struct lock;
+
+struct event {
+    enum event_id id;
+    // Set by event_loop_post.
+    int64_t posted_at;
+
+    union {
+        struct {
+            void *ctx;
+            char cmd[KEYPAD_BUFFER_SIZE_WITH_NULL];
+        } command;
+        struct otp_result otp_result;
+        struct lock *lock;
+        // Keypad context of the alarm.
+        void *alarm_ctx;
+        struct {
+            void *ctx;
+            enum door_sensor_event_kind kind;
+            // Time of the edge, or of the timeout for held open door.
+            int64_t edge_us;
+        } door_sensor;
+    };
+};
+
+#define EVENT_HANDLERS_MAX  12
+
+typedef void (*event_handler_t)(const struct event *event, void *arg);
+
+// Dispatch latency is the time from post to the start of the handler,
+// including earlier handlers of the same event.
+struct event_handler_stats {
+    const char *name;
+    uint32_t calls;
+    uint32_t dispatch_max_us;
+    uint32_t exec_max_us;
+    uint64_t exec_total_us;
+};
+
+struct event_loop_stats {
+    uint32_t dropped;
+    // Alarms and door sensor events that waited for room in their queue.
+    uint32_t delayed;
+    uint32_t max_queued;
+};
+
+void event_loop_init(void);
+
+// Handlers are registered during setup and called in registration order.
+// Name must be a static string, it is reported in status.
+void event_loop_register(enum event_id id, const char *name, event_handler_t handler, void *arg);
+
+// Safe to call from any task and from esp_timer callbacks. Returns false and
+// counts the event as dropped if the queue stays full for timeout. Alarms and
+// door sensor events ignore timeout, the caller waits until they are queued,
+// so they are never posted from esp_timer callbacks.
+bool event_loop_post(struct event *event, TickType_t timeout);
+
+void event_loop_get_stats(struct event_loop_stats *stats);
+
+// Returns number of handlers, at most max.
+int event_loop_get_handler_stats(struct event_handler_stats *stats, int max);
@@ -4,14 +4,15 @@
 #include <driver/spi_common.h>
 #include <driver/uart.h>
 #include <driver/gpio.h>
-#include <freertos/queue.h>
 
 #include "config.h"
 #include "indicator.h"
 
-static void setup_lock_gpio(void) {
+const struct door_hardware doors_hardware[DOORS_COUNT] = DOORS_HARDWARE;
+
+static void setup_lock_gpio(const struct door_hardware *door) {
     gpio_config_t config = {
-        .pin_bit_mask = 1ULL << LOCK_GPIO,
+        .pin_bit_mask = 1ULL << door->lock_gpio,
         .mode = GPIO_MODE_OUTPUT,
         .pull_up_en = GPIO_PULLUP_DISABLE,
         .pull_down_en = GPIO_PULLDOWN_DISABLE,
@@ -20,7 +21,22 @@ static void setup_lock_gpio(void) {
 
     ESP_ERROR_CHECK(gpio_config(&config));
 
-    gpio_set_level(LOCK_GPIO, !LOCK_OPENED_LOGIC_LEVEL);
+    gpio_set_level(door->lock_gpio, !LOCK_OPENED_LOGIC_LEVEL);
+}
+
+static void setup_sensor_gpio(gpio_num_t gpio) {
+    if (gpio == GPIO_NUM_NC) return;
+
+    // Interrupt is set up by door sensor, see door_sensor.c.
+    gpio_config_t config = {
+        .pin_bit_mask = 1ULL << gpio,
+        .mode = GPIO_MODE_INPUT,
+        .pull_up_en = GPIO_PULLUP_ENABLE,
+        .pull_down_en = GPIO_PULLDOWN_DISABLE,
+        .intr_type = GPIO_INTR_DISABLE,
+    };
+
+    ESP_ERROR_CHECK(gpio_config(&config));
 }
 
 static void setup_indicator_gpio(void) {
@@ -41,46 +57,16 @@ static void setup_eth_spi(void) {
 }
 #endif
 
-static void setup_keypad_uart(void) {
-    uart_config_t uart_config = {
-        .baud_rate = KEYPAD_UART_BAUDRATE,
-        .data_bits = UART_DATA_8_BITS,
-        .parity = UART_PARITY_DISABLE,
-        .stop_bits = UART_STOP_BITS_1,
-        .flow_ctrl = UART_HW_FLOWCTRL_DISABLE,
-        .source_clk = UART_SCLK_DEFAULT,
-    };
-
-    ESP_ERROR_CHECK(uart_driver_install(
-        KEYPAD_UART_NUM,
-        KEYPAD_UART_BUFFER_SIZE * 2,
-        0,
-        0,
-        NULL,
-        0
-    ));
-
-    ESP_ERROR_CHECK(uart_param_config(
-        KEYPAD_UART_NUM,
-        &uart_config
-    ));
-
-    ESP_ERROR_CHECK(uart_set_pin(
-        KEYPAD_UART_NUM,
-        KEYPAD_UART_TX,
-        KEYPAD_UART_RX,
-        /* RTS */ UART_PIN_NO_CHANGE,
-        /* CTS */ UART_PIN_NO_CHANGE
-    ));
-}
-
 void hardware_setup(void) {
     ESP_ERROR_CHECK(gpio_install_isr_service(0));
 
-    setup_lock_gpio();
+    for (int i = 0; i < DOORS_COUNT; i++) {
+        setup_lock_gpio(&doors_hardware[i]);
+        setup_sensor_gpio(doors_hardware[i].contact_gpio);
+        setup_sensor_gpio(doors_hardware[i].exit_gpio);
+    }
     setup_indicator_gpio();
 #ifndef USE_WIFI
     setup_eth_spi();
 #endif
-    setup_keypad_uart();
 }
@@ -1,5 +1,10 @@
 #pragma once
 
+#include <driver/gpio.h>
+#include <driver/uart.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/queue.h>
+
 // SPI for Ethernet (if used).
 // #define ETH_SPI_HOST       1
 // #define ETH_SPI_CLOCK_MHZ  12
@@ -11,20 +16,88 @@
 // #define ETH_SPI_INT_GPIO   10
 // #define ETH_SPI_RST_GPIO   9
 
+// Doors. Every door has up to DOOR_INPUTS_MAX keypads or readers and its own
+// lock GPIO, door contact and exit button GPIOs are optional, set them to
+// GPIO_NUM_NC if not connected.
+// With several doors, door name is used in MQTT topics:
+// xecut-lock/<device id>/<door name>/<topic>. A single door uses
+// xecut-lock/<device id>/<topic>, as before doors were supported.
+//
+// Inputs, see input.h:
+//   { .type = INPUT_UART_KEYPAD, .uart = UART_NUM_2, .tx = GPIO_NUM_4, .rx = GPIO_NUM_5 }
+//   { .type = INPUT_WIEGAND, .d0 = GPIO_NUM_6, .d1 = GPIO_NUM_7 }
+//   { .type = INPUT_RS485, .uart = UART_NUM_1, .rx = GPIO_NUM_17, .de = GPIO_NUM_18, .address = 1 }
+#define DOORS_COUNT  1
+#define DOOR_INPUTS_MAX  2
+#define DOORS_HARDWARE { \
+    { .name = "main", \
+      .inputs = { { .type = INPUT_UART_KEYPAD, .uart = UART_NUM_2, .tx = GPIO_NUM_4, .rx = GPIO_NUM_5 } }, \
+      .lock_gpio = GPIO_NUM_3, .contact_gpio = GPIO_NUM_NC, .exit_gpio = GPIO_NUM_NC }, \
+}
+
+// Every input wakes doors task through a queue of this size.
+#define INPUT_QUEUE_SIZE         16
+
 // UART for Keypad
-#define KEYPAD_UART_NUM          UART_NUM_2
 #define KEYPAD_UART_BAUDRATE     9600
 #define KEYPAD_UART_BUFFER_SIZE  256
-#define KEYPAD_UART_TX           GPIO_NUM_4
-#define KEYPAD_UART_RX           GPIO_NUM_5
+
+// RS-485 readers, frames end with RS485_FRAME_END, see input_rs485.c.
+#define RS485_BAUDRATE           9600
+#define RS485_FRAME_END          '\n'
+
+// Wiegand readers. Pulses are 20-100 us, frames are separated by silence.
+#define WIEGAND_PULSE_MIN_US     10
+#define WIEGAND_PULSE_MAX_US     200
+#define WIEGAND_FRAME_GAP_US     25000
 
 // GPIO for Lock
-#define LOCK_GPIO                GPIO_NUM_3
 #define LOCK_OPEN_TIME_US        200000
 #define LOCK_OPENED_LOGIC_LEVEL  0
 
+// GPIO for Door Sensors. Contact and exit button are wired to GND, with
+// internal pull-ups. Contact is closed while the door is closed.
+#define DOOR_CONTACT_OPEN_LOGIC_LEVEL  1
+#define DOOR_EXIT_PRESSED_LOGIC_LEVEL  0
+#define DOOR_SENSOR_DEBOUNCE_US        20000
+
 // GPIO for Indicator
 #define INDICATOR_LED_GPIO  GPIO_NUM_48
 
+enum input_type {
+    INPUT_NONE = 0,
+    INPUT_UART_KEYPAD,
+    INPUT_WIEGAND,
+    INPUT_RS485,
+    // Synthetic keys, added to every door by soak test, see soak.h.
+    INPUT_SOAK,
+};
+
+struct input_hardware {
+    enum input_type type;
+
+    // UART keypad and RS-485 reader.
+    uart_port_t uart;
+    gpio_num_t rx;
+    gpio_num_t tx;
+    // RS-485 transceiver driver enable, and bus address of the reader.
+    gpio_num_t de;
+    uint8_t address;
+
+    // Wiegand reader.
+    gpio_num_t d0;
+    gpio_num_t d1;
+};
+
+struct door_hardware {
+    const char *name;
+    struct input_hardware inputs[DOOR_INPUTS_MAX];
+    gpio_num_t lock_gpio;
+    gpio_num_t contact_gpio;
+    gpio_num_t exit_gpio;
+};
+
+extern const struct door_hardware doors_hardware[DOORS_COUNT];
+
 // Functions.
 void hardware_setup(void);
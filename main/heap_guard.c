@@ -0,0 +1,82 @@
+#include "heap_guard.h"
+
+#include <stdbool.h>
+#include <esp_attr.h>
+#include <esp_heap_caps.h>
+
+static struct {
+    TaskHandle_t tasks[HEAP_GUARD_TASKS_MAX];
+    // Nesting depth of allowed sections, per watched task.
+    uint8_t allowed[HEAP_GUARD_TASKS_MAX];
+    int tasks_count;
+
+    bool is_sealed;
+
+    uint32_t violations;
+    struct heap_guard_violation last;
+} guard = {0};
+
+static IRAM_ATTR int find_current_task(void) {
+    TaskHandle_t current = xTaskGetCurrentTaskHandle();
+
+    for (int i = 0; i < guard.tasks_count; i++) {
+        if (guard.tasks[i] == current) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+void heap_guard_watch_task(TaskHandle_t task) {
+    assert(!guard.is_sealed);
+    assert(guard.tasks_count < HEAP_GUARD_TASKS_MAX);
+
+    guard.tasks[guard.tasks_count++] = task;
+}
+
+void heap_guard_seal(void) {
+    guard.is_sealed = true;
+}
+
+void heap_guard_allow_begin(void) {
+    int i = find_current_task();
+    if (i >= 0) guard.allowed[i]++;
+}
+
+void heap_guard_allow_end(void) {
+    int i = find_current_task();
+    if (i >= 0) guard.allowed[i]--;
+}
+
+uint32_t heap_guard_violations(struct heap_guard_violation *last) {
+    if (last != NULL) {
+        *last = guard.last;
+    }
+    return guard.violations;
+}
+
+int heap_guard_get_tasks(TaskHandle_t *tasks, int size) {
+    int count = guard.tasks_count < size ? guard.tasks_count : size;
+    for (int i = 0; i < count; i++) {
+        tasks[i] = guard.tasks[i];
+    }
+    return count;
+}
+
+// Called by heap component on every successful allocation, may run with
+// cache disabled, so it must stay in IRAM and must not log or allocate.
+void IRAM_ATTR esp_heap_trace_alloc_hook(void *ptr, size_t size, uint32_t caps) {
+    if (!guard.is_sealed) return;
+
+    int i = find_current_task();
+    if (i < 0 || guard.allowed[i] > 0) return;
+
+    __atomic_fetch_add(&guard.violations, 1, __ATOMIC_RELAXED);
+    guard.last = (struct heap_guard_violation) {
+        .task = guard.tasks[i],
+        .size = size,
+    };
+}
+
+void IRAM_ATTR esp_heap_trace_free_hook(void *ptr) {
+}
@@ -0,0 +1,34 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+
+// Lock tasks must not allocate from heap after setup, all their buffers,
+// stacks and queues are static. Allocations made by watched tasks after
+// heap_guard_seal() are counted and reported in status.
+//
+// Requires CONFIG_HEAP_USE_HOOKS.
+
+#define HEAP_GUARD_TASKS_MAX  16
+
+struct heap_guard_violation {
+    TaskHandle_t task;
+    size_t size;
+};
+
+void heap_guard_watch_task(TaskHandle_t task);
+
+// Called once at the end of app_main.
+void heap_guard_seal(void);
+
+// Allocations between these calls are owned by network stack, e.g. MQTT outbox
+// entries of published messages, and are not reported.
+void heap_guard_allow_begin(void);
+void heap_guard_allow_end(void);
+
+uint32_t heap_guard_violations(struct heap_guard_violation *last);
+
+// Copies handles of watched tasks, returns their count.
+int heap_guard_get_tasks(TaskHandle_t *tasks, int size);
@@ -0,0 +1,349 @@
+#include "history.h"
+
+#include <esp_log.h>
+#include <esp_partition.h>
+#include <esp_timer.h>
+#include <mqtt_client.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <freertos/queue.h>
+#include <cJSON.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "config.h"
+#include "hardware.h"
+#include "door.h"
+#include "mqtt.h"
+#include "payload.h"
+#include "tasks.h"
+#include "trace.h"
+#include "heap_guard.h"
+
+#define TAG "history"
+
+#define HISTORY_QUERY_TOPIC   MQTT_TOPIC(MQTT_DEVICE_ID, "history/query")
+#define HISTORY_RESULT_TOPIC  MQTT_TOPIC(MQTT_DEVICE_ID, "history/result" PAYLOAD_TOPIC_SUFFIX)
+
+// Partition subtype of the access log, see partitions.csv.
+#define HISTORY_PARTITION_SUBTYPE  0x40
+#define HISTORY_SECTORS_MAX        256
+
+#define HISTORY_PAGE_SIZE          16
+#define HISTORY_PAGE_BUFFER_SIZE   3072
+#define HISTORY_LIMIT_DEFAULT      50
+#define HISTORY_LIMIT_MAX          1000
+#define HISTORY_QUERY_ID_LEN       16
+// Pages are sent with qos 1, outbox is drained before the next one. The wait
+// is bounded and a query is stopped when the outbox does not drain. Access
+// log appends are written while a query waits, see history_write_records.
+#define HISTORY_OUTBOX_MAX         (2 * HISTORY_PAGE_BUFFER_SIZE)
+#define HISTORY_OUTBOX_POLL_MS     20
+#define HISTORY_OUTBOX_WAIT_MS     1000
+
+struct history_record {
+    uint32_t timestamp;
+    uint8_t door;
+    uint8_t kind;
+    char uid[ACCESS_LOG_UID_LEN + 1];
+};
+
+struct history_query {
+    char id[HISTORY_QUERY_ID_LEN];
+    char uid[ACCESS_LOG_UID_LEN + 1];
+    bool has_uid;
+    uint32_t from;
+    uint32_t to;
+    uint32_t limit;
+};
+
+struct history_page {
+    const char *query_id;
+    int number;
+    int count;
+    bool is_failed;
+
+    struct payload writer;
+    uint8_t buffer[HISTORY_PAGE_BUFFER_SIZE];
+};
+
+static struct {
+    const esp_partition_t *partition;
+    bool is_ready;
+
+    struct access_log log;
+    struct access_log_sector sectors[HISTORY_SECTORS_MAX];
+
+    // Records have their own queue, so a running query never blocks them.
+    QueueHandle_t records;
+    QueueHandle_t queries;
+    // Notified once for every queued record and query.
+    TaskHandle_t task;
+    // Used only by history task.
+    struct history_page page;
+} history = {0};
+
+static const char *kind_name(uint8_t kind) {
+    switch (kind) {
+        case ACCESS_LOG_GRANTED:          return "granted";
+        case ACCESS_LOG_DENIED_CODE:      return "denied_code";
+        case ACCESS_LOG_DENIED_SCHEDULE:  return "denied_schedule";
+        case ACCESS_LOG_REMOTE:           return "remote";
+        default:                          return "unknown";
+    }
+}
+
+static int partition_read(void *ctx, uint32_t offset, void *buf, size_t len) {
+    return esp_partition_read(history.partition, offset, buf, len) == ESP_OK ? 0 : -1;
+}
+
+static int partition_write(void *ctx, uint32_t offset, const void *buf, size_t len) {
+    return esp_partition_write(history.partition, offset, buf, len) == ESP_OK ? 0 : -1;
+}
+
+static int partition_erase_sector(void *ctx, uint32_t offset) {
+    return esp_partition_erase_range(history.partition, offset, ACCESS_LOG_SECTOR_SIZE) == ESP_OK ? 0 : -1;
+}
+
+static void history_write_records(void) {
+    struct history_record record;
+
+    while (xQueueReceive(history.records, &record, 0) == pdTRUE) {
+        if (access_log_append(&history.log, record.timestamp, record.door, record.kind, record.uid) != 0) {
+            ESP_LOGE(TAG, "Failed to write access log entry");
+        }
+    }
+}
+
+static void page_begin(struct history_page *page) {
+    payload_init(&page->writer, PAYLOAD_FORMAT, page->buffer, sizeof(page->buffer));
+    payload_map_begin(&page->writer);
+    payload_key_text(&page->writer, PAYLOAD_QUERY, page->query_id);
+    payload_key_uint(&page->writer, PAYLOAD_PAGE, page->number);
+    payload_key(&page->writer, PAYLOAD_ENTRIES);
+    payload_array_begin(&page->writer);
+    page->count = 0;
+}
+
+static bool page_publish(struct history_page *page, bool is_last) {
+    payload_end(&page->writer);
+    payload_key(&page->writer, PAYLOAD_LAST);
+    payload_bool(&page->writer, is_last);
+    payload_end(&page->writer);
+
+    int len = payload_finish(&page->writer);
+    if (len < 0) {
+        ESP_LOGE(TAG, "History page does not fit the buffer");
+        return false;
+    }
+
+    esp_mqtt_client_handle_t client = mqtt_get_client();
+    for (int waited_ms = 0; esp_mqtt_client_get_outbox_size(client) > HISTORY_OUTBOX_MAX; waited_ms += HISTORY_OUTBOX_POLL_MS) {
+        if (!mqtt_is_connected() || waited_ms >= HISTORY_OUTBOX_WAIT_MS) {
+            ESP_LOGW(TAG, "MQTT outbox does not drain, query '%s' is stopped", page->query_id);
+            return false;
+        }
+        history_write_records();
+        vTaskDelay(pdMS_TO_TICKS(HISTORY_OUTBOX_POLL_MS));
+    }
+
+    if (mqtt_publish_data(HISTORY_RESULT_TOPIC, page->buffer, len, /* qos */ 1, /* retain */ false) < 0) {
+        return false;
+    }
+
+    page->number++;
+    return true;
+}
+
+static bool page_add_entry(const struct access_log_entry *entry, void *arg) {
+    struct history_page *page = arg;
+
+    if (page->count == HISTORY_PAGE_SIZE) {
+        history_write_records();
+        if (!page_publish(page, /* is_last */ false)) {
+            page->is_failed = true;
+            return false;
+        }
+        page_begin(page);
+    }
+
+    struct payload *p = &page->writer;
+    char uid[ACCESS_LOG_UID_LEN + 1] = {0};
+    memcpy(uid, entry->uid, sizeof(entry->uid));
+
+    payload_map_begin(p);
+    payload_key_uint(p, PAYLOAD_SEQ, entry->seq);
+    payload_key(p, PAYLOAD_TIMESTAMP);
+    payload_timestamp(p, entry->timestamp);
+    payload_key_text(p, PAYLOAD_DOOR, entry->door < DOORS_COUNT ? door_get(entry->door)->hw->name : "");
+    payload_key_text(p, PAYLOAD_EVENT, kind_name(entry->kind));
+    payload_key_text(p, PAYLOAD_UID, uid);
+    payload_end(p);
+
+    page->count++;
+    return true;
+}
+
+static void history_run_query(const struct history_query *request) {
+    struct access_log_query query = {
+        .uid = request->has_uid ? request->uid : NULL,
+        .from = request->from,
+        .to = request->to,
+        .limit = request->limit,
+    };
+
+    struct history_page *page = &history.page;
+    page->query_id = request->id;
+    page->number = 0;
+    page->is_failed = false;
+    page_begin(page);
+
+    TRACE_BEGIN("history_query");
+    int64_t start = esp_timer_get_time();
+    int count = access_log_query(&history.log, &query, page_add_entry, page);
+    if (!page->is_failed) {
+        page_publish(page, /* is_last */ true);
+    }
+    TRACE_END("history_query");
+
+    ESP_LOGI(
+        TAG, "Query '%s' returned %d entries from %lu sectors in %lu ms",
+        request->id, count, query.sectors_read, (uint32_t)((esp_timer_get_time() - start) / 1000)
+    );
+}
+
+static void history_thread(void *param) {
+    struct history_query query;
+
+    for (;;) {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+
+        history_write_records();
+        while (xQueueReceive(history.queries, &query, 0) == pdTRUE) {
+            history_run_query(&query);
+            history_write_records();
+        }
+    }
+}
+
+static uint32_t json_uint(const cJSON *object, const char *name, uint32_t fallback) {
+    const cJSON *item = cJSON_GetObjectItemCaseSensitive(object, name);
+    return cJSON_IsNumber(item) && item->valuedouble >= 0 ? (uint32_t)item->valuedouble : fallback;
+}
+
+static void mqtt_history_query_topic_updated(
+    const char *topic, int topic_len,
+    const char *data,  int data_len
+) {
+    if (!history.is_ready) {
+        ESP_LOGW(TAG, "Access log is not available");
+        return;
+    }
+
+    cJSON *json = cJSON_ParseWithLength(data, data_len);
+    if (json == NULL) {
+        ESP_LOGW(TAG, "Query is not a valid JSON");
+        return;
+    }
+
+    struct history_query query = {
+        .from = json_uint(json, "from", 0),
+        .to = json_uint(json, "to", UINT32_MAX),
+        .limit = json_uint(json, "limit", HISTORY_LIMIT_DEFAULT),
+    };
+
+    const cJSON *id = cJSON_GetObjectItemCaseSensitive(json, "id");
+    if (cJSON_IsString(id)) {
+        strlcpy(query.id, id->valuestring, sizeof(query.id));
+    }
+
+    const cJSON *uid = cJSON_GetObjectItemCaseSensitive(json, "uid");
+    if (cJSON_IsString(uid)) {
+        strlcpy(query.uid, uid->valuestring, sizeof(query.uid));
+        query.has_uid = true;
+    }
+
+    cJSON_Delete(json);
+
+    if (query.limit == 0 || query.limit > HISTORY_LIMIT_MAX) {
+        query.limit = HISTORY_LIMIT_MAX;
+    }
+
+    if (xQueueSend(history.queries, &query, 0) != pdTRUE) {
+        ESP_LOGW(TAG, "History query queue is full, dropping query '%s'", query.id);
+        return;
+    }
+    xTaskNotifyGive(history.task);
+}
+
+void history_init(void) {
+    static uint8_t records_storage[HISTORY_QUEUE_SIZE * sizeof(struct history_record)];
+    static StaticQueue_t records;
+    static uint8_t queries_storage[HISTORY_QUERY_QUEUE_SIZE * sizeof(struct history_query)];
+    static StaticQueue_t queries;
+    static StackType_t stack[HISTORY_TASK_STACK_SIZE];
+    static StaticTask_t task;
+
+    history.partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, (esp_partition_subtype_t)HISTORY_PARTITION_SUBTYPE, "accesslog");
+    if (history.partition == NULL) {
+        ESP_LOGE(TAG, "No accesslog partition, access history is disabled");
+        return;
+    }
+
+    uint32_t sectors_count = history.partition->size / ACCESS_LOG_SECTOR_SIZE;
+    if (sectors_count > HISTORY_SECTORS_MAX) {
+        sectors_count = HISTORY_SECTORS_MAX;
+    }
+
+    const struct access_log_flash flash = {
+        .read = partition_read,
+        .write = partition_write,
+        .erase_sector = partition_erase_sector,
+    };
+
+    int64_t start = esp_timer_get_time();
+    if (access_log_init(&history.log, &flash, history.sectors, sectors_count) != 0) {
+        ESP_LOGE(TAG, "Failed to read access log, access history is disabled");
+        return;
+    }
+    ESP_LOGI(
+        TAG, "Indexed %lu sectors of access log in %lu ms",
+        sectors_count, (uint32_t)((esp_timer_get_time() - start) / 1000)
+    );
+
+    history.records = xQueueCreateStatic(HISTORY_QUEUE_SIZE, sizeof(struct history_record), records_storage, &records);
+    history.queries = xQueueCreateStatic(HISTORY_QUERY_QUEUE_SIZE, sizeof(struct history_query), queries_storage, &queries);
+
+    history.task = xTaskCreateStaticPinnedToCore(
+        history_thread,
+        "history",
+        HISTORY_TASK_STACK_SIZE,
+        NULL,
+        HISTORY_TASK_PRIORITY,
+        stack,
+        &task,
+        HISTORY_TASK_CORE
+    );
+    heap_guard_watch_task(history.task);
+
+    history.is_ready = true;
+
+    mqtt_subscribe(HISTORY_QUERY_TOPIC, /* qos */ 1, mqtt_history_query_topic_updated);
+}
+
+void history_record(uint8_t door, enum access_log_kind kind, const char *uid) {
+    if (!history.is_ready) return;
+
+    struct history_record record = {
+        .timestamp = time(NULL),
+        .door = door,
+        .kind = kind,
+    };
+    strlcpy(record.uid, uid, sizeof(record.uid));
+
+    if (xQueueSend(history.records, &record, 0) != pdTRUE) {
+        ESP_LOGW(TAG, "History queue is full, dropping entry of user '%s'", uid);
+        return;
+    }
+    xTaskNotifyGive(history.task);
+}
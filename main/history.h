@@ -0,0 +1,17 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "access_log.h"
+
+// Access history in the "accesslog" flash partition, see access_log.h. It
+// survives reboots and works offline. Queries published to "history/query"
+// are answered on "history/result" in pages of HISTORY_PAGE_SIZE entries.
+
+// Called after mqtt_init and doors_init.
+void history_init(void);
+
+// Safe to call from any task. Entry is written later by history task, also
+// between pages of a running query, and is dropped only if its queue is full.
+// UID may be empty.
+void history_record(uint8_t door, enum access_log_kind kind, const char *uid);
@@ -0,0 +1,460 @@
+#include "config.h"
+#ifdef USE_LOCAL_HTTP
+
+#include "http.h"
+
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <esp_http_server.h>
+#include <lwip/sockets.h>
+#include <mbedtls/constant_time.h>
+#include <freertos/FreeRTOS.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "hardware.h"
+#include "door.h"
+#include "event_loop.h"
+#include "shadow.h"
+#include "unlock.h"
+#include "tasks.h"
+#include "trace.h"
+
+#define TAG "http"
+
+// Server allocates buffers of a socket when it is accepted, so its memory is
+// bounded by the socket count. Least recently used socket is closed when one
+// more client connects.
+#define HTTP_SOCKETS_MAX         4
+#define HTTP_WS_CLIENTS_MAX      2
+#define HTTP_URI_HANDLERS        5
+
+#define HTTP_BODY_MAX            512
+#define HTTP_TOKEN_MAX           64
+#define HTTP_WS_FRAME_MAX        64
+#define HTTP_STATUS_INTERVAL_MS  1000
+// New lock events are sent to WebSocket clients this often. Event loop only
+// sets a flag, queueing httpd work allocates and talks to lwIP.
+#define HTTP_EVENTS_INTERVAL_MS  100
+
+// Last lock events, sent to a WebSocket client right after it connects.
+#define HTTP_TAIL_SIZE           16
+#define HTTP_TAIL_ENTRY_SIZE     128
+
+static const char index_html[] = {
+    #embed "http_index.html"
+};
+
+struct http_tail_entry {
+    uint16_t len;
+    char text[HTTP_TAIL_ENTRY_SIZE];
+};
+
+static struct {
+    httpd_handle_t server;
+    struct http_callbacks cb;
+    esp_timer_handle_t status_timer;
+    esp_timer_handle_t events_timer;
+
+    portMUX_TYPE spinlock;
+    // Written by event loop handlers, sent by server task.
+    struct http_tail_entry tail[HTTP_TAIL_SIZE];
+    uint32_t tail_head;
+    bool has_new_events;
+    int ws_clients_count;
+
+    // Used only by server task.
+    int ws_clients[HTTP_WS_CLIENTS_MAX];
+    uint32_t tail_sent;
+    uint8_t status[PAYLOAD_STATUS_SIZE];
+} http = {
+    .spinlock = portMUX_INITIALIZER_UNLOCKED,
+};
+
+static bool token_matches(const char *token) {
+    size_t len = strlen(token);
+    return len == strlen(HTTP_API_TOKEN) && mbedtls_ct_memcmp(token, HTTP_API_TOKEN, len) == 0;
+}
+
+// Browsers can not set headers of a WebSocket, so token may be in query.
+static bool is_authorized(httpd_req_t *req) {
+    char header[HTTP_TOKEN_MAX + sizeof("Bearer ")];
+    if (
+        httpd_req_get_hdr_value_str(req, "Authorization", header, sizeof(header)) == ESP_OK
+        && strncmp(header, "Bearer ", strlen("Bearer ")) == 0
+    ) {
+        return token_matches(header + strlen("Bearer "));
+    }
+
+    char query[HTTP_TOKEN_MAX + sizeof("token=")];
+    char token[HTTP_TOKEN_MAX + 1];
+    if (
+        httpd_req_get_url_query_str(req, query, sizeof(query)) == ESP_OK
+        && httpd_query_key_value(query, "token", token, sizeof(token)) == ESP_OK
+    ) {
+        return token_matches(token);
+    }
+
+    return false;
+}
+
+// Returns body length or -1 if it does not fit or is not received.
+static int receive_body(httpd_req_t *req, char *body, size_t size) {
+    if (req->content_len >= size) {
+        return -1;
+    }
+
+    size_t received = 0;
+    while (received < req->content_len) {
+        int ret = httpd_req_recv(req, body + received, req->content_len - received);
+        if (ret == HTTPD_SOCK_ERR_TIMEOUT) continue;
+        if (ret <= 0) return -1;
+
+        received += ret;
+    }
+    body[received] = '\0';
+
+    return received;
+}
+
+static esp_err_t send_json(httpd_req_t *req, const char *status, const char *message, int len) {
+    httpd_resp_set_status(req, status);
+    httpd_resp_set_type(req, "application/json");
+    return httpd_resp_send(req, message, len);
+}
+
+static esp_err_t index_handler(httpd_req_t *req) {
+    httpd_resp_set_type(req, "text/html");
+    httpd_resp_set_hdr(req, "Cache-Control", "max-age=86400");
+
+    // Sent in place from flash, without a response buffer.
+    return httpd_resp_send(req, index_html, sizeof(index_html));
+}
+
+static esp_err_t status_handler(httpd_req_t *req) {
+    if (!is_authorized(req)) {
+        return httpd_resp_send_err(req, HTTPD_401_UNAUTHORIZED, "Token is required");
+    }
+
+    int len = http.cb.format_status(PAYLOAD_JSON, http.status, sizeof(http.status));
+    if (len < 0) {
+        return httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Status does not fit");
+    }
+
+    return send_json(req, HTTPD_200, (const char *)http.status, len);
+}
+
+// Signed command is authenticated by itself, token is not required.
+static esp_err_t unlock_handler(httpd_req_t *req) {
+    char body[HTTP_BODY_MAX];
+    int len = receive_body(req, body, sizeof(body));
+    if (len < 0) {
+        return httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Body is too large or incomplete");
+    }
+
+    TRACE_BEGIN("http_unlock");
+    uint32_t verify_us = 0;
+    const char *result = unlock_submit(body, len, &verify_us);
+    TRACE_END("http_unlock");
+
+    char message[96];
+    int message_len = snprintf(
+        message, sizeof(message),
+        "{\"result\": \"%s\", \"verify_us\": %lu}",
+        result, verify_us
+    );
+
+    bool is_unlocked = strcmp(result, "unlocked") == 0;
+    return send_json(req, is_unlocked ? HTTPD_200 : "403 Forbidden", message, message_len);
+}
+
+static esp_err_t config_handler(httpd_req_t *req) {
+    if (!is_authorized(req)) {
+        return httpd_resp_send_err(req, HTTPD_401_UNAUTHORIZED, "Token is required");
+    }
+
+    char body[HTTP_BODY_MAX];
+    int len = receive_body(req, body, sizeof(body));
+    if (len < 0) {
+        return httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Body is too large or incomplete");
+    }
+
+    bool is_applied = shadow_apply_desired(body, len);
+
+    const char *message = is_applied ? "{\"applied\": true}" : "{\"applied\": false}";
+    return send_json(req, is_applied ? HTTPD_200 : HTTPD_400, message, strlen(message));
+}
+
+static void ws_send(int fd, const void *data, size_t len) {
+    httpd_ws_frame_t frame = {
+        .final = true,
+        .type = HTTPD_WS_TYPE_TEXT,
+        .payload = (uint8_t *)data,
+        .len = len,
+    };
+
+    if (httpd_ws_send_frame_async(http.server, fd, &frame) != ESP_OK) {
+        ESP_LOGW(TAG, "Failed to send WebSocket frame to socket %d", fd);
+    }
+}
+
+static void ws_send_all(const void *data, size_t len) {
+    for (int i = 0; i < HTTP_WS_CLIENTS_MAX; i++) {
+        if (http.ws_clients[i] >= 0) {
+            ws_send(http.ws_clients[i], data, len);
+        }
+    }
+}
+
+// Sends events from first to the current head, skipping overwritten ones.
+static uint32_t ws_send_tail(int fd, uint32_t first) {
+    taskENTER_CRITICAL(&http.spinlock);
+    uint32_t head = http.tail_head;
+    taskEXIT_CRITICAL(&http.spinlock);
+
+    if (head - first > HTTP_TAIL_SIZE) {
+        first = head - HTTP_TAIL_SIZE;
+    }
+
+    for (uint32_t i = first; i != head; i++) {
+        struct http_tail_entry entry;
+
+        taskENTER_CRITICAL(&http.spinlock);
+        entry = http.tail[i % HTTP_TAIL_SIZE];
+        taskEXIT_CRITICAL(&http.spinlock);
+
+        if (fd >= 0) {
+            ws_send(fd, entry.text, entry.len);
+        } else {
+            ws_send_all(entry.text, entry.len);
+        }
+    }
+
+    return head;
+}
+
+static void push_events(void *arg) {
+    http.tail_sent = ws_send_tail(/* all clients */ -1, http.tail_sent);
+}
+
+static void push_status(void *arg) {
+    int len = http.cb.format_status(PAYLOAD_JSON, http.status, sizeof(http.status));
+    if (len >= 0) {
+        ws_send_all(http.status, len);
+    }
+}
+
+static void status_timer_callback(void *arg) {
+    httpd_queue_work(http.server, push_status, NULL);
+}
+
+static void events_timer_callback(void *arg) {
+    taskENTER_CRITICAL(&http.spinlock);
+    bool has_new_events = http.has_new_events;
+    http.has_new_events = false;
+    taskEXIT_CRITICAL(&http.spinlock);
+
+    if (has_new_events && httpd_queue_work(http.server, push_events, NULL) != ESP_OK) {
+        taskENTER_CRITICAL(&http.spinlock);
+        http.has_new_events = true;
+        taskEXIT_CRITICAL(&http.spinlock);
+    }
+}
+
+static bool ws_client_add(int fd) {
+    for (int i = 0; i < HTTP_WS_CLIENTS_MAX; i++) {
+        if (http.ws_clients[i] < 0) {
+            http.ws_clients[i] = fd;
+
+            taskENTER_CRITICAL(&http.spinlock);
+            bool is_first = http.ws_clients_count++ == 0;
+            taskEXIT_CRITICAL(&http.spinlock);
+
+            // Timers run only while somebody watches, so they do not wake idle lock.
+            if (is_first) {
+                http.tail_sent = http.tail_head;
+                esp_timer_start_periodic(http.status_timer, HTTP_STATUS_INTERVAL_MS * 1000);
+                esp_timer_start_periodic(http.events_timer, HTTP_EVENTS_INTERVAL_MS * 1000);
+            }
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static void ws_client_remove(int fd) {
+    for (int i = 0; i < HTTP_WS_CLIENTS_MAX; i++) {
+        if (http.ws_clients[i] == fd) {
+            http.ws_clients[i] = -1;
+
+            taskENTER_CRITICAL(&http.spinlock);
+            bool is_last = --http.ws_clients_count == 0;
+            taskEXIT_CRITICAL(&http.spinlock);
+
+            if (is_last) {
+                esp_timer_stop(http.status_timer);
+                esp_timer_stop(http.events_timer);
+            }
+            return;
+        }
+    }
+}
+
+static esp_err_t ws_handler(httpd_req_t *req) {
+    int fd = httpd_req_to_sockfd(req);
+
+    if (req->method == HTTP_GET) {
+        // Handshake is answered already, so unauthorized client is disconnected.
+        if (!is_authorized(req)) {
+            return ESP_FAIL;
+        }
+
+        if (!ws_client_add(fd)) {
+            ESP_LOGW(TAG, "Dropping WebSocket client, %d are connected already", HTTP_WS_CLIENTS_MAX);
+            return ESP_FAIL;
+        }
+
+        ws_send_tail(fd, /* first */ 0);
+        return ESP_OK;
+    }
+
+    // Clients are not expected to send data frames, they are read and dropped.
+    // A larger frame closes the connection.
+    uint8_t buf[HTTP_WS_FRAME_MAX];
+    httpd_ws_frame_t frame = { .payload = buf };
+    return httpd_ws_recv_frame(req, &frame, sizeof(buf));
+}
+
+static esp_err_t open_socket(httpd_handle_t server, int fd) {
+    // Responses are small, they are sent at once instead of waiting for ACK.
+    int nodelay = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+
+    return ESP_OK;
+}
+
+static void close_socket(httpd_handle_t server, int fd) {
+    ws_client_remove(fd);
+    close(fd);
+}
+
+static const struct door *door_by_lock(const struct lock *lock) {
+    for (int i = 0; i < DOORS_COUNT; i++) {
+        if (&door_get(i)->lock == lock) {
+            return door_get(i);
+        }
+    }
+
+    return NULL;
+}
+
+static void tail_append(const char *name, const struct door *door, const char *uid) {
+    char text[HTTP_TAIL_ENTRY_SIZE];
+
+    struct payload p;
+    payload_init(&p, PAYLOAD_JSON, text, sizeof(text));
+    payload_map_begin(&p);
+    payload_key_text(&p, PAYLOAD_EVENT, name);
+    payload_key_text(&p, PAYLOAD_DOOR, door != NULL ? door->hw->name : "");
+    if (uid != NULL) {
+        payload_key_text(&p, PAYLOAD_UID, uid);
+    }
+    payload_key(&p, PAYLOAD_TIMESTAMP);
+    payload_timestamp(&p, time(NULL));
+    payload_end(&p);
+
+    int len = payload_finish(&p);
+    if (len < 0) return;
+
+    taskENTER_CRITICAL(&http.spinlock);
+    struct http_tail_entry *entry = &http.tail[http.tail_head % HTTP_TAIL_SIZE];
+    memcpy(entry->text, text, len);
+    entry->len = len;
+    http.tail_head++;
+
+    // Sent later by server task, see events_timer_callback.
+    if (http.ws_clients_count > 0) {
+        http.has_new_events = true;
+    }
+    taskEXIT_CRITICAL(&http.spinlock);
+}
+
+static void event_handler(const struct event *event, void *arg) {
+    switch (event->id) {
+        case EVENT_OTP_RESULT:
+            tail_append(
+                event->otp_result.is_valid ? "valid_code" : "invalid_code",
+                event->otp_result.ctx, event->otp_result.uid
+            );
+            break;
+        case EVENT_LOCK_OPENED:
+            tail_append("opened", door_by_lock(event->lock), NULL);
+            break;
+        case EVENT_LOCK_CLOSED:
+            tail_append("closed", door_by_lock(event->lock), NULL);
+            break;
+        case EVENT_ALARM:
+            tail_append("alarm", event->alarm_ctx, NULL);
+            break;
+        case EVENT_DOOR_SENSOR:
+            tail_append(door_sensor_event_name(event->door_sensor.kind), event->door_sensor.ctx, NULL);
+            break;
+        default:
+            break;
+    }
+}
+
+void http_init(struct http_callbacks cb) {
+    http.cb = cb;
+    for (int i = 0; i < HTTP_WS_CLIENTS_MAX; i++) {
+        http.ws_clients[i] = -1;
+    }
+
+    const esp_timer_create_args_t timer_args = {
+        .callback = status_timer_callback,
+        .name = "http_status",
+    };
+    ESP_ERROR_CHECK(esp_timer_create(&timer_args, &http.status_timer));
+
+    const esp_timer_create_args_t events_timer_args = {
+        .callback = events_timer_callback,
+        .name = "http_events",
+    };
+    ESP_ERROR_CHECK(esp_timer_create(&events_timer_args, &http.events_timer));
+
+    httpd_config_t config = HTTPD_DEFAULT_CONFIG();
+    config.task_priority = HTTP_TASK_PRIORITY;
+    config.stack_size = HTTP_TASK_STACK_SIZE;
+    config.core_id = HTTP_TASK_CORE;
+    config.max_open_sockets = HTTP_SOCKETS_MAX;
+    config.max_uri_handlers = HTTP_URI_HANDLERS;
+    config.lru_purge_enable = true;
+    config.open_fn = open_socket;
+    config.close_fn = close_socket;
+
+    ESP_ERROR_CHECK(httpd_start(&http.server, &config));
+
+    const httpd_uri_t handlers[] = {
+        { .uri = "/",       .method = HTTP_GET,  .handler = index_handler },
+        { .uri = "/status", .method = HTTP_GET,  .handler = status_handler },
+        { .uri = "/ws",     .method = HTTP_GET,  .handler = ws_handler, .is_websocket = true },
+        { .uri = "/unlock", .method = HTTP_POST, .handler = unlock_handler },
+        { .uri = "/config", .method = HTTP_POST, .handler = config_handler },
+    };
+    for (int i = 0; i < sizeof(handlers) / sizeof(handlers[0]); i++) {
+        ESP_ERROR_CHECK(httpd_register_uri_handler(http.server, &handlers[i]));
+    }
+
+    event_loop_register(EVENT_OTP_RESULT, "http_checkin", event_handler, NULL);
+    event_loop_register(EVENT_LOCK_OPENED, "http_opened", event_handler, NULL);
+    event_loop_register(EVENT_LOCK_CLOSED, "http_closed", event_handler, NULL);
+    event_loop_register(EVENT_ALARM, "http_alarm", event_handler, NULL);
+    event_loop_register(EVENT_DOOR_SENSOR, "http_door", event_handler, NULL);
+
+    ESP_LOGI(TAG, "Local HTTP server is started on port %d", config.server_port);
+}
+
+#endif  // #ifdef USE_LOCAL_HTTP
@@ -0,0 +1,24 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "payload.h"
+
+// Local HTTP server, so the lock can be watched and controlled from the LAN
+// while the MQTT broker is down. API endpoints require HTTP_API_TOKEN, either
+// as "Authorization: Bearer <token>" header or as "token" query parameter:
+//
+//   GET  /         static page which uses the endpoints below
+//   GET  /status   status JSON, the same as published to "status"
+//   GET  /ws       WebSocket with status every second and lock events
+//   POST /unlock   signed remote unlock command, see unlock.h
+//   POST /config   desired state JSON, the same as published to "shadow/set"
+
+struct http_callbacks {
+    // Formats status message, returns its length or -1.
+    int (*format_status)(enum payload_format format, uint8_t *message, size_t size);
+};
+
+// Called after event_loop_init, unlock_init and shadow_init.
+void http_init(struct http_callbacks cb);
@@ -6,6 +6,8 @@
 #include <led_strip.h>
 
 #include "mqtt.h"
+#include "tasks.h"
+#include "heap_guard.h"
 
 typedef enum {
     INDICATOR_OK,
@@ -116,7 +118,8 @@ static void indicator_thread(void *param) {
 
     display_current_status();
 
-    while (true) vTaskDelay(pdMS_TO_TICKS(1000));
+    // Status changes are shown from event handlers.
+    vTaskDelete(NULL);
 }
 
 void indicator_init(void) {
@@ -125,14 +128,20 @@ void indicator_init(void) {
 
     start_listen_events();
 
-    xTaskCreate(
+    static StackType_t stack[INDICATOR_TASK_STACK_SIZE];
+    static StaticTask_t task;
+
+    TaskHandle_t handle = xTaskCreateStaticPinnedToCore(
         indicator_thread,
         "indicator",
-        4096,
+        INDICATOR_TASK_STACK_SIZE,
         NULL,
-        tskIDLE_PRIORITY,
-        NULL
+        INDICATOR_TASK_PRIORITY,
+        stack,
+        &task,
+        INDICATOR_TASK_CORE
     );
+    heap_guard_watch_task(handle);
 }
 
 void indicator_setup_complete(void) {
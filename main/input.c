@@ -0,0 +1,105 @@
+#include "input.h"
+
+#include <esp_err.h>
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <driver/gpio.h>
+
+#include "config.h"
+#include "power.h"
+
+#define TAG "input"
+
+static const struct input_driver *input_driver(enum input_type type) {
+    switch (type) {
+    case INPUT_UART_KEYPAD: return &input_uart_keypad_driver;
+    case INPUT_WIEGAND:     return &input_wiegand_driver;
+    case INPUT_RS485:       return &input_rs485_driver;
+#ifdef USE_SOAK
+    case INPUT_SOAK:        return &input_soak_driver;
+#endif
+    default:                return NULL;
+    }
+}
+
+#ifdef USE_POWER_SAVE
+// Wiegand capture keeps the chip awake itself, see input_wiegand.c.
+static bool input_is_uart(const struct input *input) {
+    return input->hw->type == INPUT_UART_KEYPAD || input->hw->type == INPUT_RS485;
+}
+
+// Runs on the start bit of the first byte, the chip is awake by then.
+static void input_wakeup_isr(void *arg) {
+    struct input *input = arg;
+
+    gpio_intr_disable(input->hw->rx);
+    power_stay_awake_acquire();
+    input->is_wakeup_held = true;
+
+    // Only wakes doors task. If the queue is full, the lock is released on
+    // the read of the queued data instead.
+    uart_event_t event = {
+        .type = INPUT_UART_WAKEUP,
+    };
+    xQueueSendFromISR(input->queue, &event, NULL);
+}
+#endif
+
+bool input_init(struct input *input, const struct input_hardware *hw) {
+    input->hw = hw;
+    input->driver = input_driver(hw->type);
+    if (input->driver == NULL) {
+        return false;
+    }
+
+    input->driver->init(input);
+#ifdef USE_POWER_SAVE
+    if (input_is_uart(input)) {
+        ESP_ERROR_CHECK(gpio_isr_handler_add(hw->rx, input_wakeup_isr, input));
+        input_arm_wakeup(input);
+    }
+#endif
+    ESP_LOGI(TAG, "Input '%s' is ready", input->driver->name);
+    return true;
+}
+
+bool input_take_wakeup(struct input *input) {
+    if (!input->is_wakeup_held) {
+        return false;
+    }
+
+    input->is_wakeup_held = false;
+    power_stay_awake_release();
+    return true;
+}
+
+void input_arm_wakeup(struct input *input) {
+#ifdef USE_POWER_SAVE
+    if (!input_is_uart(input)) return;
+
+    // Also sets interrupt type, line idles high.
+    ESP_ERROR_CHECK(gpio_wakeup_enable(input->hw->rx, GPIO_INTR_LOW_LEVEL));
+    gpio_intr_enable(input->hw->rx);
+#endif
+}
+
+int input_read(struct input *input, char *keys, int size) {
+    int64_t frame_end_us = esp_timer_get_time();
+    int len = input->driver->read(input, keys, size, &frame_end_us);
+
+    if (len < 0) {
+        input->stats.errors++;
+        return 0;
+    }
+    if (len == 0) {
+        return 0;
+    }
+
+    uint32_t decode_us = esp_timer_get_time() - frame_end_us;
+    input->stats.frames++;
+    input->stats.decode_total_us += decode_us;
+    if (decode_us > input->stats.decode_max_us) {
+        input->stats.decode_max_us = decode_us;
+    }
+    return len;
+}
@@ -0,0 +1,77 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/queue.h>
+#include <driver/uart.h>
+
+#include "hardware.h"
+
+// Keypads and readers of a door. Every driver decodes its frames into the
+// keys of the UART keypad, see keypad.c, so all of them feed the same keypad
+// state machine. Drivers are served by doors task: each one has a queue that
+// wakes the task, and its read function is called for every queued item.
+//
+//   UART keypad  single ASCII character per key.
+//   Wiegand      4 and 8 bit keys, 26 and 34 bit cards. Pulses are captured by
+//                MCPWM with hardware timestamps, frame end by a timer.
+//   RS-485       ASCII frames found by UART pattern detection.
+
+struct input_stats {
+    // Frames or UART reads which produced keys.
+    uint32_t frames;
+    // Framing, parity and checksum errors, noise and unknown frames.
+    uint32_t errors;
+    // From the end of a frame, as seen by hardware, to keys handed to keypad.
+    uint32_t decode_max_us;
+    uint64_t decode_total_us;
+};
+
+struct input;
+
+struct input_driver {
+    const char *name;
+    // Installs the driver and creates input queue.
+    void (*init)(struct input *input);
+    // Decodes one queued item into keys, returns count of keys, 0 if there
+    // are none or -1 on error. frame_end_us is preset to now.
+    int (*read)(struct input *input, char *keys, int size, int64_t *frame_end_us);
+};
+
+struct input {
+    const struct input_hardware *hw;
+    const struct input_driver *driver;
+    QueueHandle_t queue;
+    // Driver state.
+    void *ctx;
+    // Light sleep lock taken by wakeup interrupt, see input_take_wakeup.
+    volatile bool is_wakeup_held;
+
+    struct input_stats stats;
+};
+
+extern const struct input_driver input_uart_keypad_driver;
+extern const struct input_driver input_wiegand_driver;
+extern const struct input_driver input_rs485_driver;
+extern const struct input_driver input_soak_driver;
+
+// Queued by the wakeup interrupt of UART inputs, drivers ignore it.
+#define INPUT_UART_WAKEUP  UART_EVENT_MAX
+
+// Returns false for INPUT_NONE.
+bool input_init(struct input *input, const struct input_hardware *hw);
+
+// With USE_POWER_SAVE, the start bit on RX of a UART input wakes the chip
+// and interrupts. The interrupt takes a light sleep lock, so the UART,
+// clocked from XTAL kept on in sleep, receives the whole byte. Called after
+// every read, returns true once per such interrupt and releases its lock,
+// the caller keeps the chip awake for the session instead.
+bool input_take_wakeup(struct input *input);
+
+// Enables the wakeup interrupt again once the session ends. The interrupt
+// stays disabled while keys are entered, so it fires once per session.
+void input_arm_wakeup(struct input *input);
+
+// Reads one queued item, keeps stats.
+int input_read(struct input *input, char *keys, int size);
@@ -0,0 +1,149 @@
+#include "input.h"
+
+#include <esp_err.h>
+#include <driver/uart.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "keypad.h"
+#include "dlog.h"
+
+#define TAG "input_rs485"
+
+// Readers on a half-duplex bus send Modbus ASCII-like frames:
+//
+//   :AAKKKK...CC\n
+//
+// AA is the bus address of the reader, K are keys as sent by the UART keypad
+// and CC is XOR of all characters between ':' and CC, all numbers in hex.
+// Frames of other addresses on the bus are skipped.
+#define RS485_FRAME_START      ':'
+#define RS485_FRAME_MIN        6
+#define RS485_FRAME_MAX        (KEYPAD_BUFFER_SIZE + RS485_FRAME_MIN)
+#define RS485_BUFFER_SIZE      256
+
+static int rs485_hex_byte(const char *hex) {
+    char text[3] = { hex[0], hex[1], '\0' };
+    char *end;
+    long value = strtol(text, &end, 16);
+    return *end == '\0' ? value : -1;
+}
+
+static void rs485_init(struct input *input) {
+    const struct input_hardware *hw = input->hw;
+
+    uart_config_t uart_config = {
+        .baud_rate = RS485_BAUDRATE,
+        .data_bits = UART_DATA_8_BITS,
+        .parity = UART_PARITY_DISABLE,
+        .stop_bits = UART_STOP_BITS_1,
+        .flow_ctrl = UART_HW_FLOWCTRL_DISABLE,
+        // Not affected by CPU frequency scaling, see power.h.
+        .source_clk = UART_SCLK_XTAL,
+    };
+
+    ESP_ERROR_CHECK(uart_driver_install(hw->uart, RS485_BUFFER_SIZE * 2, 0, INPUT_QUEUE_SIZE, &input->queue, 0));
+    ESP_ERROR_CHECK(uart_param_config(hw->uart, &uart_config));
+
+    // Driver enable is on RTS, it stays low, so the transceiver only listens.
+    ESP_ERROR_CHECK(uart_set_pin(hw->uart, UART_PIN_NO_CHANGE, hw->rx, hw->de, UART_PIN_NO_CHANGE));
+    ESP_ERROR_CHECK(uart_set_mode(hw->uart, UART_MODE_RS485_HALF_DUPLEX));
+
+    // UART_PATTERN_DET is queued for every frame end, data events are ignored.
+    ESP_ERROR_CHECK(uart_enable_pattern_det_baud_intr(hw->uart, RS485_FRAME_END, 1, 9, 0, 0));
+    ESP_ERROR_CHECK(uart_pattern_queue_reset(hw->uart, INPUT_QUEUE_SIZE));
+}
+
+static int rs485_decode(const struct input *input, const char *frame, int len, char *keys, int size) {
+    // Without frame end.
+    len -= 1;
+
+    if (len < RS485_FRAME_MIN - 1 || frame[0] != RS485_FRAME_START) {
+        return -1;
+    }
+
+    int address = rs485_hex_byte(frame + 1);
+    int checksum = rs485_hex_byte(frame + len - 2);
+    if (address < 0 || checksum < 0) {
+        return -1;
+    }
+
+    uint8_t sum = 0;
+    for (int i = 1; i < len - 2; i++) {
+        sum ^= frame[i];
+    }
+    if (sum != checksum) {
+        return -1;
+    }
+
+    if (address != input->hw->address) {
+        return 0;
+    }
+
+    int keys_len = len - 5;
+    if (keys_len > size) {
+        return -1;
+    }
+    memcpy(keys, frame + 3, keys_len);
+    return keys_len;
+}
+
+static int rs485_read(struct input *input, char *keys, int size, int64_t *frame_end_us) {
+    static char frame[RS485_FRAME_MAX];
+    uart_port_t uart = input->hw->uart;
+
+    uart_event_t event;
+    if (xQueueReceive(input->queue, &event, 0) != pdTRUE) {
+        return 0;
+    }
+
+    switch (event.type) {
+    case UART_PATTERN_DET: {
+        int pos = uart_pattern_pop_pos(uart);
+        if (pos < 0) {
+            // Pattern positions overflowed, frames in buffer can't be split.
+            uart_flush_input(uart);
+            return -1;
+        }
+
+        int len = pos + 1;
+        if (len > sizeof(frame)) {
+            // Skip garbage or a frame that is too long, up to its end.
+            while (len > 0) {
+                int chunk = len < sizeof(frame) ? len : sizeof(frame);
+                uart_read_bytes(uart, frame, chunk, 0);
+                len -= chunk;
+            }
+            return -1;
+        }
+
+        if (uart_read_bytes(uart, frame, len, 0) != len) {
+            return -1;
+        }
+        return rs485_decode(input, frame, len, keys, size);
+    }
+    case UART_DATA:
+        return 0;
+    case INPUT_UART_WAKEUP:
+        return 0;
+    case UART_FRAME_ERR:
+    case UART_PARITY_ERR:
+    case UART_BREAK:
+        return -1;
+    case UART_FIFO_OVF:
+    case UART_BUFFER_FULL:
+        DLOGW(TAG, "RS-485 UART %d overflowed", uart);
+        uart_flush_input(uart);
+        uart_pattern_queue_reset(uart, INPUT_QUEUE_SIZE);
+        return -1;
+    default:
+        DLOGD(TAG, "Unhandled UART event %d on UART %d", event.type, uart);
+        return 0;
+    }
+}
+
+const struct input_driver input_rs485_driver = {
+    .name = "rs485",
+    .init = rs485_init,
+    .read = rs485_read,
+};
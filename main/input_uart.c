@@ -0,0 +1,78 @@
+#include "input.h"
+
+#include <esp_err.h>
+#include <driver/uart.h>
+
+#include "dlog.h"
+
+#define TAG "input_uart"
+
+static void uart_keypad_init(struct input *input) {
+    const struct input_hardware *hw = input->hw;
+
+    uart_config_t uart_config = {
+        .baud_rate = KEYPAD_UART_BAUDRATE,
+        .data_bits = UART_DATA_8_BITS,
+        .parity = UART_PARITY_DISABLE,
+        .stop_bits = UART_STOP_BITS_1,
+        .flow_ctrl = UART_HW_FLOWCTRL_DISABLE,
+        // Not affected by CPU frequency scaling, see power.h.
+        .source_clk = UART_SCLK_XTAL,
+    };
+
+    ESP_ERROR_CHECK(uart_driver_install(
+        hw->uart,
+        KEYPAD_UART_BUFFER_SIZE * 2,
+        0,
+        INPUT_QUEUE_SIZE,
+        &input->queue,
+        0
+    ));
+
+    ESP_ERROR_CHECK(uart_param_config(
+        hw->uart,
+        &uart_config
+    ));
+
+    ESP_ERROR_CHECK(uart_set_pin(
+        hw->uart,
+        hw->tx,
+        hw->rx,
+        /* RTS */ UART_PIN_NO_CHANGE,
+        /* CTS */ UART_PIN_NO_CHANGE
+    ));
+}
+
+static int uart_keypad_read(struct input *input, char *keys, int size, int64_t *frame_end_us) {
+    uart_event_t event;
+    if (xQueueReceive(input->queue, &event, 0) != pdTRUE) {
+        return 0;
+    }
+
+    switch (event.type) {
+    case UART_DATA: {
+        size_t len = event.size < size ? event.size : size;
+        return uart_read_bytes(input->hw->uart, keys, len, 0);
+    }
+    case INPUT_UART_WAKEUP:
+        return 0;
+    case UART_FRAME_ERR:
+    case UART_PARITY_ERR:
+    case UART_BREAK:
+        return -1;
+    case UART_FIFO_OVF:
+    case UART_BUFFER_FULL:
+        DLOGW(TAG, "Keypad UART %d overflowed", input->hw->uart);
+        uart_flush_input(input->hw->uart);
+        return 0;
+    default:
+        DLOGD(TAG, "Unhandled UART event %d on UART %d", event.type, input->hw->uart);
+        return 0;
+    }
+}
+
+const struct input_driver input_uart_keypad_driver = {
+    .name = "uart",
+    .init = uart_keypad_init,
+    .read = uart_keypad_read,
+};
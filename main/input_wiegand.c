@@ -0,0 +1,243 @@
+#include "input.h"
+
+#include <esp_err.h>
+#include <esp_timer.h>
+#include <driver/gptimer.h>
+#include <driver/mcpwm_cap.h>
+#include <soc/soc_caps.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "keypad.h"
+#include "dlog.h"
+
+#define TAG "input_wiegand"
+
+// Every reader uses its own MCPWM group, each has a single capture timer.
+#define WIEGAND_READERS_MAX  2
+// Every reader also takes a GPTimer for its frame gap, and door sensors take
+// one more, see door_sensor.c.
+#if WIEGAND_READERS_MAX + 1 > SOC_TIMER_GROUP_TOTAL_TIMERS
+#error "Wiegand readers and door sensors need more GPTimers than the chip has"
+#endif
+#define WIEGAND_BITS_MAX     64
+
+// Keypads send a key as 4 bits, or as 8 bits with inverted copy in the high
+// nibble. ESC and ENT act as clear and enter of the UART keypad.
+#define WIEGAND_KEY_ESC      10
+#define WIEGAND_KEY_ENT      11
+
+struct wiegand_frame {
+    uint64_t bits;
+    uint8_t count;
+    // Pulse too short, too long or too many bits.
+    bool is_noisy;
+    int64_t end_us;
+};
+
+struct wiegand_reader;
+
+struct wiegand_line {
+    struct wiegand_reader *reader;
+    mcpwm_cap_channel_handle_t channel;
+    uint8_t bit;
+    uint32_t fall;
+};
+
+struct wiegand_reader {
+    struct input *input;
+    mcpwm_cap_timer_handle_t capture_timer;
+    gptimer_handle_t gap_timer;
+    struct wiegand_line d0;
+    struct wiegand_line d1;
+    uint32_t pulse_min_ticks;
+    uint32_t pulse_max_ticks;
+
+    // Built by capture interrupts, handed over when the gap timer fires.
+    struct wiegand_frame frame;
+    // Gap timer is started by the first bit of a frame and stopped when it
+    // fires. Starting a running timer logs an error from the interrupt.
+    volatile bool gap_running;
+};
+
+static struct wiegand_reader readers[WIEGAND_READERS_MAX];
+static int readers_count;
+
+// Runs in capture interrupt. A bit is taken when its pulse ends, from the
+// hardware timestamps of both edges, so glitches never become bits.
+static bool wiegand_captured(mcpwm_cap_channel_handle_t channel, const mcpwm_capture_event_data_t *edata, void *arg) {
+    struct wiegand_line *line = arg;
+    struct wiegand_reader *reader = line->reader;
+
+    if (edata->cap_edge == MCPWM_CAP_EDGE_NEG) {
+        line->fall = edata->cap_value;
+        return false;
+    }
+
+    uint32_t width = edata->cap_value - line->fall;
+    if (width < reader->pulse_min_ticks || width > reader->pulse_max_ticks || reader->frame.count == WIEGAND_BITS_MAX) {
+        reader->frame.is_noisy = true;
+    } else {
+        reader->frame.bits = (reader->frame.bits << 1) | line->bit;
+        reader->frame.count++;
+    }
+
+    // Restarts frame gap.
+    gptimer_set_raw_count(reader->gap_timer, 0);
+    if (!reader->gap_running) {
+        reader->gap_running = true;
+        gptimer_start(reader->gap_timer);
+    }
+    return false;
+}
+
+// Runs in timer interrupt after WIEGAND_FRAME_GAP_US of silence.
+static bool wiegand_frame_end(gptimer_handle_t timer, const gptimer_alarm_event_data_t *edata, void *arg) {
+    struct wiegand_reader *reader = arg;
+    gptimer_stop(timer);
+    reader->gap_running = false;
+
+    reader->frame.end_us = esp_timer_get_time();
+
+    BaseType_t task_woken = pdFALSE;
+    xQueueSendFromISR(reader->input->queue, &reader->frame, &task_woken);
+    memset(&reader->frame, 0, sizeof(reader->frame));
+    return task_woken == pdTRUE;
+}
+
+static void wiegand_init_line(struct wiegand_reader *reader, struct wiegand_line *line, gpio_num_t gpio, uint8_t bit) {
+    line->reader = reader;
+    line->bit = bit;
+
+    mcpwm_capture_channel_config_t config = {
+        .gpio_num = gpio,
+        .prescale = 1,
+        // Lines idle high and pulse low.
+        .flags.neg_edge = true,
+        .flags.pos_edge = true,
+        .flags.pull_up = true,
+    };
+    ESP_ERROR_CHECK(mcpwm_new_capture_channel(reader->capture_timer, &config, &line->channel));
+
+    mcpwm_capture_event_callbacks_t callbacks = {
+        .on_cap = wiegand_captured,
+    };
+    ESP_ERROR_CHECK(mcpwm_capture_channel_register_event_callbacks(line->channel, &callbacks, line));
+    ESP_ERROR_CHECK(mcpwm_capture_channel_enable(line->channel));
+}
+
+// Capture timer runs from APB clock, so its driver holds a power management
+// lock and the chip does not enter light sleep while a reader is installed.
+static void wiegand_init(struct input *input) {
+    assert(readers_count < WIEGAND_READERS_MAX);
+    struct wiegand_reader *reader = &readers[readers_count];
+    reader->input = input;
+    input->ctx = reader;
+
+    static StaticQueue_t queues[WIEGAND_READERS_MAX];
+    static uint8_t queue_storage[WIEGAND_READERS_MAX][INPUT_QUEUE_SIZE * sizeof(struct wiegand_frame)];
+    input->queue = xQueueCreateStatic(
+        INPUT_QUEUE_SIZE, sizeof(struct wiegand_frame), queue_storage[readers_count], &queues[readers_count]
+    );
+
+    mcpwm_capture_timer_config_t capture_config = {
+        .group_id = readers_count,
+        .clk_src = MCPWM_CAPTURE_CLK_SRC_DEFAULT,
+    };
+    ESP_ERROR_CHECK(mcpwm_new_capture_timer(&capture_config, &reader->capture_timer));
+
+    uint32_t resolution_hz;
+    ESP_ERROR_CHECK(mcpwm_capture_timer_get_resolution(reader->capture_timer, &resolution_hz));
+    reader->pulse_min_ticks = (uint64_t)WIEGAND_PULSE_MIN_US * resolution_hz / 1000000;
+    reader->pulse_max_ticks = (uint64_t)WIEGAND_PULSE_MAX_US * resolution_hz / 1000000;
+
+    // Clocked from XTAL like door sensor debounce, see door_sensor.c.
+    gptimer_config_t timer_config = {
+        .clk_src = GPTIMER_CLK_SRC_XTAL,
+        .direction = GPTIMER_COUNT_UP,
+        .resolution_hz = 1000000,
+    };
+    ESP_ERROR_CHECK(gptimer_new_timer(&timer_config, &reader->gap_timer));
+
+    gptimer_alarm_config_t alarm_config = {
+        .alarm_count = WIEGAND_FRAME_GAP_US,
+    };
+    ESP_ERROR_CHECK(gptimer_set_alarm_action(reader->gap_timer, &alarm_config));
+
+    gptimer_event_callbacks_t timer_callbacks = {
+        .on_alarm = wiegand_frame_end,
+    };
+    ESP_ERROR_CHECK(gptimer_register_event_callbacks(reader->gap_timer, &timer_callbacks, reader));
+    ESP_ERROR_CHECK(gptimer_enable(reader->gap_timer));
+
+    wiegand_init_line(reader, &reader->d0, input->hw->d0, 0);
+    wiegand_init_line(reader, &reader->d1, input->hw->d1, 1);
+
+    ESP_ERROR_CHECK(mcpwm_capture_timer_enable(reader->capture_timer));
+    ESP_ERROR_CHECK(mcpwm_capture_timer_start(reader->capture_timer));
+
+    readers_count++;
+}
+
+static int wiegand_key(uint8_t code, char *keys) {
+    if (code <= 9) {
+        keys[0] = '0' + code;
+    } else if (code == WIEGAND_KEY_ESC) {
+        keys[0] = 'C';
+    } else if (code == WIEGAND_KEY_ENT) {
+        keys[0] = 'E';
+    } else {
+        return -1;
+    }
+    return 1;
+}
+
+// Cards are entered as uid: decimal card data followed by enter. First bit is
+// even parity of the first half, last bit is odd parity of the second half.
+static int wiegand_card(const struct wiegand_frame *frame, char *keys, int size) {
+    int half = frame->count / 2;
+    uint64_t first = frame->bits >> (frame->count - half);
+    uint64_t second = frame->bits & ((1ull << half) - 1);
+
+    if (__builtin_popcountll(first) % 2 != 0 || __builtin_popcountll(second) % 2 != 1) {
+        return -1;
+    }
+
+    uint64_t data = (frame->bits >> 1) & ((1ull << (frame->count - 2)) - 1);
+    int len = snprintf(keys, size, "%lluE", (unsigned long long)data);
+    return len < size ? len : -1;
+}
+
+static int wiegand_read(struct input *input, char *keys, int size, int64_t *frame_end_us) {
+    struct wiegand_frame frame;
+    if (xQueueReceive(input->queue, &frame, 0) != pdTRUE) {
+        return 0;
+    }
+
+    *frame_end_us = frame.end_us;
+    if (frame.is_noisy) {
+        return -1;
+    }
+
+    switch (frame.count) {
+    case 4:
+        return wiegand_key(frame.bits, keys);
+    case 8:
+        if ((((frame.bits >> 4) ^ frame.bits) & 0xF) != 0xF) {
+            return -1;
+        }
+        return wiegand_key(frame.bits & 0xF, keys);
+    case 26:
+    case 34:
+        return wiegand_card(&frame, keys, size);
+    default:
+        DLOGD(TAG, "Unsupported Wiegand frame of %d bits", frame.count);
+        return -1;
+    }
+}
+
+const struct input_driver input_wiegand_driver = {
+    .name = "wiegand",
+    .init = wiegand_init,
+    .read = wiegand_read,
+};
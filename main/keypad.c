@@ -4,6 +4,7 @@
 #include <driver/uart.h>
 
 #include "hardware.h"
+#include "dlog.h"
 
 #define TAG "keypad"
 
@@ -18,22 +19,12 @@
 #define KEYPAD_BTN_SLEEP   'L'
 #define KEYPAD_BTN_ARM     'A'
 
-#define KEYPAD_BUFFER_SIZE            (32)
-#define KEYPAD_BUFFER_SIZE_WITH_NULL  (KEYPAD_BUFFER_SIZE + 1)
-
 #define ASSERT_STATE(state, required_state) \
     if ((state) != required_state) { \
         ESP_LOGE(TAG, "Required state is " #required_state " but keypad is in state %s", keypad_state_str(state)); \
         abort(); \
     }
 
-enum keypad_state {
-    KEYPAD_STATE_RESET = 0,
-    KEYPAD_STATE_COMMAND = 1,
-    KEYPAD_STATE_UID_INPUT = 2,
-    KEYPAD_STATE_CODE_INPUT = 3,
-};
-
 const char *keypad_state_str(enum keypad_state state) {
     switch (state) {
         case KEYPAD_STATE_RESET:
@@ -80,111 +71,96 @@ const char *keypad_status_str(enum keypad_status status) {
     }
 }
 
-static struct {
-    // Internal keypad state. See img/keypad-state.jpg
-    enum keypad_state state;
-
-    // Callbacks for some final states
-    struct keypad_callbacks callbacks;
-
-    // Buffer for common state
-    char *buffer;
-    size_t buffer_len;
-
-    // Special buffer for UID
-    char *uid_buffer;
-    size_t uid_buffer_len;
-} keypad = {0};
-
-static enum keypad_status keypad_save_char(char chr) {
-    if (keypad.state == KEYPAD_STATE_RESET) {
-        keypad.state = KEYPAD_STATE_UID_INPUT;
+static enum keypad_status keypad_save_char(struct keypad *keypad, char chr) {
+    if (keypad->state == KEYPAD_STATE_RESET) {
+        keypad->state = KEYPAD_STATE_UID_INPUT;
     }
 
-    if (keypad.buffer_len == KEYPAD_BUFFER_SIZE) {
+    if (keypad->buffer_len == KEYPAD_BUFFER_SIZE) {
         return KEYPAD_STATUS_BUFFER_OVERFLOW;
     }
 
-    keypad.buffer[keypad.buffer_len++] = chr;
+    keypad->buffer[keypad->buffer_len++] = chr;
 
     return KEYPAD_STATUS_OK;
 }
 
-static void keypad_save_uid(void) {
-    ASSERT_STATE(keypad.state, KEYPAD_STATE_UID_INPUT);
+static void keypad_save_uid(struct keypad *keypad) {
+    ASSERT_STATE(keypad->state, KEYPAD_STATE_UID_INPUT);
 
-    memcpy(keypad.uid_buffer, keypad.buffer, keypad.buffer_len);
-    keypad.uid_buffer_len = keypad.buffer_len;
+    memcpy(keypad->uid_buffer, keypad->buffer, keypad->buffer_len);
+    keypad->uid_buffer_len = keypad->buffer_len;
 
-    memset(keypad.buffer, 0, KEYPAD_BUFFER_SIZE);
-    keypad.buffer_len = 0;
+    memset(keypad->buffer, 0, KEYPAD_BUFFER_SIZE);
+    keypad->buffer_len = 0;
 }
 
-static enum keypad_status keypad_handle_command(void) {
-    ASSERT_STATE(keypad.state, KEYPAD_STATE_COMMAND);
+static enum keypad_status keypad_handle_command(struct keypad *keypad) {
+    ASSERT_STATE(keypad->state, KEYPAD_STATE_COMMAND);
 
-    bool result = keypad.callbacks.command(keypad.buffer);
+    bool result = keypad->callbacks.command(keypad->ctx, keypad->buffer);
 
     return result ? KEYPAD_STATUS_OK : KEYPAD_STATUS_BAD_CODE;
 }
 
-static enum keypad_status keypad_verify_code(void) {
-    ASSERT_STATE(keypad.state, KEYPAD_STATE_CODE_INPUT);
+static enum keypad_status keypad_verify_code(struct keypad *keypad) {
+    ASSERT_STATE(keypad->state, KEYPAD_STATE_CODE_INPUT);
 
-    bool result = keypad.callbacks.checkin(
+    bool result = keypad->callbacks.checkin(
+        keypad->ctx,
         // UID
-        keypad.uid_buffer,
+        keypad->uid_buffer,
         // Code
-        keypad.buffer
+        keypad->buffer
     );
 
     return result ? KEYPAD_STATUS_OK : KEYPAD_STATUS_BAD_CODE;
 }
 
-static enum keypad_status keypad_next_state(void) {
+static enum keypad_status keypad_next_state(struct keypad *keypad) {
     enum keypad_status status = KEYPAD_STATUS_INVALID_STATE;
 
-    if (keypad.buffer_len == 0) {
+    if (keypad->buffer_len == 0) {
         return status;
     }
 
-    if (keypad.state == KEYPAD_STATE_COMMAND) {
-        status = keypad_handle_command();
-        keypad_reset();
+    if (keypad->state == KEYPAD_STATE_COMMAND) {
+        status = keypad_handle_command(keypad);
+        keypad_reset(keypad);
     }
-    else if (keypad.state == KEYPAD_STATE_UID_INPUT) {
-        keypad_save_uid();
-        keypad.state = KEYPAD_STATE_CODE_INPUT;
+    else if (keypad->state == KEYPAD_STATE_UID_INPUT) {
+        keypad_save_uid(keypad);
+        keypad->state = KEYPAD_STATE_CODE_INPUT;
 
         status = KEYPAD_STATUS_OK;
     }
-    else if (keypad.state == KEYPAD_STATE_CODE_INPUT) {
-        status = keypad_verify_code();
-        keypad_reset();
+    else if (keypad->state == KEYPAD_STATE_CODE_INPUT) {
+        status = keypad_verify_code(keypad);
+        keypad_reset(keypad);
     }
 
     return status;
 }
 
-static enum keypad_status keypad_handle_button(char chr) {
+static enum keypad_status keypad_handle_button(struct keypad *keypad, char chr) {
     switch (chr) {
         // Reset state
         case KEYPAD_BTN_CLEAR:
-            keypad_reset();
+            keypad_reset(keypad);
             return KEYPAD_STATUS_OK;
 
         // Special code
         case KEYPAD_BTN_POWER:
-            if (keypad.state == KEYPAD_STATE_RESET) {
-                keypad.state = KEYPAD_STATE_COMMAND;
+            if (keypad->state == KEYPAD_STATE_RESET) {
+                keypad->state = KEYPAD_STATE_COMMAND;
                 return KEYPAD_STATUS_OK;
             } else {
-                return keypad_save_char(chr);
+                return keypad_save_char(keypad, chr);
             }
 
         // Next state
         case KEYPAD_BTN_ENTER:
-            return keypad_next_state();
+            return keypad_next_state(keypad);
 
         // Numbers
         case '1':
@@ -203,14 +179,14 @@ static enum keypad_status keypad_handle_button(char chr) {
         case KEYPAD_BTN_OFF:
         case KEYPAD_BTN_STAY:
         case KEYPAD_BTN_SLEEP:
-            return keypad_save_char(chr);
+            return keypad_save_char(keypad, chr);
 
         case KEYPAD_BTN_ARM:
-            if (keypad.state == KEYPAD_STATE_RESET) {
-                keypad.callbacks.alarm();
+            if (keypad->state == KEYPAD_STATE_RESET) {
+                keypad->callbacks.alarm(keypad->ctx);
                 return KEYPAD_STATUS_OK;
             } else {
-                return keypad_save_char(chr);
+                return keypad_save_char(keypad, chr);
             }
 
         // Someone connected via flipper and is trying to hack us!
@@ -221,37 +197,37 @@ static enum keypad_status keypad_handle_button(char chr) {
     return KEYPAD_STATUS_OK;
 }
 
-void keypad_init(struct keypad_callbacks cb) {
-    keypad.state = KEYPAD_STATE_RESET;
+void keypad_init(struct keypad *keypad, struct keypad_callbacks cb, void *ctx) {
+    memset(keypad, 0, sizeof(*keypad));
 
-    keypad.buffer = malloc(KEYPAD_BUFFER_SIZE_WITH_NULL);
-    assert(keypad.buffer != NULL);
-    memset(keypad.buffer, 0, KEYPAD_BUFFER_SIZE_WITH_NULL);
-
-    keypad.uid_buffer = malloc(KEYPAD_BUFFER_SIZE_WITH_NULL);
-    assert(keypad.uid_buffer != NULL);
-    memset(keypad.uid_buffer, 0, KEYPAD_BUFFER_SIZE_WITH_NULL);
+    keypad->state = KEYPAD_STATE_RESET;
+    keypad->callbacks = cb;
+    keypad->ctx = ctx;
+}
 
-    keypad.callbacks = cb;
+// Digits are uids and codes, and the log ring is dumped over MQTT, so they
+// are logged as '*'. Control buttons and unknown bytes are kept.
+static char keypad_redact(char button) {
+    return button >= '0' && button <= '9' ? '*' : button;
 }
 
-void keypad_process(const char *data, int data_len) {
+void keypad_process(struct keypad *keypad, const char *data, int data_len) {
     for (int i = 0; i < data_len; i++) {        
-        enum keypad_status status = keypad_handle_button(data[i]);    
+        enum keypad_status status = keypad_handle_button(keypad, data[i]);    
         if (status < KEYPAD_STATUS_BAD_CODE) {
-            ESP_LOGW(TAG, "Failed to process char '%c': %s", data[i], keypad_status_str(status));
+            DLOGW(TAG, "Failed to process char '%c': %s", keypad_redact(data[i]), keypad_status_str(status));
         } else {
-            ESP_LOGD(TAG, "Char '%c' processed with status %s", data[i], keypad_status_str(status));
+            DLOGD(TAG, "Char '%c' processed with status %s", keypad_redact(data[i]), keypad_status_str(status));
         }
     }
 }
 
-void keypad_reset(void) {
-    keypad.state = KEYPAD_STATE_RESET;
+void keypad_reset(struct keypad *keypad) {
+    keypad->state = KEYPAD_STATE_RESET;
 
-    memset(keypad.buffer, 0, KEYPAD_BUFFER_SIZE);
-    keypad.buffer_len = 0;
+    memset(keypad->buffer, 0, KEYPAD_BUFFER_SIZE);
+    keypad->buffer_len = 0;
 
-    memset(keypad.uid_buffer, 0, KEYPAD_BUFFER_SIZE);
-    keypad.uid_buffer_len = 0;
+    memset(keypad->uid_buffer, 0, KEYPAD_BUFFER_SIZE);
+    keypad->uid_buffer_len = 0;
 }
@@ -4,14 +4,41 @@
 #include <stdint.h>
 #include <stddef.h>
 
+#define KEYPAD_BUFFER_SIZE            (32)
+#define KEYPAD_BUFFER_SIZE_WITH_NULL  (KEYPAD_BUFFER_SIZE + 1)
+
+enum keypad_state {
+    KEYPAD_STATE_RESET = 0,
+    KEYPAD_STATE_COMMAND = 1,
+    KEYPAD_STATE_UID_INPUT = 2,
+    KEYPAD_STATE_CODE_INPUT = 3,
+};
+
 struct keypad_callbacks {
-    bool (*command)(const char*);
-    bool (*checkin)(const char*, const char*);
-    void (*alarm)(void);
+    bool (*command)(void *ctx, const char*);
+    bool (*checkin)(void *ctx, const char*, const char*);
+    void (*alarm)(void *ctx);
+};
+
+struct keypad {
+    // Internal keypad state. See img/keypad-state.jpg
+    enum keypad_state state;
+
+    // Callbacks for some final states
+    struct keypad_callbacks callbacks;
+    void *ctx;
+
+    // Buffer for common state
+    char buffer[KEYPAD_BUFFER_SIZE_WITH_NULL];
+    size_t buffer_len;
+
+    // Special buffer for UID
+    char uid_buffer[KEYPAD_BUFFER_SIZE_WITH_NULL];
+    size_t uid_buffer_len;
 };
 
-void keypad_init(struct keypad_callbacks cb);
+void keypad_init(struct keypad *keypad, struct keypad_callbacks cb, void *ctx);
 
-void keypad_process(const char *data, int data_len);
+void keypad_process(struct keypad *keypad, const char *data, int data_len);
 
-void keypad_reset(void);
+void keypad_reset(struct keypad *keypad);
@@ -1,16 +1,98 @@
-#include <freertos/FreeRTOS.h>
-#include <freertos/task.h>
-#include <driver/gpio.h>
+#include "lock.h"
+
+#include <esp_err.h>
 
 #include "hardware.h"
+#include "trace.h"
+#include "event_loop.h"
+#include "soak.h"
+
+// Soak test never drives the strike, see soak.h.
+static void lock_set_level(struct lock *lock, int level) {
+#ifndef USE_SOAK
+    gpio_set_level(lock->gpio, level);
+#endif
+}
+
+static void lock_post_event(struct lock *lock, enum event_id id) {
+    struct event event = {
+        .id = id,
+        .lock = lock,
+    };
+    event_loop_post(&event, 0);
+}
+
+static void lock_close(void *arg) {
+    struct lock *lock = arg;
+
+    taskENTER_CRITICAL(&lock->spinlock);
+    // Triggered again after the timer fired but before this callback ran.
+    bool is_extended = esp_timer_is_active(lock->close_timer);
+    if (!is_extended) {
+        lock_set_level(lock, !LOCK_OPENED_LOGIC_LEVEL);
+        lock->is_open = false;
+    }
+    taskEXIT_CRITICAL(&lock->spinlock);
+
+    if (is_extended) return;
+
+    TRACE_INSTANT("lock_close");
+    lock_post_event(lock, EVENT_LOCK_CLOSED);
+}
+
+void lock_init(struct lock *lock, gpio_num_t gpio) {
+    lock->gpio = gpio;
+    portMUX_INITIALIZE(&lock->spinlock);
+    lock->is_open = false;
+    lock->open_time_us = LOCK_OPEN_TIME_US;
+    lock->triggered_at = 0;
 
-void lock_trigger(void) {
-    static portMUX_TYPE spinlock = portMUX_INITIALIZER_UNLOCKED;
-    taskENTER_CRITICAL(&spinlock);
+    const esp_timer_create_args_t timer_args = {
+        .callback = lock_close,
+        .arg = lock,
+        .name = "lock_close",
+    };
+    ESP_ERROR_CHECK(esp_timer_create(&timer_args, &lock->close_timer));
+}
+
+void lock_trigger(struct lock *lock) {
+    int64_t start = esp_timer_get_time();
+
+    // Called from event loop, MQTT and HTTP tasks, and races with the close
+    // timer, so strike, timer and state change together.
+    taskENTER_CRITICAL(&lock->spinlock);
+
+    // Strike is released from timer, so other doors are not blocked while this one is open.
+    lock_set_level(lock, LOCK_OPENED_LOGIC_LEVEL);
+    lock->triggered_at = esp_timer_get_time();
+
+    // Extend opening if lock is already open.
+    if (esp_timer_restart(lock->close_timer, lock->open_time_us) != ESP_OK) {
+        esp_timer_start_once(lock->close_timer, lock->open_time_us);
+    }
+
+    bool was_open = lock->is_open;
+    lock->is_open = true;
+    taskEXIT_CRITICAL(&lock->spinlock);
 
-    gpio_set_level(LOCK_GPIO, LOCK_OPENED_LOGIC_LEVEL);
-    esp_rom_delay_us(LOCK_OPEN_TIME_US);
-    gpio_set_level(LOCK_GPIO, !LOCK_OPENED_LOGIC_LEVEL);
+    TRACE_INSTANT("lock_open");
+    if (!was_open) {
+        lock_post_event(lock, EVENT_LOCK_OPENED);
+    }
+
+    SOAK_RECORD(SOAK_LOCK_TRIGGER, start);
+}
+
+uint32_t lock_get_open_time(struct lock *lock) {
+    taskENTER_CRITICAL(&lock->spinlock);
+    uint32_t open_time_us = lock->open_time_us;
+    taskEXIT_CRITICAL(&lock->spinlock);
+
+    return open_time_us;
+}
 
-    taskEXIT_CRITICAL(&spinlock);
+void lock_set_open_time(struct lock *lock, uint32_t open_time_us) {
+    taskENTER_CRITICAL(&lock->spinlock);
+    lock->open_time_us = open_time_us;
+    taskEXIT_CRITICAL(&lock->spinlock);
 }
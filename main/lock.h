@@ -1,3 +1,29 @@
 #pragma once
 
-void lock_trigger(void);
+#include <stdbool.h>
+#include <stdint.h>
+#include <driver/gpio.h>
+#include <esp_timer.h>
+#include <freertos/FreeRTOS.h>
+
+struct lock {
+    gpio_num_t gpio;
+    esp_timer_handle_t close_timer;
+    // Guards strike, close timer and is_open, see lock_trigger.
+    portMUX_TYPE spinlock;
+
+    // Reported in device shadow, open time can be changed with shadow/set.
+    volatile bool is_open;
+    // Guarded by spinlock, use lock_get_open_time and lock_set_open_time.
+    uint32_t open_time_us;
+    // Time of the last trigger, 0 if never triggered.
+    volatile int64_t triggered_at;
+};
+
+void lock_init(struct lock *lock, gpio_num_t gpio);
+
+void lock_trigger(struct lock *lock);
+
+// Safe to call from any task. A new open time applies from the next trigger.
+uint32_t lock_get_open_time(struct lock *lock);
+void lock_set_open_time(struct lock *lock, uint32_t open_time_us);
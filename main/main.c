@@ -1,20 +1,44 @@
 #include <esp_log.h>
 #include <esp_timer.h>
 #include <esp_event.h>
+#include <esp_system.h>
 #include <driver/uart.h>
 #include <freertos/FreeRTOS.h>
 #include <freertos/task.h>
 #include <stdio.h>
+#include <string.h>
 #include <sys/time.h>
 
 #include "config.h"
 #include "hardware.h"
 #include "keypad.h"
+#include "door.h"
 #include "otp.h"
+#include "otp_worker.h"
 #include "lock.h"
 #include "ntp.h"
 #include "mqtt.h"
 #include "indicator.h"
+#include "storage.h"
+#include "schedule.h"
+#include "tasks.h"
+#include "trace.h"
+#include "dlog.h"
+#include "heap_guard.h"
+#include "power.h"
+#include "mqtt_tls.h"
+#include "shadow.h"
+#include "batch.h"
+#include "payload.h"
+#include "ota.h"
+#include "coredump.h"
+#include "event_loop.h"
+#include "unlock.h"
+#include "history.h"
+#include "http.h"
+#include "broker.h"
+#include "netcache.h"
+#include "soak.h"
 
 #ifdef USE_WIFI
 #include "wifi.h"
@@ -26,6 +50,9 @@
 
 #define UPTIME()  (esp_timer_get_time() / 1000000)
 
+// Keypad and lock topic commands wait this long for room in the event loop.
+#define COMMAND_POST_TIMEOUT_MS  100
+
 time_t start_timestamp;
 
 void save_start_timestamp(void) {
@@ -37,79 +64,512 @@ void setup_timezone(void) {
     tzset();
 }
 
-bool command(const char *cmd) {
-    const char *topic = MQTT_TOPIC(MQTT_DEVICE_ID, "command");
+// Keypad callbacks run in keypad task or in MQTT task for the lock topic,
+// they only post events. Handlers run in event loop task.
+bool command(void *ctx, const char *cmd) {
+    struct event event = {
+        .id = EVENT_KEYPAD_COMMAND,
+        .command.ctx = ctx,
+    };
+    strlcpy(event.command.cmd, cmd, sizeof(event.command.cmd));
+
+    return event_loop_post(&event, pdMS_TO_TICKS(COMMAND_POST_TIMEOUT_MS));
+}
+
+static void command_handler(const struct event *event, void *arg) {
+    struct door *door = event->command.ctx;
+    const char *cmd = event->command.cmd;
+    const char *topic = door->topics.command;
 
     struct timeval tv_now;
     gettimeofday(&tv_now, NULL);
 
-    char message[256] = {0};
-    snprintf((char*)&message, sizeof(message), "{\"command\": \"%s\", \"timestamp\": \"%lld\"}", cmd, tv_now.tv_sec);
+    uint8_t message[256];
+    struct payload p;
+    payload_init(&p, PAYLOAD_FORMAT, message, sizeof(message));
+    payload_map_begin(&p);
+    payload_key(&p, PAYLOAD_COMMAND);
+    payload_text(&p, cmd);
+    payload_key(&p, PAYLOAD_TIMESTAMP);
+    payload_timestamp(&p, tv_now.tv_sec);
+    payload_end(&p);
+
+    int len = payload_finish(&p);
+    if (len < 0) return;
 
-    mqtt_publish(topic, message, /* qos */ 1, /* retain */ false);
+    batch_publish(topic, message, len);
+}
 
-    return true;
+bool checkin(void *ctx, const char *uid, const char *code) {
+    // Verification continues on OTP worker, see checkin_done.
+    return otp_worker_submit(ctx, uid, code);
 }
 
-bool checkin(const char *uid, const char *code) {
-    bool is_valid_otp = otp_verify(uid, code);
-    if (!is_valid_otp) return false;
+static void checkin_done(const struct event *event, void *arg) {
+    const struct otp_result *result = &event->otp_result;
+    struct door *door = result->ctx;
+    const char *uid = result->uid;
 
-    lock_trigger();
+#ifdef USE_SOAK
+    soak_record_checkin(uid, result->is_valid, result->submitted_at);
+#endif
 
-    const char *topic = MQTT_TOPIC(MQTT_DEVICE_ID, "checkin");
+    if (!result->is_valid) {
+        ESP_LOGW(TAG, "Invalid code entered by user '%s' at door '%s'", uid, door->hw->name);
+        history_record(door->index, ACCESS_LOG_DENIED_CODE, uid);
+        return;
+    }
+
+    bool is_allowed_now = schedule_allows(uid);
+    if (!is_allowed_now) {
+        history_record(door->index, ACCESS_LOG_DENIED_SCHEDULE, uid);
+        return;
+    }
+
+    lock_trigger(&door->lock);
+    history_record(door->index, ACCESS_LOG_GRANTED, uid);
+
+    const char *topic = door->topics.checkin;
 
     struct timeval tv_now;
     gettimeofday(&tv_now, NULL);
 
-    char message[256] = {0};
-    snprintf((char*)&message, sizeof(message), "{\"uid\": \"%s\", \"timestamp\": \"%lld\"}", uid, tv_now.tv_sec);
+    uint8_t message[256];
+    struct payload p;
+    payload_init(&p, PAYLOAD_FORMAT, message, sizeof(message));
+    payload_map_begin(&p);
+    payload_key(&p, PAYLOAD_UID);
+    payload_text(&p, uid);
+    payload_key(&p, PAYLOAD_TIMESTAMP);
+    payload_timestamp(&p, tv_now.tv_sec);
+    payload_end(&p);
 
-    mqtt_publish(topic, message, /* qos */ 1, /* retain */ false);
+    int len = payload_finish(&p);
+    if (len < 0) return;
 
-    return true;
+    batch_publish(topic, message, len);
 }
 
-void alarm(void) {
-    const char *topic = MQTT_TOPIC(MQTT_DEVICE_ID, "alarm");
+static void alarm_delivered(enum mqtt_delivery result, void *arg) {
+    struct door *door = arg;
+
+    if (result == MQTT_DELIVERY_FAILED) {
+        DLOGE(TAG, "Alarm at door '%s' is not delivered", door->hw->name);
+    }
+}
+
+void alarm(void *ctx) {
+    struct event event = {
+        .id = EVENT_ALARM,
+        .alarm_ctx = ctx,
+    };
+    // Alarms are never dropped, see event_loop_post.
+    event_loop_post(&event, portMAX_DELAY);
+}
+
+static void alarm_handler(const struct event *event, void *arg) {
+    struct door *door = event->alarm_ctx;
+    const char *topic = door->topics.alarm;
 
     struct timeval tv_now;
     gettimeofday(&tv_now, NULL);
 
-    char message[256] = {0};
-    snprintf((char*)&message, sizeof(message), "{\"event\":\"alarm\",\"timestamp\": \"%lld\"}", tv_now.tv_sec);
+    uint8_t message[64];
+    struct payload p;
+    payload_init(&p, PAYLOAD_FORMAT, message, sizeof(message));
+    payload_map_begin(&p);
+    payload_key(&p, PAYLOAD_EVENT);
+    payload_text(&p, "alarm");
+    payload_key(&p, PAYLOAD_TIMESTAMP);
+    payload_timestamp(&p, tv_now.tv_sec);
+    payload_end(&p);
+
+    int len = payload_finish(&p);
+    if (len < 0) return;
 
-    mqtt_publish(topic, message, /* qos */ 2, /* retain */ false);
+    mqtt_enqueue_data(topic, message, len, /* qos */ 2, /* retain */ false, alarm_delivered, door);
+}
+
+static void door_sensor_delivered(enum mqtt_delivery result, void *arg) {
+    struct door *door = arg;
+
+    if (result == MQTT_DELIVERY_FAILED) {
+        DLOGE(TAG, "Door alarm at door '%s' is not delivered", door->hw->name);
+    }
+}
+
+static void door_sensor_handler(const struct event *event, void *arg) {
+    struct door *door = event->door_sensor.ctx;
+    enum door_sensor_event_kind kind = event->door_sensor.kind;
+    int64_t edge_us = event->door_sensor.edge_us;
+    const char *topic = door->topics.sensor;
+
+    if (kind == DOOR_SENSOR_EXIT_REQUEST) {
+        lock_trigger(&door->lock);
+    }
+
+    // Edge time in wall clock, from its distance to now.
+    struct timeval tv_now;
+    gettimeofday(&tv_now, NULL);
+    int64_t now_us = tv_now.tv_sec * 1000000ll + tv_now.tv_usec;
+    int64_t edge_wall_us = now_us - (esp_timer_get_time() - edge_us);
+
+    uint8_t message[128];
+    struct payload p;
+    payload_init(&p, PAYLOAD_FORMAT, message, sizeof(message));
+    payload_map_begin(&p);
+    payload_key_text(&p, PAYLOAD_EVENT, door_sensor_event_name(kind));
+    payload_key(&p, PAYLOAD_TIMESTAMP);
+    payload_timestamp(&p, edge_wall_us / 1000000);
+    payload_key(&p, PAYLOAD_TIMESTAMP_US);
+    payload_int(&p, edge_wall_us);
+    payload_key_uint(&p, PAYLOAD_LATENCY_US, esp_timer_get_time() - edge_us);
+    payload_end(&p);
+
+    int len = payload_finish(&p);
+    if (len < 0) return;
+
+    if (kind == DOOR_SENSOR_FORCED_OPEN || kind == DOOR_SENSOR_HELD_OPEN) {
+        ESP_LOGW(TAG, "Door '%s' %s", door->hw->name, kind == DOOR_SENSOR_FORCED_OPEN ? "forced open" : "held open");
+        mqtt_enqueue_data(topic, message, len, /* qos */ 2, /* retain */ false, door_sensor_delivered, door);
+    } else {
+        batch_publish(topic, message, len);
+    }
+
+    door_sensor_record_latency(&door->sensor, edge_us);
 }
 
 void mqtt_lock_topic_updated(
     const char *topic, int topic_len,
     const char *data,  int data_len
 ) {
-    keypad_process(data, data_len);
+    struct door *door = door_find_by_lock_topic(topic, topic_len);
+    if (door == NULL) return;
+
+    keypad_process(&door->keypad, data, data_len);
 }
 
-void status_thread(void *param) {
+void mqtt_schedule_topic_updated(
+    const char *topic, int topic_len,
+    const char *data,  int data_len
+) {
+    bool updated = schedule_update(data, data_len);
+
+    const char *status_topic = MQTT_TOPIC(MQTT_DEVICE_ID, "schedule/status");
+
+    char message[64] = {0};
+    snprintf((char*)&message, sizeof(message), "{\"updated\": %s, \"size\": %d}", updated ? "true" : "false", data_len);
+
+    mqtt_publish(status_topic, message, /* qos */ 1, /* retain */ false);
+}
+
+#ifdef USE_TRACE
+void publish_trace_chunk(const char *chunk, void *arg) {
+    mqtt_publish(MQTT_TOPIC(MQTT_DEVICE_ID, "trace"), chunk, /* qos */ 1, /* retain */ false);
+
+    // Let MQTT client drain outbox between chunks.
+    vTaskDelay(pdMS_TO_TICKS(20));
+}
+
+static TaskHandle_t trace_dump_task;
+
+void trace_dump_thread(void *param) {
     for (;;) {
-        const char *topic = MQTT_TOPIC(MQTT_DEVICE_ID, "status");
+        // Requests received during a dump are merged into one more dump.
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        trace_dump(publish_trace_chunk, NULL);
+    }
+}
 
-        const char *status = "alive";
+void mqtt_trace_dump_topic_updated(
+    const char *topic, int topic_len,
+    const char *data,  int data_len
+) {
+    xTaskNotifyGive(trace_dump_task);
+}
 
-        struct timeval tv_now;
-        gettimeofday(&tv_now, NULL);
+void run_trace_dump_thread(void) {
+    static StackType_t stack[TRACE_DUMP_TASK_STACK_SIZE];
+    static StaticTask_t task;
 
-        int64_t uptime = UPTIME() - start_timestamp;
+    trace_dump_task = xTaskCreateStaticPinnedToCore(
+        trace_dump_thread,
+        "trace_dump",
+        TRACE_DUMP_TASK_STACK_SIZE,
+        NULL,
+        TRACE_DUMP_TASK_PRIORITY,
+        stack,
+        &task,
+        TRACE_DUMP_TASK_CORE
+    );
+}
+#endif
 
-        char message[128] = {0};
-        snprintf(
-            (char*)&message, sizeof(message),
-            "{\"status\": \"%s\", \"timestamp\": \"%lld\", \"uptime\": %lld}",
-            status, tv_now.tv_sec, uptime
+void publish_log_dump(const void *data, size_t len, void *arg) {
+    mqtt_publish_data(MQTT_TOPIC(MQTT_DEVICE_ID, "log"), data, len, /* qos */ 1, /* retain */ false);
+}
+
+void mqtt_log_dump_topic_updated(
+    const char *topic, int topic_len,
+    const char *data,  int data_len
+) {
+    dlog_dump(publish_log_dump, NULL);
+}
+
+void report_heap_violations(void) {
+    static uint32_t reported_violations = 0;
+
+    struct heap_guard_violation last;
+    uint32_t violations = heap_guard_violations(&last);
+    if (violations != reported_violations) {
+        ESP_LOGW(
+            TAG, "%lu heap allocations after setup, last one is %u bytes from task '%s'",
+            violations - reported_violations, last.size, pcTaskGetName(last.task)
         );
+        reported_violations = violations;
+    }
+}
+
+#define STATUS_INTERVAL_SEC  10
+// Liveness is tracked with presence topic and state with device shadow,
+// so unchanged status is sent rarely.
+#define STATUS_MAX_INTERVAL_SEC  (10 * 60)
+
+int format_status(enum payload_format format, uint8_t *message, size_t size) {
+    struct timeval tv_now;
+    gettimeofday(&tv_now, NULL);
+
+    int64_t uptime = UPTIME() - start_timestamp;
+
+    struct power_stats power;
+    power_get_stats(&power);
+
+    struct mqtt_tls_stats tls;
+    mqtt_tls_get_stats(&tls);
+
+    struct mqtt_stats mqtt;
+    mqtt_get_stats(&mqtt);
 
-        int ret = mqtt_publish(topic, message, /* qos */ 1, /* retain */ false);
+    struct batch_stats batch;
+    batch_get_stats(&batch);
+
+    struct event_loop_stats loop;
+    event_loop_get_stats(&loop);
+
+    struct broker_stats brokers;
+    broker_get_stats(&brokers);
+
+    struct netcache_stats net;
+    netcache_get_stats(&net);
+
+    struct event_handler_stats handlers[EVENT_HANDLERS_MAX];
+    int handlers_count = event_loop_get_handler_stats(handlers, sizeof(handlers) / sizeof(handlers[0]));
+
+    struct payload p;
+    payload_init(&p, format, message, size);
+    payload_map_begin(&p);
+
+    payload_key_text(&p, PAYLOAD_STATUS, "alive");
+    payload_key(&p, PAYLOAD_TIMESTAMP);
+    payload_timestamp(&p, tv_now.tv_sec);
+    payload_key_uint(&p, PAYLOAD_UPTIME, uptime);
+    payload_key_uint(&p, PAYLOAD_LOG_DROPPED, dlog_dropped());
+
+    payload_key_uint(&p, PAYLOAD_HEAP_FREE, esp_get_free_heap_size());
+    payload_key_uint(&p, PAYLOAD_HEAP_MIN_FREE, esp_get_minimum_free_heap_size());
+    payload_key_uint(&p, PAYLOAD_HEAP_VIOLATIONS, heap_guard_violations(NULL));
+
+    payload_key_uint(&p, PAYLOAD_WAKEUPS, power.wakeups);
+    payload_key_uint(&p, PAYLOAD_SLEPT_MS, power.slept_us / 1000);
+
+    payload_key_uint(&p, PAYLOAD_TLS_FULL, tls.full_handshakes);
+    payload_key_uint(&p, PAYLOAD_TLS_FULL_AVG_MS, tls.full_handshakes ? tls.full_total_us / tls.full_handshakes / 1000 : 0);
+    payload_key_uint(&p, PAYLOAD_TLS_RESUMED, tls.resumed_handshakes);
+    payload_key_uint(&p, PAYLOAD_TLS_RESUMED_AVG_MS, tls.resumed_handshakes ? tls.resumed_total_us / tls.resumed_handshakes / 1000 : 0);
+
+    payload_key_uint(&p, PAYLOAD_MQTT_PUBLISHED, mqtt.published);
+    payload_key_uint(&p, PAYLOAD_MQTT_PUBLISHED_BYTES, mqtt.published_bytes);
+    payload_key_uint(&p, PAYLOAD_MQTT_ROUND_TRIPS, mqtt.round_trips);
+    payload_key_uint(&p, PAYLOAD_MQTT_PUBLISH_MAX_US, mqtt.publish_block_max_us);
+    payload_key_uint(&p, PAYLOAD_MQTT_ENQUEUE_MAX_US, mqtt.enqueue_block_max_us);
+    payload_key_uint(&p, PAYLOAD_MQTT_UNDELIVERED, mqtt.delivery_failed);
+
+    payload_key(&p, PAYLOAD_FAST_START);
+    payload_bool(&p, net.is_fast_start);
+    payload_key_uint(&p, PAYLOAD_IP_READY_MS, net.ip_ready_ms);
+    payload_key_uint(&p, PAYLOAD_MQTT_READY_MS, mqtt.connected_ms);
+    payload_key_uint(&p, PAYLOAD_DNS_CACHE_HITS, net.dns_hits);
+
+    payload_key_text(&p, PAYLOAD_BROKER, brokers.candidates[brokers.active].name);
+    payload_key_uint(&p, PAYLOAD_BROKER_SWITCHES, brokers.switches);
+    payload_key(&p, PAYLOAD_BROKERS);
+    payload_array_begin(&p);
+    for (int i = 0; i < brokers.count; i++) {
+        const struct broker_candidate_stats *b = &brokers.candidates[i];
+
+        payload_map_begin(&p);
+        payload_key_text(&p, PAYLOAD_NAME, b->name);
+        payload_key(&p, PAYLOAD_HEALTHY);
+        payload_bool(&p, b->is_healthy);
+        payload_key_uint(&p, PAYLOAD_RTT_MS, b->rtt_ms);
+        payload_end(&p);
+    }
+    payload_end(&p);
+
+    payload_key_uint(&p, PAYLOAD_EVENTS, batch.events);
+    payload_key_uint(&p, PAYLOAD_EVENT_PUBLISHES, batch.publishes);
+
+    payload_key(&p, PAYLOAD_EVENT_LOOP);
+    payload_map_begin(&p);
+    payload_key_uint(&p, PAYLOAD_DROPPED, loop.dropped);
+    payload_key_uint(&p, PAYLOAD_DELAYED, loop.delayed);
+    payload_key_uint(&p, PAYLOAD_MAX_QUEUED, loop.max_queued);
+    payload_key(&p, PAYLOAD_HANDLERS);
+    payload_array_begin(&p);
+    for (int i = 0; i < handlers_count; i++) {
+        const struct event_handler_stats *h = &handlers[i];
+
+        payload_map_begin(&p);
+        payload_key_text(&p, PAYLOAD_NAME, h->name);
+        payload_key_uint(&p, PAYLOAD_CALLS, h->calls);
+        payload_key_uint(&p, PAYLOAD_DISPATCH_MAX_US, h->dispatch_max_us);
+        payload_key_uint(&p, PAYLOAD_EXEC_MAX_US, h->exec_max_us);
+        payload_key_uint(&p, PAYLOAD_AVG_US, h->calls ? h->exec_total_us / h->calls : 0);
+        payload_end(&p);
+    }
+    payload_end(&p);
+    payload_end(&p);
+
+    payload_key(&p, PAYLOAD_DOORS);
+    payload_array_begin(&p);
+
+    for (int i = 0; i < DOORS_COUNT; i++) {
+        const struct door *door = door_get(i);
+        uint32_t events = door->stats.events;
+
+        payload_map_begin(&p);
+        payload_key_text(&p, PAYLOAD_NAME, door->hw->name);
+        payload_key_uint(&p, PAYLOAD_EVENTS, events);
+        payload_key_uint(&p, PAYLOAD_AVG_US, events ? door->stats.total_us / events : 0);
+        payload_key_uint(&p, PAYLOAD_MAX_US, door->stats.max_us);
+        payload_key_uint(&p, PAYLOAD_MAX_QUEUED, door->stats.max_queued);
+        payload_key_uint(&p, PAYLOAD_WAKE_MAX_US, door->stats.wake_max_us);
+
+        payload_key(&p, PAYLOAD_INPUTS);
+        payload_array_begin(&p);
+        for (int j = 0; j < door->inputs_count; j++) {
+            const struct input *input = &door->inputs[j];
+            uint32_t frames = input->stats.frames;
+
+            payload_map_begin(&p);
+            payload_key_text(&p, PAYLOAD_NAME, input->driver->name);
+            payload_key_uint(&p, PAYLOAD_FRAMES, frames);
+            payload_key_uint(&p, PAYLOAD_RX_ERRORS, input->stats.errors);
+            payload_key_uint(&p, PAYLOAD_AVG_US, frames ? input->stats.decode_total_us / frames : 0);
+            payload_key_uint(&p, PAYLOAD_MAX_US, input->stats.decode_max_us);
+            payload_end(&p);
+        }
+        payload_end(&p);
+
+        const struct door_sensor_stats *sensor = &door->sensor.stats;
+        payload_key(&p, PAYLOAD_DOOR_OPEN);
+        payload_bool(&p, door->sensor.is_open);
+        payload_key_uint(&p, PAYLOAD_SENSOR_EVENTS, sensor->events);
+        payload_key_uint(&p, PAYLOAD_SENSOR_BOUNCES, sensor->bounces);
+        payload_key_uint(&p, PAYLOAD_SENSOR_AVG_US, sensor->events ? sensor->latency_total_us / sensor->events : 0);
+        payload_key_uint(&p, PAYLOAD_SENSOR_MAX_US, sensor->latency_max_us);
+        payload_end(&p);
+    }
+
+    payload_end(&p);
+    payload_end(&p);
+
+    int len = payload_finish(&p);
+    if (len < 0) {
+        ESP_LOGE(TAG, "Status does not fit %d bytes", size);
+    }
+
+    return len;
+}
+
+// Changes when something worth reporting happens. Counters which change all
+// the time, like uptime and free heap, are not included. Reported in device
+// shadow as metrics digest.
+uint32_t status_fingerprint(void) {
+    struct mqtt_stats mqtt;
+    mqtt_get_stats(&mqtt);
+
+    struct event_loop_stats loop;
+    event_loop_get_stats(&loop);
+
+    struct broker_stats brokers;
+    broker_get_stats(&brokers);
+
+    uint32_t counters[] = {
+        dlog_dropped(),
+        heap_guard_violations(NULL),
+        mqtt.delivery_failed,
+        loop.dropped,
+        brokers.switches,
+    };
+
+    uint32_t hash = 2166136261u;
+    for (int i = 0; i < sizeof(counters) / sizeof(counters[0]); i++) {
+        hash = (hash ^ counters[i]) * 16777619u;
+    }
+
+    for (int i = 0; i < DOORS_COUNT; i++) {
+        const struct door *door = door_get(i);
+        hash = (hash ^ door->stats.events) * 16777619u;
+        for (int j = 0; j < door->inputs_count; j++) {
+            hash = (hash ^ door->inputs[j].stats.errors) * 16777619u;
+        }
+        hash = (hash ^ door->sensor.stats.events) * 16777619u;
+    }
+
+    return hash;
+}
+
+void status_thread(void *param) {
+    const char *topic = MQTT_TOPIC(MQTT_DEVICE_ID, "status" PAYLOAD_TOPIC_SUFFIX);
+
+    // Published later from MQTT task in MQTT 5 mode, see mqtt_publish_aliased.
+    static uint8_t message[PAYLOAD_STATUS_SIZE];
+    uint32_t published_fingerprint = 0;
+    int64_t published_at = 0;
+    bool is_published = false;
+
+    for (;;) {
+        report_heap_violations();
+
+        uint32_t fingerprint = status_fingerprint();
+        shadow_set_metrics_digest(fingerprint);
+
+        bool is_changed = !is_published || fingerprint != published_fingerprint;
+        bool is_due = UPTIME() - published_at >= STATUS_MAX_INTERVAL_SEC;
+
+        if (!is_changed && !is_due) {
+            vTaskDelay(pdMS_TO_TICKS(STATUS_INTERVAL_SEC * 1000));
+            continue;
+        }
+
+        int ret = -1;
+        int len = format_status(PAYLOAD_FORMAT, message, sizeof(message));
+        if (len >= 0) {
+#ifdef USE_MQTT5
+            ret = mqtt_publish_aliased(topic, (const char *)message, len);
+#else
+            ret = mqtt_publish_data(topic, message, len, /* qos */ 1, /* retain */ false);
+#endif
+        }
         if (ret >= 0) {
-            vTaskDelay(pdMS_TO_TICKS(10 * 1000));
+            published_fingerprint = fingerprint;
+            published_at = UPTIME();
+            is_published = true;
+        }
+
+        if (ret >= 0) {
+            vTaskDelay(pdMS_TO_TICKS(STATUS_INTERVAL_SEC * 1000));
         } else {
             vTaskDelay(pdMS_TO_TICKS(MQTT_RECONNECT_DELAY_SEC * 1000));
         }
@@ -117,46 +577,41 @@ void status_thread(void *param) {
 }
 
 void run_status_thread(void) {
-    xTaskCreate(
+    static StackType_t stack[STATUS_TASK_STACK_SIZE];
+    static StaticTask_t task;
+
+    TaskHandle_t handle = xTaskCreateStaticPinnedToCore(
         status_thread,
         "lock_status",
-        4096,
+        STATUS_TASK_STACK_SIZE,
         NULL,
-        tskIDLE_PRIORITY,
-        NULL
+        STATUS_TASK_PRIORITY,
+        stack,
+        &task,
+        STATUS_TASK_CORE
     );
+    heap_guard_watch_task(handle);
 }
 
-void keypad_loop(void) {
-    uint8_t *buffer = (uint8_t*)malloc(KEYPAD_UART_BUFFER_SIZE);
-    int64_t last_input_timestamp = INT64_MAX;
-
-    for (;;) {
-        int len = uart_read_bytes(
-            KEYPAD_UART_NUM,
-            buffer,
-            KEYPAD_UART_BUFFER_SIZE,
-            pdMS_TO_TICKS(20)
-        );
-
-        // Reset keypad after inactivity before receiving new data.
-        if (len == 0) {
-            bool keypad_used = last_input_timestamp != INT64_MAX;
-            int64_t inaction_time = esp_timer_get_time() - last_input_timestamp;
-            int64_t us_to_reset = 30 * 1000 * 1000;  // 30 seconds
-
-            if (keypad_used && inaction_time >= us_to_reset) {
-                ESP_LOGD(TAG, "Reset keypad after 30 seconds of inactivity");
-                keypad_reset();
-                last_input_timestamp = INT64_MAX;
-            }
+void keypad_thread(void *param) {
+    doors_loop();
+}
 
-            continue;
-        }
+void run_keypad_thread(void) {
+    static StackType_t stack[KEYPAD_TASK_STACK_SIZE];
+    static StaticTask_t task;
 
-        keypad_process((char*)buffer, len);
-        last_input_timestamp = esp_timer_get_time();
-    }
+    TaskHandle_t handle = xTaskCreateStaticPinnedToCore(
+        keypad_thread,
+        "keypad",
+        KEYPAD_TASK_STACK_SIZE,
+        NULL,
+        KEYPAD_TASK_PRIORITY,
+        stack,
+        &task,
+        KEYPAD_TASK_CORE
+    );
+    heap_guard_watch_task(handle);
 }
 
 void app_main(void) {
@@ -164,9 +619,14 @@ void app_main(void) {
 
     save_start_timestamp();
     setup_timezone();
+    dlog_init();
 
+    storage_init();
     hardware_setup();
+    power_init();
+    schedule_init();
 
+    netcache_init();
     ntp_init();
 
 #ifdef USE_WIFI
@@ -177,16 +637,55 @@ void app_main(void) {
 
     // TODO: wait first connect before trying to connect to mqtt server.
     mqtt_init();
-    mqtt_subscribe(MQTT_TOPIC(MQTT_DEVICE_ID, "lock"), /* qos */ 1, mqtt_lock_topic_updated);
-    run_status_thread();
+    broker_init();
+    mqtt_subscribe(MQTT_TOPIC(MQTT_DEVICE_ID, "schedule"), /* qos */ 1, mqtt_schedule_topic_updated);
+    mqtt_subscribe(MQTT_TOPIC(MQTT_DEVICE_ID, "log/dump"), /* qos */ 1, mqtt_log_dump_topic_updated);
+    coredump_init();
+#ifdef USE_TRACE
+    run_trace_dump_thread();
+    mqtt_subscribe(MQTT_TOPIC(MQTT_DEVICE_ID, "trace/dump"), /* qos */ 1, mqtt_trace_dump_topic_updated);
+#endif
 
-    indicator_init();
+    event_loop_init();
+    event_loop_register(EVENT_KEYPAD_COMMAND, "command", command_handler, NULL);
+    event_loop_register(EVENT_OTP_RESULT, "checkin_done", checkin_done, NULL);
+    event_loop_register(EVENT_ALARM, "alarm", alarm_handler, NULL);
+    event_loop_register(EVENT_DOOR_SENSOR, "door_sensor", door_sensor_handler, NULL);
 
-    keypad_init((struct keypad_callbacks) {
+    otp_worker_init();
+    batch_init();
+
+    doors_init((struct keypad_callbacks) {
         .command = command,
         .checkin = checkin,
         .alarm   = alarm
     });
 
-    keypad_loop();
+    for (int i = 0; i < DOORS_COUNT; i++) {
+        mqtt_subscribe(door_get(i)->topics.lock, /* qos */ 1, mqtt_lock_topic_updated);
+    }
+    unlock_init();
+    // Fetch commands are verified by unlock.
+    ota_init();
+    history_init();
+
+    shadow_init();
+    run_status_thread();
+
+#ifdef USE_LOCAL_HTTP
+    http_init((struct http_callbacks) {
+        .format_status = format_status,
+    });
+#endif
+
+    indicator_init();
+
+    run_keypad_thread();
+
+#ifdef USE_SOAK
+    soak_init();
+#endif
+
+    // All lock buffers, stacks and queues are allocated by now.
+    heap_guard_seal();
 }
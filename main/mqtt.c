@@ -2,12 +2,82 @@
 
 #include <esp_log.h>
 #include <esp_err.h>
+#include <esp_timer.h>
 #include <mqtt_client.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <freertos/queue.h>
 
 #include "config.h"
+#include "hardware.h"
+#include "tasks.h"
+#include "trace.h"
+#include "dlog.h"
+#include "heap_guard.h"
+#include "mqtt_tls.h"
+#include "soak.h"
 
 #define TAG "mqtt"
 
+// Messages larger than client buffer are delivered in chunks and reassembled here.
+#define MQTT_MESSAGE_MAX_SIZE  (12 * 1024)
+#define MQTT_TOPIC_MAX_SIZE    128
+
+// Retained "online" is published on connect, broker publishes "offline" as Last Will.
+#define MQTT_PRESENCE_TOPIC    MQTT_TOPIC(MQTT_DEVICE_ID, "presence")
+
+// Mosquitto accepts 10 aliases by default (max_topic_alias).
+#define MQTT_TOPIC_ALIASES_MAX 8
+
+// Topics subscribed by lock modules: schedule, log/dump, ota, ota/fetch,
+// coredump/dump, unlock, history/query, shadow/set, trace/dump and a lock
+// topic per door. MQTT_SUBSCRIPTIONS_LIMIT of config.h may only add room,
+// configs written before these modules set it to 1.
+#ifdef USE_TRACE
+#define MQTT_SUBSCRIPTIONS_BUILTIN  (9 + DOORS_COUNT)
+#else
+#define MQTT_SUBSCRIPTIONS_BUILTIN  (8 + DOORS_COUNT)
+#endif
+
+#if MQTT_SUBSCRIPTIONS_LIMIT > MQTT_SUBSCRIPTIONS_BUILTIN
+#define MQTT_SUBSCRIPTIONS_MAX      MQTT_SUBSCRIPTIONS_LIMIT
+#else
+#define MQTT_SUBSCRIPTIONS_MAX      MQTT_SUBSCRIPTIONS_BUILTIN
+#endif
+
+// Slots of mqtt_enqueue_data, the largest enqueued message is a batch of events.
+#define MQTT_OUTBOX_SLOTS      8
+#define MQTT_OUTBOX_SLOT_SIZE  1024
+
+enum mqtt_outbox_slot_state {
+    MQTT_OUTBOX_SLOT_FREE,
+    // Waits in outbox queue for outbox task.
+    MQTT_OUTBOX_SLOT_QUEUED,
+    // Stored in client outbox, waits for broker acknowledgement.
+    MQTT_OUTBOX_SLOT_PENDING,
+};
+
+struct mqtt_outbox_slot {
+    enum mqtt_outbox_slot_state state;
+    int msg_id;
+
+    const char *topic;
+    int qos;
+    int retain;
+    mqtt_delivery_cb_t callback;
+    void *arg;
+
+    int data_len;
+    uint8_t data[MQTT_OUTBOX_SLOT_SIZE];
+};
+
+struct mqtt_topic_alias {
+    const char *topic;
+    // Alias is known to server only after the first publish with full topic
+    // on the current connection.
+    bool is_sent;
+};
+
 struct mqtt_subscription {
     const char *topic;
     int qos;
@@ -16,14 +86,155 @@ struct mqtt_subscription {
 
 static struct {
     esp_mqtt_client_handle_t client;
+    // TLS transport of mqtts:// brokers, NULL for others.
+    esp_transport_handle_t transport;
     bool connected;
 
-    struct mqtt_subscription subscriptions[MQTT_SUBSCRIPTIONS_LIMIT];
+    struct mqtt_subscription subscriptions[MQTT_SUBSCRIPTIONS_MAX];
     int subs_count;
-} mqtt = {0};
+
+    char message_topic[MQTT_TOPIC_MAX_SIZE];
+    int message_topic_len;
+    char message[MQTT_MESSAGE_MAX_SIZE];
+
+    // Used only from MQTT task.
+    struct mqtt_topic_alias aliases[MQTT_TOPIC_ALIASES_MAX];
+    int aliases_count;
+    bool aliases_rejected;
+
+    // Slot states are guarded by spinlock, slot data is owned by the task
+    // which moved it out of free state.
+    portMUX_TYPE outbox_spinlock;
+    struct mqtt_outbox_slot outbox[MQTT_OUTBOX_SLOTS];
+    // Indexes of queued slots, keeps publish order.
+    QueueHandle_t outbox_queue;
+
+    struct mqtt_stats stats;
+} mqtt = {
+    .outbox_spinlock = portMUX_INITIALIZER_UNLOCKED,
+};
+
+static int varint_size(int value) {
+    int size = 1;
+    while (value >= 128) {
+        value /= 128;
+        size++;
+    }
+    return size;
+}
+
+// Size of PUBLISH packet on the wire, MQTT 3.1.1 section 3.3 and MQTT 5.0 section 3.3.
+static int mqtt_publish_packet_size(int topic_len, int data_len, int qos, int properties_len) {
+    int remaining_len = 2 + topic_len + (qos > 0 ? 2 : 0) + data_len;
+#ifdef USE_MQTT5
+    remaining_len += varint_size(properties_len) + properties_len;
+#endif
+    return 1 + varint_size(remaining_len) + remaining_len;
+}
+
+static void mqtt_count_publish(int topic_len, int data_len, int qos, int properties_len) {
+    mqtt.stats.published += 1;
+    mqtt.stats.round_trips += qos;
+    mqtt.stats.published_bytes += mqtt_publish_packet_size(topic_len, data_len, qos, properties_len);
+}
+
+static void mqtt_update_block_max(uint32_t *max_us, int64_t start) {
+    uint32_t elapsed_us = esp_timer_get_time() - start;
+    if (elapsed_us > *max_us) {
+        *max_us = elapsed_us;
+    }
+}
+
+static void mqtt_outbox_complete(struct mqtt_outbox_slot *slot, enum mqtt_delivery result) {
+    mqtt_delivery_cb_t callback = slot->callback;
+    void *arg = slot->arg;
+
+    if (result == MQTT_DELIVERY_FAILED) {
+        mqtt.stats.delivery_failed += 1;
+    }
+
+    taskENTER_CRITICAL(&mqtt.outbox_spinlock);
+    slot->state = MQTT_OUTBOX_SLOT_FREE;
+    taskEXIT_CRITICAL(&mqtt.outbox_spinlock);
+
+    if (callback != NULL) {
+        callback(result, arg);
+    }
+}
+
+// Runs in MQTT task on MQTT_EVENT_PUBLISHED and MQTT_EVENT_DELETED.
+static void mqtt_outbox_handle_result(int msg_id, enum mqtt_delivery result) {
+    struct mqtt_outbox_slot *slot = NULL;
+
+    taskENTER_CRITICAL(&mqtt.outbox_spinlock);
+    for (int i = 0; i < MQTT_OUTBOX_SLOTS; i++) {
+        if (mqtt.outbox[i].state == MQTT_OUTBOX_SLOT_PENDING && mqtt.outbox[i].msg_id == msg_id) {
+            slot = &mqtt.outbox[i];
+            break;
+        }
+    }
+    taskEXIT_CRITICAL(&mqtt.outbox_spinlock);
+
+    // Message was published with mqtt_publish_data.
+    if (slot == NULL) return;
+
+    if (result == MQTT_DELIVERY_FAILED) {
+        ESP_LOGW(TAG, "Message to topic '%s' expired in outbox", slot->topic);
+    }
+
+    mqtt_outbox_complete(slot, result);
+}
+
+// Client API lock is held by MQTT task while it writes to socket, so even
+// esp_mqtt_client_enqueue may wait for the network. This task takes these
+// waits instead of the callers of mqtt_enqueue_data. It runs above MQTT task
+// on the same core, so message id is recorded before MQTT task can handle
+// the acknowledgement.
+static void mqtt_outbox_thread(void *param) {
+    for (;;) {
+        uint8_t index;
+        xQueueReceive(mqtt.outbox_queue, &index, portMAX_DELAY);
+
+        struct mqtt_outbox_slot *slot = &mqtt.outbox[index];
+
+        // Client does not keep qos 0 messages for the next connection.
+        int msg_id = -1;
+        if (mqtt.connected || slot->qos > 0) {
+            // Client allocates outbox entry for every message.
+            heap_guard_allow_begin();
+            TRACE_BEGIN("mqtt_enqueue");
+            msg_id = esp_mqtt_client_enqueue(
+                mqtt.client, slot->topic,
+                (const char *)slot->data, slot->data_len,
+                slot->qos, slot->retain, /* store */ true
+            );
+            TRACE_END("mqtt_enqueue");
+            heap_guard_allow_end();
+        }
+
+        if (msg_id < 0) {
+            ESP_LOGE(TAG, "Failed to enqueue %d bytes to topic '%s'", slot->data_len, slot->topic);
+            mqtt_outbox_complete(slot, MQTT_DELIVERY_FAILED);
+            continue;
+        }
+
+        mqtt_count_publish(strlen(slot->topic), slot->data_len, slot->qos, 0);
+        DLOGD(TAG, "Enqueued %d bytes from outbox slot %d with qos=%d", slot->data_len, index, slot->qos);
+
+        if (slot->qos == 0) {
+            mqtt_outbox_complete(slot, MQTT_DELIVERY_SENT);
+            continue;
+        }
+
+        taskENTER_CRITICAL(&mqtt.outbox_spinlock);
+        slot->msg_id = msg_id;
+        slot->state = MQTT_OUTBOX_SLOT_PENDING;
+        taskEXIT_CRITICAL(&mqtt.outbox_spinlock);
+    }
+}
 
 void subscribe_mqtt_topics() {
-    for (int i = 0; i < MQTT_SUBSCRIPTIONS_LIMIT; i++) {
+    for (int i = 0; i < MQTT_SUBSCRIPTIONS_MAX; i++) {
         struct mqtt_subscription sub = mqtt.subscriptions[i];
         if (sub.topic == NULL) break;
 
@@ -40,7 +251,7 @@ void notify_mqtt_subscriber(
     const char *topic, int topic_len,
     const char *data,  int data_len
 ) {
-    for (int i = 0; i < MQTT_SUBSCRIPTIONS_LIMIT; i++) {
+    for (int i = 0; i < MQTT_SUBSCRIPTIONS_MAX; i++) {
         struct mqtt_subscription sub = mqtt.subscriptions[i];
         if (sub.topic == NULL) break;
 
@@ -54,6 +265,114 @@ void notify_mqtt_subscriber(
     }
 }
 
+void handle_mqtt_data(esp_mqtt_event_handle_t event) {
+    if (event->current_data_offset == 0 && event->data_len == event->total_data_len) {
+        notify_mqtt_subscriber(
+            event->topic, event->topic_len,
+            event->data,  event->data_len
+        );
+        return;
+    }
+
+    // Topic is present only in the first chunk.
+    if (event->current_data_offset == 0) {
+        if (event->total_data_len > MQTT_MESSAGE_MAX_SIZE || event->topic_len > MQTT_TOPIC_MAX_SIZE) {
+            ESP_LOGE(TAG, "Dropping message of %d bytes, it is too large", event->total_data_len);
+            mqtt.message_topic_len = 0;
+            return;
+        }
+
+        memcpy(mqtt.message_topic, event->topic, event->topic_len);
+        mqtt.message_topic_len = event->topic_len;
+    }
+
+    if (mqtt.message_topic_len == 0) {
+        return;
+    }
+
+    memcpy(mqtt.message + event->current_data_offset, event->data, event->data_len);
+
+    if (event->current_data_offset + event->data_len == event->total_data_len) {
+        notify_mqtt_subscriber(
+            mqtt.message_topic, mqtt.message_topic_len,
+            mqtt.message,       event->total_data_len
+        );
+        mqtt.message_topic_len = 0;
+    }
+}
+
+#ifdef USE_MQTT5
+static void mqtt_reset_topic_aliases(void) {
+    for (int i = 0; i < mqtt.aliases_count; i++) {
+        mqtt.aliases[i].is_sent = false;
+    }
+    mqtt.aliases_rejected = false;
+}
+
+// Returns 0 if there is no free alias for the topic.
+static uint16_t mqtt_find_topic_alias(const char *topic) {
+    for (int i = 0; i < mqtt.aliases_count; i++) {
+        if (mqtt.aliases[i].topic == topic) {
+            return i + 1;
+        }
+    }
+
+    if (mqtt.aliases_count == MQTT_TOPIC_ALIASES_MAX) {
+        return 0;
+    }
+
+    mqtt.aliases[mqtt.aliases_count].topic = topic;
+    mqtt.aliases[mqtt.aliases_count].is_sent = false;
+    mqtt.aliases_count++;
+
+    return mqtt.aliases_count;
+}
+
+// Runs in MQTT task. Publish property is stored in client until the next
+// publish, so it is set and used only here, where no other task can publish
+// in between.
+static void handle_mqtt_aliased_publish(esp_mqtt_event_handle_t event) {
+    const char *topic = event->topic;
+    uint16_t alias = mqtt.aliases_rejected ? 0 : mqtt_find_topic_alias(topic);
+    bool is_alias_sent = alias != 0 && mqtt.aliases[alias - 1].is_sent;
+
+    if (alias != 0) {
+        const esp_mqtt5_publish_property_config_t property = {
+            .topic_alias = alias,
+        };
+        esp_mqtt5_client_set_publish_property(mqtt.client, &property);
+    }
+
+    // Once server knows the alias, topic is sent empty.
+    const char *wire_topic = is_alias_sent ? "" : topic;
+
+    TRACE_BEGIN("mqtt_publish");
+    int status = esp_mqtt_client_publish(mqtt.client, wire_topic, event->data, event->data_len, /* qos */ 0, /* retain */ false);
+    TRACE_END("mqtt_publish");
+
+    if (status < 0 && alias != 0) {
+        // Server allows less aliases than we use, stop using them until reconnect.
+        ESP_LOGW(TAG, "Server rejected topic alias %d, aliases are disabled", alias);
+        mqtt.aliases_rejected = true;
+        status = esp_mqtt_client_publish(mqtt.client, topic, event->data, event->data_len, /* qos */ 0, /* retain */ false);
+        alias = 0;
+    }
+
+    if (status < 0) {
+        DLOGE(TAG, "Failed to publish %d bytes to topic '%s'", event->data_len, topic);
+        return;
+    }
+
+    if (alias != 0) {
+        mqtt.aliases[alias - 1].is_sent = true;
+    }
+
+    // Topic alias property takes 3 bytes.
+    mqtt_count_publish(strlen(wire_topic), event->data_len, /* qos */ 0, alias != 0 ? 3 : 0);
+    DLOGD(TAG, "Successfully publish %d bytes to topic '%s' with alias %d", event->data_len, topic, alias);
+}
+#endif
+
 void mqtt_event_handler(
     void* event_handler_arg,
     esp_event_base_t event_base,
@@ -66,13 +385,23 @@ void mqtt_event_handler(
     {
     case MQTT_EVENT_CONNECTED:
         ESP_LOGI(TAG, "Client connected to server");
+        TRACE_INSTANT("mqtt_connected");
         mqtt.connected = true;
+        if (mqtt.stats.connected_ms == 0) {
+            mqtt.stats.connected_ms = esp_timer_get_time() / 1000;
+            ESP_LOGI(TAG, "First connection in %lu ms", mqtt.stats.connected_ms);
+        }
+#ifdef USE_MQTT5
+        mqtt_reset_topic_aliases();
+#endif
+        mqtt_publish(MQTT_PRESENCE_TOPIC, "online", /* qos */ 1, /* retain */ true);
         subscribe_mqtt_topics();
         break;
     case MQTT_EVENT_DISCONNECTED:
         // MQTT client emit disconnected event even after unsuccessful reconnects.
         if (mqtt.connected) {
             ESP_LOGW(TAG, "Client disconnected from server");
+            TRACE_INSTANT("mqtt_disconnected");
             mqtt.connected = false;
         }
         break;
@@ -82,53 +411,142 @@ void mqtt_event_handler(
         }
         break;
     case MQTT_EVENT_DATA:
-        notify_mqtt_subscriber(
-            event->topic, event->topic_len,
-            event->data,  event->data_len
-        );
+        handle_mqtt_data(event);
+        break;
+    case MQTT_EVENT_PUBLISHED:
+        mqtt_outbox_handle_result(event->msg_id, MQTT_DELIVERY_ACKED);
+        break;
+    case MQTT_EVENT_DELETED:
+        mqtt_outbox_handle_result(event->msg_id, MQTT_DELIVERY_FAILED);
         break;
+#ifdef USE_MQTT5
+    case MQTT_USER_EVENT:
+        handle_mqtt_aliased_publish(event);
+        break;
+#endif
     default:
         ESP_LOGD(TAG, "Unhandled MQTT event %d", event_id);
         break;
     }
 }
 
-void mqtt_init(void) {
-    const esp_mqtt_client_config_t mqtt_cfg = {
-        .broker.address.uri = MQTT_URI,
+static void mqtt_outbox_init(void) {
+    static uint8_t queue_storage[MQTT_OUTBOX_SLOTS];
+    static StaticQueue_t queue;
+    static StackType_t stack[MQTT_OUTBOX_TASK_STACK_SIZE];
+    static StaticTask_t task;
+
+    mqtt.outbox_queue = xQueueCreateStatic(MQTT_OUTBOX_SLOTS, sizeof(uint8_t), queue_storage, &queue);
+
+    TaskHandle_t handle = xTaskCreateStaticPinnedToCore(
+        mqtt_outbox_thread,
+        "mqtt_outbox",
+        MQTT_OUTBOX_TASK_STACK_SIZE,
+        NULL,
+        MQTT_OUTBOX_TASK_PRIORITY,
+        stack,
+        &task,
+        MQTT_OUTBOX_TASK_CORE
+    );
+    heap_guard_watch_task(handle);
+}
+
+static esp_mqtt_client_config_t mqtt_client_config(const char *uri) {
+    return (esp_mqtt_client_config_t) {
+        .broker.address.uri = uri,
         .credentials.client_id = "xecut-lock-" MQTT_DEVICE_ID,
+#ifdef USE_MQTT5
+        .session.protocol_ver = MQTT_PROTOCOL_V_5,
+#else
         .session.protocol_ver = MQTT_PROTOCOL_V_3_1_1,
+#endif
+        .session.last_will = {
+            .topic = MQTT_PRESENCE_TOPIC,
+            .msg = "offline",
+            .qos = 1,
+            .retain = true,
+        },
         .network.reconnect_timeout_ms = MQTT_RECONNECT_DELAY_SEC * 1000,
+        .network.transport = mqtt.transport,
+        .task.priority = MQTT_TASK_PRIORITY,
+        .task.stack_size = MQTT_TASK_STACK_SIZE,
     };
+}
+
+void mqtt_init(void) {
+    mqtt_outbox_init();
+
+    if (strncmp(MQTT_URI, "mqtts://", strlen("mqtts://")) == 0) {
+        mqtt.transport = mqtt_tls_init();
+    }
+
+    esp_mqtt_client_config_t mqtt_cfg = mqtt_client_config(MQTT_URI);
+
     mqtt.client = esp_mqtt_client_init(&mqtt_cfg);
     esp_mqtt_client_register_event(mqtt.client, ESP_EVENT_ANY_ID, mqtt_event_handler, NULL);
     esp_mqtt_client_start(mqtt.client);
 }
 
+void mqtt_set_broker(const char *uri) {
+    // Graceful disconnect suppresses Last Will, so presence is cleared here.
+    if (mqtt.connected) {
+        esp_mqtt_client_publish(mqtt.client, MQTT_PRESENCE_TOPIC, "offline", 0, /* qos */ 0, /* retain */ true);
+    }
+
+    // Client restarts its task and parses the new URI, both allocate.
+    heap_guard_allow_begin();
+    esp_mqtt_client_stop(mqtt.client);
+    mqtt.connected = false;
+
+    esp_mqtt_client_config_t mqtt_cfg = mqtt_client_config(uri);
+    esp_mqtt_set_config(mqtt.client, &mqtt_cfg);
+    esp_mqtt_client_start(mqtt.client);
+    heap_guard_allow_end();
+}
+
+bool mqtt_is_connected(void) {
+    return mqtt.connected;
+}
+
 void *mqtt_get_client(void) {
     return mqtt.client;
 }
 
 int mqtt_publish(const char *topic, const char *payload, int qos, int retain) {
+    return mqtt_publish_data(topic, payload, strlen(payload), qos, retain);
+}
+
+int mqtt_publish_data(const char *topic, const void *data, int data_len, int qos, int retain) {
     if (!mqtt.connected) {
-        ESP_LOGE(
-            TAG, "Unable to publish message '%s' to topic '%s' without connection to server",
-            topic, payload
+        DLOGE(
+            TAG, "Unable to publish %d bytes to topic '%s' without connection to server",
+            data_len, topic
         );
         return -1;
     }
 
-    int status = esp_mqtt_client_publish(mqtt.client, topic, payload, 0, qos, retain);
+    int64_t start = esp_timer_get_time();
+
+    // Client allocates outbox entry for every message with qos > 0.
+    heap_guard_allow_begin();
+    TRACE_BEGIN("mqtt_publish");
+    int status = esp_mqtt_client_publish(mqtt.client, topic, data, data_len, qos, retain);
+    TRACE_END("mqtt_publish");
+    heap_guard_allow_end();
+
+    mqtt_update_block_max(&mqtt.stats.publish_block_max_us, start);
+    SOAK_RECORD(SOAK_MQTT_PUBLISH, start);
     if (status >= 0) {
-        ESP_LOGD(
-            TAG, "Successfully publish message '%s' to topic '%s' with qos=%d, retain=%d",
-            topic, payload,
+        mqtt_count_publish(strlen(topic), data_len, qos, 0);
+        DLOGD(
+            TAG, "Successfully publish %d bytes to topic '%s' with qos=%d, retain=%d",
+            data_len, topic,
             qos, retain
         );
     } else {
-        ESP_LOGE(
-            TAG, "Failed to publish message '%s' to topic '%s': %s",
-            topic, payload,
+        DLOGE(
+            TAG, "Failed to publish %d bytes to topic '%s': %s",
+            data_len, topic,
             status == -1 ? "unknown error" : "full outbox"
         );
     }
@@ -136,8 +554,86 @@ int mqtt_publish(const char *topic, const char *payload, int qos, int retain) {
     return status;
 }
 
+int mqtt_enqueue_data(
+    const char *topic, const void *data, int data_len, int qos, int retain,
+    mqtt_delivery_cb_t callback, void *arg
+) {
+    int64_t start = esp_timer_get_time();
+
+    if (data_len > MQTT_OUTBOX_SLOT_SIZE) {
+        ESP_LOGE(TAG, "Message of %d bytes to topic '%s' does not fit outbox slot", data_len, topic);
+        return -1;
+    }
+
+    struct mqtt_outbox_slot *slot = NULL;
+
+    taskENTER_CRITICAL(&mqtt.outbox_spinlock);
+    for (int i = 0; i < MQTT_OUTBOX_SLOTS; i++) {
+        if (mqtt.outbox[i].state == MQTT_OUTBOX_SLOT_FREE) {
+            slot = &mqtt.outbox[i];
+            slot->state = MQTT_OUTBOX_SLOT_QUEUED;
+            break;
+        }
+    }
+    taskEXIT_CRITICAL(&mqtt.outbox_spinlock);
+
+    if (slot == NULL) {
+        ESP_LOGE(TAG, "Unable to enqueue %d bytes to topic '%s': all outbox slots are busy", data_len, topic);
+        mqtt.stats.delivery_failed += 1;
+        return -1;
+    }
+
+    slot->topic = topic;
+    slot->qos = qos;
+    slot->retain = retain;
+    slot->callback = callback;
+    slot->arg = arg;
+    slot->data_len = data_len;
+    memcpy(slot->data, data, data_len);
+
+    // Queue is as long as outbox, so it always has room for the slot.
+    uint8_t index = slot - mqtt.outbox;
+    xQueueSend(mqtt.outbox_queue, &index, 0);
+
+    mqtt_update_block_max(&mqtt.stats.enqueue_block_max_us, start);
+
+    return 0;
+}
+
+#ifdef USE_MQTT5
+int mqtt_publish_aliased(const char *topic, const char *data, int data_len) {
+    if (!mqtt.connected) {
+        DLOGE(
+            TAG, "Unable to publish %d bytes to topic '%s' without connection to server",
+            data_len, topic
+        );
+        return -1;
+    }
+
+    esp_mqtt_event_t event = {
+        .topic = (char *)topic,
+        .data = (char *)data,
+        .data_len = data_len,
+    };
+
+    // Event loop copies the event to heap.
+    heap_guard_allow_begin();
+    esp_err_t ret = esp_mqtt_dispatch_custom_event(mqtt.client, &event);
+    heap_guard_allow_end();
+
+    return ret == ESP_OK ? 0 : -1;
+}
+#endif
+
+void mqtt_get_stats(struct mqtt_stats *stats) {
+    *stats = mqtt.stats;
+}
+
 int mqtt_subscribe(const char *topic, int qos, mqtt_topic_updated_handler_t callback) {
-    if (mqtt.subs_count == MQTT_SUBSCRIPTIONS_LIMIT) return 1;
+    if (mqtt.subs_count == MQTT_SUBSCRIPTIONS_MAX) {
+        ESP_LOGE(TAG, "Unable to subscribe to topic '%s', increase MQTT_SUBSCRIPTIONS_LIMIT", topic);
+        return 1;
+    }
 
     mqtt.subscriptions[mqtt.subs_count].topic = topic;
     mqtt.subscriptions[mqtt.subs_count].qos = qos;
@@ -1,6 +1,19 @@
 #pragma once
 
-#define MQTT_TOPIC(device_id, topic) ("xecut-lock/" device_id "/" topic)
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "config.h"
+
+// Soak test mirrors the whole topic tree, so backends never see synthetic
+// checkins and commands meant for the door in service never reach it.
+#ifdef USE_SOAK
+#define MQTT_TOPIC_ROOT "xecut-lock-soak/"
+#else
+#define MQTT_TOPIC_ROOT "xecut-lock/"
+#endif
+
+#define MQTT_TOPIC(device_id, topic) (MQTT_TOPIC_ROOT device_id "/" topic)
 
 typedef void (*mqtt_topic_updated_handler_t)(
     const char *topic, int topic_len,
@@ -9,8 +22,62 @@ typedef void (*mqtt_topic_updated_handler_t)(
 
 void mqtt_init(void);
 
+// Reconnects to another broker, see broker.c. Must use the scheme of
+// MQTT_URI, because TLS transport is set up once. Not called from MQTT task.
+void mqtt_set_broker(const char *uri);
+
+bool mqtt_is_connected(void);
+
 void *mqtt_get_client(void);
 
+// Topic must be a static string, it is logged by pointer.
 int mqtt_publish(const char *topic, const char *payload, int qos, int retain);
 
+int mqtt_publish_data(const char *topic, const void *data, int data_len, int qos, int retain);
+
+enum mqtt_delivery {
+    // Qos 0 message is handed to client, broker does not acknowledge it.
+    MQTT_DELIVERY_SENT,
+    // Broker acknowledged qos 1 or 2 message.
+    MQTT_DELIVERY_ACKED,
+    // Client failed to send the message, or dropped it from outbox after
+    // retrying.
+    MQTT_DELIVERY_FAILED,
+};
+
+// Called from MQTT task or outbox task, must not block.
+typedef void (*mqtt_delivery_cb_t)(enum mqtt_delivery result, void *arg);
+
+// Copies the message into a preallocated outbox slot and returns at once,
+// outbox task hands it to MQTT client, see mqtt_outbox_thread. Never waits for
+// the network, so it is used from keypad task. Messages with qos > 0 are kept
+// in client outbox while disconnected. Returns -1 without calling callback if
+// all slots are busy. Callback may be NULL.
+int mqtt_enqueue_data(
+    const char *topic, const void *data, int data_len, int qos, int retain,
+    mqtt_delivery_cb_t callback, void *arg
+);
+
+#ifdef USE_MQTT5
+// Publishes with qos 0 using a topic alias. Publish happens later in MQTT
+// task, so topic and data must stay valid after return.
+int mqtt_publish_aliased(const char *topic, const char *data, int data_len);
+#endif
+
+// Estimated from packet sizes of successful publishes.
+struct mqtt_stats {
+    uint32_t published;
+    uint64_t published_bytes;
+    // Waits for broker acknowledgement, one per qos 1 publish and two per qos 2.
+    uint32_t round_trips;
+    // Worst time a caller spent in mqtt_publish_data and mqtt_enqueue_data.
+    uint32_t publish_block_max_us;
+    uint32_t enqueue_block_max_us;
+    uint32_t delivery_failed;
+    // Boot to the first connection, 0 until connected.
+    uint32_t connected_ms;
+};
+
+void mqtt_get_stats(struct mqtt_stats *stats);
+
 int mqtt_subscribe(const char *topic, int qos, mqtt_topic_updated_handler_t callback);
@@ -0,0 +1,438 @@
+#include "mqtt_tls.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <string.h>
+#include <esp_err.h>
+#include <esp_log.h>
+#include <esp_random.h>
+#include <esp_timer.h>
+#include <esp_crt_bundle.h>
+#include <lwip/sockets.h>
+#include <lwip/netdb.h>
+#include <mbedtls/ssl.h>
+#include <mbedtls/net_sockets.h>
+#include <mbedtls/x509_crt.h>
+
+#include "config.h"
+#include "storage.h"
+#include "trace.h"
+
+#define TAG "mqtt_tls"
+
+#define MQTT_TLS_DEFAULT_PORT     8883
+#define MQTT_TLS_NVS_NAMESPACE    "mqtt_tls"
+#define MQTT_TLS_NVS_KEY          "session"
+// Serialized session includes peer certificate.
+#define MQTT_TLS_SESSION_MAX_SIZE 3072
+#define MQTT_TLS_MASTER_SIZE      48
+
+// Saved session contains its master secret, which decrypts recorded traffic
+// of every connection resumed from it, so it is written only to encrypted
+// NVS. Otherwise sessions live in RAM and the first connect after a reboot
+// is a full handshake.
+#ifdef CONFIG_NVS_ENCRYPTION
+#define MQTT_TLS_PERSIST_SESSION
+#endif
+
+#ifdef USE_MQTT_TLS_CA
+static const uint8_t mqtt_ca_pem[] = {
+    #embed "../private/mqtt_ca.pem"
+    , 0
+};
+#endif
+
+// AES and SHA run on hardware accelerators, ECDHE and RSA use hardware MPI.
+static const int ciphersuites[] = {
+    MBEDTLS_TLS_ECDHE_ECDSA_WITH_AES_128_GCM_SHA256,
+    MBEDTLS_TLS_ECDHE_RSA_WITH_AES_128_GCM_SHA256,
+    MBEDTLS_TLS_ECDHE_ECDSA_WITH_AES_256_GCM_SHA384,
+    MBEDTLS_TLS_ECDHE_RSA_WITH_AES_256_GCM_SHA384,
+    0
+};
+
+// Persisted as is, master secret goes first to tell resumed handshakes apart.
+struct mqtt_tls_saved_session {
+    uint8_t master[MQTT_TLS_MASTER_SIZE];
+    uint8_t session[MQTT_TLS_SESSION_MAX_SIZE];
+};
+
+static struct {
+    int sock;
+
+    mbedtls_ssl_context ssl;
+    mbedtls_ssl_config conf;
+#ifdef USE_MQTT_TLS_CA
+    mbedtls_x509_crt ca;
+#endif
+
+    // Session to resume and master secret it was created with. Resumed
+    // handshake reuses master secret, full handshake creates a new one.
+    mbedtls_ssl_session session;
+    bool has_session;
+    uint8_t master[MQTT_TLS_MASTER_SIZE];
+    uint8_t handshake_master[MQTT_TLS_MASTER_SIZE];
+
+#ifdef MQTT_TLS_PERSIST_SESSION
+    struct mqtt_tls_saved_session saved;
+#endif
+
+    struct mqtt_tls_stats stats;
+} tls = {
+    .sock = -1,
+};
+
+static int tls_random(void *ctx, unsigned char *buf, size_t len) {
+    esp_fill_random(buf, len);
+    return 0;
+}
+
+static void tls_export_keys(
+    void *ctx,
+    mbedtls_ssl_key_export_type type,
+    const unsigned char *secret, size_t secret_len,
+    const unsigned char client_random[32],
+    const unsigned char server_random[32],
+    mbedtls_tls_prf_types tls_prf_type
+) {
+    if (type == MBEDTLS_SSL_KEY_EXPORT_TLS12_MASTER_SECRET && secret_len == MQTT_TLS_MASTER_SIZE) {
+        memcpy(tls.handshake_master, secret, MQTT_TLS_MASTER_SIZE);
+    }
+}
+
+static int tls_poll(int sock, int timeout_ms, bool is_write) {
+    fd_set fds;
+    FD_ZERO(&fds);
+    FD_SET(sock, &fds);
+
+    struct timeval timeout = {
+        .tv_sec = timeout_ms / 1000,
+        .tv_usec = (timeout_ms % 1000) * 1000,
+    };
+
+    return select(sock + 1, is_write ? NULL : &fds, is_write ? &fds : NULL, NULL, timeout_ms < 0 ? NULL : &timeout);
+}
+
+static int tls_send(void *ctx, const unsigned char *buf, size_t len) {
+    int ret = send(*(int *)ctx, buf, len, 0);
+    if (ret < 0) {
+        return errno == EAGAIN ? MBEDTLS_ERR_SSL_WANT_WRITE : MBEDTLS_ERR_NET_SEND_FAILED;
+    }
+    return ret;
+}
+
+static int tls_recv_timeout(void *ctx, unsigned char *buf, size_t len, uint32_t timeout_ms) {
+    int sock = *(int *)ctx;
+
+    int ready = tls_poll(sock, timeout_ms == 0 ? -1 : timeout_ms, false);
+    if (ready == 0) {
+        return MBEDTLS_ERR_SSL_TIMEOUT;
+    }
+    if (ready < 0) {
+        return MBEDTLS_ERR_NET_RECV_FAILED;
+    }
+
+    int ret = recv(sock, buf, len, 0);
+    if (ret < 0) {
+        return errno == EAGAIN ? MBEDTLS_ERR_SSL_WANT_READ : MBEDTLS_ERR_NET_RECV_FAILED;
+    }
+    return ret;
+}
+
+static int tls_socket_connect(const char *host, int port, int timeout_ms) {
+    struct addrinfo hints = {
+        .ai_family = AF_INET,
+        .ai_socktype = SOCK_STREAM,
+    };
+    struct addrinfo *addr = NULL;
+
+    char port_str[8];
+    snprintf(port_str, sizeof(port_str), "%d", port);
+
+    if (getaddrinfo(host, port_str, &hints, &addr) != 0 || addr == NULL) {
+        ESP_LOGE(TAG, "Failed to resolve '%s'", host);
+        return -1;
+    }
+
+    int sock = socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol);
+    if (sock < 0) {
+        freeaddrinfo(addr);
+        return -1;
+    }
+
+    int nodelay = 1;
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+
+    // Non-blocking connect to respect the timeout.
+    int flags = fcntl(sock, F_GETFL, 0);
+    fcntl(sock, F_SETFL, flags | O_NONBLOCK);
+
+    int ret = connect(sock, addr->ai_addr, addr->ai_addrlen);
+    freeaddrinfo(addr);
+
+    if (ret < 0 && errno == EINPROGRESS) {
+        int error = 0;
+        socklen_t error_len = sizeof(error);
+
+        if (tls_poll(sock, timeout_ms, true) > 0) {
+            getsockopt(sock, SOL_SOCKET, SO_ERROR, &error, &error_len);
+            ret = error == 0 ? 0 : -1;
+        }
+    }
+
+    if (ret < 0) {
+        ESP_LOGE(TAG, "Failed to connect to %s:%d", host, port);
+        close(sock);
+        return -1;
+    }
+
+    fcntl(sock, F_SETFL, flags);
+
+    return sock;
+}
+
+static void tls_forget_session(void) {
+    mbedtls_ssl_session_free(&tls.session);
+    mbedtls_ssl_session_init(&tls.session);
+    tls.has_session = false;
+}
+
+static void tls_load_session(void) {
+#ifndef MQTT_TLS_PERSIST_SESSION
+    // Earlier firmware saved the session without NVS encryption.
+    storage_erase_blob(MQTT_TLS_NVS_NAMESPACE, MQTT_TLS_NVS_KEY);
+#else
+    size_t len = sizeof(tls.saved);
+    esp_err_t ret = storage_load_blob(MQTT_TLS_NVS_NAMESPACE, MQTT_TLS_NVS_KEY, &tls.saved, &len);
+    if (ret != ESP_OK || len <= MQTT_TLS_MASTER_SIZE) {
+        return;
+    }
+
+    if (mbedtls_ssl_session_load(&tls.session, tls.saved.session, len - MQTT_TLS_MASTER_SIZE) != 0) {
+        ESP_LOGW(TAG, "Stored TLS session is invalid, it was saved by other firmware");
+        tls_forget_session();
+        return;
+    }
+
+    memcpy(tls.master, tls.saved.master, MQTT_TLS_MASTER_SIZE);
+    tls.has_session = true;
+#endif
+}
+
+static void tls_update_session(bool is_resumed) {
+    mbedtls_ssl_session session;
+    mbedtls_ssl_session_init(&session);
+
+    if (mbedtls_ssl_get_session(&tls.ssl, &session) != 0) {
+        mbedtls_ssl_session_free(&session);
+        return;
+    }
+
+    // Server may renew a ticket on resumption, keep it in RAM only. Flash
+    // is written after full handshakes only, and only if it is encrypted.
+    tls_forget_session();
+    tls.session = session;
+    tls.has_session = true;
+    memcpy(tls.master, tls.handshake_master, MQTT_TLS_MASTER_SIZE);
+
+#ifdef MQTT_TLS_PERSIST_SESSION
+    if (is_resumed) {
+        return;
+    }
+
+    size_t len = 0;
+    int ret = mbedtls_ssl_session_save(&tls.session, tls.saved.session, sizeof(tls.saved.session), &len);
+    if (ret != 0) {
+        ESP_LOGW(TAG, "TLS session does not fit into %d bytes, it will not survive reboot", MQTT_TLS_SESSION_MAX_SIZE);
+        return;
+    }
+
+    memcpy(tls.saved.master, tls.master, MQTT_TLS_MASTER_SIZE);
+    storage_save_blob(MQTT_TLS_NVS_NAMESPACE, MQTT_TLS_NVS_KEY, &tls.saved, MQTT_TLS_MASTER_SIZE + len);
+#endif
+}
+
+static int tls_handshake(const char *host, int timeout_ms) {
+    mbedtls_ssl_session_reset(&tls.ssl);
+    mbedtls_ssl_set_hostname(&tls.ssl, host);
+    mbedtls_ssl_set_bio(&tls.ssl, &tls.sock, tls_send, NULL, tls_recv_timeout);
+    mbedtls_ssl_set_export_keys_cb(&tls.ssl, tls_export_keys, NULL);
+    mbedtls_ssl_conf_read_timeout(&tls.conf, timeout_ms);
+
+    if (tls.has_session) {
+        mbedtls_ssl_set_session(&tls.ssl, &tls.session);
+    }
+    memset(tls.handshake_master, 0, MQTT_TLS_MASTER_SIZE);
+
+    int ret;
+    do {
+        ret = mbedtls_ssl_handshake(&tls.ssl);
+    } while (ret == MBEDTLS_ERR_SSL_WANT_READ || ret == MBEDTLS_ERR_SSL_WANT_WRITE);
+
+    return ret;
+}
+
+static int mqtt_tls_connect(esp_transport_handle_t t, const char *host, int port, int timeout_ms) {
+    tls.sock = tls_socket_connect(host, port, timeout_ms);
+    if (tls.sock < 0) {
+        return -1;
+    }
+
+    TRACE_BEGIN("tls_handshake");
+    int64_t started_at = esp_timer_get_time();
+    int ret = tls_handshake(host, timeout_ms);
+    int64_t handshake_us = esp_timer_get_time() - started_at;
+    TRACE_END("tls_handshake");
+
+    if (ret != 0) {
+        ESP_LOGE(TAG, "TLS handshake with %s failed: -0x%04x", host, -ret);
+
+        // Do not retry with a session server may have rejected, but keep it
+        // if the link just went down during the handshake.
+        bool is_network_error = ret == MBEDTLS_ERR_SSL_TIMEOUT
+            || ret == MBEDTLS_ERR_NET_RECV_FAILED
+            || ret == MBEDTLS_ERR_NET_SEND_FAILED;
+        if (!is_network_error) {
+            tls_forget_session();
+        }
+        close(tls.sock);
+        tls.sock = -1;
+        return -1;
+    }
+
+    bool is_resumed = tls.has_session && memcmp(tls.master, tls.handshake_master, MQTT_TLS_MASTER_SIZE) == 0;
+    if (is_resumed) {
+        tls.stats.resumed_handshakes++;
+        tls.stats.resumed_total_us += handshake_us;
+    } else {
+        tls.stats.full_handshakes++;
+        tls.stats.full_total_us += handshake_us;
+    }
+
+    ESP_LOGI(TAG, "%s TLS handshake with %s took %lld ms", is_resumed ? "Resumed" : "Full", host, handshake_us / 1000);
+
+    tls_update_session(is_resumed);
+
+    return 0;
+}
+
+static int mqtt_tls_poll_read(esp_transport_handle_t t, int timeout_ms) {
+    if (mbedtls_ssl_get_bytes_avail(&tls.ssl) > 0) {
+        return 1;
+    }
+    return tls_poll(tls.sock, timeout_ms, false);
+}
+
+static int mqtt_tls_poll_write(esp_transport_handle_t t, int timeout_ms) {
+    return tls_poll(tls.sock, timeout_ms, true);
+}
+
+static int mqtt_tls_read(esp_transport_handle_t t, char *buffer, int len, int timeout_ms) {
+    int ready = mqtt_tls_poll_read(t, timeout_ms);
+    if (ready == 0) {
+        return ERR_TCP_TRANSPORT_CONNECTION_TIMEOUT;
+    }
+    if (ready < 0) {
+        return ERR_TCP_TRANSPORT_CONNECTION_FAILED;
+    }
+
+    int ret = mbedtls_ssl_read(&tls.ssl, (unsigned char *)buffer, len);
+    if (ret == MBEDTLS_ERR_SSL_WANT_READ || ret == MBEDTLS_ERR_SSL_WANT_WRITE) {
+        return ERR_TCP_TRANSPORT_CONNECTION_TIMEOUT;
+    }
+    if (ret == 0 || ret == MBEDTLS_ERR_SSL_PEER_CLOSE_NOTIFY) {
+        return ERR_TCP_TRANSPORT_CONNECTION_CLOSED_BY_FIN;
+    }
+    if (ret < 0) {
+        ESP_LOGE(TAG, "TLS read failed: -0x%04x", -ret);
+        return ERR_TCP_TRANSPORT_CONNECTION_FAILED;
+    }
+    return ret;
+}
+
+static int mqtt_tls_write(esp_transport_handle_t t, const char *buffer, int len, int timeout_ms) {
+    int written = 0;
+
+    while (written < len) {
+        if (mqtt_tls_poll_write(t, timeout_ms) <= 0) {
+            return written > 0 ? written : ERR_TCP_TRANSPORT_CONNECTION_FAILED;
+        }
+
+        int ret = mbedtls_ssl_write(&tls.ssl, (const unsigned char *)buffer + written, len - written);
+        if (ret == MBEDTLS_ERR_SSL_WANT_READ || ret == MBEDTLS_ERR_SSL_WANT_WRITE) {
+            continue;
+        }
+        if (ret < 0) {
+            ESP_LOGE(TAG, "TLS write failed: -0x%04x", -ret);
+            return ERR_TCP_TRANSPORT_CONNECTION_FAILED;
+        }
+        written += ret;
+    }
+
+    return written;
+}
+
+static int mqtt_tls_close(esp_transport_handle_t t) {
+    if (tls.sock >= 0) {
+        mbedtls_ssl_close_notify(&tls.ssl);
+        close(tls.sock);
+        tls.sock = -1;
+    }
+    return 0;
+}
+
+static int mqtt_tls_destroy(esp_transport_handle_t t) {
+    return mqtt_tls_close(t);
+}
+
+esp_transport_handle_t mqtt_tls_init(void) {
+    mbedtls_ssl_init(&tls.ssl);
+    mbedtls_ssl_config_init(&tls.conf);
+    mbedtls_ssl_session_init(&tls.session);
+
+    int ret = mbedtls_ssl_config_defaults(&tls.conf, MBEDTLS_SSL_IS_CLIENT, MBEDTLS_SSL_TRANSPORT_STREAM, MBEDTLS_SSL_PRESET_DEFAULT);
+    assert(ret == 0);
+
+    mbedtls_ssl_conf_rng(&tls.conf, tls_random, NULL);
+    mbedtls_ssl_conf_authmode(&tls.conf, MBEDTLS_SSL_VERIFY_REQUIRED);
+    mbedtls_ssl_conf_ciphersuites(&tls.conf, ciphersuites);
+    // Session resumption is implemented for TLS 1.2 tickets and session IDs.
+    mbedtls_ssl_conf_max_tls_version(&tls.conf, MBEDTLS_SSL_VERSION_TLS1_2);
+    mbedtls_ssl_conf_session_tickets(&tls.conf, MBEDTLS_SSL_SESSION_TICKETS_ENABLED);
+
+#ifdef USE_MQTT_TLS_CA
+    mbedtls_x509_crt_init(&tls.ca);
+    ret = mbedtls_x509_crt_parse(&tls.ca, mqtt_ca_pem, sizeof(mqtt_ca_pem));
+    assert(ret == 0);
+    mbedtls_ssl_conf_ca_chain(&tls.conf, &tls.ca, NULL);
+#else
+    ESP_ERROR_CHECK(esp_crt_bundle_attach(&tls.conf));
+#endif
+
+    ret = mbedtls_ssl_setup(&tls.ssl, &tls.conf);
+    assert(ret == 0);
+
+    tls_load_session();
+
+    esp_transport_handle_t t = esp_transport_init();
+    assert(t != NULL);
+
+    esp_transport_set_func(
+        t,
+        mqtt_tls_connect,
+        mqtt_tls_read,
+        mqtt_tls_write,
+        mqtt_tls_close,
+        mqtt_tls_poll_read,
+        mqtt_tls_poll_write,
+        mqtt_tls_destroy
+    );
+    esp_transport_set_default_port(t, MQTT_TLS_DEFAULT_PORT);
+
+    return t;
+}
+
+void mqtt_tls_get_stats(struct mqtt_tls_stats *stats) {
+    *stats = tls.stats;
+}
@@ -0,0 +1,20 @@
+#pragma once
+
+#include <stdint.h>
+#include <esp_transport.h>
+
+// TLS transport for MQTT client which resumes TLS sessions after reconnects.
+// Session of the last full handshake is kept in RAM, and with NVS encryption
+// also in NVS, so it is resumed after reboots too.
+
+struct mqtt_tls_stats {
+    uint32_t full_handshakes;
+    uint64_t full_total_us;
+
+    uint32_t resumed_handshakes;
+    uint64_t resumed_total_us;
+};
+
+esp_transport_handle_t mqtt_tls_init(void);
+
+void mqtt_tls_get_stats(struct mqtt_tls_stats *stats);
@@ -0,0 +1,356 @@
+#include "netcache.h"
+
+#include <esp_event.h>
+#include <esp_log.h>
+#include <esp_netif.h>
+#include <esp_netif_net_stack.h>
+#include <esp_timer.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <lwip/api.h>
+#include <lwip/etharp.h>
+#include <lwip/netdb.h>
+#include <string.h>
+
+#include "config.h"
+#include "broker.h"
+#include "ntp.h"
+#include "storage.h"
+#include "tasks.h"
+#include "heap_guard.h"
+
+#define TAG "netcache"
+
+// Static ARP entries seed gateway MAC. lwIP is built with them by the top
+// level CMakeLists.txt.
+#if !ETHARP_SUPPORT_STATIC_ENTRIES
+#error "netcache requires ETHARP_SUPPORT_STATIC_ENTRIES"
+#endif
+
+#define NETCACHE_NVS_NAMESPACE     "netcache"
+#define NETCACHE_NVS_KEY           "state"
+// Bump when layout of struct netcache_saved changes.
+#define NETCACHE_VERSION           1
+
+#define NETCACHE_HOST_BROKER       0
+#define NETCACHE_HOST_NTP          1
+#define NETCACHE_HOSTS_MAX         2
+#define NETCACHE_HOST_MAX          64
+
+// Revalidation waits so it does not compete with MQTT connect for the link.
+#define NETCACHE_REVALIDATE_DELAY_MS  5000
+#define NETCACHE_REFRESH_SEC          (60 * 60)
+#define NETCACHE_ARP_TIMEOUT_MS       500
+
+struct netcache_host {
+    char name[NETCACHE_HOST_MAX];
+    // IPv4 in network byte order, 0 if not resolved yet.
+    uint32_t ip;
+};
+
+struct netcache_saved {
+    uint32_t version;
+    struct netcache_host hosts[NETCACHE_HOSTS_MAX];
+    uint32_t gateway;
+    uint8_t gateway_mac[6];
+};
+
+struct netcache_arp {
+    esp_netif_t *netif;
+    ip4_addr_t gateway;
+    struct eth_addr mac;
+    bool found;
+};
+
+static struct {
+    portMUX_TYPE spinlock;
+
+    // Read by DNS hook from any task, written under spinlock by netcache task.
+    struct netcache_saved saved;
+    // Host is answered from cache until its first successful revalidation,
+    // then lwIP resolves it, so a moved broker is followed right away.
+    bool is_served[NETCACHE_HOSTS_MAX];
+    bool is_arp_seeded;
+
+    TaskHandle_t task;
+    // Written under spinlock by IP event handler, the task takes a copy.
+    esp_netif_t *netif;
+    uint32_t gateway;
+
+    struct netcache_stats stats;
+} netcache = {
+    .spinlock = portMUX_INITIALIZER_UNLOCKED,
+};
+
+// Called by lwIP for each netconn lookup, including getaddrinfo. Returns 1 if
+// answered from cache. Netcache task itself always asks DNS server, and
+// revalidated hosts are never answered.
+int lwip_hook_netconn_external_resolve(const char *name, ip_addr_t *addr, u8_t addrtype, err_t *err) {
+    if (addrtype == NETCONN_DNS_IPV6 || xTaskGetCurrentTaskHandle() == netcache.task) {
+        return 0;
+    }
+
+    uint32_t ip = 0;
+
+    taskENTER_CRITICAL(&netcache.spinlock);
+    for (int i = 0; i < NETCACHE_HOSTS_MAX; i++) {
+        const struct netcache_host *h = &netcache.saved.hosts[i];
+        if (netcache.is_served[i] && h->ip != 0 && strcmp(h->name, name) == 0) {
+            ip = h->ip;
+            netcache.stats.dns_hits++;
+            break;
+        }
+    }
+    taskEXIT_CRITICAL(&netcache.spinlock);
+
+    if (ip == 0) {
+        return 0;
+    }
+
+    ip_addr_set_ip4_u32(addr, ip);
+    *err = ERR_OK;
+    return 1;
+}
+
+bool netcache_lookup(const char *host, char *ip, size_t size) {
+    struct netcache_host h = {};
+
+    taskENTER_CRITICAL(&netcache.spinlock);
+    for (int i = 0; i < NETCACHE_HOSTS_MAX; i++) {
+        if (strcmp(netcache.saved.hosts[i].name, host) == 0) {
+            h = netcache.saved.hosts[i];
+            break;
+        }
+    }
+    taskEXIT_CRITICAL(&netcache.spinlock);
+
+    if (h.ip == 0) {
+        return false;
+    }
+
+    esp_ip4_addr_t addr = { .addr = h.ip };
+    esp_ip4addr_ntoa(&addr, ip, size);
+    return true;
+}
+
+void netcache_get_stats(struct netcache_stats *stats) {
+    taskENTER_CRITICAL(&netcache.spinlock);
+    *stats = netcache.stats;
+    taskEXIT_CRITICAL(&netcache.spinlock);
+}
+
+static esp_err_t netcache_seed_arp(void *ctx) {
+    struct netcache_arp *arp = ctx;
+    return etharp_add_static_entry(&arp->gateway, &arp->mac) == ERR_OK ? ESP_OK : ESP_FAIL;
+}
+
+static esp_err_t netcache_unseed_arp(void *ctx) {
+    struct netcache_arp *arp = ctx;
+    etharp_remove_static_entry(&arp->gateway);
+    return ESP_OK;
+}
+
+static esp_err_t netcache_request_arp(void *ctx) {
+    struct netcache_arp *arp = ctx;
+    struct netif *netif = esp_netif_get_netif_impl(arp->netif);
+    return etharp_request(netif, &arp->gateway) == ERR_OK ? ESP_OK : ESP_FAIL;
+}
+
+static esp_err_t netcache_find_arp(void *ctx) {
+    struct netcache_arp *arp = ctx;
+    struct netif *netif = esp_netif_get_netif_impl(arp->netif);
+    struct eth_addr *mac = NULL;
+    const ip4_addr_t *ip = NULL;
+
+    arp->found = etharp_find_addr(netif, &arp->gateway, &mac, &ip) >= 0;
+    if (arp->found) {
+        arp->mac = *mac;
+    }
+    return ESP_OK;
+}
+
+// Runs in the default event loop task, seeding is left to netcache task.
+static void ip_event_handler(void *arg, esp_event_base_t base, int32_t id, void *data) {
+    const ip_event_got_ip_t *event = data;
+    bool is_first = false;
+
+    taskENTER_CRITICAL(&netcache.spinlock);
+    if (netcache.stats.ip_ready_ms == 0) {
+        netcache.stats.ip_ready_ms = esp_timer_get_time() / 1000;
+        is_first = true;
+    }
+    netcache.netif = event->esp_netif;
+    netcache.gateway = event->ip_info.gw.addr;
+    taskEXIT_CRITICAL(&netcache.spinlock);
+
+    if (is_first) {
+        ESP_LOGI(
+            TAG, "IP ready in %lu ms, %s start",
+            netcache.stats.ip_ready_ms, netcache.stats.is_fast_start ? "fast" : "cold"
+        );
+    }
+
+    xTaskNotifyGive(netcache.task);
+}
+
+// Gateway MAC saved last boot is added as a static ARP entry, so the first
+// packet does not wait for ARP. Revalidation replaces it.
+static void netcache_seed_gateway(esp_netif_t *netif, uint32_t gateway) {
+    if (netcache.is_arp_seeded || netcache.saved.gateway != gateway) return;
+
+    struct netcache_arp arp = { .netif = netif };
+    ip4_addr_set_u32(&arp.gateway, gateway);
+    memcpy(arp.mac.addr, netcache.saved.gateway_mac, sizeof(arp.mac.addr));
+
+    netcache.is_arp_seeded = esp_netif_tcpip_exec(netcache_seed_arp, &arp) == ESP_OK;
+}
+
+static bool netcache_revalidate_host(int index) {
+    struct netcache_host *h = &netcache.saved.hosts[index];
+    const struct addrinfo hints = {
+        .ai_family = AF_INET,
+        .ai_socktype = SOCK_STREAM,
+    };
+    struct addrinfo *addr = NULL;
+
+    // Keeps the cached answer if DNS server is not reachable.
+    if (getaddrinfo(h->name, NULL, &hints, &addr) != 0 || addr == NULL) {
+        ESP_LOGW(TAG, "Failed to resolve %s", h->name);
+        return false;
+    }
+
+    uint32_t ip = ((struct sockaddr_in *)addr->ai_addr)->sin_addr.s_addr;
+    freeaddrinfo(addr);
+
+    bool changed = ip != h->ip;
+
+    taskENTER_CRITICAL(&netcache.spinlock);
+    h->ip = ip;
+    netcache.is_served[index] = false;
+    taskEXIT_CRITICAL(&netcache.spinlock);
+    return changed;
+}
+
+static bool netcache_revalidate_gateway(esp_netif_t *netif, uint32_t gateway) {
+    struct netcache_arp arp = { .netif = netif };
+    ip4_addr_set_u32(&arp.gateway, gateway);
+
+    // Seeded entry is replaced by a dynamic one, so gateway changes are noticed.
+    if (netcache.is_arp_seeded) {
+        esp_netif_tcpip_exec(netcache_unseed_arp, &arp);
+        netcache.is_arp_seeded = false;
+    }
+
+    esp_netif_tcpip_exec(netcache_request_arp, &arp);
+    vTaskDelay(pdMS_TO_TICKS(NETCACHE_ARP_TIMEOUT_MS));
+    esp_netif_tcpip_exec(netcache_find_arp, &arp);
+
+    if (!arp.found) {
+        ESP_LOGW(TAG, "Gateway did not answer ARP request");
+        return false;
+    }
+
+    if (netcache.saved.gateway == gateway
+        && memcmp(netcache.saved.gateway_mac, arp.mac.addr, sizeof(arp.mac.addr)) == 0) {
+        return false;
+    }
+
+    netcache.saved.gateway = gateway;
+    memcpy(netcache.saved.gateway_mac, arp.mac.addr, sizeof(arp.mac.addr));
+    return true;
+}
+
+static void netcache_thread(void *arg) {
+    while (true) {
+        // Woken by a new IP, otherwise refreshes periodically.
+        ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(NETCACHE_REFRESH_SEC * 1000));
+
+        taskENTER_CRITICAL(&netcache.spinlock);
+        esp_netif_t *netif = netcache.netif;
+        uint32_t gateway = netcache.gateway;
+        taskEXIT_CRITICAL(&netcache.spinlock);
+
+        if (netif == NULL) continue;
+
+        netcache_seed_gateway(netif, gateway);
+        vTaskDelay(pdMS_TO_TICKS(NETCACHE_REVALIDATE_DELAY_MS));
+
+        bool changed = false;
+
+        // Lookups allocate in lwIP.
+        heap_guard_allow_begin();
+        for (int i = 0; i < NETCACHE_HOSTS_MAX; i++) {
+            if (netcache.saved.hosts[i].name[0] != '\0') {
+                changed |= netcache_revalidate_host(i);
+            }
+        }
+        changed |= netcache_revalidate_gateway(netif, gateway);
+        heap_guard_allow_end();
+
+        if (!changed) continue;
+
+        ESP_LOGI(TAG, "Network state changed, saving");
+        taskENTER_CRITICAL(&netcache.spinlock);
+        netcache.stats.changes++;
+        taskEXIT_CRITICAL(&netcache.spinlock);
+
+        netcache.saved.version = NETCACHE_VERSION;
+        storage_save_blob(NETCACHE_NVS_NAMESPACE, NETCACHE_NVS_KEY, &netcache.saved, sizeof(netcache.saved));
+    }
+}
+
+// Hosts cached this boot, answers saved for other names are dropped.
+static void netcache_set_hosts(const struct netcache_saved *loaded) {
+    struct netcache_host *hosts = netcache.saved.hosts;
+    char broker_host[NETCACHE_HOST_MAX];
+    uint16_t broker_port;
+    ip4_addr_t numeric;
+
+    // Numeric broker address is never looked up.
+    if (broker_parse_uri(MQTT_URI, broker_host, sizeof(broker_host), &broker_port) && !ip4addr_aton(broker_host, &numeric)) {
+        strlcpy(hosts[NETCACHE_HOST_BROKER].name, broker_host, NETCACHE_HOST_MAX);
+    }
+    strlcpy(hosts[NETCACHE_HOST_NTP].name, NTP_SERVER, NETCACHE_HOST_MAX);
+
+    for (int i = 0; i < NETCACHE_HOSTS_MAX; i++) {
+        struct netcache_host *h = &hosts[i];
+        if (loaded != NULL && h->name[0] != '\0' && strcmp(loaded->hosts[i].name, h->name) == 0) {
+            h->ip = loaded->hosts[i].ip;
+            netcache.is_served[i] = true;
+        }
+    }
+}
+
+void netcache_init(void) {
+    static StackType_t stack[NETCACHE_TASK_STACK_SIZE];
+    static StaticTask_t task;
+    static struct netcache_saved loaded;
+
+    size_t len = sizeof(loaded);
+    esp_err_t ret = storage_load_blob(NETCACHE_NVS_NAMESPACE, NETCACHE_NVS_KEY, &loaded, &len);
+    bool is_loaded = ret == ESP_OK && len == sizeof(loaded) && loaded.version == NETCACHE_VERSION;
+
+    netcache_set_hosts(is_loaded ? &loaded : NULL);
+    if (is_loaded) {
+        netcache.saved.gateway = loaded.gateway;
+        memcpy(netcache.saved.gateway_mac, loaded.gateway_mac, sizeof(loaded.gateway_mac));
+        netcache.stats.is_fast_start = true;
+    } else {
+        ESP_LOGI(TAG, "No network state cached, cold start");
+    }
+
+    netcache.task = xTaskCreateStaticPinnedToCore(
+        netcache_thread,
+        "netcache",
+        NETCACHE_TASK_STACK_SIZE,
+        NULL,
+        NETCACHE_TASK_PRIORITY,
+        stack,
+        &task,
+        NETCACHE_TASK_CORE
+    );
+    heap_guard_watch_task(netcache.task);
+
+    ESP_ERROR_CHECK(esp_event_handler_register(IP_EVENT, IP_EVENT_STA_GOT_IP, ip_event_handler, NULL));
+    ESP_ERROR_CHECK(esp_event_handler_register(IP_EVENT, IP_EVENT_ETH_GOT_IP, ip_event_handler, NULL));
+}
@@ -0,0 +1,30 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Network state cached across reboots to shorten time to MQTT connected.
+// DNS answers for the MQTT broker and NTP hosts and the gateway MAC address
+// are saved in NVS, used right away on the next boot and revalidated in the
+// background after the IP is acquired. The DHCP lease itself is restored by
+// lwIP, see LWIP_DHCP_RESTORE_LAST_IP in sdkconfig.
+
+struct netcache_stats {
+    // Cache was loaded from NVS at boot.
+    bool is_fast_start;
+    // Boot to the first IP, 0 until acquired.
+    uint32_t ip_ready_ms;
+    // Lookups answered from cache.
+    uint32_t dns_hits;
+    // Revalidations which found a different answer or gateway.
+    uint32_t changes;
+};
+
+// Called after storage_init and before ntp_init, wifi_init and eth_init.
+void netcache_init(void);
+
+// Copies cached IPv4 address of a host as text, returns false if not cached.
+bool netcache_lookup(const char *host, char *ip, size_t size);
+
+void netcache_get_stats(struct netcache_stats *stats);
@@ -6,9 +6,13 @@
 #include <sys/time.h>
 
 #include "indicator.h"
+#include "netcache.h"
+#include "shadow.h"
 
 #define TAG "ntp"
 
+static volatile bool is_synced;
+
 void callback(struct timeval *tv) {
     time_t nowtime = tv->tv_sec;
     struct tm *nowtm = localtime(&nowtime);
@@ -17,14 +21,29 @@ void callback(struct timeval *tv) {
     strftime(buf, sizeof(buf), "%c", nowtm);
     ESP_LOGI(TAG, "Time synchronized successfully. Current timestamp: %s", buf);
 
+    is_synced = true;
     indicator_setup_complete();
+    shadow_set_ntp_synced(true);
+}
+
+bool ntp_is_synced(void) {
+    return is_synced;
 }
 
 void ntp_init(void) {
-    esp_sntp_config_t config = ESP_NETIF_SNTP_DEFAULT_CONFIG("pool.ntp.org");
+    // SNTP resolves servers bypassing the netcache DNS hook, so the cached
+    // address is given as a server of its own, tried before the name.
+    static char cached_ip[16];
+    esp_sntp_config_t config = ESP_NETIF_SNTP_DEFAULT_CONFIG(NTP_SERVER);
+    if (netcache_lookup(NTP_SERVER, cached_ip, sizeof(cached_ip))) {
+        config.num_of_servers = 2;
+        config.servers[0] = cached_ip;
+        config.servers[1] = NTP_SERVER;
+    }
     config.server_from_dhcp = true;
     config.renew_servers_after_new_IP = true;
     config.ip_event_to_renew = IP_EVENT_STA_GOT_IP;
+    // Server 0 is from DHCP.
     config.index_of_first_server = 1;
     config.sync_cb = callback;
 
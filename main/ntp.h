@@ -1,3 +1,10 @@
 #pragma once
 
+#include <stdbool.h>
+
+#define NTP_SERVER "pool.ntp.org"
+
 void ntp_init(void);
+
+// False until the first synchronization, the clock starts in 1970 before it.
+bool ntp_is_synced(void);
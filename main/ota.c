@@ -0,0 +1,552 @@
+#include "ota.h"
+
+#include <esp_log.h>
+#include <esp_err.h>
+#include <esp_app_desc.h>
+#include <esp_ota_ops.h>
+#include <esp_partition.h>
+#include <esp_http_client.h>
+#include <esp_delta_ota.h>
+#include <esp_timer.h>
+#include <esp_system.h>
+#include <esp_netif.h>
+#include <esp_heap_caps.h>
+#include <mqtt_client.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <freertos/semphr.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "config.h"
+#include "mqtt.h"
+#include "power.h"
+#include "tasks.h"
+#include "trace.h"
+#include "unlock.h"
+
+#define TAG "ota"
+
+#define OTA_TOPIC         MQTT_TOPIC(MQTT_DEVICE_ID, "ota")
+#define OTA_FETCH_TOPIC   MQTT_TOPIC(MQTT_DEVICE_ID, "ota/fetch")
+#define OTA_STATUS_TOPIC  MQTT_TOPIC(MQTT_DEVICE_ID, "ota/status")
+
+// These values must be identical to the values from the utils/gen_ota.py file.
+#define OTA_MAGIC    0x41544F58  // "XOTA"
+#define OTA_VERSION  1
+
+#define OTA_HEALTH_CHECK_TIMEOUT_SEC  120
+// Signed fetch commands are bound to this scope, see unlock.h.
+#define OTA_FETCH_SCOPE               "ota/fetch"
+// Lets the last status leave before restart.
+#define OTA_RESTART_DELAY_MS          1000
+
+#define OTA_URL_MAX_LEN      256
+#define OTA_HTTP_CHUNK_SIZE  4096
+
+enum ota_image_type {
+    OTA_IMAGE_FULL  = 0,
+    OTA_IMAGE_DELTA = 1,
+};
+
+struct ota_header {
+    uint32_t magic;
+    uint16_t version;
+    uint8_t  type;
+    uint8_t  reserved;
+    // Size of image or patch following the header.
+    uint32_t size;
+    // Delta only, app_elf_sha256 of the image the patch is made against.
+    uint8_t  base_elf_sha256[32];
+} __attribute__((packed));
+
+// MQTT chunk starts with its offset in the update stream, so duplicates
+// after reconnect are skipped and lost chunks are detected.
+struct ota_chunk_header {
+    uint32_t offset;
+} __attribute__((packed));
+
+static struct {
+    // Update is fed either from MQTT task or from HTTP fetch task.
+    SemaphoreHandle_t mutex;
+    StaticSemaphore_t mutex_buffer;
+
+    bool is_receiving;
+    bool is_fetching;
+
+    struct ota_header header;
+    uint32_t offset;
+    uint32_t written;
+    int64_t started_at;
+
+    const esp_partition_t *running;
+    const esp_partition_t *target;
+    esp_ota_handle_t handle;
+    esp_delta_ota_handle_t delta;
+
+    TaskHandle_t fetch_task;
+    char url[OTA_URL_MAX_LEN];
+    uint8_t http_chunk[OTA_HTTP_CHUNK_SIZE];
+
+    esp_timer_handle_t health_timer;
+    esp_timer_handle_t restart_timer;
+} ota = {0};
+
+static void publish_status(const char *message) {
+    mqtt_publish(OTA_STATUS_TOPIC, message, /* qos */ 0, /* retain */ false);
+}
+
+static void publish_progress(void) {
+    char message[64];
+    snprintf(message, sizeof(message), "{\"state\": \"receiving\", \"offset\": %lu}", ota.offset);
+    publish_status(message);
+}
+
+static void publish_failed(const char *error) {
+    char message[128];
+    snprintf(message, sizeof(message), "{\"state\": \"failed\", \"offset\": %lu, \"error\": \"%s\"}", ota.offset, error);
+    publish_status(message);
+}
+
+static esp_err_t delta_read(uint8_t *buf, size_t size, int src_offset) {
+    return esp_partition_read(ota.running, src_offset, buf, size);
+}
+
+static esp_err_t delta_write(const uint8_t *buf, size_t size, void *user_data) {
+    ota.written += size;
+    return esp_ota_write(ota.handle, buf, size);
+}
+
+static void ota_abort(const char *error) {
+    ESP_LOGE(TAG, "Update failed at offset %lu: %s", ota.offset, error);
+    TRACE_INSTANT("ota_failed");
+
+    if (ota.delta != NULL) {
+        esp_delta_ota_deinit(ota.delta);
+        ota.delta = NULL;
+    }
+    esp_ota_abort(ota.handle);
+
+    publish_failed(error);
+
+    ota.is_receiving = false;
+    power_cpu_max_release();
+}
+
+static const char *ota_begin(void) {
+    const struct ota_header *header = &ota.header;
+
+    if (header->magic != OTA_MAGIC || header->version != OTA_VERSION) {
+        return "unsupported update format";
+    }
+
+    if (header->type == OTA_IMAGE_DELTA) {
+        const esp_app_desc_t *app = esp_app_get_description();
+        if (memcmp(header->base_elf_sha256, app->app_elf_sha256, sizeof(app->app_elf_sha256)) != 0) {
+            return "delta is made against another firmware";
+        }
+    } else if (header->type != OTA_IMAGE_FULL) {
+        return "unknown image type";
+    }
+
+    ota.target = esp_ota_get_next_update_partition(NULL);
+    if (ota.target == NULL) {
+        return "no OTA partition";
+    }
+
+    if (esp_ota_begin(ota.target, OTA_WITH_SEQUENTIAL_WRITES, &ota.handle) != ESP_OK) {
+        return "unable to erase OTA partition";
+    }
+
+    if (header->type == OTA_IMAGE_DELTA) {
+        esp_delta_ota_cfg_t cfg = {
+            .read_cb = delta_read,
+            .write_cb_with_user_data = delta_write,
+        };
+        ota.delta = esp_delta_ota_init(&cfg);
+        if (ota.delta == NULL) {
+            esp_ota_abort(ota.handle);
+            return "unable to start delta decoder";
+        }
+    }
+
+    return NULL;
+}
+
+static const char *ota_end(void) {
+    if (ota.delta != NULL) {
+        esp_err_t ret = esp_delta_ota_finalize(ota.delta);
+        esp_delta_ota_deinit(ota.delta);
+        ota.delta = NULL;
+
+        if (ret != ESP_OK) {
+            esp_ota_abort(ota.handle);
+            return "delta does not apply";
+        }
+    }
+
+    // Validates the image and, with signed apps, its signature.
+    esp_err_t ret = esp_ota_end(ota.handle);
+    if (ret == ESP_ERR_OTA_VALIDATE_FAILED) {
+        return "image or signature is invalid";
+    } else if (ret != ESP_OK) {
+        return "unable to finish update";
+    }
+
+    // Bootloader refuses images below the secure version in eFuse, which is
+    // raised only when the running firmware is confirmed. This also rejects
+    // downgrades below an unconfirmed running firmware, and reports them.
+    esp_app_desc_t desc;
+    if (esp_ota_get_partition_description(ota.target, &desc) != ESP_OK) {
+        return "unable to read image description";
+    }
+    if (desc.secure_version < esp_app_get_description()->secure_version) {
+        return "downgrade is not allowed";
+    }
+
+    if (esp_ota_set_boot_partition(ota.target) != ESP_OK) {
+        return "unable to set boot partition";
+    }
+
+    return NULL;
+}
+
+// Feeds the next piece of the update stream. Header comes first, image or
+// patch is written right away, so the whole update is never in RAM.
+static void ota_feed(const uint8_t *data, size_t len) {
+    if (ota.offset < sizeof(ota.header)) {
+        size_t header_len = sizeof(ota.header) - ota.offset;
+        if (header_len > len) {
+            header_len = len;
+        }
+
+        memcpy((uint8_t *)&ota.header + ota.offset, data, header_len);
+        ota.offset += header_len;
+        data += header_len;
+        len -= header_len;
+
+        if (ota.offset < sizeof(ota.header)) return;
+
+        const char *error = ota_begin();
+        if (error != NULL) {
+            ESP_LOGE(TAG, "Unable to start update: %s", error);
+            publish_failed(error);
+            ota.is_receiving = false;
+            power_cpu_max_release();
+            return;
+        }
+
+        ESP_LOGI(
+            TAG, "Receiving %s update of %lu bytes to partition '%s'",
+            ota.header.type == OTA_IMAGE_DELTA ? "delta" : "full", ota.header.size, ota.target->label
+        );
+    }
+
+    uint32_t end = sizeof(ota.header) + ota.header.size;
+    if (ota.offset + len > end) {
+        ota_abort("update is larger than its header says");
+        return;
+    }
+
+    esp_err_t ret;
+    if (ota.delta != NULL) {
+        ret = esp_delta_ota_feed_patch(ota.delta, data, len);
+    } else {
+        ret = esp_ota_write(ota.handle, data, len);
+        ota.written += len;
+    }
+
+    if (ret != ESP_OK) {
+        ota_abort(ota.delta != NULL ? "delta does not apply" : "unable to write image");
+        return;
+    }
+
+    ota.offset += len;
+    if (ota.offset < end) return;
+
+    const char *error = ota_end();
+    if (error != NULL) {
+        ESP_LOGE(TAG, "Update failed: %s", error);
+        publish_failed(error);
+        ota.is_receiving = false;
+        power_cpu_max_release();
+        return;
+    }
+
+    uint32_t duration_ms = (esp_timer_get_time() - ota.started_at) / 1000;
+    ESP_LOGI(TAG, "Update of %lu bytes written as %lu bytes in %lu ms, restarting", ota.offset, ota.written, duration_ms);
+    TRACE_INSTANT("ota_done");
+
+    char message[160];
+    snprintf(
+        message, sizeof(message),
+        "{\"state\": \"done\", \"type\": \"%s\", \"received\": %lu, \"written\": %lu, \"duration_ms\": %lu}",
+        ota.header.type == OTA_IMAGE_DELTA ? "delta" : "full", ota.offset, ota.written, duration_ms
+    );
+    publish_status(message);
+
+    ota.is_receiving = false;
+    esp_timer_start_once(ota.restart_timer, OTA_RESTART_DELAY_MS * 1000);
+}
+
+static void ota_start(void) {
+    if (ota.is_receiving) {
+        ESP_LOGW(TAG, "Previous update is not finished, starting over");
+        ota_abort("restarted");
+    }
+
+    ota.is_receiving = true;
+    ota.offset = 0;
+    ota.written = 0;
+    ota.started_at = esp_timer_get_time();
+    TRACE_INSTANT("ota_start");
+
+    // Patching and flash writes are CPU bound.
+    power_cpu_max_acquire();
+}
+
+static void mqtt_ota_topic_updated(
+    const char *topic, int topic_len,
+    const char *data,  int data_len
+) {
+    if (data_len < sizeof(struct ota_chunk_header)) return;
+
+    struct ota_chunk_header chunk;
+    memcpy(&chunk, data, sizeof(chunk));
+    data += sizeof(chunk);
+    data_len -= sizeof(chunk);
+
+    xSemaphoreTake(ota.mutex, portMAX_DELAY);
+
+    if (ota.is_fetching) {
+        ESP_LOGW(TAG, "Chunk is ignored during HTTP update");
+    } else if (chunk.offset == 0) {
+        ota_start();
+        ota_feed((const uint8_t *)data, data_len);
+    } else if (!ota.is_receiving) {
+        ESP_LOGW(TAG, "Chunk at offset %lu without update in progress", chunk.offset);
+        publish_failed("no update in progress");
+    } else if (chunk.offset < ota.offset) {
+        // Redelivered after reconnect, already written.
+        ESP_LOGD(TAG, "Duplicate chunk at offset %lu", chunk.offset);
+    } else if (chunk.offset > ota.offset) {
+        ota_abort("chunk is lost");
+    } else {
+        ota_feed((const uint8_t *)data, data_len);
+    }
+
+    // Acknowledge every chunk, sender keeps only a few chunks in flight.
+    if (ota.is_receiving) {
+        publish_progress();
+    }
+
+    xSemaphoreGive(ota.mutex);
+}
+
+static void ota_fetch(void) {
+    esp_http_client_config_t config = {
+        .url = ota.url,
+        .timeout_ms = 10000,
+    };
+
+    esp_http_client_handle_t client = esp_http_client_init(&config);
+    if (client == NULL || esp_http_client_open(client, 0) != ESP_OK) {
+        ota_abort("unable to connect to update server");
+        goto cleanup;
+    }
+
+    esp_http_client_fetch_headers(client);
+    if (esp_http_client_get_status_code(client) != 200) {
+        ota_abort("update server did not return the update");
+        goto cleanup;
+    }
+
+    while (ota.is_receiving) {
+        int len = esp_http_client_read(client, (char *)ota.http_chunk, sizeof(ota.http_chunk));
+        if (len <= 0) {
+            ota_abort("update is truncated");
+            break;
+        }
+
+        ota_feed(ota.http_chunk, len);
+    }
+
+cleanup:
+    if (client != NULL) {
+        esp_http_client_cleanup(client);
+    }
+}
+
+static void ota_fetch_thread(void *param) {
+    for (;;) {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+
+        ESP_LOGI(TAG, "Fetching update from '%s'", ota.url);
+
+        // Fetch is marked by the topic handler, so URL is not replaced
+        // while it is used.
+        xSemaphoreTake(ota.mutex, portMAX_DELAY);
+        ota_start();
+        xSemaphoreGive(ota.mutex);
+
+        // Mutex is not held while waiting for network, MQTT chunks are
+        // rejected with is_fetching instead.
+        ota_fetch();
+
+        xSemaphoreTake(ota.mutex, portMAX_DELAY);
+        ota.is_fetching = false;
+        xSemaphoreGive(ota.mutex);
+    }
+}
+
+// Command is struct unlock_auth followed by the URL, so only the backend
+// can make the lock download and install an update.
+static void mqtt_ota_fetch_topic_updated(
+    const char *topic, int topic_len,
+    const char *data,  int data_len
+) {
+    const char *error = unlock_verify(OTA_FETCH_SCOPE, data, data_len);
+    if (error != NULL) {
+        ESP_LOGE(TAG, "Fetch command is rejected: %s", error);
+        publish_failed(error);
+        return;
+    }
+    data += sizeof(struct unlock_auth);
+    data_len -= sizeof(struct unlock_auth);
+
+    if (data_len == 0 || data_len >= sizeof(ota.url)) {
+        ESP_LOGE(TAG, "Update URL must be 1 to %d chars long", sizeof(ota.url) - 1);
+        return;
+    }
+
+    xSemaphoreTake(ota.mutex, portMAX_DELAY);
+
+    if (ota.is_fetching) {
+        xSemaphoreGive(ota.mutex);
+        ESP_LOGW(TAG, "Fetch is already in progress");
+        return;
+    }
+
+    memcpy(ota.url, data, data_len);
+    ota.url[data_len] = '\0';
+    ota.is_fetching = true;
+
+    xSemaphoreGive(ota.mutex);
+
+    xTaskNotifyGive(ota.fetch_task);
+}
+
+static void restart(void *arg) {
+    esp_restart();
+}
+
+static void health_check_passed(const char *reason) {
+    esp_ota_mark_app_valid_cancel_rollback();
+
+    const esp_app_desc_t *app = esp_app_get_description();
+    ESP_LOGI(TAG, "Firmware '%s' passed health check: %s", app->version, reason);
+
+    char message[96];
+    snprintf(message, sizeof(message), "{\"state\": \"confirmed\", \"version\": \"%s\"}", app->version);
+    publish_status(message);
+}
+
+// Checks what the firmware can prove without the MQTT server, so a broker
+// outage during an update does not revert good firmware. Setup has passed
+// already, it aborts on any error.
+static const char *self_test(void) {
+    esp_netif_ip_info_t ip_info = {0};
+    esp_netif_t *netif = esp_netif_get_default_netif();
+    if (netif == NULL || esp_netif_get_ip_info(netif, &ip_info) != ESP_OK || ip_info.ip.addr == 0) {
+        return "no IP address";
+    }
+
+    if (!heap_caps_check_integrity_all(true)) {
+        return "heap is corrupted";
+    }
+
+    return NULL;
+}
+
+static void health_check_timeout(void *arg) {
+    const char *error = self_test();
+    if (error != NULL) {
+        ESP_LOGE(TAG, "New firmware did not pass health check: %s, rolling back", error);
+        esp_ota_mark_app_invalid_rollback_and_reboot();
+        return;
+    }
+
+    ESP_LOGW(TAG, "MQTT server is unreachable, firmware is confirmed by self-test");
+    health_check_passed("self-test");
+}
+
+static void mqtt_event_handler(
+    void *arg,
+    esp_event_base_t event_base,
+    int32_t event_id,
+    void *event_data
+) {
+    // Connection to MQTT server means network, TLS and MQTT client work.
+    if (event_id != MQTT_EVENT_CONNECTED || !esp_timer_is_active(ota.health_timer)) return;
+
+    esp_timer_stop(ota.health_timer);
+    health_check_passed("MQTT connected");
+}
+
+static void start_health_check(void) {
+    esp_ota_img_states_t state;
+    if (esp_ota_get_state_partition(ota.running, &state) != ESP_OK || state != ESP_OTA_IMG_PENDING_VERIFY) {
+        return;
+    }
+
+    ESP_LOGW(TAG, "First boot of new firmware, waiting for health check");
+
+    if (mqtt_is_connected()) {
+        health_check_passed("MQTT connected");
+        return;
+    }
+
+    const esp_timer_create_args_t timer_args = {
+        .callback = health_check_timeout,
+        .name = "ota_health",
+    };
+    ESP_ERROR_CHECK(esp_timer_create(&timer_args, &ota.health_timer));
+    ESP_ERROR_CHECK(esp_timer_start_once(ota.health_timer, OTA_HEALTH_CHECK_TIMEOUT_SEC * 1000000LL));
+
+    ESP_ERROR_CHECK(esp_mqtt_client_register_event(mqtt_get_client(), MQTT_EVENT_CONNECTED, &mqtt_event_handler, NULL));
+}
+
+void ota_init(void) {
+    static StackType_t stack[OTA_TASK_STACK_SIZE];
+    static StaticTask_t task;
+
+    ota.running = esp_ota_get_running_partition();
+    ota.mutex = xSemaphoreCreateMutexStatic(&ota.mutex_buffer);
+
+    const esp_partition_t *invalid = esp_ota_get_last_invalid_partition();
+    if (invalid != NULL) {
+        ESP_LOGW(TAG, "Firmware in partition '%s' was rolled back", invalid->label);
+    }
+
+    start_health_check();
+
+    const esp_timer_create_args_t timer_args = {
+        .callback = restart,
+        .name = "ota_restart",
+    };
+    ESP_ERROR_CHECK(esp_timer_create(&timer_args, &ota.restart_timer));
+
+    ota.fetch_task = xTaskCreateStaticPinnedToCore(
+        ota_fetch_thread,
+        "ota_fetch",
+        OTA_TASK_STACK_SIZE,
+        NULL,
+        OTA_TASK_PRIORITY,
+        stack,
+        &task,
+        OTA_TASK_CORE
+    );
+
+    mqtt_subscribe(OTA_TOPIC, /* qos */ 1, mqtt_ota_topic_updated);
+    mqtt_subscribe(OTA_FETCH_TOPIC, /* qos */ 1, mqtt_ota_fetch_topic_updated);
+}
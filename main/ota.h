@@ -0,0 +1,17 @@
+#pragma once
+
+// Firmware updates as full images or detools deltas against the running
+// image, see utils/gen_ota.py. Update is received in chunks on
+// xecut-lock/<id>/ota or fetched from URL published to xecut-lock/<id>/ota/fetch,
+// and is streamed to the inactive OTA partition. Progress is reported to
+// xecut-lock/<id>/ota/status.
+//
+// URL must be signed with the unlock key, see unlock.h. Images below the
+// secure version of the running firmware are rejected.
+//
+// New firmware is confirmed when it connects to MQTT server. If it does not
+// within OTA_HEALTH_CHECK_TIMEOUT_SEC after the first boot, it is confirmed
+// by local self-test, otherwise bootloader rolls back to the previous one.
+
+// Called after mqtt_init and unlock_init.
+void ota_init(void);
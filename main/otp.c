@@ -4,13 +4,16 @@
 #include <esp_timer.h>
 #include <stddef.h>
 #include <stdint.h>
+#include <assert.h>
 #include <stdlib.h>
 #include <string.h>
 #include <math.h>
 #include <sys/time.h>
 #include <machine/endian.h>
 #include <mbedtls/md.h>
-#include <mbedtls/pkcs5.h>
+
+#include "config.h"
+#include "trace.h"
 
 #define TAG "otp"
 
@@ -19,11 +22,7 @@
 #define OTP_DIGITS    6
 #define OTP_TIMESTEP  30
 #define UID_MAX_LEN   32
-
-// Uncomment this line to get timings of otp_verify.
-// #define DEBUG_PERFORMANCE
-
-#define DECENTRALA_PREFIX 'M'
+#define SHA1_SIZE     20
 
 const uint8_t kdf_key[] = {
     #embed "../private/key.bin"
@@ -33,6 +32,81 @@ const uint8_t decentrala_kdf_key[] = {
     #embed "../private/decentrala_key.bin"
 };
 
+// Set up once, because mbedtls_md_setup allocates HMAC state from heap.
+// Used only by OTP worker task.
+static mbedtls_md_context_t hmac;
+
+#ifdef USE_SOAK
+// Used only by soak task, see otp_generate.
+static mbedtls_md_context_t soak_hmac;
+#endif
+
+static void hmac_setup(mbedtls_md_context_t *ctx) {
+    mbedtls_md_init(ctx);
+    int ret = mbedtls_md_setup(ctx, mbedtls_md_info_from_type(MBEDTLS_MD_SHA1), /* hmac */ 1);
+    assert(ret == 0);
+}
+
+void otp_init(void) {
+    hmac_setup(&hmac);
+#ifdef USE_SOAK
+    hmac_setup(&soak_hmac);
+#endif
+}
+
+static void hmac_sha1(
+    mbedtls_md_context_t *hmac,
+    const uint8_t *key,  size_t key_len,
+    const uint8_t *data, size_t data_len,
+    uint8_t *digest
+) {
+    mbedtls_md_hmac_starts(hmac, key, key_len);
+    mbedtls_md_hmac_update(hmac, data, data_len);
+    mbedtls_md_hmac_finish(hmac, digest);
+}
+
+// PBKDF2-HMAC-SHA1 from RFC 8018, same result as mbedtls_pkcs5_pbkdf2_hmac_ext,
+// which sets up a new HMAC context on every call.
+static void pbkdf2_sha1(
+    mbedtls_md_context_t *hmac,
+    const uint8_t *password, size_t password_len,
+    const uint8_t *salt,     size_t salt_len,
+    uint32_t rounds,
+    uint8_t *output, size_t output_len
+) {
+    uint8_t u[SHA1_SIZE];
+    uint8_t t[SHA1_SIZE];
+
+    for (uint32_t block = 1; output_len > 0; block++) {
+        const uint8_t counter[4] = { block >> 24, block >> 16, block >> 8, block };
+
+        mbedtls_md_hmac_starts(hmac, password, password_len);
+        mbedtls_md_hmac_update(hmac, salt, salt_len);
+        mbedtls_md_hmac_update(hmac, counter, sizeof(counter));
+        mbedtls_md_hmac_finish(hmac, u);
+        memcpy(t, u, sizeof(t));
+
+        for (uint32_t round = 1; round < rounds; round++) {
+            // Keeps the key, only restarts inner hash.
+            mbedtls_md_hmac_reset(hmac);
+            mbedtls_md_hmac_update(hmac, u, sizeof(u));
+            mbedtls_md_hmac_finish(hmac, u);
+
+            for (int i = 0; i < SHA1_SIZE; i++) {
+                t[i] ^= u[i];
+            }
+        }
+
+        size_t len = output_len < SHA1_SIZE ? output_len : SHA1_SIZE;
+        memcpy(output, t, len);
+        output += len;
+        output_len -= len;
+    }
+
+    memset(u, 0, sizeof(u));
+    memset(t, 0, sizeof(t));
+}
+
 static uint32_t otp_truncate(const uint8_t *digest, uint8_t digits) {
   uint64_t offset = digest[19] & 0x0f;
   uint32_t bin_code =
@@ -45,6 +119,7 @@ static uint32_t otp_truncate(const uint8_t *digest, uint8_t digits) {
 };
 
 static uint32_t get_otp(
+    mbedtls_md_context_t *hmac,
     uint8_t key[],
     uint8_t key_len,
     uint8_t digits,
@@ -67,10 +142,10 @@ static uint32_t get_otp(
     step = bswap_64(step);
 #endif
 
-    mbedtls_md_hmac(
-        mbedtls_md_info_from_type(MBEDTLS_MD_SHA1),
+    hmac_sha1(
+        hmac,
         key, key_len,
-        (const unsigned char *)&step, sizeof(step),
+        (const uint8_t *)&step, sizeof(step),
         digest
     );
     
@@ -85,37 +160,39 @@ static uint32_t str_to_uint32(const char *str) {
     return ret;
 }
 
-static uint32_t calculate_otp(const char *uid, const uint8_t *kdf, const size_t kdf_size) {
-    struct timeval tv_now;
-    gettimeofday(&tv_now, NULL);
-    uint64_t step = tv_now.tv_sec / OTP_TIMESTEP;
-
+static uint32_t calculate_otp(
+    mbedtls_md_context_t *hmac,
+    const char *uid,
+    const uint8_t *kdf, const size_t kdf_size,
+    uint64_t step
+) {
     uint8_t otp_key[OTP_KEY_SIZE];
-    mbedtls_pkcs5_pbkdf2_hmac_ext(
-        MBEDTLS_MD_SHA1,
+    TRACE_BEGIN("otp_kdf");
+    pbkdf2_sha1(
+        hmac,
         (const uint8_t*)uid, strlen(uid),
         kdf, kdf_size,
         KDF_ROUNDS,
-        sizeof(otp_key), otp_key
+        otp_key, sizeof(otp_key)
     );
+    TRACE_END("otp_kdf");
 
-    return get_otp(otp_key, sizeof(otp_key), OTP_DIGITS, step);
+    return get_otp(hmac, otp_key, sizeof(otp_key), OTP_DIGITS, step);
 }
 
 static void prepare_decentrala_uid(const char *uid, char *decentrala_uid) {
     time_t rawtime = time(NULL);
-    struct tm *timeinfo = localtime(&rawtime);
+    struct tm timeinfo;
+    localtime_r(&rawtime, &timeinfo);
 
-    int month = timeinfo->tm_mon + 1;
-    int year = timeinfo->tm_year + 1900;
+    int month = timeinfo.tm_mon + 1;
+    int year = timeinfo.tm_year + 1900;
 
     sprintf(decentrala_uid, "%s%02d%04d", uid, month, year);
 }
 
 bool otp_verify(const char *uid, const char *code) {
-#ifdef DEBUG_PERFORMANCE
-    uint64_t start = esp_timer_get_time();
-#endif
+    TRACE_BEGIN("otp_verify");
 
     const bool is_decentrala = (*uid == DECENTRALA_PREFIX);
 
@@ -129,13 +206,14 @@ bool otp_verify(const char *uid, const char *code) {
     const size_t   otp_kdf_size = is_decentrala ? sizeof(decentrala_kdf_key) : sizeof(kdf_key);
 
     uint32_t user_code  = str_to_uint32(code);
-    uint32_t valid_code = calculate_otp(otp_uid, otp_kdf, otp_kdf_size);
+    struct timeval tv_now;
+    gettimeofday(&tv_now, NULL);
+    uint64_t step = tv_now.tv_sec / OTP_TIMESTEP;
+
+    uint32_t valid_code = calculate_otp(&hmac, otp_uid, otp_kdf, otp_kdf_size, step);
     int is_valid = user_code == valid_code;
 
-#ifdef DEBUG_PERFORMANCE
-    uint64_t end = esp_timer_get_time();
-    ESP_LOGI(TAG, "otp_verify took %llu milliseconds to get otp", (end - start)/1000);
-#endif
+    TRACE_END("otp_verify");
 
     // ESP_LOGD(
     //     TAG, "Code for user '%s' is %06d, input is %06d, otp is %s",
@@ -144,3 +222,14 @@ bool otp_verify(const char *uid, const char *code) {
 
     return is_valid;
 }
+
+#ifdef USE_SOAK
+uint32_t otp_generate(const char *uid, int64_t *expires_at) {
+    struct timeval tv_now;
+    gettimeofday(&tv_now, NULL);
+    uint64_t step = tv_now.tv_sec / OTP_TIMESTEP;
+
+    *expires_at = (step + 1) * OTP_TIMESTEP;
+    return calculate_otp(&soak_hmac, uid, kdf_key, sizeof(kdf_key), step);
+}
+#endif
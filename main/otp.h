@@ -1,5 +1,19 @@
 #pragma once
 
 #include <stdbool.h>
+#include <stdint.h>
+
+#include "config.h"
+
+#define DECENTRALA_PREFIX 'M'
+
+// Must be called before the first otp_verify.
+void otp_init(void);
 
 bool otp_verify(const char *uid,  const char *code);
+
+#ifdef USE_SOAK
+// Current code of a regular user for synthetic checkins. Unix time when it
+// expires is stored to expires_at. Called only by soak task.
+uint32_t otp_generate(const char *uid, int64_t *expires_at);
+#endif
@@ -0,0 +1,109 @@
+#include "otp_worker.h"
+
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <freertos/queue.h>
+#include <string.h>
+
+#include "otp.h"
+#include "event_loop.h"
+#include "tasks.h"
+#include "trace.h"
+#include "dlog.h"
+#include "heap_guard.h"
+#include "power.h"
+#include "soak.h"
+
+#define TAG "otp_worker"
+
+struct otp_job {
+    void *ctx;
+    char uid[KEYPAD_BUFFER_SIZE_WITH_NULL];
+    char code[KEYPAD_BUFFER_SIZE_WITH_NULL];
+
+    int64_t submitted_at;
+};
+
+static struct {
+    QueueHandle_t jobs;
+} worker = {0};
+
+static void otp_worker_thread(void *param) {
+    struct otp_job job;
+
+    for (;;) {
+        xQueueReceive(worker.jobs, &job, portMAX_DELAY);
+
+        power_cpu_max_acquire();
+        int64_t start = esp_timer_get_time();
+        bool is_valid = otp_verify(job.uid, job.code);
+        SOAK_RECORD(SOAK_OTP_VERIFY, start);
+
+        struct event event = {
+            .id = EVENT_OTP_RESULT,
+            .otp_result = {
+                .ctx = job.ctx,
+                .is_valid = is_valid,
+                .submitted_at = job.submitted_at,
+                .completed_at = esp_timer_get_time(),
+            },
+        };
+        power_cpu_max_release();
+        memcpy(event.otp_result.uid, job.uid, sizeof(event.otp_result.uid));
+
+        // Do not keep entered codes in memory longer than needed.
+        memset(&job, 0, sizeof(job));
+
+        const struct otp_result *result = &event.otp_result;
+        DLOGD(TAG, "Verification took %lu us", (uint32_t)(result->completed_at - result->submitted_at));
+
+        // Verified checkin must not be lost, wait for the event loop.
+        event_loop_post(&event, portMAX_DELAY);
+    }
+}
+
+void otp_worker_init(void) {
+    static uint8_t jobs_storage[OTP_QUEUE_SIZE * sizeof(struct otp_job)];
+    static StaticQueue_t jobs_queue;
+    static StackType_t stack[OTP_TASK_STACK_SIZE];
+    static StaticTask_t task;
+
+    otp_init();
+
+    worker.jobs = xQueueCreateStatic(OTP_QUEUE_SIZE, sizeof(struct otp_job), jobs_storage, &jobs_queue);
+
+    TaskHandle_t handle = xTaskCreateStaticPinnedToCore(
+        otp_worker_thread,
+        "otp_worker",
+        OTP_TASK_STACK_SIZE,
+        NULL,
+        OTP_TASK_PRIORITY,
+        stack,
+        &task,
+        OTP_TASK_CORE
+    );
+    heap_guard_watch_task(handle);
+}
+
+bool otp_worker_submit(void *ctx, const char *uid, const char *code) {
+    struct otp_job job = {
+        .ctx = ctx,
+        .submitted_at = esp_timer_get_time(),
+    };
+    strlcpy(job.uid, uid, sizeof(job.uid));
+    strlcpy(job.code, code, sizeof(job.code));
+
+    TRACE_INSTANT("otp_submit");
+
+    bool queued = xQueueSend(worker.jobs, &job, 0) == pdTRUE;
+    if (!queued) {
+        ESP_LOGW(TAG, "Verification queue is full, dropping code for user '%s'", uid);
+    }
+
+    memset(&job, 0, sizeof(job));
+
+    return queued;
+}
+
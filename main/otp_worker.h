@@ -0,0 +1,20 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "keypad.h"
+
+struct otp_result {
+    void *ctx;
+    char uid[KEYPAD_BUFFER_SIZE_WITH_NULL];
+    bool is_valid;
+
+    int64_t submitted_at;
+    int64_t completed_at;
+};
+
+void otp_worker_init(void);
+
+// Result is posted to event loop as EVENT_OTP_RESULT.
+bool otp_worker_submit(void *ctx, const char *uid, const char *code);
@@ -0,0 +1,267 @@
+#include "payload.h"
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+
+#define CBOR_UINT        0
+#define CBOR_NEGINT      1
+#define CBOR_TEXT        3
+#define CBOR_ARRAY       4
+#define CBOR_MAP         5
+#define CBOR_TAG         6
+#define CBOR_SIMPLE      7
+
+#define CBOR_INDEFINITE  31
+#define CBOR_FALSE       20
+#define CBOR_TRUE        21
+#define CBOR_BREAK       0xFF
+
+#define CBOR_TAG_EPOCH   1
+
+static const char *field_names[] = {
+#define PAYLOAD_FIELD_NAME(id, key, name) [key] = name,
+    PAYLOAD_FIELDS(PAYLOAD_FIELD_NAME)
+#undef PAYLOAD_FIELD_NAME
+};
+
+static void put(struct payload *p, const void *data, size_t len) {
+    if (p->is_overflow || p->len + len > p->size) {
+        p->is_overflow = true;
+        return;
+    }
+
+    memcpy(&p->buf[p->len], data, len);
+    p->len += len;
+}
+
+static void put_byte(struct payload *p, uint8_t byte) {
+    put(p, &byte, 1);
+}
+
+static void cbor_head(struct payload *p, uint8_t major, uint64_t value) {
+    uint8_t head[9];
+    int len;
+
+    if (value < 24) {
+        head[0] = major << 5 | value;
+        len = 1;
+    } else if (value <= UINT8_MAX) {
+        head[0] = major << 5 | 24;
+        len = 2;
+    } else if (value <= UINT16_MAX) {
+        head[0] = major << 5 | 25;
+        len = 3;
+    } else if (value <= UINT32_MAX) {
+        head[0] = major << 5 | 26;
+        len = 5;
+    } else {
+        head[0] = major << 5 | 27;
+        len = 9;
+    }
+
+    // Argument is big endian.
+    for (int i = 1; i < len; i++) {
+        head[i] = value >> (8 * (len - 1 - i));
+    }
+
+    put(p, head, len);
+}
+
+// Puts comma before every item of JSON container except the first one and
+// except map values, which follow a key.
+static void json_separator(struct payload *p) {
+    if (p->after_key) {
+        p->after_key = false;
+        return;
+    }
+
+    if (p->depth > 0 && p->items[p->depth - 1]++ > 0) {
+        put_byte(p, ',');
+    }
+}
+
+static void json_text(struct payload *p, const char *value) {
+    put_byte(p, '"');
+
+    for (const char *c = value; *c; c++) {
+        if (*c == '"' || *c == '\\') {
+            put_byte(p, '\\');
+            put_byte(p, *c);
+        } else if ((uint8_t)*c < 0x20) {
+            char escaped[8];
+            snprintf(escaped, sizeof(escaped), "\\u%04x", *c);
+            put(p, escaped, 6);
+        } else {
+            put_byte(p, *c);
+        }
+    }
+
+    put_byte(p, '"');
+}
+
+static void begin(struct payload *p, uint8_t major, char opener, char closer) {
+    if (p->format == PAYLOAD_CBOR) {
+        put_byte(p, major << 5 | CBOR_INDEFINITE);
+        return;
+    }
+
+    json_separator(p);
+    put_byte(p, opener);
+
+    if (p->depth == PAYLOAD_DEPTH_MAX) {
+        p->is_overflow = true;
+        return;
+    }
+
+    p->items[p->depth] = 0;
+    p->closers[p->depth] = closer;
+    p->depth++;
+}
+
+void payload_init(struct payload *p, enum payload_format format, void *buf, size_t size) {
+    *p = (struct payload) {
+        .format = format,
+        .buf = buf,
+        .size = size,
+    };
+}
+
+void payload_map_begin(struct payload *p) {
+    begin(p, CBOR_MAP, '{', '}');
+}
+
+void payload_array_begin(struct payload *p) {
+    begin(p, CBOR_ARRAY, '[', ']');
+}
+
+void payload_end(struct payload *p) {
+    if (p->format == PAYLOAD_CBOR) {
+        put_byte(p, CBOR_BREAK);
+        return;
+    }
+
+    if (p->depth == 0) {
+        p->is_overflow = true;
+        return;
+    }
+
+    p->depth--;
+    put_byte(p, p->closers[p->depth]);
+}
+
+void payload_key(struct payload *p, enum payload_field field) {
+    if (p->format == PAYLOAD_CBOR) {
+        cbor_head(p, CBOR_UINT, field);
+        return;
+    }
+
+    json_separator(p);
+    json_text(p, field_names[field]);
+    put_byte(p, ':');
+    p->after_key = true;
+}
+
+void payload_text(struct payload *p, const char *value) {
+    if (p->format == PAYLOAD_CBOR) {
+        size_t len = strlen(value);
+        cbor_head(p, CBOR_TEXT, len);
+        put(p, value, len);
+        return;
+    }
+
+    json_separator(p);
+    json_text(p, value);
+}
+
+void payload_uint(struct payload *p, uint64_t value) {
+    if (p->format == PAYLOAD_CBOR) {
+        cbor_head(p, CBOR_UINT, value);
+        return;
+    }
+
+    char number[24];
+    int len = snprintf(number, sizeof(number), "%" PRIu64, value);
+
+    json_separator(p);
+    put(p, number, len);
+}
+
+void payload_int(struct payload *p, int64_t value) {
+    if (p->format == PAYLOAD_CBOR) {
+        if (value >= 0) {
+            cbor_head(p, CBOR_UINT, value);
+        } else {
+            cbor_head(p, CBOR_NEGINT, -1 - value);
+        }
+        return;
+    }
+
+    char number[24];
+    int len = snprintf(number, sizeof(number), "%" PRId64, value);
+
+    json_separator(p);
+    put(p, number, len);
+}
+
+void payload_bool(struct payload *p, bool value) {
+    if (p->format == PAYLOAD_CBOR) {
+        put_byte(p, CBOR_SIMPLE << 5 | (value ? CBOR_TRUE : CBOR_FALSE));
+        return;
+    }
+
+    json_separator(p);
+    if (value) {
+        put(p, "true", 4);
+    } else {
+        put(p, "false", 5);
+    }
+}
+
+void payload_key_text(struct payload *p, enum payload_field field, const char *value) {
+    payload_key(p, field);
+    payload_text(p, value);
+}
+
+void payload_key_uint(struct payload *p, enum payload_field field, uint64_t value) {
+    payload_key(p, field);
+    payload_uint(p, value);
+}
+
+void payload_timestamp(struct payload *p, int64_t value) {
+    if (p->format == PAYLOAD_CBOR) {
+        cbor_head(p, CBOR_TAG, CBOR_TAG_EPOCH);
+        payload_int(p, value);
+        return;
+    }
+
+    char number[24];
+    int len = snprintf(number, sizeof(number), "\"%" PRId64 "\"", value);
+
+    json_separator(p);
+    put(p, number, len);
+}
+
+void payload_raw(struct payload *p, const void *data, size_t len) {
+    if (p->format == PAYLOAD_JSON) {
+        json_separator(p);
+    }
+
+    put(p, data, len);
+}
+
+int payload_finish(struct payload *p) {
+    if (p->format == PAYLOAD_JSON) {
+        // Terminator is not counted in length.
+        put_byte(p, '\0');
+        if (!p->is_overflow) {
+            p->len--;
+        }
+    }
+
+    if (p->is_overflow || p->depth != 0) {
+        return -1;
+    }
+
+    return p->len;
+}
@@ -0,0 +1,75 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "config.h"
+#include "payload_schema.h"
+
+// Writer of lock payloads in JSON or CBOR (RFC 8949). Both formats are
+// produced by the same calls, so a payload is described once. Containers are
+// CBOR indefinite length, so field count need not be known in advance.
+//
+// Has no ESP-IDF dependencies, utils/bench_payload.c builds it on host.
+
+#define PAYLOAD_DEPTH_MAX  4
+
+// Buffer of the status document, for status topic and HTTP /status. Status
+// grows with doors, inputs, brokers and event handlers.
+#define PAYLOAD_STATUS_SIZE  3072
+
+enum payload_format {
+    PAYLOAD_JSON,
+    PAYLOAD_CBOR,
+};
+
+// Format of lock topics is selected per deployment. CBOR topics get a
+// suffix, so a backend never confuses the formats.
+#ifdef USE_CBOR
+#define PAYLOAD_FORMAT        PAYLOAD_CBOR
+#define PAYLOAD_TOPIC_SUFFIX  "/cbor"
+#else
+#define PAYLOAD_FORMAT        PAYLOAD_JSON
+#define PAYLOAD_TOPIC_SUFFIX  ""
+#endif
+
+struct payload {
+    enum payload_format format;
+    uint8_t *buf;
+    size_t size;
+    size_t len;
+    bool is_overflow;
+
+    // Used by JSON only, to put separators and closing brackets.
+    int depth;
+    uint16_t items[PAYLOAD_DEPTH_MAX];
+    char closers[PAYLOAD_DEPTH_MAX];
+    bool after_key;
+};
+
+void payload_init(struct payload *p, enum payload_format format, void *buf, size_t size);
+
+void payload_map_begin(struct payload *p);
+void payload_array_begin(struct payload *p);
+void payload_end(struct payload *p);
+
+void payload_key(struct payload *p, enum payload_field field);
+
+void payload_text(struct payload *p, const char *value);
+void payload_uint(struct payload *p, uint64_t value);
+void payload_int(struct payload *p, int64_t value);
+void payload_bool(struct payload *p, bool value);
+
+void payload_key_text(struct payload *p, enum payload_field field, const char *value);
+void payload_key_uint(struct payload *p, enum payload_field field, uint64_t value);
+
+// Unix time in seconds. JSON keeps quoted decimal string for compatibility
+// with existing backends, CBOR uses tag 1.
+void payload_timestamp(struct payload *p, int64_t value);
+
+// Appends a value encoded by another writer of the same format.
+void payload_raw(struct payload *p, const void *data, size_t len);
+
+// Returns payload length or -1 if buffer is too small. JSON is null terminated.
+int payload_finish(struct payload *p);
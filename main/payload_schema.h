@@ -0,0 +1,99 @@
+#pragma once
+
+// Fields of checkin, command, alarm, status and crash summary payloads. JSON
+// uses the name, CBOR uses the integer key to keep messages small. Keys must
+// never be reused. utils/decode_cbor.py parses this file, keep one field per
+// line.
+#define PAYLOAD_FIELDS(X) \
+    X(UID,                  1,  "uid") \
+    X(TIMESTAMP,            2,  "timestamp") \
+    X(COMMAND,              3,  "command") \
+    X(EVENT,                4,  "event") \
+    X(STATUS,               5,  "status") \
+    X(UPTIME,               6,  "uptime") \
+    X(LOG_DROPPED,          7,  "log_dropped") \
+    X(HEAP_FREE,            8,  "heap_free") \
+    X(HEAP_MIN_FREE,        9,  "heap_min_free") \
+    X(HEAP_VIOLATIONS,      10, "heap_violations") \
+    X(WAKEUPS,              11, "wakeups") \
+    X(SLEPT_MS,             12, "slept_ms") \
+    X(TLS_FULL,             13, "tls_full") \
+    X(TLS_FULL_AVG_MS,      14, "tls_full_avg_ms") \
+    X(TLS_RESUMED,          15, "tls_resumed") \
+    X(TLS_RESUMED_AVG_MS,   16, "tls_resumed_avg_ms") \
+    X(MQTT_PUBLISHED,       17, "mqtt_published") \
+    X(MQTT_PUBLISHED_BYTES, 18, "mqtt_published_bytes") \
+    X(MQTT_ROUND_TRIPS,     19, "mqtt_round_trips") \
+    X(EVENTS,               20, "events") \
+    X(EVENT_PUBLISHES,      21, "event_publishes") \
+    X(DOORS,                22, "doors") \
+    X(NAME,                 23, "name") \
+    X(AVG_US,               24, "avg_us") \
+    X(MAX_US,               25, "max_us") \
+    X(MAX_QUEUED,           26, "max_queued") \
+    X(RX_ERRORS,            27, "rx_errors") \
+    X(WAKE_DROPPED,         28, "wake_dropped") \
+    X(WAKE_MAX_US,          29, "wake_max_us") \
+    X(RESET_REASON,         30, "reset_reason") \
+    X(VERSION,              31, "version") \
+    X(ELF_SHA256,           32, "elf_sha256") \
+    X(TASK,                 33, "task") \
+    X(PC,                   34, "pc") \
+    X(EXC_CAUSE,            35, "exc_cause") \
+    X(EXC_VADDR,            36, "exc_vaddr") \
+    X(REGISTERS,            37, "registers") \
+    X(BACKTRACE,            38, "backtrace") \
+    X(BACKTRACE_CORRUPTED,  39, "backtrace_corrupted") \
+    X(TASKS,                40, "tasks") \
+    X(TCB,                  41, "tcb") \
+    X(SIZE,                 42, "size") \
+    X(MQTT_PUBLISH_MAX_US,  43, "mqtt_publish_max_us") \
+    X(MQTT_ENQUEUE_MAX_US,  44, "mqtt_enqueue_max_us") \
+    X(MQTT_UNDELIVERED,     45, "mqtt_undelivered") \
+    X(EVENT_LOOP,           46, "event_loop") \
+    X(DROPPED,              47, "dropped") \
+    X(HANDLERS,             48, "handlers") \
+    X(CALLS,                49, "calls") \
+    X(DISPATCH_MAX_US,      50, "dispatch_max_us") \
+    X(EXEC_MAX_US,          51, "exec_max_us") \
+    X(QUERY,                52, "query") \
+    X(PAGE,                 53, "page") \
+    X(LAST,                 54, "last") \
+    X(ENTRIES,              55, "entries") \
+    X(SEQ,                  56, "seq") \
+    X(DOOR,                 57, "door") \
+    X(BROKER,               58, "broker") \
+    X(BROKERS,              59, "brokers") \
+    X(BROKER_SWITCHES,      60, "broker_switches") \
+    X(HEALTHY,              61, "healthy") \
+    X(RTT_MS,               62, "rtt_ms") \
+    X(FAST_START,           63, "fast_start") \
+    X(IP_READY_MS,          64, "ip_ready_ms") \
+    X(MQTT_READY_MS,        65, "mqtt_ready_ms") \
+    X(DNS_CACHE_HITS,       66, "dns_cache_hits") \
+    X(TIMESTAMP_US,         67, "timestamp_us") \
+    X(LATENCY_US,           68, "latency_us") \
+    X(DOOR_OPEN,            69, "door_open") \
+    X(SENSOR_EVENTS,        70, "sensor_events") \
+    X(SENSOR_BOUNCES,       71, "sensor_bounces") \
+    X(SENSOR_AVG_US,        72, "sensor_avg_us") \
+    X(SENSOR_MAX_US,        73, "sensor_max_us") \
+    X(INPUTS,               74, "inputs") \
+    X(FRAMES,               75, "frames") \
+    X(INJECTED,             76, "injected") \
+    X(MALFORMED,            77, "malformed") \
+    X(INJECT_DROPPED,       78, "inject_dropped") \
+    X(VERIFIED,             79, "verified") \
+    X(REJECTED,             80, "rejected") \
+    X(MISMATCHES,           81, "mismatches") \
+    X(LOOP_DROPPED,         82, "loop_dropped") \
+    X(LATENCY,              83, "latency") \
+    X(BUCKETS,              84, "buckets") \
+    X(STACK_FREE,           85, "stack_free") \
+    X(DELAYED,              86, "delayed")
+
+enum payload_field {
+#define PAYLOAD_FIELD_ENUM(id, key, name) PAYLOAD_##id = key,
+    PAYLOAD_FIELDS(PAYLOAD_FIELD_ENUM)
+#undef PAYLOAD_FIELD_ENUM
+};
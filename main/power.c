@@ -0,0 +1,120 @@
+#include "power.h"
+
+#include <esp_err.h>
+#include <esp_log.h>
+#include <esp_pm.h>
+#include <esp_sleep.h>
+#include <esp_timer.h>
+#include <esp_attr.h>
+#include <driver/gpio.h>
+
+#include "config.h"
+#include "hardware.h"
+
+#define TAG "power"
+
+#if defined(USE_POWER_SAVE) && !defined(CONFIG_PM_ENABLE)
+#error "USE_POWER_SAVE requires CONFIG_PM_ENABLE and CONFIG_FREERTOS_USE_TICKLESS_IDLE in sdkconfig"
+#endif
+
+// XTAL frequency, so APB clock and everything clocked from XTAL keeps running.
+#define POWER_MIN_CPU_FREQ_MHZ  40
+
+static struct {
+    esp_pm_lock_handle_t cpu_max_lock;
+    esp_pm_lock_handle_t stay_awake_lock;
+
+    uint32_t wakeups;
+    uint64_t slept_us;
+    int64_t wakeup_timestamp;
+} power = {
+    .wakeup_timestamp = INT64_MAX,
+};
+
+#ifdef USE_POWER_SAVE
+static IRAM_ATTR esp_err_t power_light_sleep_exit(int64_t sleep_time_us, void *arg) {
+    power.wakeups++;
+    power.slept_us += sleep_time_us;
+    power.wakeup_timestamp = esp_timer_get_time();
+
+    return ESP_OK;
+}
+
+static void power_enable_wakeup_pins(void) {
+    // UART RX pins are enabled by input.c, door sensors by door_sensor.c.
+    for (int i = 0; i < DOORS_COUNT; i++) {
+        // Keep lock output driven as configured while sleeping.
+        ESP_ERROR_CHECK(gpio_sleep_sel_dis(doors_hardware[i].lock_gpio));
+
+        // Keep pull-ups of door sensors, their wakeup level is set by door_sensor.c.
+        if (doors_hardware[i].contact_gpio != GPIO_NUM_NC) {
+            ESP_ERROR_CHECK(gpio_sleep_sel_dis(doors_hardware[i].contact_gpio));
+        }
+        if (doors_hardware[i].exit_gpio != GPIO_NUM_NC) {
+            ESP_ERROR_CHECK(gpio_sleep_sel_dis(doors_hardware[i].exit_gpio));
+        }
+    }
+
+#ifndef USE_WIFI
+    // W5500 interrupt is active low. With WiFi the driver wakes up for beacons itself.
+    ESP_ERROR_CHECK(gpio_wakeup_enable(ETH_SPI_INT_GPIO, GPIO_INTR_LOW_LEVEL));
+#endif
+
+    ESP_ERROR_CHECK(esp_sleep_enable_gpio_wakeup());
+
+    // UART inputs are clocked from XTAL, it keeps running in light sleep so
+    // they receive the byte whose start bit wakes the chip.
+    ESP_ERROR_CHECK(esp_sleep_pd_config(ESP_PD_DOMAIN_XTAL, ESP_PD_OPTION_ON));
+}
+#endif
+
+void power_init(void) {
+    ESP_ERROR_CHECK(esp_pm_lock_create(ESP_PM_CPU_FREQ_MAX, 0, "cpu_max", &power.cpu_max_lock));
+    ESP_ERROR_CHECK(esp_pm_lock_create(ESP_PM_NO_LIGHT_SLEEP, 0, "stay_awake", &power.stay_awake_lock));
+
+#ifdef USE_POWER_SAVE
+    power_enable_wakeup_pins();
+
+    esp_pm_sleep_cbs_register_config_t cbs = {
+        .exit_cb = power_light_sleep_exit,
+    };
+    ESP_ERROR_CHECK(esp_pm_light_sleep_register_cbs(&cbs));
+
+    esp_pm_config_t config = {
+        .max_freq_mhz = CONFIG_ESP_DEFAULT_CPU_FREQ_MHZ,
+        .min_freq_mhz = POWER_MIN_CPU_FREQ_MHZ,
+        .light_sleep_enable = true,
+    };
+    ESP_ERROR_CHECK(esp_pm_configure(&config));
+
+    ESP_LOGI(TAG, "Power save enabled, CPU %d-%d MHz with light sleep", POWER_MIN_CPU_FREQ_MHZ, CONFIG_ESP_DEFAULT_CPU_FREQ_MHZ);
+#endif
+}
+
+void power_cpu_max_acquire(void) {
+    esp_pm_lock_acquire(power.cpu_max_lock);
+}
+
+void power_cpu_max_release(void) {
+    esp_pm_lock_release(power.cpu_max_lock);
+}
+
+void power_stay_awake_acquire(void) {
+    esp_pm_lock_acquire(power.stay_awake_lock);
+}
+
+void power_stay_awake_release(void) {
+    esp_pm_lock_release(power.stay_awake_lock);
+}
+
+int64_t power_since_wakeup_us(void) {
+    if (power.wakeup_timestamp == INT64_MAX) {
+        return INT64_MAX;
+    }
+    return esp_timer_get_time() - power.wakeup_timestamp;
+}
+
+void power_get_stats(struct power_stats *stats) {
+    stats->wakeups = power.wakeups;
+    stats->slept_us = power.slept_us;
+}
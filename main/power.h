@@ -0,0 +1,35 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Idle power mode, enabled with USE_POWER_SAVE in config.h. CPU runs at
+// XTAL frequency while idle and enters light sleep automatically, keypad and
+// RS-485 UART RX and Ethernet interrupt pins wake it up. Wiegand readers keep the
+// chip out of light sleep, see input_wiegand.c.
+//
+// CONFIG_PM_ENABLE and CONFIG_FREERTOS_USE_TICKLESS_IDLE stay on in every
+// build. Without USE_POWER_SAVE esp_pm_configure is never called, so the CPU
+// stays at its default frequency, the chip never sleeps and locks below
+// have no effect beyond their bookkeeping.
+
+void power_init(void);
+
+// Keep CPU at maximum frequency, e.g. during OTP verification.
+void power_cpu_max_acquire(void);
+void power_cpu_max_release(void);
+
+// Forbid light sleep, e.g. while keypad input is in progress. Nested calls
+// are counted.
+void power_stay_awake_acquire(void);
+void power_stay_awake_release(void);
+
+// Time from wakeup to now, INT64_MAX if the chip did not sleep yet.
+int64_t power_since_wakeup_us(void);
+
+struct power_stats {
+    uint32_t wakeups;
+    uint64_t slept_us;
+};
+
+void power_get_stats(struct power_stats *stats);
@@ -0,0 +1,359 @@
+#include "schedule.h"
+
+#include <esp_log.h>
+#include <esp_rom_crc.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include "ntp.h"
+#include "otp.h"
+#include "storage.h"
+
+#define TAG "schedule"
+
+// These values must be identical to the values from the utils/gen_schedule.py file.
+#define SCHEDULE_MAGIC          0x48435358  // "XSCH"
+#define SCHEDULE_VERSION        1
+#define SCHEDULE_SLOT_MINUTES   15
+#define SCHEDULE_UID_LEN        32
+#define SCHEDULE_GROUPS_MAX     32
+#define SCHEDULE_MEMBERS_MAX    256
+#define SCHEDULE_HOLIDAYS_MAX   32
+#define SCHEDULE_GROUP_ANY      0xFF
+
+#define SCHEDULE_DAY_SLOTS   (24 * 60 / SCHEDULE_SLOT_MINUTES)
+#define SCHEDULE_WEEK_SLOTS  (7 * SCHEDULE_DAY_SLOTS)
+#define SCHEDULE_DAY_BYTES   (SCHEDULE_DAY_SLOTS / 8)
+#define SCHEDULE_WEEK_BYTES  (SCHEDULE_WEEK_SLOTS / 8)
+
+// Open addressing table for uid lookups, kept at most half full.
+#define SCHEDULE_INDEX_SIZE   (SCHEDULE_MEMBERS_MAX * 2)
+#define SCHEDULE_INDEX_EMPTY  0xFFFF
+
+// Recurring holidays are indexed by month and day, so lookup does not depend on
+// leap years. Dated ones are few and are scanned, the same date may repeat
+// in different years.
+#define SCHEDULE_DATES              (12 * 31)
+#define SCHEDULE_DATE(month, mday)  (((month) - 1) * 31 + ((mday) - 1))
+#define SCHEDULE_NO_HOLIDAY         0xFF
+
+#define SCHEDULE_NVS_NAMESPACE  "schedule"
+#define SCHEDULE_NVS_KEY        "blob"
+
+#define SLOT_IS_SET(bitmap, slot)  (((bitmap)[(slot) / 8] >> ((slot) % 8)) & 1)
+
+struct schedule_header {
+    uint32_t magic;
+    uint16_t version;
+    uint8_t  groups_count;
+    // Group for uids which are not listed in members, SCHEDULE_GROUP_ANY for no restrictions.
+    uint8_t  default_group;
+    uint8_t  decentrala_group;
+    uint8_t  reserved;
+    uint16_t members_count;
+    uint16_t holidays_count;
+    uint16_t reserved2;
+} __attribute__((packed));
+
+struct schedule_member {
+    // Zero padded, not null terminated if uid is exactly SCHEDULE_UID_LEN chars long.
+    char    uid[SCHEDULE_UID_LEN];
+    uint8_t group;
+} __attribute__((packed));
+
+struct schedule_holiday {
+    // Zero for holidays repeated every year.
+    uint16_t year;
+    uint8_t  month;
+    uint8_t  mday;
+    // Bitmask of groups which use holiday slots instead of their week bitmap.
+    uint32_t groups;
+    uint8_t  slots[SCHEDULE_DAY_BYTES];
+} __attribute__((packed));
+
+#define SCHEDULE_BLOB_MAX ( \
+    sizeof(struct schedule_header) + \
+    SCHEDULE_GROUPS_MAX * SCHEDULE_WEEK_BYTES + \
+    SCHEDULE_MEMBERS_MAX * sizeof(struct schedule_member) + \
+    SCHEDULE_HOLIDAYS_MAX * sizeof(struct schedule_holiday) + \
+    sizeof(uint32_t) \
+)
+
+static struct {
+    SemaphoreHandle_t mutex;
+    bool loaded;
+
+    // Raw blob as received, all pointers below point into it.
+    uint8_t blob[SCHEDULE_BLOB_MAX];
+    size_t blob_len;
+
+    const struct schedule_header *header;
+    const uint8_t *weeks;
+    const struct schedule_member *members;
+    const struct schedule_holiday *holidays;
+
+    uint16_t members_index[SCHEDULE_INDEX_SIZE];
+    uint8_t recurring_holidays[SCHEDULE_DATES];
+} schedule = {0};
+
+static uint32_t uid_hash(const char *uid, size_t uid_len) {
+    // FNV-1a
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < uid_len; i++) {
+        hash ^= (uint8_t)uid[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static size_t member_uid_len(const struct schedule_member *member) {
+    return strnlen(member->uid, SCHEDULE_UID_LEN);
+}
+
+static size_t schedule_expected_len(const struct schedule_header *header) {
+    return sizeof(struct schedule_header)
+        + header->groups_count * SCHEDULE_WEEK_BYTES
+        + header->members_count * sizeof(struct schedule_member)
+        + header->holidays_count * sizeof(struct schedule_holiday)
+        + sizeof(uint32_t);
+}
+
+static bool is_valid_group(const struct schedule_header *header, uint8_t group) {
+    return group == SCHEDULE_GROUP_ANY || group < header->groups_count;
+}
+
+static bool schedule_validate(const uint8_t *blob, size_t blob_len) {
+    if (blob_len < sizeof(struct schedule_header) + sizeof(uint32_t) || blob_len > SCHEDULE_BLOB_MAX) {
+        ESP_LOGE(TAG, "Invalid schedule size %u", blob_len);
+        return false;
+    }
+
+    struct schedule_header header;
+    memcpy(&header, blob, sizeof(header));
+
+    if (header.magic != SCHEDULE_MAGIC || header.version != SCHEDULE_VERSION) {
+        ESP_LOGE(TAG, "Unsupported schedule format %08lx v%u", header.magic, header.version);
+        return false;
+    }
+
+    if (header.groups_count > SCHEDULE_GROUPS_MAX ||
+        header.members_count > SCHEDULE_MEMBERS_MAX ||
+        header.holidays_count > SCHEDULE_HOLIDAYS_MAX
+    ) {
+        ESP_LOGE(TAG, "Schedule exceeds limits");
+        return false;
+    }
+
+    if (schedule_expected_len(&header) != blob_len) {
+        ESP_LOGE(TAG, "Schedule size mismatch");
+        return false;
+    }
+
+    uint32_t crc;
+    memcpy(&crc, blob + blob_len - sizeof(crc), sizeof(crc));
+    if (esp_rom_crc32_le(0, blob, blob_len - sizeof(crc)) != crc) {
+        ESP_LOGE(TAG, "Schedule checksum mismatch");
+        return false;
+    }
+
+    if (!is_valid_group(&header, header.default_group) || !is_valid_group(&header, header.decentrala_group)) {
+        ESP_LOGE(TAG, "Schedule default groups out of range");
+        return false;
+    }
+
+    const struct schedule_member *members = (const struct schedule_member *)(
+        blob + sizeof(header) + header.groups_count * SCHEDULE_WEEK_BYTES
+    );
+    for (int i = 0; i < header.members_count; i++) {
+        if (!is_valid_group(&header, members[i].group) || member_uid_len(&members[i]) == 0) {
+            ESP_LOGE(TAG, "Schedule member %d is invalid", i);
+            return false;
+        }
+    }
+
+    const struct schedule_holiday *holidays = (const struct schedule_holiday *)(
+        (const uint8_t *)members + header.members_count * sizeof(struct schedule_member)
+    );
+    for (int i = 0; i < header.holidays_count; i++) {
+        if (holidays[i].month < 1 || holidays[i].month > 12 || holidays[i].mday < 1 || holidays[i].mday > 31) {
+            ESP_LOGE(TAG, "Schedule holiday %d has invalid date", i);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// Must be called with mutex taken and a validated blob.
+static void schedule_build_index(void) {
+    const struct schedule_header *header = (const struct schedule_header *)schedule.blob;
+
+    schedule.header = header;
+    schedule.weeks = schedule.blob + sizeof(*header);
+    schedule.members = (const struct schedule_member *)(
+        schedule.weeks + header->groups_count * SCHEDULE_WEEK_BYTES
+    );
+    schedule.holidays = (const struct schedule_holiday *)(
+        (const uint8_t *)schedule.members + header->members_count * sizeof(struct schedule_member)
+    );
+
+    memset(schedule.members_index, 0xFF, sizeof(schedule.members_index));
+    for (uint16_t i = 0; i < header->members_count; i++) {
+        const struct schedule_member *member = &schedule.members[i];
+
+        uint32_t slot = uid_hash(member->uid, member_uid_len(member)) % SCHEDULE_INDEX_SIZE;
+        while (schedule.members_index[slot] != SCHEDULE_INDEX_EMPTY) {
+            slot = (slot + 1) % SCHEDULE_INDEX_SIZE;
+        }
+        schedule.members_index[slot] = i;
+    }
+
+    // Later entries win if several recurring holidays share the same date.
+    memset(schedule.recurring_holidays, SCHEDULE_NO_HOLIDAY, sizeof(schedule.recurring_holidays));
+    for (uint8_t i = 0; i < header->holidays_count; i++) {
+        const struct schedule_holiday *holiday = &schedule.holidays[i];
+
+        if (holiday->year == 0) {
+            schedule.recurring_holidays[SCHEDULE_DATE(holiday->month, holiday->mday)] = i;
+        }
+    }
+
+    schedule.loaded = true;
+}
+
+static uint8_t schedule_find_group(const char *uid) {
+    size_t uid_len = strnlen(uid, SCHEDULE_UID_LEN + 1);
+
+    if (uid_len <= SCHEDULE_UID_LEN) {
+        uint32_t slot = uid_hash(uid, uid_len) % SCHEDULE_INDEX_SIZE;
+
+        while (schedule.members_index[slot] != SCHEDULE_INDEX_EMPTY) {
+            const struct schedule_member *member = &schedule.members[schedule.members_index[slot]];
+            if (member_uid_len(member) == uid_len && memcmp(member->uid, uid, uid_len) == 0) {
+                return member->group;
+            }
+            slot = (slot + 1) % SCHEDULE_INDEX_SIZE;
+        }
+    }
+
+    return *uid == DECENTRALA_PREFIX ? schedule.header->decentrala_group : schedule.header->default_group;
+}
+
+static const struct schedule_holiday *schedule_find_holiday(const struct tm *timeinfo) {
+    const struct schedule_holiday *dated = NULL;
+    for (int i = 0; i < schedule.header->holidays_count; i++) {
+        const struct schedule_holiday *holiday = &schedule.holidays[i];
+        if (holiday->year == timeinfo->tm_year + 1900 &&
+            holiday->month == timeinfo->tm_mon + 1 &&
+            holiday->mday == timeinfo->tm_mday
+        ) {
+            // Later entries win, as for recurring holidays.
+            dated = holiday;
+        }
+    }
+    if (dated != NULL) {
+        return dated;
+    }
+
+    uint8_t idx = schedule.recurring_holidays[SCHEDULE_DATE(timeinfo->tm_mon + 1, timeinfo->tm_mday)];
+    if (idx != SCHEDULE_NO_HOLIDAY) {
+        return &schedule.holidays[idx];
+    }
+
+    return NULL;
+}
+
+void schedule_init(void) {
+    static StaticSemaphore_t mutex;
+    schedule.mutex = xSemaphoreCreateMutexStatic(&mutex);
+    assert(schedule.mutex != NULL);
+
+    size_t blob_len = sizeof(schedule.blob);
+    esp_err_t ret = storage_load_blob(SCHEDULE_NVS_NAMESPACE, SCHEDULE_NVS_KEY, schedule.blob, &blob_len);
+    if (ret != ESP_OK) {
+        ESP_LOGW(TAG, "No access schedule stored, access is not restricted by time");
+        return;
+    }
+
+    if (!schedule_validate(schedule.blob, blob_len)) {
+        ESP_LOGE(TAG, "Stored access schedule is corrupted, access is not restricted by time");
+        return;
+    }
+
+    schedule.blob_len = blob_len;
+    schedule_build_index();
+
+    ESP_LOGI(
+        TAG, "Loaded access schedule with %u groups, %u members and %u holidays",
+        schedule.header->groups_count, schedule.header->members_count, schedule.header->holidays_count
+    );
+}
+
+bool schedule_update(const void *blob, size_t blob_len) {
+    if (!schedule_validate(blob, blob_len)) {
+        return false;
+    }
+
+    xSemaphoreTake(schedule.mutex, portMAX_DELAY);
+    memcpy(schedule.blob, blob, blob_len);
+    schedule.blob_len = blob_len;
+    schedule_build_index();
+    xSemaphoreGive(schedule.mutex);
+
+    ESP_LOGI(TAG, "Access schedule updated");
+
+    return storage_save_blob(SCHEDULE_NVS_NAMESPACE, SCHEDULE_NVS_KEY, blob, blob_len) == ESP_OK;
+}
+
+bool schedule_allows(const char *uid) {
+    if (!schedule.loaded) {
+        return true;
+    }
+
+    // Before the first sync weekday and date are wrong, so only groups
+    // without restrictions are allowed.
+    if (!ntp_is_synced()) {
+        xSemaphoreTake(schedule.mutex, portMAX_DELAY);
+        uint8_t group = schedule_find_group(uid);
+        xSemaphoreGive(schedule.mutex);
+
+        if (group != SCHEDULE_GROUP_ANY) {
+            ESP_LOGW(TAG, "Time is not synchronized, user '%s' from group %u is denied", uid, group);
+            return false;
+        }
+        return true;
+    }
+
+    time_t rawtime = time(NULL);
+    struct tm timeinfo;
+    localtime_r(&rawtime, &timeinfo);
+
+    int day_slot = (timeinfo.tm_hour * 60 + timeinfo.tm_min) / SCHEDULE_SLOT_MINUTES;
+    // Week bitmaps start on Monday, tm_wday starts on Sunday.
+    int week_slot = ((timeinfo.tm_wday + 6) % 7) * SCHEDULE_DAY_SLOTS + day_slot;
+
+    xSemaphoreTake(schedule.mutex, portMAX_DELAY);
+
+    bool allowed;
+    uint8_t group = schedule_find_group(uid);
+    const struct schedule_holiday *holiday = schedule_find_holiday(&timeinfo);
+
+    if (group == SCHEDULE_GROUP_ANY) {
+        allowed = true;
+    } else if (holiday != NULL && (holiday->groups & (1u << group))) {
+        allowed = SLOT_IS_SET(holiday->slots, day_slot);
+    } else {
+        allowed = SLOT_IS_SET(schedule.weeks + group * SCHEDULE_WEEK_BYTES, week_slot);
+    }
+
+    xSemaphoreGive(schedule.mutex);
+
+    if (!allowed) {
+        ESP_LOGW(TAG, "User '%s' from group %u is outside of access schedule", uid, group);
+    }
+
+    return allowed;
+}
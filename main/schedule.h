@@ -0,0 +1,10 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+void schedule_init(void);
+
+bool schedule_update(const void *blob, size_t blob_len);
+
+bool schedule_allows(const char *uid);
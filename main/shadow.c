@@ -0,0 +1,423 @@
+#include "shadow.h"
+
+#include <esp_log.h>
+#include <esp_app_desc.h>
+#include <esp_timer.h>
+#include <mqtt_client.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <freertos/semphr.h>
+#include <cJSON.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "config.h"
+#include "hardware.h"
+#include "door.h"
+#include "event_loop.h"
+#include "mqtt.h"
+#include "storage.h"
+#include "tasks.h"
+#include "trace.h"
+#include "unlock.h"
+#include "heap_guard.h"
+
+#define TAG "shadow"
+
+#define SHADOW_TOPIC         MQTT_TOPIC(MQTT_DEVICE_ID, "shadow")
+#define SHADOW_UPDATE_TOPIC  MQTT_TOPIC(MQTT_DEVICE_ID, "shadow/update")
+#define SHADOW_SET_TOPIC     MQTT_TOPIC(MQTT_DEVICE_ID, "shadow/set")
+
+// Changes made within this window, e.g. lock open and metrics update, are
+// sent as one diff.
+#define SHADOW_COALESCE_MS            100
+// Full retained document is refreshed at most this often, diffs are not delayed.
+#define SHADOW_DOCUMENT_INTERVAL_SEC  60
+#define SHADOW_MESSAGE_SIZE           512
+
+#define SHADOW_OPEN_TIME_MS_MIN  100
+#define SHADOW_OPEN_TIME_MS_MAX  10000
+
+#define SHADOW_IP_MAX_LEN  16
+
+// Signed desired state is bound to this scope, see unlock.h.
+#define SHADOW_SET_SCOPE   "shadow/set"
+
+// Saved in NVS, so applied desired state survives reboot.
+struct shadow_desired {
+    uint32_t open_time_ms[DOORS_COUNT];
+};
+
+static struct {
+    // Guards reported fields and document schedule, they are set from
+    // network, NTP, status, MQTT and shadow tasks.
+    portMUX_TYPE spinlock;
+    TaskHandle_t task;
+
+    uint32_t dirty;
+
+    const char *netif;
+    char ip[SHADOW_IP_MAX_LEN];
+    bool ntp_synced;
+    time_t ntp_synced_at;
+    uint32_t metrics_digest;
+
+    bool document_pending;
+    int64_t document_published_at;
+
+    struct shadow_desired desired;
+    // Desired state is set from MQTT task and local HTTP server.
+    SemaphoreHandle_t desired_mutex;
+
+    // Sequence number of diff, lets backend notice lost updates. Used only
+    // by shadow task, like the message buffer.
+    uint32_t seq;
+    char message[SHADOW_MESSAGE_SIZE];
+} shadow = {
+    .spinlock = portMUX_INITIALIZER_UNLOCKED,
+    .netif = "none",
+};
+
+void shadow_mark_dirty(uint32_t fields) {
+    taskENTER_CRITICAL(&shadow.spinlock);
+    shadow.dirty |= fields;
+    taskEXIT_CRITICAL(&shadow.spinlock);
+
+    if (shadow.task != NULL) {
+        xTaskNotifyGive(shadow.task);
+    }
+}
+
+void shadow_set_network(const char *netif, const char *ip) {
+    taskENTER_CRITICAL(&shadow.spinlock);
+    shadow.netif = netif;
+    strlcpy(shadow.ip, ip, sizeof(shadow.ip));
+    taskEXIT_CRITICAL(&shadow.spinlock);
+
+    shadow_mark_dirty(SHADOW_NETWORK);
+}
+
+void shadow_set_ntp_synced(bool is_synced) {
+    struct timeval tv_now;
+    gettimeofday(&tv_now, NULL);
+
+    taskENTER_CRITICAL(&shadow.spinlock);
+    shadow.ntp_synced = is_synced;
+    shadow.ntp_synced_at = tv_now.tv_sec;
+    taskEXIT_CRITICAL(&shadow.spinlock);
+
+    shadow_mark_dirty(SHADOW_NTP);
+}
+
+void shadow_set_metrics_digest(uint32_t digest) {
+    taskENTER_CRITICAL(&shadow.spinlock);
+    bool is_changed = digest != shadow.metrics_digest;
+    shadow.metrics_digest = digest;
+    taskEXIT_CRITICAL(&shadow.spinlock);
+
+    if (is_changed) {
+        shadow_mark_dirty(SHADOW_METRICS);
+    }
+}
+
+static int format_doors(char *message, size_t size) {
+    int len = snprintf(message, size, "\"doors\": {");
+
+    for (int i = 0; i < DOORS_COUNT && len < size; i++) {
+        struct door *door = door_get(i);
+
+        len += snprintf(
+            &message[len], size - len,
+            "%s\"%s\": {\"lock\": \"%s\", \"open_time_ms\": %lu}",
+            i == 0 ? "" : ", ",
+            door->hw->name,
+            door->lock.is_open ? "open" : "closed",
+            lock_get_open_time(&door->lock) / 1000
+        );
+    }
+
+    if (len < size) {
+        len += snprintf(&message[len], size - len, "}");
+    }
+
+    return len;
+}
+
+// Formats only requested fields, so the same code produces diffs and full document.
+static int format_shadow(char *message, size_t size, uint32_t fields) {
+    const char *netif;
+    char ip[SHADOW_IP_MAX_LEN];
+    bool ntp_synced;
+    time_t ntp_synced_at;
+    uint32_t metrics_digest;
+
+    taskENTER_CRITICAL(&shadow.spinlock);
+    netif = shadow.netif;
+    memcpy(ip, shadow.ip, sizeof(ip));
+    ntp_synced = shadow.ntp_synced;
+    ntp_synced_at = shadow.ntp_synced_at;
+    metrics_digest = shadow.metrics_digest;
+    taskEXIT_CRITICAL(&shadow.spinlock);
+
+    int len = snprintf(message, size, "{\"seq\": %lu", shadow.seq);
+
+    if ((fields & SHADOW_NETWORK) && len < size) {
+        len += snprintf(
+            &message[len], size - len,
+            ", \"network\": {\"interface\": \"%s\", \"ip\": \"%s\"}",
+            netif, ip
+        );
+    }
+
+    if ((fields & SHADOW_NTP) && len < size) {
+        len += snprintf(
+            &message[len], size - len,
+            ", \"ntp\": {\"synced\": %s, \"synced_at\": %lld}",
+            ntp_synced ? "true" : "false", ntp_synced_at
+        );
+    }
+
+    if ((fields & SHADOW_DOORS) && len < size) {
+        len += snprintf(&message[len], size - len, ", ");
+    }
+    if ((fields & SHADOW_DOORS) && len < size) {
+        len += format_doors(&message[len], size - len);
+    }
+
+    if ((fields & SHADOW_FIRMWARE) && len < size) {
+        const esp_app_desc_t *app = esp_app_get_description();
+        len += snprintf(
+            &message[len], size - len,
+            ", \"firmware\": {\"version\": \"%s\", \"idf\": \"%s\"}",
+            app->version, app->idf_ver
+        );
+    }
+
+    if ((fields & SHADOW_METRICS) && len < size) {
+        len += snprintf(
+            &message[len], size - len,
+            ", \"metrics\": {\"digest\": \"%08lx\"}",
+            metrics_digest
+        );
+    }
+
+    if (len < size) {
+        len += snprintf(&message[len], size - len, "}");
+    }
+
+    if (len >= size) {
+        ESP_LOGE(TAG, "Shadow does not fit %d bytes, increase SHADOW_MESSAGE_SIZE", size);
+        return -1;
+    }
+
+    return len;
+}
+
+static void publish_document(void) {
+    int len = format_shadow(shadow.message, sizeof(shadow.message), SHADOW_ALL);
+    if (len < 0) return;
+
+    int ret = mqtt_publish_data(SHADOW_TOPIC, shadow.message, len, /* qos */ 1, /* retain */ true);
+    if (ret >= 0) {
+        taskENTER_CRITICAL(&shadow.spinlock);
+        shadow.document_pending = false;
+        shadow.document_published_at = esp_timer_get_time();
+        taskEXIT_CRITICAL(&shadow.spinlock);
+    }
+}
+
+static void publish_diff(uint32_t dirty) {
+    shadow.seq++;
+
+    int len = format_shadow(shadow.message, sizeof(shadow.message), dirty);
+    if (len < 0) return;
+
+    TRACE_INSTANT("shadow_diff");
+    mqtt_publish_data(SHADOW_UPDATE_TOPIC, shadow.message, len, /* qos */ 1, /* retain */ false);
+
+    taskENTER_CRITICAL(&shadow.spinlock);
+    shadow.document_pending = true;
+    taskEXIT_CRITICAL(&shadow.spinlock);
+}
+
+static TickType_t document_wait_ticks(void) {
+    taskENTER_CRITICAL(&shadow.spinlock);
+    bool document_pending = shadow.document_pending;
+    int64_t published_at = shadow.document_published_at;
+    taskEXIT_CRITICAL(&shadow.spinlock);
+
+    if (!document_pending) {
+        return portMAX_DELAY;
+    }
+
+    int64_t due_at = published_at + SHADOW_DOCUMENT_INTERVAL_SEC * 1000000LL;
+    int64_t now = esp_timer_get_time();
+
+    return due_at > now ? pdMS_TO_TICKS((due_at - now) / 1000) : 0;
+}
+
+static void shadow_thread(void *param) {
+    for (;;) {
+        bool is_notified = ulTaskNotifyTake(pdTRUE, document_wait_ticks()) > 0;
+
+        if (is_notified) {
+            // Notifications which come during this delay are covered by the same diff.
+            vTaskDelay(pdMS_TO_TICKS(SHADOW_COALESCE_MS));
+            ulTaskNotifyTake(pdTRUE, 0);
+
+            taskENTER_CRITICAL(&shadow.spinlock);
+            uint32_t dirty = shadow.dirty;
+            shadow.dirty = 0;
+            taskEXIT_CRITICAL(&shadow.spinlock);
+
+            // Fields changed while disconnected are sent on connect anyway.
+            if (dirty != 0) {
+                publish_diff(dirty);
+            }
+        }
+
+        if (document_wait_ticks() == 0) {
+            publish_document();
+        }
+    }
+}
+
+static void mqtt_event_handler(
+    void *arg,
+    esp_event_base_t event_base,
+    int32_t event_id,
+    void *event_data
+) {
+    if (event_id == MQTT_EVENT_CONNECTED) {
+        // Retained document may be outdated, refresh it right after the diff.
+        taskENTER_CRITICAL(&shadow.spinlock);
+        shadow.document_published_at = 0;
+        taskEXIT_CRITICAL(&shadow.spinlock);
+        shadow_mark_dirty(SHADOW_ALL);
+    }
+}
+
+static bool apply_door_desired(struct door *door, const cJSON *desired) {
+    const cJSON *open_time = cJSON_GetObjectItemCaseSensitive(desired, "open_time_ms");
+    if (open_time == NULL) {
+        return true;
+    }
+
+    if (
+        !cJSON_IsNumber(open_time)
+        || open_time->valuedouble < SHADOW_OPEN_TIME_MS_MIN
+        || open_time->valuedouble > SHADOW_OPEN_TIME_MS_MAX
+    ) {
+        ESP_LOGW(
+            TAG, "Door '%s' open_time_ms must be a number from %d to %d",
+            door->hw->name, SHADOW_OPEN_TIME_MS_MIN, SHADOW_OPEN_TIME_MS_MAX
+        );
+        return false;
+    }
+
+    shadow.desired.open_time_ms[door->index] = open_time->valueint;
+    lock_set_open_time(&door->lock, open_time->valueint * 1000);
+
+    ESP_LOGI(TAG, "Door '%s' open time is set to %d ms", door->hw->name, open_time->valueint);
+
+    return true;
+}
+
+bool shadow_apply_desired(const char *data, int data_len) {
+    cJSON *desired = cJSON_ParseWithLength(data, data_len);
+    if (desired == NULL) {
+        ESP_LOGW(TAG, "Desired state is not a valid JSON");
+        return false;
+    }
+
+    xSemaphoreTake(shadow.desired_mutex, portMAX_DELAY);
+
+    bool is_applied = false;
+
+    const cJSON *doors = cJSON_GetObjectItemCaseSensitive(desired, "doors");
+    for (int i = 0; i < DOORS_COUNT && cJSON_IsObject(doors); i++) {
+        struct door *door = door_get(i);
+
+        const cJSON *door_desired = cJSON_GetObjectItemCaseSensitive(doors, door->hw->name);
+        if (cJSON_IsObject(door_desired)) {
+            is_applied |= apply_door_desired(door, door_desired);
+        }
+    }
+
+    cJSON_Delete(desired);
+
+    if (is_applied) {
+        storage_save_blob("shadow", "desired", &shadow.desired, sizeof(shadow.desired));
+    }
+
+    xSemaphoreGive(shadow.desired_mutex);
+
+    // Reported state is echoed even if nothing is applied, so backend sees actual values.
+    shadow_mark_dirty(SHADOW_DOORS);
+
+    return is_applied;
+}
+
+// Desired state on MQTT is struct unlock_auth followed by the JSON, so only
+// the backend can change how the lock opens. Local HTTP checks its token
+// and passes the JSON as is.
+static void mqtt_shadow_set_topic_updated(
+    const char *topic, int topic_len,
+    const char *data,  int data_len
+) {
+    const char *error = unlock_verify(SHADOW_SET_SCOPE, data, data_len);
+    if (error != NULL) {
+        ESP_LOGW(TAG, "Desired state is rejected: %s", error);
+        return;
+    }
+
+    shadow_apply_desired(data + sizeof(struct unlock_auth), data_len - sizeof(struct unlock_auth));
+}
+
+static void lock_event_handler(const struct event *event, void *arg) {
+    shadow_mark_dirty(SHADOW_DOORS);
+}
+
+static void load_desired(void) {
+    size_t len = sizeof(shadow.desired);
+    esp_err_t ret = storage_load_blob("shadow", "desired", &shadow.desired, &len);
+    if (ret != ESP_OK || len != sizeof(shadow.desired)) {
+        ESP_LOGI(TAG, "No saved desired state, using defaults");
+        return;
+    }
+
+    for (int i = 0; i < DOORS_COUNT; i++) {
+        uint32_t open_time_ms = shadow.desired.open_time_ms[i];
+        if (open_time_ms >= SHADOW_OPEN_TIME_MS_MIN && open_time_ms <= SHADOW_OPEN_TIME_MS_MAX) {
+            lock_set_open_time(&door_get(i)->lock, open_time_ms * 1000);
+        }
+    }
+}
+
+void shadow_init(void) {
+    static StackType_t stack[SHADOW_TASK_STACK_SIZE];
+    static StaticTask_t task;
+    static StaticSemaphore_t desired_mutex;
+
+    shadow.desired_mutex = xSemaphoreCreateMutexStatic(&desired_mutex);
+    load_desired();
+
+    shadow.task = xTaskCreateStaticPinnedToCore(
+        shadow_thread,
+        "shadow",
+        SHADOW_TASK_STACK_SIZE,
+        NULL,
+        SHADOW_TASK_PRIORITY,
+        stack,
+        &task,
+        SHADOW_TASK_CORE
+    );
+    heap_guard_watch_task(shadow.task);
+
+    event_loop_register(EVENT_LOCK_OPENED, "shadow_opened", lock_event_handler, NULL);
+    event_loop_register(EVENT_LOCK_CLOSED, "shadow_closed", lock_event_handler, NULL);
+
+    ESP_ERROR_CHECK(esp_mqtt_client_register_event(mqtt_get_client(), MQTT_EVENT_CONNECTED, &mqtt_event_handler, NULL));
+    mqtt_subscribe(SHADOW_SET_TOPIC, /* qos */ 1, mqtt_shadow_set_topic_updated);
+}
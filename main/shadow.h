@@ -0,0 +1,40 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Device shadow is a retained JSON document with the reported lock state.
+// Setters only update the field and mark it dirty, shadow task coalesces
+// changes made within SHADOW_COALESCE_MS and publishes a diff with dirty
+// fields only. Desired state from "shadow/set" is applied and echoed back
+// in the next diff, it must be signed with the unlock key, see unlock.h.
+
+enum shadow_field {
+    SHADOW_NETWORK  = 1 << 0,
+    SHADOW_NTP      = 1 << 1,
+    SHADOW_DOORS    = 1 << 2,
+    SHADOW_FIRMWARE = 1 << 3,
+    SHADOW_METRICS  = 1 << 4,
+
+    SHADOW_ALL      = (1 << 5) - 1,
+};
+
+// Called after doors_init, mqtt_init and unlock_init, loads saved desired
+// state.
+void shadow_init(void);
+
+// Safe to call from any task and from esp_timer callbacks.
+void shadow_mark_dirty(uint32_t fields);
+
+// Interface name must be a static string. Empty ip means address is lost.
+void shadow_set_network(const char *netif, const char *ip);
+
+void shadow_set_ntp_synced(bool is_synced);
+
+// Applies desired state JSON without the signature of "shadow/set", e.g.
+// from local HTTP server, which checks its own token. Returns true if any
+// field is applied.
+bool shadow_apply_desired(const char *data, int data_len);
+
+// Marks metrics dirty only if digest is changed.
+void shadow_set_metrics_digest(uint32_t digest);
@@ -0,0 +1,383 @@
+#include "config.h"
+#ifdef USE_SOAK
+
+#include "soak.h"
+
+#include <esp_log.h>
+#include <esp_random.h>
+#include <esp_system.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/queue.h>
+#include <freertos/task.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "door.h"
+#include "dlog.h"
+#include "event_loop.h"
+#include "heap_guard.h"
+#include "input.h"
+#include "mqtt.h"
+#include "otp.h"
+#include "payload.h"
+#include "tasks.h"
+
+#define TAG "soak"
+
+// Synthetic users are a prefix followed by user index. Valid codes are
+// entered only with SOAK_VALID_PREFIX, so an OTP result tells which stream
+// it came from.
+#define SOAK_USERS           8
+#define SOAK_VALID_PREFIX    "9000"
+#define SOAK_INVALID_PREFIX  "9100"
+#define SOAK_UID_SIZE        8
+// Longer than keypad buffer, so it overflows.
+#define SOAK_OVERFLOW_DIGITS (KEYPAD_BUFFER_SIZE + 8)
+#define SOAK_STREAM_MAX      (SOAK_OVERFLOW_DIGITS + 4)
+// Code which expires sooner may be verified in the next time step.
+#define SOAK_CODE_MARGIN_SEC 2
+
+#define SOAK_PERIOD_MS       (1000 / SOAK_STREAMS_PER_SEC)
+#define SOAK_REPORT_SIZE     2048
+
+// Item of soak input queue.
+struct soak_stream {
+    char keys[SOAK_STREAM_MAX];
+    uint8_t len;
+    int64_t injected_at;
+};
+
+struct soak_histogram {
+    uint32_t count;
+    uint32_t max_us;
+    uint32_t buckets[SOAK_BUCKETS];
+};
+
+struct soak_stats {
+    uint32_t injected;
+    uint32_t malformed;
+    // Streams which did not fit input queue.
+    uint32_t inject_dropped;
+    uint32_t verified;
+    uint32_t rejected;
+    // Valid code rejected or wrong code accepted.
+    uint32_t mismatches;
+    struct soak_histogram probes[SOAK_PROBES_COUNT];
+};
+
+struct soak_user {
+    char uid[SOAK_UID_SIZE];
+    uint32_t code;
+    int64_t expires_at;
+};
+
+static struct {
+    portMUX_TYPE lock;
+    struct soak_stats stats;
+
+    struct input *inputs[DOORS_COUNT];
+    int inputs_count;
+
+    struct soak_user users[SOAK_USERS];
+} soak = {
+    .lock = portMUX_INITIALIZER_UNLOCKED,
+};
+
+static const char *soak_probe_name(enum soak_probe probe) {
+    switch (probe) {
+    case SOAK_KEYPAD_PROCESS: return "keypad_process";
+    case SOAK_OTP_VERIFY:     return "otp_verify";
+    case SOAK_LOCK_TRIGGER:   return "lock_trigger";
+    case SOAK_MQTT_PUBLISH:   return "mqtt_publish";
+    case SOAK_CHECKIN:        return "checkin";
+    default:                  return "unknown";
+    }
+}
+
+void soak_record(enum soak_probe probe, uint32_t elapsed_us) {
+    int bucket = elapsed_us > 1 ? 31 - __builtin_clz(elapsed_us) : 0;
+    if (bucket >= SOAK_BUCKETS) {
+        bucket = SOAK_BUCKETS - 1;
+    }
+
+    struct soak_histogram *h = &soak.stats.probes[probe];
+
+    portENTER_CRITICAL(&soak.lock);
+    h->count++;
+    h->buckets[bucket]++;
+    if (elapsed_us > h->max_us) {
+        h->max_us = elapsed_us;
+    }
+    portEXIT_CRITICAL(&soak.lock);
+}
+
+void soak_record_checkin(const char *uid, bool is_valid, int64_t submitted_at) {
+    SOAK_RECORD(SOAK_CHECKIN, submitted_at);
+
+    bool is_expected_valid = strncmp(uid, SOAK_VALID_PREFIX, strlen(SOAK_VALID_PREFIX)) == 0;
+
+    portENTER_CRITICAL(&soak.lock);
+    if (is_valid) {
+        soak.stats.verified++;
+    } else {
+        soak.stats.rejected++;
+    }
+    if (is_valid != is_expected_valid) {
+        soak.stats.mismatches++;
+    }
+    portEXIT_CRITICAL(&soak.lock);
+}
+
+// Input driver, served by doors task like real keypads.
+
+static void soak_input_init(struct input *input) {
+    assert(soak.inputs_count < DOORS_COUNT);
+
+    static StaticQueue_t queues[DOORS_COUNT];
+    static uint8_t queue_storage[DOORS_COUNT][INPUT_QUEUE_SIZE * sizeof(struct soak_stream)];
+    input->queue = xQueueCreateStatic(
+        INPUT_QUEUE_SIZE, sizeof(struct soak_stream),
+        queue_storage[soak.inputs_count], &queues[soak.inputs_count]
+    );
+
+    soak.inputs[soak.inputs_count++] = input;
+}
+
+static int soak_input_read(struct input *input, char *keys, int size, int64_t *frame_end_us) {
+    struct soak_stream stream;
+    if (xQueueReceive(input->queue, &stream, 0) != pdTRUE) {
+        return 0;
+    }
+
+    int len = stream.len < size ? stream.len : size;
+    memcpy(keys, stream.keys, len);
+    // Decode latency of soak input is the time spent in queue.
+    *frame_end_us = stream.injected_at;
+    return len;
+}
+
+const struct input_driver input_soak_driver = {
+    .name = "soak",
+    .init = soak_input_init,
+    .read = soak_input_read,
+};
+
+// Generator.
+
+static void soak_random_digits(char *keys, int count) {
+    for (int i = 0; i < count; i++) {
+        keys[i] = '0' + esp_random() % 10;
+    }
+}
+
+// Returns false if code of the user is about to expire.
+static bool soak_valid_code(struct soak_user *user, char *code, size_t size) {
+    struct timeval tv_now;
+    gettimeofday(&tv_now, NULL);
+
+    if (user->expires_at - tv_now.tv_sec < SOAK_CODE_MARGIN_SEC) {
+        user->code = otp_generate(user->uid, &user->expires_at);
+    }
+    if (user->expires_at - tv_now.tv_sec < SOAK_CODE_MARGIN_SEC) {
+        return false;
+    }
+
+    snprintf(code, size, "%06lu", user->code);
+    return true;
+}
+
+// Every stream starts with Clear, so a malformed one never affects the next.
+static int soak_make_stream(char *keys, bool *is_malformed) {
+    int len = 0;
+    keys[len++] = 'C';
+
+    int kind = esp_random() % 100;
+    int user = esp_random() % SOAK_USERS;
+
+    if (kind < SOAK_MALFORMED_PERCENT) {
+        soak_random_digits(&keys[len], SOAK_OVERFLOW_DIGITS);
+        len += SOAK_OVERFLOW_DIGITS;
+        keys[len++] = 'E';
+        *is_malformed = true;
+        return len;
+    }
+
+    char code[8];
+    bool is_valid = kind < SOAK_MALFORMED_PERCENT + SOAK_VALID_PERCENT
+        && soak_valid_code(&soak.users[user], code, sizeof(code));
+
+    if (is_valid) {
+        len += sprintf(&keys[len], "%sE%sE", soak.users[user].uid, code);
+    } else {
+        len += sprintf(&keys[len], SOAK_INVALID_PREFIX "%dE", user);
+        soak_random_digits(&keys[len], 6);
+        len += 6;
+        keys[len++] = 'E';
+    }
+    return len;
+}
+
+static void soak_inject(void) {
+    struct soak_stream stream = {0};
+    bool is_malformed = false;
+    stream.len = soak_make_stream(stream.keys, &is_malformed);
+    stream.injected_at = esp_timer_get_time();
+
+    struct input *input = soak.inputs[esp_random() % soak.inputs_count];
+    bool is_queued = xQueueSend(input->queue, &stream, 0) == pdTRUE;
+
+    portENTER_CRITICAL(&soak.lock);
+    soak.stats.injected++;
+    if (is_malformed) {
+        soak.stats.malformed++;
+    }
+    if (!is_queued) {
+        soak.stats.inject_dropped++;
+    }
+    portEXIT_CRITICAL(&soak.lock);
+}
+
+// Report.
+
+static void soak_format_tasks(struct payload *p) {
+    TaskHandle_t tasks[HEAP_GUARD_TASKS_MAX];
+    int count = heap_guard_get_tasks(tasks, HEAP_GUARD_TASKS_MAX);
+
+    payload_key(p, PAYLOAD_TASKS);
+    payload_array_begin(p);
+    for (int i = 0; i < count; i++) {
+        payload_map_begin(p);
+        payload_key_text(p, PAYLOAD_NAME, pcTaskGetName(tasks[i]));
+        // Stack type is a byte in ESP-IDF, so the watermark is in bytes.
+        payload_key_uint(p, PAYLOAD_STACK_FREE, uxTaskGetStackHighWaterMark(tasks[i]));
+        payload_end(p);
+    }
+    payload_end(p);
+}
+
+static void soak_format_probes(struct payload *p, const struct soak_stats *stats) {
+    payload_key(p, PAYLOAD_LATENCY);
+    payload_array_begin(p);
+    for (int i = 0; i < SOAK_PROBES_COUNT; i++) {
+        const struct soak_histogram *h = &stats->probes[i];
+
+        payload_map_begin(p);
+        payload_key_text(p, PAYLOAD_NAME, soak_probe_name(i));
+        payload_key_uint(p, PAYLOAD_CALLS, h->count);
+        payload_key_uint(p, PAYLOAD_MAX_US, h->max_us);
+        payload_key(p, PAYLOAD_BUCKETS);
+        payload_array_begin(p);
+        for (int j = 0; j < SOAK_BUCKETS; j++) {
+            payload_uint(p, h->buckets[j]);
+        }
+        payload_end(p);
+        payload_end(p);
+    }
+    payload_end(p);
+}
+
+static uint32_t soak_input_errors(void) {
+    uint32_t errors = 0;
+    for (int i = 0; i < DOORS_COUNT; i++) {
+        const struct door *door = door_get(i);
+        for (int j = 0; j < door->inputs_count; j++) {
+            errors += door->inputs[j].stats.errors;
+        }
+    }
+    return errors;
+}
+
+static void soak_report(void) {
+    static uint8_t message[SOAK_REPORT_SIZE];
+    static struct soak_stats stats;
+
+    portENTER_CRITICAL(&soak.lock);
+    stats = soak.stats;
+    portEXIT_CRITICAL(&soak.lock);
+
+    struct mqtt_stats mqtt;
+    mqtt_get_stats(&mqtt);
+
+    struct event_loop_stats loop;
+    event_loop_get_stats(&loop);
+
+    struct payload p;
+    payload_init(&p, PAYLOAD_FORMAT, message, sizeof(message));
+    payload_map_begin(&p);
+
+    payload_key_uint(&p, PAYLOAD_UPTIME, esp_timer_get_time() / 1000000);
+    payload_key_uint(&p, PAYLOAD_INJECTED, stats.injected);
+    payload_key_uint(&p, PAYLOAD_MALFORMED, stats.malformed);
+    payload_key_uint(&p, PAYLOAD_INJECT_DROPPED, stats.inject_dropped);
+    payload_key_uint(&p, PAYLOAD_VERIFIED, stats.verified);
+    payload_key_uint(&p, PAYLOAD_REJECTED, stats.rejected);
+    payload_key_uint(&p, PAYLOAD_MISMATCHES, stats.mismatches);
+
+    payload_key_uint(&p, PAYLOAD_HEAP_FREE, esp_get_free_heap_size());
+    payload_key_uint(&p, PAYLOAD_HEAP_MIN_FREE, esp_get_minimum_free_heap_size());
+    payload_key_uint(&p, PAYLOAD_HEAP_VIOLATIONS, heap_guard_violations(NULL));
+    payload_key_uint(&p, PAYLOAD_LOG_DROPPED, dlog_dropped());
+    payload_key_uint(&p, PAYLOAD_LOOP_DROPPED, loop.dropped);
+    payload_key_uint(&p, PAYLOAD_MQTT_UNDELIVERED, mqtt.delivery_failed);
+    payload_key_uint(&p, PAYLOAD_RX_ERRORS, soak_input_errors());
+
+    soak_format_tasks(&p);
+    soak_format_probes(&p, &stats);
+
+    payload_end(&p);
+
+    int len = payload_finish(&p);
+    if (len < 0) {
+        ESP_LOGE(TAG, "Report does not fit %d bytes", SOAK_REPORT_SIZE);
+        return;
+    }
+
+    mqtt_publish_data(MQTT_TOPIC(MQTT_DEVICE_ID, "soak" PAYLOAD_TOPIC_SUFFIX), message, len, /* qos */ 1, /* retain */ false);
+}
+
+static void soak_thread(void *param) {
+    TickType_t wake_time = xTaskGetTickCount();
+    int64_t reported_at = esp_timer_get_time();
+
+    for (;;) {
+        xTaskDelayUntil(&wake_time, pdMS_TO_TICKS(SOAK_PERIOD_MS));
+        soak_inject();
+
+        int64_t now = esp_timer_get_time();
+        if (now - reported_at >= SOAK_REPORT_INTERVAL_SEC * 1000000LL) {
+            soak_report();
+            reported_at = now;
+        }
+    }
+}
+
+void soak_init(void) {
+    static StackType_t stack[SOAK_TASK_STACK_SIZE];
+    static StaticTask_t task;
+
+    if (soak.inputs_count == 0) {
+        ESP_LOGE(TAG, "No soak inputs, soak test is disabled");
+        return;
+    }
+
+    for (int i = 0; i < SOAK_USERS; i++) {
+        snprintf(soak.users[i].uid, SOAK_UID_SIZE, SOAK_VALID_PREFIX "%d", i);
+    }
+
+    TaskHandle_t handle = xTaskCreateStaticPinnedToCore(
+        soak_thread,
+        "soak",
+        SOAK_TASK_STACK_SIZE,
+        NULL,
+        SOAK_TASK_PRIORITY,
+        stack,
+        &task,
+        SOAK_TASK_CORE
+    );
+    heap_guard_watch_task(handle);
+
+    ESP_LOGW(TAG, "Soak test is running, lock is never opened");
+}
+
+#endif  // #ifdef USE_SOAK
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <esp_timer.h>
+
+#include "config.h"
+
+// Soak test. Every door gets a synthetic input, fed with checkins of regular
+// users at SOAK_STREAMS_PER_SEC: valid codes, wrong codes and malformed key
+// sequences. The strike is never driven and all topics are mirrored to
+// xecut-lock-soak/, see MQTT_TOPIC. Latency histograms of the hot paths,
+// heap and stack watermarks and error counts are published to the soak topic
+// every SOAK_REPORT_INTERVAL_SEC. Compiled out unless USE_SOAK is defined.
+
+enum soak_probe {
+    SOAK_KEYPAD_PROCESS,
+    SOAK_OTP_VERIFY,
+    SOAK_LOCK_TRIGGER,
+    SOAK_MQTT_PUBLISH,
+    // From keypad submit to the handled OTP result.
+    SOAK_CHECKIN,
+    SOAK_PROBES_COUNT,
+};
+
+// Bucket i counts latencies from 2^i to 2^(i+1) us, the last one counts
+// everything above.
+#define SOAK_BUCKETS  20
+
+#ifdef USE_SOAK
+
+#define SOAK_RECORD(probe, start_us)  soak_record((probe), esp_timer_get_time() - (start_us))
+
+// Called after doors_init.
+void soak_init(void);
+
+// Thread safe, called from hot paths through SOAK_RECORD.
+void soak_record(enum soak_probe probe, uint32_t elapsed_us);
+
+// Called by event loop for every OTP result.
+void soak_record_checkin(const char *uid, bool is_valid, int64_t submitted_at);
+
+#else
+
+// Start time is still taken, so it is never an unused variable.
+#define SOAK_RECORD(probe, start_us)  ((void)(start_us))
+
+#endif
@@ -0,0 +1,79 @@
+#include "storage.h"
+
+#include <esp_log.h>
+#include <nvs_flash.h>
+#include <nvs.h>
+
+#define TAG "storage"
+
+static esp_err_t nvs_init(void) {
+    esp_err_t ret = nvs_flash_init();
+    if (ret == ESP_ERR_NVS_NO_FREE_PAGES || ret == ESP_ERR_NVS_NEW_VERSION_FOUND) {
+        ESP_ERROR_CHECK(nvs_flash_erase());
+        return nvs_flash_init();
+    }
+    return ret;
+}
+
+void storage_init(void) {
+    ESP_ERROR_CHECK(nvs_init());
+}
+
+esp_err_t storage_load_blob(const char *ns, const char *key, void *buffer, size_t *len) {
+    nvs_handle_t handle;
+
+    esp_err_t ret = nvs_open(ns, NVS_READONLY, &handle);
+    if (ret != ESP_OK) {
+        return ret;
+    }
+
+    ret = nvs_get_blob(handle, key, buffer, len);
+    nvs_close(handle);
+
+    return ret;
+}
+
+esp_err_t storage_save_blob(const char *ns, const char *key, const void *buffer, size_t len) {
+    nvs_handle_t handle;
+
+    esp_err_t ret = nvs_open(ns, NVS_READWRITE, &handle);
+    if (ret != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to open namespace '%s': %s", ns, esp_err_to_name(ret));
+        return ret;
+    }
+
+    ret = nvs_set_blob(handle, key, buffer, len);
+    if (ret == ESP_OK) {
+        ret = nvs_commit(handle);
+    }
+    nvs_close(handle);
+
+    if (ret != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to save '%s/%s': %s", ns, key, esp_err_to_name(ret));
+    }
+
+    return ret;
+}
+
+esp_err_t storage_erase_blob(const char *ns, const char *key) {
+    nvs_handle_t handle;
+
+    esp_err_t ret = nvs_open(ns, NVS_READWRITE, &handle);
+    if (ret != ESP_OK) {
+        return ret;
+    }
+
+    ret = nvs_erase_key(handle, key);
+    if (ret == ESP_OK) {
+        ret = nvs_commit(handle);
+    } else if (ret == ESP_ERR_NVS_NOT_FOUND) {
+        ret = ESP_OK;
+    }
+    nvs_close(handle);
+
+    if (ret != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to erase '%s/%s': %s", ns, key, esp_err_to_name(ret));
+    }
+
+    return ret;
+}
@@ -0,0 +1,13 @@
+#pragma once
+
+#include <stddef.h>
+#include <esp_err.h>
+
+void storage_init(void);
+
+esp_err_t storage_load_blob(const char *ns, const char *key, void *buffer, size_t *len);
+
+esp_err_t storage_save_blob(const char *ns, const char *key, const void *buffer, size_t len);
+
+// Returns ESP_OK if the key is erased or does not exist.
+esp_err_t storage_erase_blob(const char *ns, const char *key);
@@ -0,0 +1,116 @@
+#pragma once
+
+#include <freertos/FreeRTOS.h>
+
+// Core affinity and priority of firmware tasks.
+//
+// lwIP and MQTT tasks are pinned to NETWORK_CORE in sdkconfig
+// (CONFIG_LWIP_TCPIP_TASK_AFFINITY_CPU0 and CONFIG_MQTT_USE_CORE_0),
+// keep them in sync when changing it. Keypad and OTP verification run on
+// the other core, so a slow network never delays input or unlocking.
+#define NETWORK_CORE  0
+#define APP_CORE      1
+
+// Network
+#define MQTT_TASK_PRIORITY        5
+#define MQTT_TASK_STACK_SIZE      6144
+#define ETH_RX_TASK_PRIORITY      15
+
+// Hands messages of mqtt_enqueue_data to MQTT client, must run above MQTT
+// task on its core, see mqtt_outbox_thread.
+#define MQTT_OUTBOX_TASK_CORE       NETWORK_CORE
+#define MQTT_OUTBOX_TASK_PRIORITY   (MQTT_TASK_PRIORITY + 1)
+#define MQTT_OUTBOX_TASK_STACK_SIZE 3072
+
+// Keypad input and lock actuation, must preempt OTP verification.
+#define KEYPAD_TASK_CORE          APP_CORE
+#define KEYPAD_TASK_PRIORITY      10
+#define KEYPAD_TASK_STACK_SIZE    4096
+
+// Re-arms door sensor interrupts after debounce and classifies door events,
+// see door_sensor.c.
+#define DOOR_SENSOR_TASK_CORE       APP_CORE
+#define DOOR_SENSOR_TASK_PRIORITY   9
+#define DOOR_SENSOR_TASK_STACK_SIZE 3072
+
+// Dispatches keypad, OTP result, lock and alarm events, see event_loop.h.
+// Unlocks the door after verification, so it runs above OTP worker, but
+// never delays keypad input.
+#define EVENT_LOOP_TASK_CORE       APP_CORE
+#define EVENT_LOOP_TASK_PRIORITY   8
+#define EVENT_LOOP_TASK_STACK_SIZE 4096
+#define EVENT_LOOP_QUEUE_SIZE      16
+// Alarms and door sensor events, dispatched before the others.
+#define EVENT_LOOP_CRITICAL_QUEUE_SIZE 8
+
+// OTP verification worker.
+#define OTP_TASK_CORE             APP_CORE
+#define OTP_TASK_PRIORITY         5
+#define OTP_TASK_STACK_SIZE       6144
+#define OTP_QUEUE_SIZE            4
+
+// Background tasks.
+#define STATUS_TASK_CORE          tskNO_AFFINITY
+#define STATUS_TASK_PRIORITY      tskIDLE_PRIORITY
+#define STATUS_TASK_STACK_SIZE    4096
+
+// Publishes device shadow diffs.
+#define SHADOW_TASK_CORE          tskNO_AFFINITY
+#define SHADOW_TASK_PRIORITY      (tskIDLE_PRIORITY + 1)
+#define SHADOW_TASK_STACK_SIZE    3072
+
+// Flushes batched events, see batch.c.
+#define BATCH_TASK_CORE           tskNO_AFFINITY
+#define BATCH_TASK_PRIORITY       (tskIDLE_PRIORITY + 1)
+#define BATCH_TASK_STACK_SIZE     3072
+
+// Fetches OTA updates over HTTP.
+#define OTA_TASK_CORE             tskNO_AFFINITY
+#define OTA_TASK_PRIORITY         (tskIDLE_PRIORITY + 1)
+#define OTA_TASK_STACK_SIZE       6144
+
+// Uploads crash summary and core dump, exists only after a crash.
+#define COREDUMP_TASK_CORE        tskNO_AFFINITY
+#define COREDUMP_TASK_PRIORITY    tskIDLE_PRIORITY
+#define COREDUMP_TASK_STACK_SIZE  4096
+
+// Local HTTP server, see http.c. Unlock requests are verified in this task.
+#define HTTP_TASK_CORE            NETWORK_CORE
+#define HTTP_TASK_PRIORITY        (tskIDLE_PRIORITY + 5)
+#define HTTP_TASK_STACK_SIZE      4096
+
+// Probes MQTT brokers and switches between them, see broker.c.
+#define BROKER_TASK_CORE          tskNO_AFFINITY
+#define BROKER_TASK_PRIORITY      (tskIDLE_PRIORITY + 1)
+#define BROKER_TASK_STACK_SIZE    4096
+
+// Revalidates cached DNS answers and gateway MAC, see netcache.c.
+#define NETCACHE_TASK_CORE        tskNO_AFFINITY
+#define NETCACHE_TASK_PRIORITY    (tskIDLE_PRIORITY + 1)
+#define NETCACHE_TASK_STACK_SIZE  3072
+
+// Injects synthetic checkins and publishes soak report, see soak.c.
+// Generates valid codes with PBKDF2 like OTP worker.
+#define SOAK_TASK_CORE            tskNO_AFFINITY
+#define SOAK_TASK_PRIORITY        (tskIDLE_PRIORITY + 2)
+#define SOAK_TASK_STACK_SIZE      6144
+
+// Writes access log and answers history queries, see history.c.
+#define HISTORY_TASK_CORE         tskNO_AFFINITY
+#define HISTORY_TASK_PRIORITY     (tskIDLE_PRIORITY + 1)
+#define HISTORY_TASK_STACK_SIZE   4096
+#define HISTORY_QUEUE_SIZE        16
+#define HISTORY_QUERY_QUEUE_SIZE  2
+
+#define INDICATOR_TASK_CORE       tskNO_AFFINITY
+#define INDICATOR_TASK_PRIORITY   tskIDLE_PRIORITY
+#define INDICATOR_TASK_STACK_SIZE 4096
+
+// Formats deferred log records.
+#define DLOG_TASK_CORE            tskNO_AFFINITY
+#define DLOG_TASK_PRIORITY        tskIDLE_PRIORITY
+#define DLOG_TASK_STACK_SIZE      3072
+
+#define TRACE_DUMP_TASK_CORE      tskNO_AFFINITY
+#define TRACE_DUMP_TASK_PRIORITY  tskIDLE_PRIORITY
+#define TRACE_DUMP_TASK_STACK_SIZE 4096
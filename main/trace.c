@@ -0,0 +1,168 @@
+#include "trace.h"
+
+#ifdef USE_TRACE
+
+#include <esp_timer.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <string.h>
+
+#define TAG "trace"
+
+// Events per core, older events are overwritten.
+#define TRACE_BUFFER_EVENTS  256
+#define TRACE_CHUNK_SIZE     2048
+#define TRACE_EVENT_MAX_LEN  128
+#define TRACE_TASKS_MAX      24
+
+struct trace_event {
+    // Names are string literals, so only pointer is stored.
+    const char *name;
+    TaskHandle_t task;
+    int64_t timestamp;
+    uint8_t phase;
+};
+
+// Each core writes to its own buffer, slots are claimed with atomic increment,
+// so tasks preempting each other on the same core never need a lock.
+struct trace_buffer {
+    atomic_uint head;
+    struct trace_event events[TRACE_BUFFER_EVENTS];
+};
+
+static struct {
+    struct trace_buffer buffers[portNUM_PROCESSORS];
+    atomic_bool paused;
+} trace = {0};
+
+struct trace_writer {
+    char chunk[TRACE_CHUNK_SIZE];
+    size_t len;
+    bool has_events;
+
+    trace_emit_t emit;
+    void *arg;
+
+    TaskHandle_t tasks[TRACE_TASKS_MAX];
+    int tasks_count;
+};
+
+void trace_record(const char *name, enum trace_phase phase) {
+    if (atomic_load_explicit(&trace.paused, memory_order_relaxed)) {
+        return;
+    }
+
+    struct trace_buffer *buffer = &trace.buffers[xPortGetCoreID()];
+    unsigned idx = atomic_fetch_add_explicit(&buffer->head, 1, memory_order_relaxed);
+
+    struct trace_event *event = &buffer->events[idx % TRACE_BUFFER_EVENTS];
+    event->name = name;
+    event->task = xTaskGetCurrentTaskHandle();
+    event->timestamp = esp_timer_get_time();
+    event->phase = phase;
+}
+
+static void trace_flush(struct trace_writer *writer) {
+    if (writer->len == 0) return;
+
+    writer->emit(writer->chunk, writer->arg);
+    writer->len = 0;
+    writer->chunk[0] = '\0';
+}
+
+static void trace_append(struct trace_writer *writer, const char *str, int len) {
+    if (writer->len + len >= TRACE_CHUNK_SIZE) {
+        trace_flush(writer);
+    }
+
+    memcpy(writer->chunk + writer->len, str, len + 1);
+    writer->len += len;
+}
+
+static void trace_remember_task(struct trace_writer *writer, TaskHandle_t task) {
+    for (int i = 0; i < writer->tasks_count; i++) {
+        if (writer->tasks[i] == task) return;
+    }
+
+    if (writer->tasks_count < TRACE_TASKS_MAX) {
+        writer->tasks[writer->tasks_count++] = task;
+    }
+}
+
+static void trace_append_event(struct trace_writer *writer, const char *name, char phase, int64_t ts, TaskHandle_t task, int core) {
+    char event[TRACE_EVENT_MAX_LEN];
+
+    int len = snprintf(
+        event, sizeof(event),
+        "%s{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%lld,\"pid\":1,\"tid\":%lu,\"args\":{\"core\":%d}%s}",
+        writer->has_events ? ",\n" : "",
+        name, phase, ts, (uint32_t)task, core,
+        // Instant events are scoped to thread.
+        phase == TRACE_PHASE_INSTANT ? ",\"s\":\"t\"" : ""
+    );
+
+    if (len > 0 && len < sizeof(event)) {
+        trace_append(writer, event, len);
+        writer->has_events = true;
+    }
+}
+
+static void trace_append_thread_names(struct trace_writer *writer) {
+    char event[TRACE_EVENT_MAX_LEN];
+
+    for (int i = 0; i < writer->tasks_count; i++) {
+        int len = snprintf(
+            event, sizeof(event),
+            "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%lu,\"args\":{\"name\":\"%s\"}}",
+            writer->has_events ? ",\n" : "",
+            (uint32_t)writer->tasks[i], pcTaskGetName(writer->tasks[i])
+        );
+
+        if (len > 0 && len < sizeof(event)) {
+            trace_append(writer, event, len);
+            writer->has_events = true;
+        }
+    }
+}
+
+void trace_dump(trace_emit_t emit, void *arg) {
+    static struct trace_writer writer;
+
+    writer = (struct trace_writer) {
+        .emit = emit,
+        .arg = arg,
+    };
+
+    // Recording is paused while buffers are read, events are dropped meanwhile.
+    atomic_store(&trace.paused, true);
+
+    const char *header = "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+    trace_append(&writer, header, strlen(header));
+
+    for (int core = 0; core < portNUM_PROCESSORS; core++) {
+        struct trace_buffer *buffer = &trace.buffers[core];
+
+        unsigned head = atomic_load(&buffer->head);
+        unsigned count = head < TRACE_BUFFER_EVENTS ? head : TRACE_BUFFER_EVENTS;
+
+        for (unsigned idx = head - count; idx != head; idx++) {
+            const struct trace_event *event = &buffer->events[idx % TRACE_BUFFER_EVENTS];
+
+            trace_append_event(&writer, event->name, event->phase, event->timestamp, event->task, core);
+            trace_remember_task(&writer, event->task);
+        }
+
+        atomic_store(&buffer->head, 0);
+    }
+
+    trace_append_thread_names(&writer);
+    const char *footer = "\n]}";
+    trace_append(&writer, footer, strlen(footer));
+    trace_flush(&writer);
+
+    atomic_store(&trace.paused, false);
+}
+
+#endif  // #ifdef USE_TRACE
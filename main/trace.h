@@ -0,0 +1,33 @@
+#pragma once
+
+#include "config.h"
+
+// Span tracing with microsecond timestamps, exported in Chrome trace format.
+// Compiled out completely unless USE_TRACE is defined in config.h.
+
+enum trace_phase {
+    TRACE_PHASE_BEGIN   = 'B',
+    TRACE_PHASE_END     = 'E',
+    TRACE_PHASE_INSTANT = 'i',
+};
+
+// Receives consecutive parts of JSON document, null terminated.
+typedef void (*trace_emit_t)(const char *chunk, void *arg);
+
+#ifdef USE_TRACE
+
+#define TRACE_BEGIN(name)    trace_record((name), TRACE_PHASE_BEGIN)
+#define TRACE_END(name)      trace_record((name), TRACE_PHASE_END)
+#define TRACE_INSTANT(name)  trace_record((name), TRACE_PHASE_INSTANT)
+
+void trace_record(const char *name, enum trace_phase phase);
+
+void trace_dump(trace_emit_t emit, void *arg);
+
+#else
+
+#define TRACE_BEGIN(name)    ((void)0)
+#define TRACE_END(name)      ((void)0)
+#define TRACE_INSTANT(name)  ((void)0)
+
+#endif
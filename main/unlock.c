@@ -0,0 +1,271 @@
+#include "unlock.h"
+
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#include <mbedtls/md.h>
+#include <mbedtls/constant_time.h>
+#include <assert.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "config.h"
+#include "hardware.h"
+#include "door.h"
+#include "mqtt.h"
+#include "storage.h"
+#include "history.h"
+#include "trace.h"
+#include "dlog.h"
+
+#define TAG "unlock"
+
+#define UNLOCK_TOPIC         MQTT_TOPIC(MQTT_DEVICE_ID, "unlock")
+#define UNLOCK_RESULT_TOPIC  MQTT_TOPIC(MQTT_DEVICE_ID, "unlock/result")
+
+// These values must be identical to the values from the utils/remote_unlock.py file.
+#define UNLOCK_VERSION       1
+
+// Commands signed for a later time are rejected, so a leaked command can not
+// be kept for later use.
+#define UNLOCK_MAX_TTL_SEC   60
+// Counters up to this far behind the highest one are accepted once, so
+// commands from several backends may arrive out of order.
+#define UNLOCK_WINDOW        64
+// Clock is not synchronized yet if it is before 2025-01-01.
+#define UNLOCK_MIN_TIME      1735689600
+
+#define UNLOCK_NVS_NAMESPACE "unlock"
+#define UNLOCK_NVS_KEY       "counter"
+
+const uint8_t unlock_key[] = {
+    #embed "../private/unlock_key.bin"
+};
+
+// Little-endian. MAC is truncated HMAC-SHA256 of MQTT_DEVICE_ID followed by
+// all fields before it, so a command for one lock is rejected by others.
+struct unlock_command {
+    uint8_t  version;
+    uint8_t  door;
+    uint16_t reserved;
+    uint32_t expires;
+    uint64_t counter;
+    uint8_t  mac[UNLOCK_MAC_SIZE];
+} __attribute__((packed));
+
+static struct {
+    // Commands arrive from MQTT task and local HTTP server.
+    SemaphoreHandle_t mutex;
+
+    // Set up once, because mbedtls_md_setup allocates HMAC state from heap.
+    mbedtls_md_context_t hmac;
+
+    // Bit N is set if counter highest - N is used.
+    uint64_t highest;
+    uint64_t window;
+} unlock = {0};
+
+static void publish_result(const struct unlock_command *cmd, const char *result, uint32_t verify_us) {
+    char message[128];
+    snprintf(
+        message, sizeof(message),
+        "{\"counter\": %llu, \"result\": \"%s\", \"verify_us\": %lu}",
+        cmd->counter, result, verify_us
+    );
+
+    // Qos 0 and published right from MQTT task, it is only a latency hint.
+    mqtt_publish(UNLOCK_RESULT_TOPIC, message, /* qos */ 0, /* retain */ false);
+}
+
+static bool unlock_mac_is_valid(const struct unlock_command *cmd) {
+    uint8_t digest[32];
+
+    mbedtls_md_hmac_starts(&unlock.hmac, unlock_key, sizeof(unlock_key));
+    mbedtls_md_hmac_update(&unlock.hmac, (const uint8_t *)MQTT_DEVICE_ID, strlen(MQTT_DEVICE_ID));
+    mbedtls_md_hmac_update(&unlock.hmac, (const uint8_t *)cmd, offsetof(struct unlock_command, mac));
+    mbedtls_md_hmac_finish(&unlock.hmac, digest);
+
+    return mbedtls_ct_memcmp(digest, cmd->mac, UNLOCK_MAC_SIZE) == 0;
+}
+
+// Marks counter as used, returns false if it is used already or too old.
+static bool unlock_use_counter(uint64_t counter) {
+    if (counter > unlock.highest) {
+        uint64_t shift = counter - unlock.highest;
+        unlock.window = shift < UNLOCK_WINDOW ? (unlock.window << shift) | 1 : 1;
+        unlock.highest = counter;
+        return true;
+    }
+
+    uint64_t age = unlock.highest - counter;
+    if (age >= UNLOCK_WINDOW || (unlock.window & (1ull << age))) {
+        return false;
+    }
+
+    unlock.window |= 1ull << age;
+    return true;
+}
+
+static bool unlock_auth_mac_is_valid(const char *scope, const struct unlock_auth *auth, const void *data, int data_len) {
+    uint8_t digest[32];
+
+    mbedtls_md_hmac_starts(&unlock.hmac, unlock_key, sizeof(unlock_key));
+    mbedtls_md_hmac_update(&unlock.hmac, (const uint8_t *)MQTT_DEVICE_ID, strlen(MQTT_DEVICE_ID));
+    mbedtls_md_hmac_update(&unlock.hmac, (const uint8_t *)scope, strlen(scope) + 1);
+    mbedtls_md_hmac_update(&unlock.hmac, (const uint8_t *)auth, offsetof(struct unlock_auth, mac));
+    mbedtls_md_hmac_update(&unlock.hmac, data, data_len);
+    mbedtls_md_hmac_finish(&unlock.hmac, digest);
+
+    return mbedtls_ct_memcmp(digest, auth->mac, UNLOCK_MAC_SIZE) == 0;
+}
+
+static const char *unlock_check_expiry(uint32_t expires) {
+    time_t now = time(NULL);
+    if (now < UNLOCK_MIN_TIME) {
+        return "no_time";
+    }
+
+    if (expires < now || expires > now + UNLOCK_MAX_TTL_SEC) {
+        return "expired";
+    }
+
+    return NULL;
+}
+
+static const char *unlock_execute(const struct unlock_command *cmd) {
+    if (cmd->version != UNLOCK_VERSION) {
+        return "unsupported_version";
+    }
+
+    if (!unlock_mac_is_valid(cmd)) {
+        return "bad_signature";
+    }
+
+    const char *error = unlock_check_expiry(cmd->expires);
+    if (error != NULL) {
+        return error;
+    }
+
+    if (cmd->door >= DOORS_COUNT) {
+        return "unknown_door";
+    }
+
+    if (!unlock_use_counter(cmd->counter)) {
+        return "replayed";
+    }
+
+    lock_trigger(&door_get(cmd->door)->lock);
+    history_record(cmd->door, ACCESS_LOG_REMOTE, "");
+
+    return "unlocked";
+}
+
+const char *unlock_submit(const void *data, int data_len, uint32_t *verify_us) {
+    struct unlock_command cmd;
+    if (data_len != sizeof(cmd)) {
+        ESP_LOGW(TAG, "Dropping command of %d bytes, expected %d", data_len, sizeof(cmd));
+        return "bad_length";
+    }
+    memcpy(&cmd, data, sizeof(cmd));
+
+    xSemaphoreTake(unlock.mutex, portMAX_DELAY);
+
+    TRACE_BEGIN("remote_unlock");
+    int64_t start = esp_timer_get_time();
+    const char *result = unlock_execute(&cmd);
+    *verify_us = esp_timer_get_time() - start;
+    TRACE_END("remote_unlock");
+
+    bool is_unlocked = strcmp(result, "unlocked") == 0;
+    if (is_unlocked) {
+        // Saved after the door is opened, so a reboot never accepts used counters.
+        storage_save_blob(UNLOCK_NVS_NAMESPACE, UNLOCK_NVS_KEY, &unlock.highest, sizeof(unlock.highest));
+    }
+
+    xSemaphoreGive(unlock.mutex);
+
+    if (is_unlocked) {
+        ESP_LOGI(TAG, "Door '%s' is unlocked remotely", door_get(cmd.door)->hw->name);
+    } else {
+        DLOGW(TAG, "Rejected remote unlock: %s", result);
+    }
+
+    return result;
+}
+
+static const char *unlock_verify_locked(const char *scope, const struct unlock_auth *auth, const void *data, int data_len) {
+    if (auth->version != UNLOCK_VERSION) {
+        return "unsupported_version";
+    }
+
+    if (!unlock_auth_mac_is_valid(scope, auth, data, data_len)) {
+        return "bad_signature";
+    }
+
+    const char *error = unlock_check_expiry(auth->expires);
+    if (error != NULL) {
+        return error;
+    }
+
+    if (!unlock_use_counter(auth->counter)) {
+        return "replayed";
+    }
+
+    return NULL;
+}
+
+const char *unlock_verify(const char *scope, const void *data, int data_len) {
+    struct unlock_auth auth;
+    if (data_len < (int)sizeof(auth)) {
+        return "bad_length";
+    }
+    memcpy(&auth, data, sizeof(auth));
+
+    xSemaphoreTake(unlock.mutex, portMAX_DELAY);
+
+    const char *error = unlock_verify_locked(scope, &auth, (const uint8_t *)data + sizeof(auth), data_len - sizeof(auth));
+    if (error == NULL) {
+        storage_save_blob(UNLOCK_NVS_NAMESPACE, UNLOCK_NVS_KEY, &unlock.highest, sizeof(unlock.highest));
+    }
+
+    xSemaphoreGive(unlock.mutex);
+
+    if (error != NULL) {
+        DLOGW(TAG, "Rejected signed command: %s", error);
+    }
+
+    return error;
+}
+
+static void mqtt_unlock_topic_updated(
+    const char *topic, int topic_len,
+    const char *data,  int data_len
+) {
+    uint32_t verify_us = 0;
+    const char *result = unlock_submit(data, data_len, &verify_us);
+
+    if (data_len == sizeof(struct unlock_command)) {
+        publish_result((const struct unlock_command *)data, result, verify_us);
+    }
+}
+
+void unlock_init(void) {
+    static StaticSemaphore_t mutex;
+    unlock.mutex = xSemaphoreCreateMutexStatic(&mutex);
+
+    mbedtls_md_init(&unlock.hmac);
+    int ret = mbedtls_md_setup(&unlock.hmac, mbedtls_md_info_from_type(MBEDTLS_MD_SHA256), /* hmac */ 1);
+    assert(ret == 0);
+
+    size_t len = sizeof(unlock.highest);
+    if (storage_load_blob(UNLOCK_NVS_NAMESPACE, UNLOCK_NVS_KEY, &unlock.highest, &len) != ESP_OK || len != sizeof(unlock.highest)) {
+        unlock.highest = 0;
+    }
+    // Counters before the saved one are unknown after reboot, treat them as used.
+    unlock.window = UINT64_MAX;
+
+    mqtt_subscribe(UNLOCK_TOPIC, /* qos */ 0, mqtt_unlock_topic_updated);
+}
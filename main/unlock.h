@@ -0,0 +1,37 @@
+#pragma once
+
+#include <stdint.h>
+
+#define UNLOCK_MAC_SIZE  16
+
+// Remote unlock with a signed command published to "unlock". A command is
+// authenticated with HMAC-SHA256 and a dedicated key, and carries a counter
+// and an expiry time, so it can be used only once and only shortly after it
+// was signed. Verification takes a single HMAC, the door is opened right
+// from MQTT task. The result is published to "unlock/result".
+
+// Other commands that can harm the lock, e.g. OTA fetch and shadow changes,
+// start with this header and are checked the same way. MAC covers
+// MQTT_DEVICE_ID, the scope with its terminating zero, the fields before MAC
+// and the command after the header, so a command is valid on one topic only.
+// All signed commands share one counter.
+struct unlock_auth {
+    uint8_t  version;
+    uint8_t  reserved[3];
+    uint32_t expires;
+    uint64_t counter;
+    uint8_t  mac[UNLOCK_MAC_SIZE];
+} __attribute__((packed));
+
+// Called after doors_init and mqtt_init.
+void unlock_init(void);
+
+// Verifies a command received by other means than MQTT, e.g. local HTTP,
+// and opens the door. Safe to call from any task. Returns result name,
+// "unlocked" on success.
+const char *unlock_submit(const void *data, int data_len, uint32_t *verify_us);
+
+// Verifies a command of data_len bytes starting with struct unlock_auth.
+// Safe to call from any task. Returns NULL if the command is accepted,
+// otherwise the reason.
+const char *unlock_verify(const char *scope, const void *data, int data_len);
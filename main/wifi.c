@@ -6,9 +6,11 @@
 #include <esp_log.h>
 #include <esp_event.h>
 #include <esp_wifi.h>
-#include <nvs_flash.h>
+#include <stdio.h>
 
 #include "hardware.h"
+#include "trace.h"
+#include "shadow.h"
 
 #define TAG "wifi"
 
@@ -26,13 +28,16 @@ static void event_handler(
     }
     else if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_CONNECTED) {
         ESP_LOGI(TAG, "Wifi connected to '%s'", WIFI_SSID);
+        TRACE_INSTANT("wifi_connected");
         wifi_connected = true;
     }
     else if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_DISCONNECTED) {
         // WiFi emit disconnected event even after unsuccessful reconnects.
         if (wifi_connected) {
             ESP_LOGW(TAG, "Wifi disconnected from '%s'", WIFI_SSID);
+            TRACE_INSTANT("wifi_disconnected");
             wifi_connected = false;
+            shadow_set_network("wifi", "");
         }
 
         vTaskDelay(pdMS_TO_TICKS(WIFI_RECONNECT_DELAY_SEC * 1000));
@@ -41,20 +46,15 @@ static void event_handler(
     else if (event_base == IP_EVENT && event_id == IP_EVENT_STA_GOT_IP) {
         ip_event_got_ip_t *event = (ip_event_got_ip_t*)event_data;
         ESP_LOGI(TAG, "Got IP Address: " IPSTR, IP2STR(&event->ip_info.ip));
-    }
-}
+        TRACE_INSTANT("wifi_got_ip");
 
-static esp_err_t nvs_init(void) {
-    esp_err_t ret = nvs_flash_init();
-    if (ret == ESP_ERR_NVS_NO_FREE_PAGES || ret == ESP_ERR_NVS_NEW_VERSION_FOUND) {
-        ESP_ERROR_CHECK(nvs_flash_erase());
-        return nvs_flash_init();
+        char ip[16];
+        snprintf(ip, sizeof(ip), IPSTR, IP2STR(&event->ip_info.ip));
+        shadow_set_network("wifi", ip);
     }
-    return ret;
 }
 
 void wifi_init(void) {
-    ESP_ERROR_CHECK(nvs_init());
     ESP_ERROR_CHECK(esp_netif_init());
 
     wifi_init_config_t cfg = WIFI_INIT_CONFIG_DEFAULT();
@@ -0,0 +1,181 @@
+// Measures access log queries on host with a file instead of flash:
+//
+//   gcc -O2 -I main -o bench_access_log utils/bench_access_log.c main/access_log.c
+//   ./bench_access_log /tmp/access_log.bin 1000000
+//
+// Fills the log with entries of 1000 users, one every 30 seconds, then
+// reopens it, which rebuilds the index like a reboot, and runs UID and time
+// range queries. Reads go through pread, so the time includes the syscalls
+// a flash read would cost on the lock. The file is reused if it exists.
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "access_log.h"
+
+#define USERS          1000
+#define INTERVAL_SEC   30
+#define START_TIME     1760000000u
+#define QUERIES        1000
+#define QUERY_LIMIT    20
+
+struct file_flash {
+    int fd;
+    uint64_t reads;
+    uint64_t read_bytes;
+};
+
+static int file_read(void *ctx, uint32_t offset, void *buf, size_t len) {
+    struct file_flash *f = ctx;
+    f->reads++;
+    f->read_bytes += len;
+    return pread(f->fd, buf, len, offset) == (ssize_t)len ? 0 : -1;
+}
+
+static int file_write(void *ctx, uint32_t offset, const void *buf, size_t len) {
+    struct file_flash *f = ctx;
+    return pwrite(f->fd, buf, len, offset) == (ssize_t)len ? 0 : -1;
+}
+
+static int file_erase_sector(void *ctx, uint32_t offset) {
+    struct file_flash *f = ctx;
+    uint8_t erased[ACCESS_LOG_SECTOR_SIZE];
+    memset(erased, 0xFF, sizeof(erased));
+    return pwrite(f->fd, erased, sizeof(erased), offset) == (ssize_t)sizeof(erased) ? 0 : -1;
+}
+
+static double now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+static void format_uid(char *uid, int user) {
+    snprintf(uid, ACCESS_LOG_UID_LEN, "%d", 1000 + user);
+}
+
+static bool count_entry(const struct access_log_entry *entry, void *arg) {
+    (*(int *)arg)++;
+    return true;
+}
+
+static int compare_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+static void run_queries(const char *name, struct access_log *log, struct file_flash *flash, bool by_uid, uint32_t entries) {
+    static double times[QUERIES];
+    uint64_t sectors = 0, reads = 0, emitted = 0;
+
+    srand(42);
+    for (int i = 0; i < QUERIES; i++) {
+        char uid[ACCESS_LOG_UID_LEN];
+        format_uid(uid, rand() % USERS);
+
+        // One hour window somewhere in the log.
+        uint32_t from = START_TIME + (uint32_t)(rand() % entries) * INTERVAL_SEC;
+
+        struct access_log_query query = {
+            .uid = by_uid ? uid : NULL,
+            .from = by_uid ? 0 : from,
+            .to = by_uid ? UINT32_MAX : from + 3600,
+            .limit = by_uid ? QUERY_LIMIT : 0,
+        };
+
+        int count = 0;
+        uint64_t reads_before = flash->reads;
+        double start = now_ms();
+        if (access_log_query(log, &query, count_entry, &count) < 0) {
+            fprintf(stderr, "Query failed\n");
+            exit(1);
+        }
+        times[i] = now_ms() - start;
+
+        sectors += query.sectors_read;
+        reads += flash->reads - reads_before;
+        emitted += count;
+    }
+
+    qsort(times, QUERIES, sizeof(times[0]), compare_double);
+    printf(
+        "%-24s median %.3f ms, p99 %.3f ms, %.1f entries, %.1f sectors and %.1f reads per query\n",
+        name, times[QUERIES / 2], times[QUERIES * 99 / 100],
+        (double)emitted / QUERIES, (double)sectors / QUERIES, (double)reads / QUERIES
+    );
+}
+
+int main(int argc, char **argv) {
+    if (argc != 3) {
+        fprintf(stderr, "Usage: %s <file> <entries>\n", argv[0]);
+        return 1;
+    }
+
+    uint32_t entries = strtoul(argv[2], NULL, 10);
+    // One spare sector, it is erased when the ring wraps.
+    uint32_t sectors_count = (entries + ACCESS_LOG_ENTRIES_PER_SECTOR - 1) / ACCESS_LOG_ENTRIES_PER_SECTOR + 1;
+
+    struct file_flash flash = { .fd = open(argv[1], O_RDWR | O_CREAT, 0644) };
+    if (flash.fd < 0) {
+        perror("open");
+        return 1;
+    }
+
+    struct stat st;
+    fstat(flash.fd, &st);
+    bool is_new = st.st_size != (off_t)sectors_count * ACCESS_LOG_SECTOR_SIZE;
+    if (is_new) {
+        ftruncate(flash.fd, 0);
+        for (uint32_t i = 0; i < sectors_count; i++) {
+            file_erase_sector(&flash, i * ACCESS_LOG_SECTOR_SIZE);
+        }
+    }
+
+    const struct access_log_flash ops = {
+        .read = file_read,
+        .write = file_write,
+        .erase_sector = file_erase_sector,
+        .ctx = &flash,
+    };
+    struct access_log_sector *sectors = calloc(sectors_count, sizeof(struct access_log_sector));
+    struct access_log log;
+
+    if (access_log_init(&log, &ops, sectors, sectors_count) != 0) {
+        fprintf(stderr, "Init failed\n");
+        return 1;
+    }
+
+    if (is_new) {
+        double start = now_ms();
+        srand(1);
+        for (uint32_t i = 0; i < entries; i++) {
+            char uid[ACCESS_LOG_UID_LEN];
+            format_uid(uid, rand() % USERS);
+            access_log_append(&log, START_TIME + i * INTERVAL_SEC, 0, ACCESS_LOG_GRANTED, uid);
+        }
+        printf("Appended %u entries in %.0f ms\n", entries, now_ms() - start);
+    }
+
+    double start = now_ms();
+    if (access_log_init(&log, &ops, sectors, sectors_count) != 0) {
+        fprintf(stderr, "Init failed\n");
+        return 1;
+    }
+    printf(
+        "Rebuilt index of %u sectors in %.0f ms, %zu bytes of RAM\n",
+        sectors_count, now_ms() - start, sectors_count * sizeof(struct access_log_sector)
+    );
+
+    run_queries("Last 20 of UID:", &log, &flash, true, entries);
+    run_queries("All in 1 hour window:", &log, &flash, false, entries);
+
+    close(flash.fd);
+    free(sectors);
+
+    return 0;
+}
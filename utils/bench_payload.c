@@ -0,0 +1,102 @@
+// Compares size and encode time of JSON and CBOR lock payloads on host:
+//
+//   gcc -O2 -I main -o bench_payload utils/bench_payload.c main/payload.c
+//   ./bench_payload
+//
+// Payloads repeat the calls from main/main.c with typical values. Absolute
+// times differ on ESP32-S3, but the ratio between formats is similar.
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "payload.h"
+
+#define ITERATIONS  200000
+
+static int encode_checkin(enum payload_format format, uint8_t *buf, size_t size) {
+    struct payload p;
+    payload_init(&p, format, buf, size);
+    payload_map_begin(&p);
+    payload_key_text(&p, PAYLOAD_UID, "alice");
+    payload_key(&p, PAYLOAD_TIMESTAMP);
+    payload_timestamp(&p, 1760000000);
+    payload_end(&p);
+    return payload_finish(&p);
+}
+
+// Hand-built JSON as it was sent before the payload writer.
+static int encode_checkin_snprintf(enum payload_format format, uint8_t *buf, size_t size) {
+    return snprintf((char *)buf, size, "{\"uid\": \"%s\", \"timestamp\": \"%lld\"}", "alice", 1760000000LL);
+}
+
+static int encode_status(enum payload_format format, uint8_t *buf, size_t size) {
+    struct payload p;
+    payload_init(&p, format, buf, size);
+    payload_map_begin(&p);
+    payload_key_text(&p, PAYLOAD_STATUS, "alive");
+    payload_key(&p, PAYLOAD_TIMESTAMP);
+    payload_timestamp(&p, 1760000000);
+    payload_key_uint(&p, PAYLOAD_UPTIME, 86400);
+    payload_key_uint(&p, PAYLOAD_LOG_DROPPED, 0);
+    payload_key_uint(&p, PAYLOAD_HEAP_FREE, 182344);
+    payload_key_uint(&p, PAYLOAD_HEAP_MIN_FREE, 171020);
+    payload_key_uint(&p, PAYLOAD_HEAP_VIOLATIONS, 0);
+    payload_key_uint(&p, PAYLOAD_WAKEUPS, 1520);
+    payload_key_uint(&p, PAYLOAD_SLEPT_MS, 80123456);
+    payload_key_uint(&p, PAYLOAD_TLS_FULL, 1);
+    payload_key_uint(&p, PAYLOAD_TLS_FULL_AVG_MS, 812);
+    payload_key_uint(&p, PAYLOAD_TLS_RESUMED, 3);
+    payload_key_uint(&p, PAYLOAD_TLS_RESUMED_AVG_MS, 95);
+    payload_key_uint(&p, PAYLOAD_MQTT_PUBLISHED, 210);
+    payload_key_uint(&p, PAYLOAD_MQTT_PUBLISHED_BYTES, 61234);
+    payload_key_uint(&p, PAYLOAD_MQTT_ROUND_TRIPS, 190);
+    payload_key_uint(&p, PAYLOAD_EVENTS, 42);
+    payload_key_uint(&p, PAYLOAD_EVENT_PUBLISHES, 30);
+    payload_key(&p, PAYLOAD_DOORS);
+    payload_array_begin(&p);
+    payload_map_begin(&p);
+    payload_key_text(&p, PAYLOAD_NAME, "main");
+    payload_key_uint(&p, PAYLOAD_EVENTS, 1337);
+    payload_key_uint(&p, PAYLOAD_AVG_US, 41);
+    payload_key_uint(&p, PAYLOAD_MAX_US, 230);
+    payload_key_uint(&p, PAYLOAD_MAX_QUEUED, 3);
+    payload_key_uint(&p, PAYLOAD_RX_ERRORS, 0);
+    payload_key_uint(&p, PAYLOAD_WAKE_DROPPED, 12);
+    payload_key_uint(&p, PAYLOAD_WAKE_MAX_US, 1800);
+    payload_end(&p);
+    payload_end(&p);
+    payload_end(&p);
+    return payload_finish(&p);
+}
+
+typedef int (*encode_t)(enum payload_format format, uint8_t *buf, size_t size);
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void bench(const char *name, encode_t encode, enum payload_format format) {
+    static uint8_t buf[1024];
+    volatile int len = 0;
+
+    double start = now_ns();
+    for (int i = 0; i < ITERATIONS; i++) {
+        len = encode(format, buf, sizeof(buf));
+    }
+    double elapsed = now_ns() - start;
+
+    printf("%-24s %6d bytes %10.1f ns\n", name, len, elapsed / ITERATIONS);
+}
+
+int main(void) {
+    bench("checkin json snprintf", encode_checkin_snprintf, PAYLOAD_JSON);
+    bench("checkin json", encode_checkin, PAYLOAD_JSON);
+    bench("checkin cbor", encode_checkin, PAYLOAD_CBOR);
+    bench("status json", encode_status, PAYLOAD_JSON);
+    bench("status cbor", encode_status, PAYLOAD_CBOR);
+
+    return 0;
+}
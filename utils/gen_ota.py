@@ -0,0 +1,72 @@
+#!/usr/bin/env python3
+
+import argparse
+import io
+import struct
+import sys
+
+import detools
+
+# These values must be identical to the values from the main/ota.c file.
+OTA_MAGIC       = 0x41544F58
+OTA_VERSION     = 1
+OTA_HEADER      = '<IHBBI32s'
+OTA_IMAGE_FULL  = 0
+OTA_IMAGE_DELTA = 1
+
+# esp_app_desc_t follows image header and first segment header.
+APP_DESC_OFFSET     = 32
+APP_DESC_MAGIC      = 0xABCD5432
+APP_ELF_SHA256_AT   = APP_DESC_OFFSET + 144
+
+def read_elf_sha256(image: bytes) -> bytes:
+    magic, = struct.unpack_from('<I', image, APP_DESC_OFFSET)
+    if magic != APP_DESC_MAGIC:
+        raise Exception("base is not an ESP-IDF app image")
+
+    return image[APP_ELF_SHA256_AT:APP_ELF_SHA256_AT + 32]
+
+def create_delta(base: bytes, image: bytes) -> bytes:
+    patch = io.BytesIO()
+    # esp_delta_ota applies sequential heatshrink compressed detools patches.
+    detools.create_patch(io.BytesIO(base), io.BytesIO(image), patch, compression='heatshrink')
+    return patch.getvalue()
+
+def main():
+    parser = argparse.ArgumentParser(description='Pack firmware image into full or delta OTA update')
+    parser.add_argument('image_path', help='Path to new signed firmware image, e.g. build/xecut-lock.bin')
+    parser.add_argument('output_path', help='Path to save the update')
+    parser.add_argument('--base', help='Path to firmware image running on the lock, makes a delta update')
+
+    args = parser.parse_args()
+
+    try:
+        with open(args.image_path, 'rb') as f:
+            image = f.read()
+
+        if args.base:
+            with open(args.base, 'rb') as f:
+                base = f.read()
+
+            image_type, base_sha256 = OTA_IMAGE_DELTA, read_elf_sha256(base)
+            payload = create_delta(base, image)
+        else:
+            image_type, base_sha256 = OTA_IMAGE_FULL, bytes(32)
+            payload = image
+
+        header = struct.pack(OTA_HEADER, OTA_MAGIC, OTA_VERSION, image_type, 0, len(payload), base_sha256)
+
+        with open(args.output_path, 'wb') as f:
+            f.write(header + payload)
+
+        kind = 'delta' if args.base else 'full'
+        print(f"Saved {kind} update of {len(header) + len(payload)} bytes for {len(image)} byte image to {args.output_path}")
+
+    except Exception as e:
+        print(f"Failed to create update: {e}", file=sys.stderr)
+        return 1
+
+    return 0
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,158 @@
+#!/usr/bin/env python3
+
+import argparse
+import json
+import struct
+import sys
+import zlib
+from datetime import date
+
+# These values must be identical to the values from the main/schedule.c file.
+SCHEDULE_MAGIC        = 0x48435358
+SCHEDULE_VERSION      = 1
+SCHEDULE_SLOT_MINUTES = 15
+SCHEDULE_UID_LEN      = 32
+SCHEDULE_GROUPS_MAX   = 32
+SCHEDULE_MEMBERS_MAX  = 256
+SCHEDULE_HOLIDAYS_MAX = 32
+SCHEDULE_GROUP_ANY    = 0xFF
+
+DAY_SLOTS = 24 * 60 // SCHEDULE_SLOT_MINUTES
+WEEKDAYS  = ['mon', 'tue', 'wed', 'thu', 'fri', 'sat', 'sun']
+
+def parse_time(value: str) -> int:
+    hours, minutes = value.split(':')
+    total = int(hours) * 60 + int(minutes)
+
+    if total < 0 or total > 24 * 60 or total % SCHEDULE_SLOT_MINUTES != 0:
+        raise Exception(f"time '{value}' must be within a day and aligned to {SCHEDULE_SLOT_MINUTES} minutes")
+
+    return total // SCHEDULE_SLOT_MINUTES
+
+def parse_ranges(ranges: list) -> list:
+    slots = [False] * DAY_SLOTS
+
+    for value in ranges:
+        start, end = value.split('-')
+        start_slot, end_slot = parse_time(start), parse_time(end)
+        if start_slot >= end_slot:
+            raise Exception(f"range '{value}' is empty")
+
+        for slot in range(start_slot, end_slot):
+            slots[slot] = True
+
+    return slots
+
+def pack_bits(slots: list) -> bytes:
+    packed = bytearray(len(slots) // 8)
+    for i, is_set in enumerate(slots):
+        if is_set:
+            packed[i // 8] |= 1 << (i % 8)
+    return bytes(packed)
+
+def compile_group(name: str, spec: dict) -> bytes:
+    unknown = set(spec) - set(WEEKDAYS)
+    if unknown:
+        raise Exception(f"group '{name}' has unknown days: {', '.join(sorted(unknown))}")
+
+    slots = []
+    for day in WEEKDAYS:
+        slots += parse_ranges(spec.get(day, []))
+
+    return pack_bits(slots)
+
+def group_index(groups: dict, name) -> int:
+    if name is None or name == '*':
+        return SCHEDULE_GROUP_ANY
+
+    if name not in groups:
+        raise Exception(f"unknown group '{name}'")
+
+    return list(groups).index(name)
+
+def compile_holiday(groups: dict, spec: dict) -> bytes:
+    # Either "2026-12-31" for a single date or "12-31" for every year.
+    parts = spec['date'].split('-')
+    if len(parts) == 3:
+        day = date.fromisoformat(spec['date'])
+        year, month, mday = day.year, day.month, day.day
+    else:
+        year, month, mday = 0, int(parts[0]), int(parts[1])
+        date(2000, month, mday)
+
+    mask = 0
+    for name in spec.get('groups', list(groups)):
+        mask |= 1 << group_index(groups, name)
+
+    slots = pack_bits(parse_ranges(spec.get('hours', [])))
+
+    return struct.pack('<HBBI', year, month, mday, mask) + slots
+
+def compile_schedule(spec: dict) -> bytes:
+    groups   = spec.get('groups', {})
+    members  = spec.get('members', {})
+    holidays = spec.get('holidays', [])
+
+    if len(groups) > SCHEDULE_GROUPS_MAX:
+        raise Exception(f"too many groups, max is {SCHEDULE_GROUPS_MAX}")
+
+    if len(members) > SCHEDULE_MEMBERS_MAX:
+        raise Exception(f"too many members, max is {SCHEDULE_MEMBERS_MAX}")
+
+    if len(holidays) > SCHEDULE_HOLIDAYS_MAX:
+        raise Exception(f"too many holidays, max is {SCHEDULE_HOLIDAYS_MAX}")
+
+    blob = struct.pack(
+        '<IHBBBBHHH',
+        SCHEDULE_MAGIC,
+        SCHEDULE_VERSION,
+        len(groups),
+        group_index(groups, spec.get('default_group')),
+        group_index(groups, spec.get('decentrala_group')),
+        0,
+        len(members),
+        len(holidays),
+        0,
+    )
+
+    for name, group_spec in groups.items():
+        blob += compile_group(name, group_spec)
+
+    for uid, group in members.items():
+        uid_bytes = uid.encode('utf-8')
+        if not uid_bytes or len(uid_bytes) > SCHEDULE_UID_LEN:
+            raise Exception(f"uid '{uid}' must be 1 to {SCHEDULE_UID_LEN} chars long")
+
+        blob += uid_bytes.ljust(SCHEDULE_UID_LEN, b'\0') + struct.pack('<B', group_index(groups, group))
+
+    for holiday in holidays:
+        blob += compile_holiday(groups, holiday)
+
+    return blob + struct.pack('<I', zlib.crc32(blob))
+
+def main():
+    parser = argparse.ArgumentParser(description='Compile access schedule description into binary blob')
+    parser.add_argument('schedule_path', help='Path to JSON schedule description')
+    parser.add_argument('output_path', help='Path to save the compiled schedule')
+
+    args = parser.parse_args()
+
+    try:
+        with open(args.schedule_path, 'r') as f:
+            spec = json.load(f)
+
+        blob = compile_schedule(spec)
+
+        with open(args.output_path, 'wb') as f:
+            f.write(blob)
+
+        print(f"Compiled {len(blob)} byte schedule and saved to {args.output_path}")
+
+    except Exception as e:
+        print(f"Failed to compile schedule: {e}", file=sys.stderr)
+        return 1
+
+    return 0
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,134 @@
+#!/usr/bin/env python3
+
+import argparse
+import base64
+import csv
+import hashlib
+import json
+import os
+import subprocess
+import sys
+import time
+from datetime import datetime, timezone
+from multiprocessing import Pool
+
+import get_decentrala_otp
+from get_otp import KDF_ROUNDS, OTP_DIGITS, OTP_KEY_SIZE, OTP_TIMESTEP, validate_uid
+
+worker = {}
+
+def init_worker(kdf_key: bytes, qr_dir: str):
+    worker['kdf_key'] = kdf_key
+    worker['qr_dir'] = qr_dir
+
+def provision(user: dict) -> dict:
+    otp_key = hashlib.pbkdf2_hmac(
+        'sha1',
+        user['kdf_uid'].encode('utf-8'),
+        worker['kdf_key'],
+        KDF_ROUNDS,
+        OTP_KEY_SIZE,
+    )
+
+    otp_key_b32 = base64.b32encode(otp_key).decode('utf-8').rstrip('=')
+    url = f"otpauth://totp/{user['uid']}?period={OTP_TIMESTEP}&digits={OTP_DIGITS}&algorithm=SHA1&secret={otp_key_b32}&issuer=Xecut"
+
+    if worker['qr_dir']:
+        subprocess.run(['qrencode', '-o', os.path.join(worker['qr_dir'], f"{user['uid']}.png"), url], check=True)
+
+    # Identifies the issued key in the manifest without disclosing it.
+    return {'url': url, 'key_sha256': hashlib.sha256(otp_key).hexdigest()[:16]}
+
+def read_users(csv_path: str, month: str) -> list:
+    users = []
+    errors = []
+    seen = set()
+
+    with open(csv_path, 'r', newline='') as f:
+        reader = csv.DictReader(f)
+        if 'uid' not in (reader.fieldnames or []):
+            raise Exception(f"{csv_path} has no 'uid' column")
+
+        for row in reader:
+            uid = row['uid'].strip()
+
+            try:
+                # Decentrala members get a new key every month, like in get_decentrala_otp.py.
+                if uid.startswith('M'):
+                    get_decentrala_otp.validate_uid(uid)
+                    kdf_uid = get_decentrala_otp.update_uid_with_date(uid) if month is None else f"{uid}{month[5:7]}{month[0:4]}"
+                else:
+                    validate_uid(uid)
+                    kdf_uid = uid
+
+                if uid in seen:
+                    raise Exception("duplicate uid")
+
+            except Exception as e:
+                errors.append(f"line {reader.line_num}, uid '{uid}': {e}")
+                continue
+
+            seen.add(uid)
+            users.append({**row, 'uid': uid, 'kdf_uid': kdf_uid})
+
+    if errors:
+        raise Exception("invalid uids:\n  " + "\n  ".join(errors))
+
+    return users
+
+def main():
+    parser = argparse.ArgumentParser(description='Generate OTP keys, otpauth URLs and QR codes for a list of users')
+    parser.add_argument('kdf_key_path', help='Path to KDF key file')
+    parser.add_argument('csv_path', help='Path to CSV with uid column, other columns are copied to the manifest')
+    parser.add_argument('output_dir', help='Directory to save otpauth.csv, manifest.json and QR codes')
+    parser.add_argument('--month', help='Month of Decentrala member keys as YYYY-MM, current by default')
+    parser.add_argument('--jobs', type=int, default=os.cpu_count(), help='Number of parallel processes')
+    parser.add_argument('--no-qr', action='store_true', help='Do not generate QR codes, which requires qrencode')
+
+    args = parser.parse_args()
+
+    try:
+        if args.month is not None:
+            datetime.strptime(args.month, '%Y-%m')
+
+        users = read_users(args.csv_path, args.month)
+
+        with open(args.kdf_key_path, 'rb') as f:
+            kdf_key = f.read()
+
+        qr_dir = None if args.no_qr else os.path.join(args.output_dir, 'qr')
+        os.makedirs(qr_dir or args.output_dir, exist_ok=True)
+
+        start = time.perf_counter()
+        with Pool(args.jobs, initializer=init_worker, initargs=(kdf_key, qr_dir)) as pool:
+            results = pool.map(provision, users, chunksize=max(1, len(users) // (args.jobs * 4)))
+        elapsed = time.perf_counter() - start
+
+        with open(os.path.join(args.output_dir, 'otpauth.csv'), 'w', newline='') as f:
+            writer = csv.writer(f)
+            writer.writerow(['uid', 'otpauth_url'])
+            for user, result in zip(users, results):
+                writer.writerow([user['uid'], result['url']])
+
+        manifest = {
+            'issued_at': datetime.now(timezone.utc).isoformat(timespec='seconds'),
+            'kdf_key_sha256': hashlib.sha256(kdf_key).hexdigest()[:16],
+            'users': [
+                {**user, 'key_sha256': result['key_sha256']}
+                for user, result in zip(users, results)
+            ],
+        }
+        with open(os.path.join(args.output_dir, 'manifest.json'), 'w') as f:
+            json.dump(manifest, f, indent=2)
+
+        rate = len(users) / elapsed if elapsed > 0 else 0
+        print(f"Provisioned {len(users)} users in {elapsed:.2f} s with {args.jobs} processes, {rate:.1f} users/s")
+
+    except Exception as e:
+        print(f"Failed to provision users: {e}", file=sys.stderr)
+        return 1
+
+    return 0
+
+if __name__ == "__main__":
+    sys.exit(main())